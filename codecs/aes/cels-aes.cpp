@@ -0,0 +1,656 @@
+/*
+    AES encryption codec for CELS - Framework and standard API for compression algorithms
+    Copyright (C) 2021, Bulat Ziganshin <Bulat.Ziganshin@gmail.com>
+
+    MIT License (https://opensource.org/licenses/MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+
+    You can contact the author at:
+       - CELS repository: https://github.com/Bulat-Ziganshin/CELS
+*/
+
+// Method string: "aes[-128|-192|-256][:bN]", where
+//   -128/-192/-256 - key size in bits, 256 by default
+//   bN - size of the buffer for stream encryption (4m by default, optional k/m/g suffix, multiple of 16)
+// Data are encrypted in the CTR mode. The key is requested from the application with the CELS_REQUEST_KEY
+// callback at the start of every operation, so keys never appear in method strings, and the output of
+// any CELS_UNPARSE_* variant is safe to display or store. There is no authentication, so combine
+// the codec with checksums if tampering should be detected.
+//
+// Encrypted data start with 8-byte random nonce and 4-byte key check code, followed by the data XORed
+// with the keystream AES(nonce || 64-bit big-endian block number). The check code is the beginning of
+// AES(nonce || all ones), i.e. the block never used for data, so the wrong key is reported as
+// CELS_ERROR_BAD_PASSWORD prior to decryption.
+//
+// The CTR kernel is chosen at runtime: VAES+AVX2 processing 16 blocks in 8 ymm registers, AES-NI
+// pipelining 8 blocks, or portable T-table code. Buffers larger than 2*AES_MIN_SEGMENT are split into
+// segments encrypted in parallel by the framework thread pool, since CTR blocks are independent.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include "CELS.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define AES_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AES_TARGET(isa)
+#else
+#include <cpuid.h>
+#define AES_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+const int AES_BLOCK = 16;
+const int AES_NONCE_SIZE = 8;
+const int AES_CHECK_SIZE = 4;
+const int AES_HEADER_SIZE = AES_NONCE_SIZE + AES_CHECK_SIZE;   // Stream header: nonce + key check code
+const int AES_MAX_ROUNDS = 14;
+const int AES_MAX_KEY_SIZE = 32;
+const CelsNum AES_DEFAULT_BUFSIZE = 4<<20;
+const CelsNum AES_MIN_BUFSIZE = 64<<10;     // Limits for the buffer size set by the "b" parameter and memory limits
+const CelsNum AES_MAX_BUFSIZE = 1<<30;
+const CelsNum AES_MIN_SEGMENT = 256<<10;    // Smaller pieces of data aren't worth a separate task
+const int AES_MAX_SEGMENTS = 64;
+
+// Cels() of the application, saved at codec registration
+static CelsCallback* CelsApi = NULL;
+
+// Structure representing the parsed codec
+struct AesCodec
+{
+    int KeyBits;                // 128, 192 or 256
+    CelsNum BufSize;            // size of the buffer for stream encryption
+};
+
+// Expanded key along with the CTR kernel chosen for this CPU
+struct AesKey;
+typedef void AesCtrKernel (const AesKey* key, const unsigned char* nonce, uint64_t counter, const unsigned char* in, unsigned char* out, size_t blocks);
+struct AesKey
+{
+    unsigned char rk[AES_BLOCK*(AES_MAX_ROUNDS+1)];   // round keys in the FIPS-197 byte order, as used by AES-NI
+    uint32_t rkw[4*(AES_MAX_ROUNDS+1)];              // the same as big-endian words for the portable code
+    int rounds;
+    AesCtrKernel* ctr;
+};
+
+
+// Parse memory size like "64k" or "1m" at str, storing pointer to the first char after the number into *end
+static CelsNum AesParseSize (const char* str, char** end)
+{
+    CelsNum size = strtoll(str, end, 10);
+    if (*end == str)  return -1;
+    switch (**end)
+    {
+        case 'g': size <<= 10;  // fallthrough
+        case 'm': size <<= 10;  // fallthrough
+        case 'k': size <<= 10;  ++*end;
+    }
+    return size;
+}
+
+// Format memory size into the shortest form accepted by AesParseSize
+static int AesFormatSize (char* str, CelsNum size)
+{
+    static const char* suffix[] = {"", "k", "m", "g"};
+    int i = 0;
+    while (size >= 1024  &&  size % 1024 == 0  &&  i < 3)
+        size /= 1024,  i++;
+    return sprintf(str, "%lld%s", (long long) size, suffix[i]);
+}
+
+// Clear memory that held key material, in the way the compiler can't optimize out
+static void AesWipe (void* buf, size_t size)
+{
+    volatile unsigned char* ptr = (volatile unsigned char*) buf;
+    while (size--)  *ptr++ = 0;
+}
+
+static inline uint32_t AesLoadBE (const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void AesStoreBE (unsigned char* p, uint32_t x)
+{
+    p[0] = (unsigned char)(x >> 24),  p[1] = (unsigned char)(x >> 16),  p[2] = (unsigned char)(x >> 8),  p[3] = (unsigned char)x;
+}
+
+static inline uint64_t AesBswap64 (uint64_t x)
+{
+    x = ((x & 0x00FF00FF00FF00FFULL) << 8)  | ((x >> 8)  & 0x00FF00FF00FF00FFULL);
+    x = ((x & 0x0000FFFF0000FFFFULL) << 16) | ((x >> 16) & 0x0000FFFF0000FFFFULL);
+    return (x << 32) | (x >> 32);
+}
+
+
+// *** Portable implementation **********************************************************************************************
+
+// S-box and T-tables, computed on the first use
+struct AesTables
+{
+    unsigned char sbox[256];
+    uint32_t te[4][256];
+
+    AesTables()
+    {
+        // S-box is the multiplicative inverse in GF(2^8) followed by the affine transformation.
+        // p runs over all non-zero elements multiplying by 3, while q = 1/p is divided by 3
+        unsigned char p = 1,  q = 1;
+        do {
+            p = p ^ (unsigned char)(p << 1) ^ (p & 0x80? 0x1B : 0);
+            q ^= q << 1;  q ^= q << 2;  q ^= q << 4;
+            if (q & 0x80)  q ^= 0x09;
+            unsigned char x = q ^ rotl8(q,1) ^ rotl8(q,2) ^ rotl8(q,3) ^ rotl8(q,4);
+            sbox[p] = x ^ 0x63;
+        } while (p != 1);
+        sbox[0] = 0x63;
+
+        // te[0][x] is the column (2s, s, s, 3s) of MixColumns applied to s = sbox[x], other tables are its rotations
+        for (int i=0; i<256; i++) {
+            uint32_t s = sbox[i],  s2 = xtime(sbox[i]),  s3 = s2 ^ s;
+            uint32_t t = (s2 << 24) | (s << 16) | (s << 8) | s3;
+            for (int j=0; j<4; j++)
+                te[j][i] = t,  t = (t >> 8) | (t << 24);
+        }
+    }
+
+    static unsigned char rotl8 (unsigned char x, int r)  {return (unsigned char)((x << r) | (x >> (8-r)));}
+    static unsigned char xtime (unsigned char x)         {return (unsigned char)((x << 1) ^ (x & 0x80? 0x1B : 0));}
+};
+
+static const AesTables& AesGetTables()
+{
+    static const AesTables tables;
+    return tables;
+}
+
+static void AesEncryptBlock (const AesKey* key, const unsigned char* in, unsigned char* out)
+{
+    const AesTables& T = AesGetTables();
+    const uint32_t* rk = key->rkw;
+    uint32_t s0 = AesLoadBE(in)    ^ rk[0],  s1 = AesLoadBE(in+4)  ^ rk[1],
+             s2 = AesLoadBE(in+8)  ^ rk[2],  s3 = AesLoadBE(in+12) ^ rk[3];
+
+    for (int r=1; r < key->rounds; r++)
+    {
+        rk += 4;
+        uint32_t t0 = T.te[0][s0>>24] ^ T.te[1][(s1>>16)&255] ^ T.te[2][(s2>>8)&255] ^ T.te[3][s3&255] ^ rk[0];
+        uint32_t t1 = T.te[0][s1>>24] ^ T.te[1][(s2>>16)&255] ^ T.te[2][(s3>>8)&255] ^ T.te[3][s0&255] ^ rk[1];
+        uint32_t t2 = T.te[0][s2>>24] ^ T.te[1][(s3>>16)&255] ^ T.te[2][(s0>>8)&255] ^ T.te[3][s1&255] ^ rk[2];
+        uint32_t t3 = T.te[0][s3>>24] ^ T.te[1][(s0>>16)&255] ^ T.te[2][(s1>>8)&255] ^ T.te[3][s2&255] ^ rk[3];
+        s0 = t0,  s1 = t1,  s2 = t2,  s3 = t3;
+    }
+
+    // The last round lacks MixColumns
+    rk += 4;
+    const unsigned char* S = T.sbox;
+    AesStoreBE (out,    ((uint32_t)S[s0>>24] << 24 | (uint32_t)S[(s1>>16)&255] << 16 | (uint32_t)S[(s2>>8)&255] << 8 | S[s3&255]) ^ rk[0]);
+    AesStoreBE (out+4,  ((uint32_t)S[s1>>24] << 24 | (uint32_t)S[(s2>>16)&255] << 16 | (uint32_t)S[(s3>>8)&255] << 8 | S[s0&255]) ^ rk[1]);
+    AesStoreBE (out+8,  ((uint32_t)S[s2>>24] << 24 | (uint32_t)S[(s3>>16)&255] << 16 | (uint32_t)S[(s0>>8)&255] << 8 | S[s1&255]) ^ rk[2]);
+    AesStoreBE (out+12, ((uint32_t)S[s3>>24] << 24 | (uint32_t)S[(s0>>16)&255] << 16 | (uint32_t)S[(s1>>8)&255] << 8 | S[s2&255]) ^ rk[3]);
+}
+
+static void AesCtrPortable (const AesKey* key, const unsigned char* nonce, uint64_t counter, const unsigned char* in, unsigned char* out, size_t blocks)
+{
+    unsigned char block[AES_BLOCK],  stream[AES_BLOCK];
+    memcpy (block, nonce, AES_NONCE_SIZE);
+    for (size_t i=0; i<blocks; i++, counter++)
+    {
+        for (int j=0; j<8; j++)
+            block[AES_NONCE_SIZE+j] = (unsigned char)(counter >> (56-8*j));
+        AesEncryptBlock (key, block, stream);
+        for (int j=0; j<AES_BLOCK; j++)
+            out[i*AES_BLOCK+j] = in[i*AES_BLOCK+j] ^ stream[j];
+    }
+    AesWipe (stream, sizeof(stream));
+}
+
+
+// *** x86 kernels **********************************************************************************************************
+
+#ifdef AES_X86
+// Eight independent blocks hide the latency of AESENC
+AES_TARGET("aes,sse2")
+static void AesCtrNi (const AesKey* key, const unsigned char* nonce, uint64_t counter, const unsigned char* in, unsigned char* out, size_t blocks)
+{
+    __m128i rk[AES_MAX_ROUNDS+1];
+    int rounds = key->rounds;
+    for (int r=0; r<=rounds; r++)
+        rk[r] = _mm_loadu_si128 ((const __m128i*)(key->rk + r*AES_BLOCK));
+    long long n;
+    memcpy (&n, nonce, AES_NONCE_SIZE);
+
+    size_t i = 0;
+    for (; i+8 <= blocks; i += 8)
+    {
+        __m128i x[8];
+        for (int k=0; k<8; k++)
+            x[k] = _mm_xor_si128 (_mm_set_epi64x ((long long) AesBswap64(counter+i+k), n), rk[0]);
+        for (int r=1; r<rounds; r++)
+            for (int k=0; k<8; k++)
+                x[k] = _mm_aesenc_si128 (x[k], rk[r]);
+        for (int k=0; k<8; k++) {
+            x[k] = _mm_aesenclast_si128 (x[k], rk[rounds]);
+            __m128i data = _mm_loadu_si128 ((const __m128i*)(in + (i+k)*AES_BLOCK));
+            _mm_storeu_si128 ((__m128i*)(out + (i+k)*AES_BLOCK), _mm_xor_si128 (x[k], data));
+        }
+    }
+    for (; i < blocks; i++)
+    {
+        __m128i x = _mm_xor_si128 (_mm_set_epi64x ((long long) AesBswap64(counter+i), n), rk[0]);
+        for (int r=1; r<rounds; r++)
+            x = _mm_aesenc_si128 (x, rk[r]);
+        x = _mm_aesenclast_si128 (x, rk[rounds]);
+        __m128i data = _mm_loadu_si128 ((const __m128i*)(in + i*AES_BLOCK));
+        _mm_storeu_si128 ((__m128i*)(out + i*AES_BLOCK), _mm_xor_si128 (x, data));
+    }
+}
+
+// VAES encrypts two blocks per instruction, so 8 ymm registers keep 16 blocks in flight
+AES_TARGET("vaes,avx2,aes")
+static void AesCtrVaes (const AesKey* key, const unsigned char* nonce, uint64_t counter, const unsigned char* in, unsigned char* out, size_t blocks)
+{
+    __m256i rk[AES_MAX_ROUNDS+1];
+    int rounds = key->rounds;
+    for (int r=0; r<=rounds; r++)
+        rk[r] = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i*)(key->rk + r*AES_BLOCK)));
+    long long n;
+    memcpy (&n, nonce, AES_NONCE_SIZE);
+
+    size_t i = 0;
+    for (; i+16 <= blocks; i += 16)
+    {
+        __m256i x[8];
+        for (int k=0; k<8; k++)
+            x[k] = _mm256_xor_si256 (_mm256_set_epi64x ((long long) AesBswap64(counter+i+2*k+1), n,
+                                                        (long long) AesBswap64(counter+i+2*k),   n), rk[0]);
+        for (int r=1; r<rounds; r++)
+            for (int k=0; k<8; k++)
+                x[k] = _mm256_aesenc_epi128 (x[k], rk[r]);
+        for (int k=0; k<8; k++) {
+            x[k] = _mm256_aesenclast_epi128 (x[k], rk[rounds]);
+            __m256i data = _mm256_loadu_si256 ((const __m256i*)(in + (i+2*k)*AES_BLOCK));
+            _mm256_storeu_si256 ((__m256i*)(out + (i+2*k)*AES_BLOCK), _mm256_xor_si256 (x[k], data));
+        }
+    }
+    if (i < blocks)
+        AesCtrNi (key, nonce, counter+i, in + i*AES_BLOCK, out + i*AES_BLOCK, blocks-i);
+}
+
+static void AesCpuid (unsigned leaf, unsigned regs[4])
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex (r, leaf, 0);
+    for (int i=0; i<4; i++)  regs[i] = r[i];
+#else
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    if (__get_cpuid_max (0, NULL) >= leaf)
+        __cpuid_count (leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// OS support for saving the AVX state
+static bool AesAvxEnabled()
+{
+#ifdef _MSC_VER
+    return (_xgetbv(0) & 6) == 6;
+#else
+    unsigned lo, hi;
+    __asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (lo & 6) == 6;
+#endif
+}
+#endif // AES_X86
+
+static AesCtrKernel* AesChooseKernel()
+{
+#ifdef AES_X86
+    unsigned leaf1[4],  leaf7[4];
+    AesCpuid (1, leaf1);
+    AesCpuid (7, leaf7);
+    bool aesni = (leaf1[2] >> 25) & 1;
+    bool avx   = ((leaf1[2] >> 27) & 1)  &&  ((leaf1[2] >> 28) & 1)  &&  AesAvxEnabled();
+    bool vaes  = avx  &&  ((leaf7[1] >> 5) & 1)  &&  ((leaf7[2] >> 9) & 1);   // AVX2 and VAES
+    if (aesni && vaes)  return AesCtrVaes;
+    if (aesni)          return AesCtrNi;
+#endif
+    return AesCtrPortable;
+}
+
+
+// *** Keys and CTR mode ****************************************************************************************************
+
+static void AesExpandKey (AesKey* key, const unsigned char* raw, int bits)
+{
+    const AesTables& T = AesGetTables();
+    int nk = bits/32;
+    key->rounds = nk+6;
+    unsigned char* w = key->rk;
+    memcpy (w, raw, 4*nk);
+
+    unsigned char rcon = 1;
+    for (int i = nk;  i < 4*(key->rounds+1);  i++)
+    {
+        unsigned char t[4];
+        memcpy (t, w + 4*(i-1), 4);
+        if (i % nk == 0) {
+            unsigned char t0 = t[0];
+            t[0] = T.sbox[t[1]] ^ rcon,  t[1] = T.sbox[t[2]],  t[2] = T.sbox[t[3]],  t[3] = T.sbox[t0];
+            rcon = AesTables::xtime (rcon);
+        } else if (nk > 6  &&  i % nk == 4) {
+            for (int j=0; j<4; j++)  t[j] = T.sbox[t[j]];
+        }
+        for (int j=0; j<4; j++)
+            w[4*i+j] = w[4*(i-nk)+j] ^ t[j];
+    }
+    for (int i=0; i < 4*(key->rounds+1); i++)
+        key->rkw[i] = AesLoadBE (w + 4*i);
+
+    static AesCtrKernel* const kernel = AesChooseKernel();
+    key->ctr = kernel;
+}
+
+// Request the key from the application and expand it. The raw key is wiped right after the expansion
+static CelsResult AesLoadKey (AesCodec* codec, AesKey* key, void* ud, CelsCallback* cb)
+{
+    unsigned char raw[AES_MAX_KEY_SIZE];
+    char name[16];
+    sprintf (name, "aes-%d", codec->KeyBits);
+    CelsResult result = CelsRequestKey (cb,ud, name, raw, codec->KeyBits/8);
+    if (result == CELS_ERROR_NOT_IMPLEMENTED)  result = CELS_ERROR_BAD_PASSWORD;   // no key - no encryption
+    if (result >= CELS_OK)  AesExpandKey (key, raw, codec->KeyBits);
+    AesWipe (raw, sizeof(raw));
+    return (result < CELS_OK? result : CELS_OK);
+}
+
+// Fresh nonce for each operation. Several entropy sources are mixed, since std::random_device is deterministic
+// on some platforms, and reusing the nonce with the same key would reveal XOR of plaintexts
+static void AesNewNonce (unsigned char* nonce)
+{
+    static std::atomic<uint64_t> sequence (0);
+    uint64_t x = (uint64_t) std::chrono::high_resolution_clock::now().time_since_epoch().count();
+    x += (sequence++ + 1) * 0x9E3779B97F4A7C15ULL;
+    x ^= (uint64_t)(size_t) nonce;
+    try {
+        std::random_device rd;
+        x ^= ((uint64_t) rd() << 32) ^ rd();
+    } catch (...) {}
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    for (int i=0; i<AES_NONCE_SIZE; i++)
+        nonce[i] = (unsigned char)(x >> (8*i));
+}
+
+static void AesCheckCode (const AesKey* key, const unsigned char* nonce, unsigned char* check)
+{
+    unsigned char block[AES_BLOCK];
+    memcpy (block, nonce, AES_NONCE_SIZE);
+    memset (block + AES_NONCE_SIZE, 0xFF, AES_BLOCK - AES_NONCE_SIZE);
+    AesEncryptBlock (key, block, block);
+    memcpy (check, block, AES_CHECK_SIZE);
+}
+
+// En/decrypt data starting at the block `counter` of the stream. Only the last piece of data may have a partial block
+static void AesCtrCrypt (const AesKey* key, const unsigned char* nonce, uint64_t counter, const unsigned char* in, unsigned char* out, size_t size)
+{
+    size_t blocks = size / AES_BLOCK,  tail = size % AES_BLOCK;
+    key->ctr (key, nonce, counter, in, out, blocks);
+    if (tail) {
+        unsigned char block[AES_BLOCK] = {0};
+        memcpy (block, in + blocks*AES_BLOCK, tail);
+        key->ctr (key, nonce, counter+blocks, block, block, 1);
+        memcpy (out + blocks*AES_BLOCK, block, tail);
+    }
+}
+
+struct AesSegment
+{
+    const AesKey* key;
+    const unsigned char* nonce;
+    uint64_t counter;
+    const unsigned char* in;
+    unsigned char* out;
+    size_t size;
+};
+
+static void __cdecl AesSegmentTask (void* arg)
+{
+    AesSegment* s = (AesSegment*) arg;
+    AesCtrCrypt (s->key, s->nonce, s->counter, s->in, s->out, s->size);
+}
+
+// Split the buffer into segments processed by the framework thread pool, the last one being processed by this thread
+static void AesCtrParallel (const AesKey* key, const unsigned char* nonce, uint64_t counter, const unsigned char* in, unsigned char* out, size_t size)
+{
+    CelsResult threads = (CelsApi? CelsGetThreads (CelsApi) : 1);
+    size_t segments = size / AES_MIN_SEGMENT;
+    if (threads > 0  &&  segments > (size_t)threads)  segments = (size_t) threads;
+    if (segments > AES_MAX_SEGMENTS)  segments = AES_MAX_SEGMENTS;
+    if (segments < 2  ||  threads < 2)  {AesCtrCrypt (key, nonce, counter, in, out, size);  return;}
+
+    size_t segmentSize = (size / segments + AES_BLOCK-1) / AES_BLOCK * AES_BLOCK;
+    AesSegment segment[AES_MAX_SEGMENTS];
+    CelsTaskGroup group = {0};
+    for (size_t i=0, pos=0;  pos < size;  i++, pos += segmentSize)
+    {
+        AesSegment s = {key, nonce, counter + pos/AES_BLOCK, in+pos, out+pos, (size-pos < segmentSize? size-pos : segmentSize)};
+        segment[i] = s;
+        if (pos + segmentSize >= size  ||  CelsSubmitTask (CelsApi, &group, AesSegmentTask, &segment[i]) < CELS_OK)
+            AesSegmentTask (&segment[i]);
+    }
+    CelsWaitTasks (CelsApi, &group);
+}
+
+
+// *** Codec ****************************************************************************************************************
+
+// Read the buffer entirely unless EOF is reached, so only the last buffer may contain a partial block
+static CelsResult AesReadFull (void* buf, CelsNum size, void* ud, CelsCallback* cb)
+{
+    CelsNum done = 0;
+    while (done < size) {
+        CelsResult result = CelsRead(cb,ud, (char*)buf + done, size - done);
+        if (result < CELS_OK)  return result;
+        if (result == 0)  break;
+        done += result;
+    }
+    return done;
+}
+
+// Stream en/decryption employing callbacks for I/O
+CelsResult CELS_AES_stream (AesCodec* codec, bool decrypt, void* ud, CelsCallback* cb)
+{
+    AesKey* key = (AesKey*) CelsMemAlloc(cb,ud, sizeof(AesKey) + codec->BufSize);
+    if (key == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    unsigned char* buf = (unsigned char*) (key+1);
+    unsigned char header[AES_HEADER_SIZE];
+    CelsResult errcode = CELS_OK;
+
+    if (!decrypt) {
+        errcode = AesLoadKey (codec, key, ud,cb);
+        if (errcode < CELS_OK)  goto finished;
+        AesNewNonce (header);
+        AesCheckCode (key, header, header + AES_NONCE_SIZE);
+        CELS_WRITE_EXACTLY(header, AES_HEADER_SIZE);
+    } else {
+        CELS_READ_EXACTLY_OR_EOF(header, AES_HEADER_SIZE);
+        errcode = AesLoadKey (codec, key, ud,cb);
+        if (errcode < CELS_OK)  goto finished;
+        unsigned char check[AES_CHECK_SIZE];
+        AesCheckCode (key, header, check);
+        if (memcmp (check, header + AES_NONCE_SIZE, AES_CHECK_SIZE))  CELS_RETURN(CELS_ERROR_BAD_PASSWORD);
+    }
+
+    for (uint64_t counter = 0;;)
+    {
+        CelsResult len = AesReadFull (buf, codec->BufSize, ud,cb);
+        if (len <= 0)  CELS_RETURN(len);
+        AesCtrParallel (key, header, counter, buf, buf, len);
+        counter += len / AES_BLOCK;
+        CELS_WRITE_EXACTLY(buf, len);
+    }
+
+finished:
+    AesWipe (key, sizeof(AesKey));
+    CelsMemFree(cb,ud, key);
+    return errcode;
+}
+
+// Memory buffer en/decryption, still requesting the key via the callback
+CelsResult CELS_AES_membuf (AesCodec* codec, bool decrypt, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    unsigned char* in  = (unsigned char*) inbuf;
+    unsigned char* out = (unsigned char*) outbuf;
+    CelsNum size = (decrypt? insize - AES_HEADER_SIZE : insize);
+    if (size < 0)  return CELS_ERROR_BAD_COMPRESSED_DATA;
+    if (outsize < (decrypt? size : size + AES_HEADER_SIZE))  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+
+    AesKey key;
+    CelsResult errcode = AesLoadKey (codec, &key, ud,cb);
+    if (errcode < CELS_OK)  return errcode;
+
+    if (!decrypt) {
+        AesNewNonce (out);
+        AesCheckCode (&key, out, out + AES_NONCE_SIZE);
+        AesCtrParallel (&key, out, 0, in, out + AES_HEADER_SIZE, size);
+        errcode = size + AES_HEADER_SIZE;
+    } else {
+        unsigned char check[AES_CHECK_SIZE];
+        AesCheckCode (&key, in, check);
+        if (memcmp (check, in + AES_NONCE_SIZE, AES_CHECK_SIZE))
+            errcode = CELS_ERROR_BAD_PASSWORD;
+        else
+            AesCtrParallel (&key, in, 0, in + AES_HEADER_SIZE, out, size),  errcode = size;
+    }
+    AesWipe (&key, sizeof(key));
+    return errcode;
+}
+
+
+static CelsNum AesMemoryUsage (AesCodec* codec, CelsNum bufsize)
+{
+    return sizeof(AesKey) + bufsize;
+}
+
+static CelsResult __cdecl AesMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    AesCodec *codec = (AesCodec*)self;
+
+    switch (service)
+    {
+    case CELS_LOAD_CODEC:
+        CelsApi = cb;
+        return CELS_OK;
+
+    case CELS_PARSE:
+        {
+            if (outsize < (CelsNum)sizeof(AesCodec))  return CELS_ERROR_GENERAL;
+
+            codec = (AesCodec*)outbuf;
+            codec->BufSize = AES_DEFAULT_BUFSIZE;
+
+            // Method name is "aes" optionally followed by the key size
+            char** param = (char**)inbuf;
+            if      (!strcmp(param[0], "aes")  ||  !strcmp(param[0], "aes-256"))  codec->KeyBits = 256;
+            else if (!strcmp(param[0], "aes-192"))  codec->KeyBits = 192;
+            else if (!strcmp(param[0], "aes-128"))  codec->KeyBits = 128;
+            else return CELS_ERROR_INVALID_COMPRESSOR;
+
+            // There is intentionally no parameter for the key itself
+            while (*++param)
+            {
+                char* end;
+                if (**param=='b')  {CelsNum size = AesParseSize(*param+1, &end);  if (*end || size < AES_MIN_BUFSIZE || size > AES_MAX_BUFSIZE || size % AES_BLOCK)  return CELS_ERROR_INVALID_COMPRESSOR;  codec->BufSize = size;  continue;}
+                return CELS_ERROR_INVALID_COMPRESSOR;
+            }
+            return sizeof(AesCodec);
+        }
+
+    case CELS_UNPARSE:
+        {
+            // Every variant is free of keys, and PURE also drops the buffer size that doesn't affect the format
+            char str[CELS_MAX_METHOD_STRING_SIZE];
+            int len = sprintf(str, (codec->KeyBits == 256? "aes" : "aes-%d"), codec->KeyBits);
+            if (codec->BufSize != AES_DEFAULT_BUFSIZE  &&  subservice != CELS_UNPARSE_PURE)
+                len += sprintf(str+len, ":b"),  len += AesFormatSize(str+len, codec->BufSize);
+
+            if (len >= outsize)  return CELS_ERROR_GENERAL;
+            strcpy ((char*)outbuf, str);
+            return CELS_OK;
+        }
+
+    case CELS_GET_MAX_COMPRESSED_SIZE:
+        return insize + AES_HEADER_SIZE;
+
+    case CELS_GET_COMPRESSION_MEMORY:
+    case CELS_GET_DECOMPRESSION_MEMORY:
+        return AesMemoryUsage (codec, codec->BufSize);
+
+    case CELS_GET_MINIMUM_COMPRESSION_MEMORY:
+    case CELS_GET_MINIMUM_DECOMPRESSION_MEMORY:
+        return AesMemoryUsage (codec, AES_MIN_BUFSIZE);
+
+    case CELS_SET_COMPRESSION_MEMORY:
+    case CELS_SET_DECOMPRESSION_MEMORY:
+        {
+            // Halve the buffer until it fits, keeping it a multiple of the block size
+            CelsNum bufsize = codec->BufSize;
+            while (bufsize > AES_MIN_BUFSIZE  &&  AesMemoryUsage(codec, bufsize) > insize)
+                bufsize = bufsize/2 / AES_BLOCK * AES_BLOCK;
+            codec->BufSize = (bufsize < AES_MIN_BUFSIZE? AES_MIN_BUFSIZE : bufsize);
+            return CELS_OK;
+        }
+
+    case CELS_GET_BLOCKSIZE:
+        return 0;
+
+    case CELS_COMPRESS:
+    case CELS_DECOMPRESS:
+        if (inbuf && outbuf)    return CELS_AES_membuf(codec, service==CELS_DECOMPRESS, inbuf,insize, outbuf,outsize, ud,cb);
+        if (inbuf || outbuf)    return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb)                return CELS_ERROR_GENERAL;
+        return CELS_AES_stream(codec, service==CELS_DECOMPRESS, ud,cb);
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+
+#ifdef CELS_REGISTER_CODECS
+static CelsResult dummy = CelsRegister ("aes*", NULL, AesMain);
+#else
+// Loaded from DLL: register the codec with the wildcard name
+CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (service == CELS_LOAD_MODULE)
+        return cb(NULL, CELS_REGISTER,0, (void*)"aes*",0, NULL,0, NULL,(CelsCallback0*)AesMain);
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+#endif
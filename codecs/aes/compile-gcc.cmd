@@ -0,0 +1,4 @@
+@set lib=../../lib
+gcc -c -O3 -I%lib% cels-aes.cpp
+dllwrap --driver-name c++ cels-aes.o -def %lib%/CELS.def -s -o cels-aes.dll
+@del *.o
@@ -0,0 +1,326 @@
+/*
+    "auto" meta-codec for CELS - Framework and standard API for compression algorithms
+    Copyright (C) 2021, Bulat Ziganshin <Bulat.Ziganshin@gmail.com>
+
+    MIT License (https://opensource.org/licenses/MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+
+    You can contact the author at:
+       - CELS repository: https://github.com/Bulat-Ziganshin/CELS
+*/
+
+// Method string: "auto[N][:method1][:method2]...", where
+//   N       - speed of the link transferring compressed data in MB/s (100 by default)
+//   methodX - candidate methods, with ':' inside of the candidate method written as '/', f.e. "lz4/a8"
+// Candidates are called through the Cels() pointer received at codec registration, so they can be
+// any methods registered in the application, as far as they support memory buffer (de)compression.
+// Without explicit candidates, "lz4" is used. Storing data uncompressed is always the candidate #0.
+//
+// Each chunk of input data is sampled, and every candidate compresses the sample. The candidate
+// minimizing the time required to compress the data and then send it over the N MB/s link wins
+// and compresses the entire chunk. So, small N prefers better compression and large N - faster one.
+//
+// Compressed stream is a sequence of chunks, each one is represented by
+//   1 byte:  candidate number
+//   4 bytes: compressed size
+//   4 bytes: original size
+//   and then compressed data.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "CELS.h"
+
+const int AUTO_CHUNKSIZE = 1<<20;           // Input data are split into chunks of this size
+const int AUTO_SAMPLES = 4;                 // Number of samples taken from each chunk
+const int AUTO_SAMPLESIZE = 16<<10;         // Size of each sample
+const int AUTO_HEADER_SIZE = 1+4+4;         // Chunk header: candidate number + compressed size + original size
+const int AUTO_MAX_CANDIDATES = 8;          // Including the "store" candidate
+const int AUTO_CANDIDATES_SIZE = 700;       // Space for candidate method strings in the parsed method
+const double AUTO_DEFAULT_LINK_SPEED = 100;
+
+// Cels() of the application, saved at codec registration
+static CelsCallback* CelsApi = NULL;
+
+// Structure representing the parsed codec
+struct AutoCodec
+{
+    double LinkSpeed;                       // speed of the link transferring compressed data in MB/s
+    int NumCandidates;                      // number of candidate methods, excluding "store"
+    char Candidates[AUTO_CANDIDATES_SIZE];  // candidate method strings (in the usual ':' notation), each one followed by '\0'
+};
+
+
+// Current time in seconds
+static double AutoTime()
+{
+    return std::chrono::duration<double> (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Parse every candidate method once per operation, storing them into the `parsed` array
+static CelsResult AutoParseCandidates (AutoCodec* codec, char* parsed)
+{
+    const char* candidate = codec->Candidates;
+    for (int i=0; i < codec->NumCandidates; i++)
+    {
+        CelsResult result = CelsApi ((void*)candidate, CELS_PARSE,0, NULL,0, parsed + i*CELS_MAX_PARSED_METHOD_SIZE,CELS_MAX_PARSED_METHOD_SIZE, NULL,NULL);
+        if (result < CELS_OK) {
+            while (i--)  CelsApi (parsed + i*CELS_MAX_PARSED_METHOD_SIZE, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback0*)CelsApi);
+            return result;
+        }
+        candidate += strlen(candidate) + 1;
+    }
+    return CELS_OK;
+}
+
+static void AutoFreeCandidates (AutoCodec* codec, char* parsed)
+{
+    for (int i=0; i < codec->NumCandidates; i++)
+        CelsApi (parsed + i*CELS_MAX_PARSED_METHOD_SIZE, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback0*)CelsApi);
+}
+
+// Choose the candidate for compression of (buf,size): 0 means "store", i>0 - the candidate method #i
+static int AutoChooseCandidate (AutoCodec* codec, char* parsed, char* buf, CelsNum size, char* sample, char* compressed)
+{
+    // Build the sample from AUTO_SAMPLES pieces evenly spread over the chunk
+    CelsNum sampleSize = size;
+    if (size > AUTO_SAMPLES*AUTO_SAMPLESIZE) {
+        for (int i=0; i<AUTO_SAMPLES; i++)
+            memcpy (sample + i*AUTO_SAMPLESIZE, buf + (size-AUTO_SAMPLESIZE) / (AUTO_SAMPLES-1) * i, AUTO_SAMPLESIZE);
+        sampleSize = AUTO_SAMPLES*AUTO_SAMPLESIZE;
+        buf = sample;
+    }
+
+    // "store" spends no time, but sends all the data over the link
+    double linkSpeed = codec->LinkSpeed * 1e6;
+    double bestCost = sampleSize / linkSpeed;
+    int best = 0;
+
+    for (int i=0; i < codec->NumCandidates; i++)
+    {
+        double startTime = AutoTime();
+        CelsResult compressedSize = CelsApi (parsed + i*CELS_MAX_PARSED_METHOD_SIZE, CELS_COMPRESS,0, buf,sampleSize, compressed,sampleSize, NULL,NULL);
+        if (compressedSize < CELS_OK  ||  compressedSize >= sampleSize)  continue;   // not a candidate for these data
+
+        double cost = (AutoTime() - startTime) + compressedSize / linkSpeed;
+        if (cost < bestCost)
+            bestCost = cost,  best = i+1;
+    }
+    return best;
+}
+
+
+// Stream compression employing callbacks for I/O
+CelsResult CELS_AUTO_compress (AutoCodec* codec, void* ud, CelsCallback* cb)
+{
+    size_t parsedSize = codec->NumCandidates * CELS_MAX_PARSED_METHOD_SIZE;
+    char* buf = (char*) CelsMemAlloc(cb,ud, parsedSize + AUTO_CHUNKSIZE + AUTO_HEADER_SIZE + AUTO_CHUNKSIZE + AUTO_SAMPLES*AUTO_SAMPLESIZE);
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* parsed = buf;
+    char* origBuf = parsed + parsedSize;
+    char* compressedBuf = origBuf + AUTO_CHUNKSIZE;
+    char* sample = compressedBuf + AUTO_HEADER_SIZE + AUTO_CHUNKSIZE;
+
+    CelsResult errcode = AutoParseCandidates (codec, parsed);
+    if (errcode < CELS_OK)  {CelsMemFree(cb,ud, buf);  return errcode;}
+
+    for(;;)
+    {
+        CelsResult origSize;
+        CELS_READ_OR_EOF(origSize, origBuf, AUTO_CHUNKSIZE);
+
+        int candidate = AutoChooseCandidate (codec, parsed, origBuf, origSize, sample, compressedBuf + AUTO_HEADER_SIZE);
+
+        CelsResult compressedSize = origSize;
+        if (candidate > 0) {
+            // Compressed data should be smaller than the original ones, otherwise we store the chunk
+            compressedSize = CelsApi (parsed + (candidate-1)*CELS_MAX_PARSED_METHOD_SIZE, CELS_COMPRESS,0,
+                                      origBuf,origSize, compressedBuf + AUTO_HEADER_SIZE,origSize, NULL,NULL);
+            if (compressedSize < CELS_OK  ||  compressedSize >= origSize)
+                candidate = 0,  compressedSize = origSize;
+        }
+        if (candidate == 0)
+            memcpy (compressedBuf + AUTO_HEADER_SIZE, origBuf, origSize);
+
+        compressedBuf[0] = (char) candidate;
+        CelsSerializeInt (compressedSize, compressedBuf+1, 4);
+        CelsSerializeInt (origSize,       compressedBuf+5, 4);
+        CELS_WRITE_EXACTLY(compressedBuf, AUTO_HEADER_SIZE + compressedSize);
+    }
+
+finished:
+    AutoFreeCandidates (codec, parsed);
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+
+// Stream decompression employing callbacks for I/O
+CelsResult CELS_AUTO_decompress (AutoCodec* codec, void* ud, CelsCallback* cb)
+{
+    size_t parsedSize = codec->NumCandidates * CELS_MAX_PARSED_METHOD_SIZE;
+    char* buf = (char*) CelsMemAlloc(cb,ud, parsedSize + AUTO_CHUNKSIZE + AUTO_CHUNKSIZE);
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* parsed = buf;
+    char* origBuf = parsed + parsedSize;
+    char* compressedBuf = origBuf + AUTO_CHUNKSIZE;
+
+    CelsResult errcode = AutoParseCandidates (codec, parsed);
+    if (errcode < CELS_OK)  {CelsMemFree(cb,ud, buf);  return errcode;}
+
+    for(;;)
+    {
+        char header[AUTO_HEADER_SIZE];
+        CELS_READ_EXACTLY_OR_EOF(header, AUTO_HEADER_SIZE);
+
+        int candidate = (unsigned char) header[0];
+        CelsResult compressedSize = CelsDeserializeInt(header+1, 4);
+        CelsResult origSize       = CelsDeserializeInt(header+5, 4);
+        if (candidate > codec->NumCandidates  ||  compressedSize > AUTO_CHUNKSIZE  ||  origSize > AUTO_CHUNKSIZE)
+            CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+        if (candidate == 0) {
+            if (compressedSize != origSize)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+            CELS_READ_EXACTLY(origBuf, origSize);
+        } else {
+            CELS_READ_EXACTLY(compressedBuf, compressedSize);
+            CelsResult result = CelsApi (parsed + (candidate-1)*CELS_MAX_PARSED_METHOD_SIZE, CELS_DECOMPRESS,0,
+                                         compressedBuf,compressedSize, origBuf,origSize, NULL,NULL);
+            if (result != origSize)  CELS_RETURN2(result, CELS_ERROR_BAD_COMPRESSED_DATA);
+        }
+
+        CELS_WRITE_EXACTLY(origBuf, origSize);
+    }
+
+finished:
+    AutoFreeCandidates (codec, parsed);
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+
+static CelsResult __cdecl AutoMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    AutoCodec *codec = (AutoCodec*)self;
+
+    switch (service)
+    {
+    case CELS_LOAD_CODEC:
+        CelsApi = cb;
+        return CELS_OK;
+
+    case CELS_PARSE:
+        {
+            if (outsize < (CelsNum)sizeof(AutoCodec))  return CELS_ERROR_GENERAL;
+
+            codec = (AutoCodec*)outbuf;
+            codec->LinkSpeed = AUTO_DEFAULT_LINK_SPEED;
+            codec->NumCandidates = 0;
+
+            // Method name is "auto" optionally followed by the link speed
+            char** param = (char**)inbuf;
+            if (strncmp(param[0], "auto", 4))  return CELS_ERROR_INVALID_COMPRESSOR;
+            if (param[0][4]) {
+                char* end;
+                codec->LinkSpeed = strtod(param[0]+4, &end);
+                if (*end || codec->LinkSpeed <= 0)  return CELS_ERROR_INVALID_COMPRESSOR;
+            }
+
+            // Remaining parameters are candidate methods
+            char* candidate = codec->Candidates;
+            while (*++param)
+            {
+                size_t len = strlen(*param);
+                if (codec->NumCandidates+1 >= AUTO_MAX_CANDIDATES  ||  candidate+len+1 > codec->Candidates+AUTO_CANDIDATES_SIZE)
+                    return CELS_ERROR_INVALID_COMPRESSOR;
+                for (size_t i=0; i<=len; i++)
+                    candidate[i] = ((*param)[i]=='/'? CELS_METHOD_PARAMETERS_DELIMITER : (*param)[i]);
+                candidate += len+1;
+                codec->NumCandidates++;
+            }
+            if (codec->NumCandidates == 0) {
+                strcpy (codec->Candidates, "lz4");
+                codec->NumCandidates = 1;
+            }
+            return sizeof(AutoCodec);
+        }
+
+    case CELS_UNPARSE:
+        {
+            char str[CELS_MAX_METHOD_STRING_SIZE];
+            int len = sprintf(str, "auto");
+            if (codec->LinkSpeed != AUTO_DEFAULT_LINK_SPEED)   len += sprintf(str+len, "%g", codec->LinkSpeed);
+
+            const char* candidate = codec->Candidates;
+            for (int i=0; i < codec->NumCandidates; i++)
+            {
+                size_t candidateLen = strlen(candidate);
+                if (len + 1 + candidateLen >= sizeof(str))  return CELS_ERROR_GENERAL;
+                str[len++] = CELS_METHOD_PARAMETERS_DELIMITER;
+                for (size_t j=0; j<candidateLen; j++)
+                    str[len++] = (candidate[j]==CELS_METHOD_PARAMETERS_DELIMITER? '/' : candidate[j]);
+                candidate += candidateLen+1;
+            }
+            str[len] = '\0';
+
+            if (len >= outsize)  return CELS_ERROR_GENERAL;
+            strcpy ((char*)outbuf, str);
+            return CELS_OK;
+        }
+
+    case CELS_GET_MAX_COMPRESSED_SIZE:
+        return insize + (insize / AUTO_CHUNKSIZE + 1) * AUTO_HEADER_SIZE;
+
+    case CELS_GET_COMPRESSION_MEMORY:
+        return codec->NumCandidates * CELS_MAX_PARSED_METHOD_SIZE + 2*AUTO_CHUNKSIZE + AUTO_HEADER_SIZE + AUTO_SAMPLES*AUTO_SAMPLESIZE;
+
+    case CELS_GET_DECOMPRESSION_MEMORY:
+        return codec->NumCandidates * CELS_MAX_PARSED_METHOD_SIZE + 2*AUTO_CHUNKSIZE;
+
+    case CELS_COMPRESS:
+        if (inbuf || outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb || !CelsApi)  return CELS_ERROR_GENERAL;
+        return CELS_AUTO_compress(codec, ud,cb);
+
+    case CELS_DECOMPRESS:
+        if (inbuf || outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb || !CelsApi)  return CELS_ERROR_GENERAL;
+        return CELS_AUTO_decompress(codec, ud,cb);
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+
+#ifdef CELS_REGISTER_CODECS
+static CelsResult dummy = CelsRegister ("auto*", NULL, AutoMain);
+#else
+// Loaded from DLL: register the codec with the wildcard name
+CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (service == CELS_LOAD_MODULE)
+        return cb(NULL, CELS_REGISTER,0, (void*)"auto*",0, NULL,0, NULL,(CelsCallback0*)AutoMain);
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+#endif
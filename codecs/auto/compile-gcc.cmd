@@ -0,0 +1,4 @@
+@set lib=../../lib
+gcc -c -O3 -I%lib% cels-auto.cpp
+dllwrap --driver-name c++ cels-auto.o -def %lib%/CELS.def -s -o cels-auto.dll
+@del *.o
@@ -0,0 +1,612 @@
+/*
+    "dedup" codec for CELS - Framework and standard API for compression algorithms
+    Copyright (C) 2021, Bulat Ziganshin <Bulat.Ziganshin@gmail.com>
+
+    MIT License (https://opensource.org/licenses/MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+
+    You can contact the author at:
+       - CELS repository: https://github.com/Bulat-Ziganshin/CELS
+*/
+
+// Method string: "dedup[:aN][:wN][:backend]", where
+//   aN      - average chunk size (8k by default, power of 2 between 256 and 64k, optional k/m/g suffix)
+//   wN      - window where duplicate chunks are searched (64m by default, power of 2 between 1m and 1g)
+//   backend - method compressing the deduplicated data, with ':' inside of it written as '/', f.e. "lz4/a8".
+//             It's called through the Cels() pointer received at codec registration, so it can be
+//             any method registered in the application, as far as it supports memory buffer (de)compression.
+//             "lz4" by default, "store" disables the backend.
+//
+// Input data are split into chunks at content-defined boundaries found by the gear rolling hash with
+// normalized chunking of FastCDC, so the boundaries survive insertions and deletions in the data.
+// Every chunk is looked up in the fingerprint index, and if the same chunk is found in the last
+// wN bytes of data, it's replaced with the reference. The index holds two entries per average chunk
+// of the window, and the window is reduced when the memory for compression/decompression is limited.
+// The decompressor keeps the window too, so both sides should use the same method string.
+//
+// Compressed stream starts with a byte holding log2 of the window size, followed by blocks:
+//   1 byte:  1 if the block was compressed by the backend, 0 if it's stored
+//   4 bytes: compressed size
+//   4 bytes: size of the deduplicated data
+//   4 bytes: original size
+//   and then compressed data.
+// Deduplicated data is a sequence of tokens, each one starting with varint holding length*2+flag.
+// With flag=0, it's followed by the literal data, with flag=1 - by varint holding the distance back
+// to the reference source. A reference may overlap the data it produces, repeating them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "CELS.h"
+
+const int DEDUP_BLOCKSIZE = 1<<20;          // Input data are encoded in blocks of this size
+const int DEDUP_ENCODING_SLACK = 16;        // Deduplicated block may be a bit larger than the original data
+const int DEDUP_HEADER_SIZE = 1+4+4+4;      // Block header: backend flag + compressed size + deduplicated size + original size
+const int DEDUP_BACKEND_SIZE = 256;         // Space for the backend method string in the parsed method
+const CelsNum DEDUP_DEFAULT_CHUNKSIZE = 8<<10;
+const CelsNum DEDUP_MIN_CHUNKSIZE = 256;    // Limits for the average chunk size
+const CelsNum DEDUP_MAX_CHUNKSIZE = 64<<10;
+const CelsNum DEDUP_DEFAULT_WINDOW = 64<<20;
+const CelsNum DEDUP_MIN_WINDOW = 1<<20;     // Window can't be smaller than the block since literal runs are stored into it at once
+const CelsNum DEDUP_MAX_WINDOW = 1<<30;
+
+// Cels() of the application, saved at codec registration
+static CelsCallback* CelsApi = NULL;
+
+// Structure representing the parsed codec
+struct DedupCodec
+{
+    CelsNum AvgChunkSize;                   // average chunk size
+    CelsNum WindowSize;                     // amount of preceding data where duplicate chunks are searched
+    char Backend[DEDUP_BACKEND_SIZE];       // method compressing the deduplicated data (in the usual ':' notation), "" if none
+};
+
+// Fingerprint index entry: the last chunk seen with this hash
+struct DedupIndexEntry
+{
+    uint32_t check;                         // higher bits of the hash, not used for the index addressing
+    uint32_t len;                           // chunk length
+    uint64_t pos;                           // chunk position in the stream
+};
+
+
+// Parse memory size like "64k" or "1m" at str, storing pointer to the first char after the number into *end
+static CelsNum DedupParseSize (const char* str, char** end)
+{
+    CelsNum size = strtoll(str, end, 10);
+    if (*end == str)  return -1;
+    switch (**end)
+    {
+        case 'g': size <<= 10;  // fallthrough
+        case 'm': size <<= 10;  // fallthrough
+        case 'k': size <<= 10;  ++*end;
+    }
+    return size;
+}
+
+// Format memory size into the shortest form accepted by DedupParseSize
+static int DedupFormatSize (char* str, CelsNum size)
+{
+    static const char* suffix[] = {"", "k", "m", "g"};
+    int i = 0;
+    while (size >= 1024  &&  size % 1024 == 0  &&  i < 3)
+        size /= 1024,  i++;
+    return sprintf(str, "%lld%s", (long long) size, suffix[i]);
+}
+
+static int DedupIsPowerOf2 (CelsNum x)
+{
+    return x > 0  &&  (x & (x-1)) == 0;
+}
+
+static int DedupLog2 (CelsNum x)
+{
+    int bits = 0;
+    while (x > 1)  x >>= 1,  bits++;
+    return bits;
+}
+
+// Number of fingerprint index entries for the given window
+static CelsNum DedupIndexEntries (DedupCodec* codec, CelsNum window)
+{
+    return 2 * window / codec->AvgChunkSize;
+}
+
+static CelsNum DedupMemoryUsage (DedupCodec* codec, bool compression, CelsNum window)
+{
+    CelsNum buffers = DEDUP_BLOCKSIZE + 2 * (DEDUP_BLOCKSIZE + DEDUP_ENCODING_SLACK);
+    CelsNum index = (compression?  DedupIndexEntries(codec, window) * sizeof(DedupIndexEntry) : 0);
+    CelsNum backend = 0;
+    if (codec->Backend[0]) {
+        backend = CELS_MAX_PARSED_METHOD_SIZE;
+        CelsResult mem = (CelsApi?  CelsApi (codec->Backend, compression? CELS_GET_COMPRESSION_MEMORY : CELS_GET_DECOMPRESSION_MEMORY,0, NULL,0, NULL,0, NULL,NULL) : 0);
+        if (mem > 0)  backend += mem;
+    }
+    return window + index + buffers + backend;
+}
+
+
+// Gear table for the rolling hash, generated by splitmix64 so the chunk boundaries are the same on every platform
+static void DedupInitGear (uint64_t* gear)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (int i=0; i<256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the chunk starting at buf. The hash needs more matching bits until the average size is reached
+// and less ones after that, so chunk sizes are concentrated around the average (FastCDC normalized chunking).
+// Bytes below the minimal chunk size aren't hashed at all, since the boundary can't be placed there
+static size_t DedupCut (const uint64_t* gear, const unsigned char* buf, size_t size, size_t avg, uint64_t hardMask, uint64_t easyMask)
+{
+    size_t minSize = avg/4,  maxSize = avg*8;
+    if (size <= minSize)  return size;
+    if (size > maxSize)   size = maxSize;
+    size_t normalSize = (avg < size? avg : size);
+
+    uint64_t hash = 0;
+    size_t i = minSize;
+    for (; i < normalSize; i++) {
+        hash = (hash << 1) + gear[buf[i]];
+        if (!(hash & hardMask))  return i+1;
+    }
+    for (; i < size; i++) {
+        hash = (hash << 1) + gear[buf[i]];
+        if (!(hash & easyMask))  return i+1;
+    }
+    return size;
+}
+
+static inline uint64_t DedupRotl (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64-r));
+}
+
+// Fingerprint of the chunk. Four independent lanes keep multiple multiplications in flight
+static uint64_t DedupHash (const unsigned char* buf, size_t len)
+{
+    const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL,  PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t lane[4] = {len, PRIME1, PRIME2, PRIME1 ^ PRIME2};
+    size_t i = 0;
+    for (; i+32 <= len; i += 32)
+        for (int k=0; k<4; k++) {
+            uint64_t word;
+            memcpy (&word, buf + i + 8*k, 8);
+            lane[k] = DedupRotl (lane[k] + word * PRIME2, 31) * PRIME1;
+        }
+    uint64_t hash = DedupRotl(lane[0],1) + DedupRotl(lane[1],7) + DedupRotl(lane[2],12) + DedupRotl(lane[3],18);
+    for (; i < len; i++)
+        hash = DedupRotl (hash ^ (buf[i] * PRIME1), 11) * PRIME2;
+    hash ^= hash >> 33;  hash *= PRIME2;
+    hash ^= hash >> 29;  hash *= PRIME1;
+    return hash ^ (hash >> 32);
+}
+
+
+// The window is a ring buffer holding the last `mask+1` bytes of the stream
+static void DedupRingPut (char* ring, size_t mask, uint64_t pos, const char* buf, size_t len)
+{
+    size_t start = (size_t)(pos & mask),  first = (len < mask+1-start? len : mask+1-start);
+    memcpy (ring + start, buf, first);
+    memcpy (ring, buf + first, len - first);
+}
+
+static void DedupRingGet (const char* ring, size_t mask, uint64_t pos, char* buf, size_t len)
+{
+    size_t start = (size_t)(pos & mask),  first = (len < mask+1-start? len : mask+1-start);
+    memcpy (buf, ring + start, first);
+    memcpy (buf + first, ring, len - first);
+}
+
+static bool DedupRingEqual (const char* ring, size_t mask, uint64_t pos, const char* buf, size_t len)
+{
+    size_t start = (size_t)(pos & mask),  first = (len < mask+1-start? len : mask+1-start);
+    return memcmp (ring + start, buf, first) == 0  &&  memcmp (ring, buf + first, len - first) == 0;
+}
+
+static char* DedupPutVarint (char* ptr, uint64_t value)
+{
+    while (value >= 128)
+        *ptr++ = (char)(value | 128),  value >>= 7;
+    *ptr++ = (char)value;
+    return ptr;
+}
+
+// Returns NULL if the varint isn't finished before the end of buffer
+static const char* DedupGetVarint (const char* ptr, const char* end, uint64_t* value)
+{
+    *value = 0;
+    for (int shift = 0;  ptr < end  &&  shift < 64;  shift += 7) {
+        unsigned char c = *ptr++;
+        *value |= (uint64_t)(c & 127) << shift;
+        if (c < 128)  return ptr;
+    }
+    return NULL;
+}
+
+
+// Compress the deduplicated block with the backend and write it
+static CelsResult DedupWriteBlock (char* parsed, char* encoded, CelsNum encodedSize, char* compressed, CelsNum origSize, void* ud, CelsCallback* cb)
+{
+    char header[DEDUP_HEADER_SIZE];
+    char* data = encoded;
+    CelsResult dataSize = encodedSize;
+    header[0] = 0;
+
+    // Compressed data should be smaller than the deduplicated ones, otherwise we store the block
+    if (parsed) {
+        CelsResult compressedSize = CelsApi (parsed, CELS_COMPRESS,0, encoded,encodedSize, compressed,encodedSize, NULL,NULL);
+        if (compressedSize >= CELS_OK  &&  compressedSize < encodedSize)
+            header[0] = 1,  data = compressed,  dataSize = compressedSize;
+    }
+
+    CelsSerializeInt (dataSize,    header+1, 4);
+    CelsSerializeInt (encodedSize, header+5, 4);
+    CelsSerializeInt (origSize,    header+9, 4);
+    CelsIoVec iov[2] = {{header, DEDUP_HEADER_SIZE}, {data, dataSize}};
+    CelsResult result = CelsWritev(cb,ud, iov, 2);
+    return (result == DEDUP_HEADER_SIZE+dataSize? CELS_OK : result < CELS_OK? result : CELS_ERROR_WRITE);
+}
+
+
+// Stream compression employing callbacks for I/O
+CelsResult CELS_DEDUP_compress (DedupCodec* codec, void* ud, CelsCallback* cb)
+{
+    size_t window = (size_t) codec->WindowSize,  mask = window-1;
+    size_t indexSize = (size_t) DedupIndexEntries (codec, codec->WindowSize);
+    size_t parsedSize = (codec->Backend[0]? CELS_MAX_PARSED_METHOD_SIZE : 0);
+    char* buf = (char*) CelsMemAlloc(cb,ud, parsedSize + window + indexSize*sizeof(DedupIndexEntry) + DEDUP_BLOCKSIZE + 2*(DEDUP_BLOCKSIZE + DEDUP_ENCODING_SLACK));
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    DedupIndexEntry* index = (DedupIndexEntry*) buf;   // placed first for alignment
+    char* ring = (char*) (index + indexSize);
+    char* parsed = ring + window;
+    char* inbuf = parsed + parsedSize;
+    char* encoded = inbuf + DEDUP_BLOCKSIZE;
+    char* compressed = encoded + DEDUP_BLOCKSIZE + DEDUP_ENCODING_SLACK;
+    memset (index, 0, indexSize*sizeof(DedupIndexEntry));
+
+    CelsResult errcode = CELS_OK;
+    if (parsedSize) {
+        errcode = CelsApi (codec->Backend, CELS_PARSE,0, NULL,0, parsed,CELS_MAX_PARSED_METHOD_SIZE, NULL,NULL);
+        if (errcode < CELS_OK)  {CelsMemFree(cb,ud, buf);  return errcode;}
+        errcode = CELS_OK;
+    }
+
+    uint64_t gear[256];
+    DedupInitGear (gear);
+    size_t avg = (size_t) codec->AvgChunkSize;
+    int bits = DedupLog2 (avg);
+    uint64_t hardMask = ~0ULL << (64 - (bits+2)),  easyMask = ~0ULL << (64 - (bits-2));
+
+    char streamHeader = (char) DedupLog2 (window);
+    CELS_WRITE_EXACTLY(&streamHeader, 1);
+
+    {
+        uint64_t pos = 0;           // stream position of the next chunk
+        size_t filled = 0;          // amount of data in the inbuf
+        bool eof = false;
+        for(;;)
+        {
+            if (!eof) {
+                CelsResult result = CelsRead(cb,ud, inbuf+filled, DEDUP_BLOCKSIZE-filled);
+                if (result < CELS_OK)  CELS_RETURN(result);
+                eof = (result < DEDUP_BLOCKSIZE - (CelsResult)filled);
+                filled += result;
+            }
+            if (filled == 0)  break;
+
+            // Split the data into chunks, leaving the tail that may be cut differently once more data are read
+            char* out = encoded;
+            size_t start = 0,  literals = 0;      // chunk start and the first literal byte not encoded yet
+            uint64_t refLen = 0,  refDist = 0;    // reference not encoded yet, extended while chunks follow the same source
+            while (start < filled  &&  (eof  ||  filled-start >= avg*8))
+            {
+                size_t len = DedupCut (gear, (unsigned char*)inbuf+start, filled-start, avg, hardMask, easyMask);
+                uint64_t hash = DedupHash ((unsigned char*)inbuf+start, len);
+                DedupIndexEntry* entry = &index[hash & (indexSize-1)];
+
+                if (entry->check == (uint32_t)(hash >> 32)  &&  entry->len == len  &&  pos - entry->pos <= window
+                    &&  DedupRingEqual (ring, mask, entry->pos, inbuf+start, len))
+                {
+                    if (refLen  &&  refDist != pos - entry->pos)
+                        out = DedupPutVarint (out, refLen*2+1),  out = DedupPutVarint (out, refDist),  refLen = 0;
+                    if (literals < start)
+                        out = DedupPutVarint (out, (start-literals)*2),  memcpy (out, inbuf+literals, start-literals),  out += start-literals;
+                    refDist = pos - entry->pos;
+                    refLen += len;
+                    literals = start + len;
+                }
+                else
+                {
+                    if (refLen)
+                        out = DedupPutVarint (out, refLen*2+1),  out = DedupPutVarint (out, refDist),  refLen = 0;
+                    entry->check = (uint32_t)(hash >> 32);
+                    entry->len   = (uint32_t) len;
+                    entry->pos   = pos;
+                }
+
+                DedupRingPut (ring, mask, pos, inbuf+start, len);
+                pos += len;
+                start += len;
+            }
+            if (refLen)
+                out = DedupPutVarint (out, refLen*2+1),  out = DedupPutVarint (out, refDist);
+            if (literals < start)
+                out = DedupPutVarint (out, (start-literals)*2),  memcpy (out, inbuf+literals, start-literals),  out += start-literals;
+
+            errcode = DedupWriteBlock (parsedSize? parsed : NULL, encoded, out-encoded, compressed, start, ud,cb);
+            if (errcode < CELS_OK)  goto finished;
+
+            memmove (inbuf, inbuf+start, filled-start);
+            filled -= start;
+        }
+    }
+
+finished:
+    if (parsedSize)  CelsApi (parsed, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback0*)CelsApi);
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+
+// Stream decompression employing callbacks for I/O
+CelsResult CELS_DEDUP_decompress (DedupCodec* codec, void* ud, CelsCallback* cb)
+{
+    size_t window = (size_t) codec->WindowSize,  mask = window-1;
+    size_t parsedSize = (codec->Backend[0]? CELS_MAX_PARSED_METHOD_SIZE : 0);
+    char* buf = (char*) CelsMemAlloc(cb,ud, parsedSize + window + DEDUP_BLOCKSIZE + 2*(DEDUP_BLOCKSIZE + DEDUP_ENCODING_SLACK));
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* ring = buf;
+    char* parsed = ring + window;
+    char* origBuf = parsed + parsedSize;
+    char* encoded = origBuf + DEDUP_BLOCKSIZE;
+    char* compressed = encoded + DEDUP_BLOCKSIZE + DEDUP_ENCODING_SLACK;
+
+    CelsResult errcode = CELS_OK;
+    if (parsedSize) {
+        errcode = CelsApi (codec->Backend, CELS_PARSE,0, NULL,0, parsed,CELS_MAX_PARSED_METHOD_SIZE, NULL,NULL);
+        if (errcode < CELS_OK)  {CelsMemFree(cb,ud, buf);  return errcode;}
+        errcode = CELS_OK;
+    }
+
+    {
+        // The stream can't refer further back than our window
+        char streamHeader;
+        CELS_READ_EXACTLY_OR_EOF(&streamHeader, 1);
+        if (streamHeader < 0  ||  streamHeader > DedupLog2 (window))  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+        uint64_t pos = 0;
+        for(;;)
+        {
+            char header[DEDUP_HEADER_SIZE];
+            CELS_READ_EXACTLY_OR_EOF(header, DEDUP_HEADER_SIZE);
+
+            int compressedBlock = header[0];
+            CelsResult compressedSize = CelsDeserializeInt(header+1, 4);
+            CelsResult encodedSize    = CelsDeserializeInt(header+5, 4);
+            CelsResult origSize       = CelsDeserializeInt(header+9, 4);
+            if (compressedBlock > 1  ||  (compressedBlock && !parsedSize)  ||  (!compressedBlock && compressedSize != encodedSize)
+                ||  compressedSize > DEDUP_BLOCKSIZE + DEDUP_ENCODING_SLACK  ||  encodedSize > DEDUP_BLOCKSIZE + DEDUP_ENCODING_SLACK  ||  origSize > DEDUP_BLOCKSIZE)
+                CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+            if (compressedBlock) {
+                CELS_READ_EXACTLY(compressed, compressedSize);
+                CelsResult result = CelsApi (parsed, CELS_DECOMPRESS,0, compressed,compressedSize, encoded,encodedSize, NULL,NULL);
+                if (result != encodedSize)  CELS_RETURN2(result, CELS_ERROR_BAD_COMPRESSED_DATA);
+            } else {
+                CELS_READ_EXACTLY(encoded, encodedSize);
+            }
+
+            // Decode tokens, appending every one to the window, so the following references may use it
+            const char *ptr = encoded,  *end = encoded + encodedSize;
+            uint64_t done = 0;
+            while (ptr < end)
+            {
+                uint64_t token, len, dist;
+                ptr = DedupGetVarint (ptr, end, &token);
+                if (ptr == NULL)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+                len = token / 2;
+                if (len == 0  ||  len > (uint64_t)origSize - done)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+                if (token & 1) {
+                    ptr = DedupGetVarint (ptr, end, &dist);
+                    if (ptr == NULL  ||  dist == 0  ||  dist > window  ||  dist > pos)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+                    // Copy in pieces no longer than the distance, since the reference may overlap its own output
+                    while (len) {
+                        size_t piece = (size_t)(len < dist? len : dist);
+                        DedupRingGet (ring, mask, pos-dist, origBuf+done, piece);
+                        DedupRingPut (ring, mask, pos, origBuf+done, piece);
+                        pos += piece,  done += piece,  len -= piece;
+                    }
+                } else {
+                    if (len > (uint64_t)(end - ptr))  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+                    memcpy (origBuf+done, ptr, len);
+                    DedupRingPut (ring, mask, pos, ptr, len);
+                    ptr += len,  pos += len,  done += len;
+                }
+            }
+            if (done != (uint64_t)origSize)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+            CELS_WRITE_EXACTLY(origBuf, origSize);
+        }
+    }
+
+finished:
+    if (parsedSize)  CelsApi (parsed, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback0*)CelsApi);
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+
+static CelsResult __cdecl DedupMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    DedupCodec *codec = (DedupCodec*)self;
+
+    switch (service)
+    {
+    case CELS_LOAD_CODEC:
+        CelsApi = cb;
+        return CELS_OK;
+
+    case CELS_PARSE:
+        {
+            if (outsize < (CelsNum)sizeof(DedupCodec))  return CELS_ERROR_GENERAL;
+
+            codec = (DedupCodec*)outbuf;
+            codec->AvgChunkSize = DEDUP_DEFAULT_CHUNKSIZE;
+            codec->WindowSize = DEDUP_DEFAULT_WINDOW;
+            strcpy (codec->Backend, "lz4");
+            bool backendSet = false;
+
+            // Skip param[0] since it contains the method name
+            char** param = (char**)inbuf;
+            while (*++param)
+            {
+                char* end;
+                if (**param=='a'  &&  isdigit((unsigned char)(*param)[1])) {
+                    codec->AvgChunkSize = DedupParseSize(*param+1, &end);
+                    if (*end || !DedupIsPowerOf2(codec->AvgChunkSize) || codec->AvgChunkSize < DEDUP_MIN_CHUNKSIZE || codec->AvgChunkSize > DEDUP_MAX_CHUNKSIZE)  return CELS_ERROR_INVALID_COMPRESSOR;
+                    continue;
+                }
+                if (**param=='w'  &&  isdigit((unsigned char)(*param)[1])) {
+                    codec->WindowSize = DedupParseSize(*param+1, &end);
+                    if (*end || !DedupIsPowerOf2(codec->WindowSize) || codec->WindowSize < DEDUP_MIN_WINDOW || codec->WindowSize > DEDUP_MAX_WINDOW)  return CELS_ERROR_INVALID_COMPRESSOR;
+                    continue;
+                }
+
+                // Anything else is the backend method
+                size_t len = strlen(*param);
+                if (backendSet  ||  len >= DEDUP_BACKEND_SIZE)  return CELS_ERROR_INVALID_COMPRESSOR;
+                for (size_t i=0; i<=len; i++)
+                    codec->Backend[i] = ((*param)[i]=='/'? CELS_METHOD_PARAMETERS_DELIMITER : (*param)[i]);
+                if (!strcmp(codec->Backend, "store"))
+                    codec->Backend[0] = '\0';
+                backendSet = true;
+            }
+            return sizeof(DedupCodec);
+        }
+
+    case CELS_UNPARSE:
+        {
+            char str[CELS_MAX_METHOD_STRING_SIZE];
+            int len = sprintf(str, "dedup");
+            if (codec->AvgChunkSize != DEDUP_DEFAULT_CHUNKSIZE)  len += sprintf(str+len, ":a"),  len += DedupFormatSize(str+len, codec->AvgChunkSize);
+            if (codec->WindowSize != DEDUP_DEFAULT_WINDOW)       len += sprintf(str+len, ":w"),  len += DedupFormatSize(str+len, codec->WindowSize);
+
+            if (!codec->Backend[0]) {
+                len += sprintf(str+len, ":store");
+            } else if (strcmp(codec->Backend, "lz4")) {
+                size_t backendLen = strlen(codec->Backend);
+                if (len + 1 + backendLen >= sizeof(str))  return CELS_ERROR_GENERAL;
+                str[len++] = CELS_METHOD_PARAMETERS_DELIMITER;
+                for (size_t i=0; i<backendLen; i++)
+                    str[len++] = (codec->Backend[i]==CELS_METHOD_PARAMETERS_DELIMITER? '/' : codec->Backend[i]);
+                str[len] = '\0';
+            }
+
+            if (len >= outsize)  return CELS_ERROR_GENERAL;
+            strcpy ((char*)outbuf, str);
+            return CELS_OK;
+        }
+
+    case CELS_GET_DICTIONARY_SIZE:
+        return codec->WindowSize;
+
+    case CELS_SET_DICTIONARY_SIZE:
+        {
+            CelsNum window = DEDUP_MIN_WINDOW;
+            while (window*2 <= insize  &&  window < DEDUP_MAX_WINDOW)
+                window *= 2;
+            codec->WindowSize = window;
+            return CELS_OK;
+        }
+
+    case CELS_GET_MAX_COMPRESSED_SIZE:
+        return 1 + insize + (insize / DEDUP_BLOCKSIZE + 1) * (DEDUP_HEADER_SIZE + DEDUP_ENCODING_SLACK);
+
+    case CELS_GET_COMPRESSION_MEMORY:
+    case CELS_GET_DECOMPRESSION_MEMORY:
+        return DedupMemoryUsage (codec, service==CELS_GET_COMPRESSION_MEMORY, codec->WindowSize);
+
+    case CELS_GET_MINIMUM_COMPRESSION_MEMORY:
+    case CELS_GET_MINIMUM_DECOMPRESSION_MEMORY:
+        return DedupMemoryUsage (codec, service==CELS_GET_MINIMUM_COMPRESSION_MEMORY, DEDUP_MIN_WINDOW);
+
+    case CELS_SET_COMPRESSION_MEMORY:
+    case CELS_SET_DECOMPRESSION_MEMORY:
+        {
+            // Find the largest window (and index following it) fitting into the memory limit.
+            // The same window is used by the decompressor, so both limits are simultaneously reduced
+            CelsNum window = codec->WindowSize;
+            while (window > DEDUP_MIN_WINDOW  &&  DedupMemoryUsage(codec, service==CELS_SET_COMPRESSION_MEMORY, window) > insize)
+                window /= 2;
+            codec->WindowSize = window;
+            return CELS_OK;
+        }
+
+    case CELS_GET_BLOCKSIZE:
+        return 0;   // all blocks share the window
+
+    case CELS_SET_MINIMAL_INPUT_SIZE:
+        {
+            // Window larger than the entire input just wastes memory
+            CelsNum window = DEDUP_MIN_WINDOW;
+            while (window < insize  &&  window < codec->WindowSize)
+                window *= 2;
+            if (window < codec->WindowSize)
+                codec->WindowSize = window;
+            return CELS_OK;
+        }
+
+    case CELS_COMPRESS:
+        if (inbuf || outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb || (codec->Backend[0] && !CelsApi))  return CELS_ERROR_GENERAL;
+        return CELS_DEDUP_compress(codec, ud,cb);
+
+    case CELS_DECOMPRESS:
+        if (inbuf || outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb || (codec->Backend[0] && !CelsApi))  return CELS_ERROR_GENERAL;
+        return CELS_DEDUP_decompress(codec, ud,cb);
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+
+#ifdef CELS_REGISTER_CODECS
+static CelsResult dummy = CelsRegister ("dedup", NULL, DedupMain);
+#else
+// Loaded from DLL: register the codec under its own name, so CELS_LOAD_CODEC delivers Cels() to DedupMain
+CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (service == CELS_LOAD_MODULE)
+        return cb(NULL, CELS_REGISTER,0, (void*)"dedup",0, NULL,0, NULL,(CelsCallback0*)DedupMain);
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+#endif
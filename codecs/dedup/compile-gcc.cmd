@@ -0,0 +1,4 @@
+@set lib=../../lib
+gcc -c -O3 -I%lib% cels-dedup.cpp
+dllwrap --driver-name c++ cels-dedup.o -def %lib%/CELS.def -s -o cels-dedup.dll
+@del *.o
@@ -0,0 +1,701 @@
+/*
+    "lrm" codec for CELS - Framework and standard API for compression algorithms
+    Copyright (C) 2021, Bulat Ziganshin <Bulat.Ziganshin@gmail.com>
+
+    MIT License (https://opensource.org/licenses/MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+
+    You can contact the author at:
+       - CELS repository: https://github.com/Bulat-Ziganshin/CELS
+*/
+
+// Method string: "lrm[:wN][:mN][:backend]", where
+//   wN      - window where long-range matches are searched (256m by default, power of 2 between 16m and 4g,
+//             1g for 32-bit builds, optional k/m/g suffix)
+//   mN      - minimal match length (64 by default, between 16 and 4096)
+//   backend - method compressing the preprocessed data, with ':' inside of it written as '/', f.e. "lz4/a8".
+//             It's called through the Cels() pointer received at codec registration, so it can be
+//             any method registered in the application, as far as it supports memory buffer (de)compression.
+//             "lz4" by default, "store" disables the backend.
+//
+// Long-range matcher finds byte-level repeats far beyond the reach of the backend, f.e. hundreds of MB apart
+// in VM images or database dumps, and replaces them with references, leaving the rest to the backend.
+// Input is processed in 4 MB blocks. Rabin-Karp rolling hash of every mN bytes is computed over the block,
+// in parallel by the framework thread pool, and only positions whose hash has log2(mN) top bits zero are
+// kept, so the sparse index holds about one entry per mN bytes of the window. Sampling depends only on
+// the data, so two copies of the same data are sampled at the same places. Each sampled position is looked
+// up in the index and checked against the window, and the match is extended in both directions.
+// Matches shorter than mN are ignored. Window size is set by "w", CELS_SET_DICTIONARY_SIZE, and reduced
+// by CELS_SET_[DE]COMPRESSION_MEMORY.
+//
+// The decompressor keeps only the window and a few block buffers, so its memory is bounded by the window
+// regardless of the stream size. Compressed stream has the same layout as one of the "dedup" codec:
+// the byte holding log2 of the window size, followed by blocks:
+//   1 byte:  1 if the block was compressed by the backend, 0 if it's stored
+//   4 bytes: compressed size
+//   4 bytes: size of the preprocessed data
+//   4 bytes: original size
+//   and then compressed data.
+// Preprocessed data is a sequence of tokens, each one starting with varint holding length*2+flag.
+// With flag=0, it's followed by the literal data, with flag=1 - by varint holding the distance back
+// to the match source. A match may overlap the data it produces, repeating them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "CELS.h"
+
+const int LRM_BLOCKSIZE = 4<<20;            // Input data are encoded in blocks of this size
+const int LRM_SEGMENT = 256<<10;            // Part of the block hashed by a single task
+const int LRM_MAX_SEGMENTS = LRM_BLOCKSIZE / LRM_SEGMENT;
+const int LRM_ENCODING_SLACK = 16;          // Preprocessed block may be a bit larger than the original data
+const int LRM_HEADER_SIZE = 1+4+4+4;        // Block header: backend flag + compressed size + preprocessed size + original size
+const int LRM_BACKEND_SIZE = 256;           // Space for the backend method string in the parsed method
+const CelsNum LRM_DEFAULT_MINMATCH = 64;
+const CelsNum LRM_MIN_MINMATCH = 16;        // Limits for the minimal match length
+const CelsNum LRM_MAX_MINMATCH = 4096;
+const CelsNum LRM_DEFAULT_WINDOW = 256<<20;
+const CelsNum LRM_MIN_WINDOW = 16<<20;      // Window should be much larger than the block, since matches can't reach further than window-blocksize
+const CelsNum LRM_MAX_WINDOW = (sizeof(size_t) > 4?  CelsNum(4)<<30 : CelsNum(1)<<30);
+
+// Cels() of the application, saved at codec registration
+static CelsCallback* CelsApi = NULL;
+
+// Structure representing the parsed codec
+struct LrmCodec
+{
+    CelsNum WindowSize;                     // amount of preceding data where matches are searched
+    CelsNum MinMatch;                       // minimal match length, which is also the length of hashed strings
+    char Backend[LRM_BACKEND_SIZE];         // method compressing the preprocessed data (in the usual ':' notation), "" if none
+};
+
+// Sparse index entry: the last sampled position with this hash
+struct LrmIndexEntry
+{
+    uint32_t check;                         // higher bits of the hash, not used for the index addressing
+    uint32_t reserved;
+    uint64_t pos;                           // position in the stream
+};
+
+// Sampled position in the current block
+struct LrmCandidate
+{
+    uint64_t hash;
+    size_t pos;                             // offset in the block
+};
+
+
+// Parse memory size like "64k" or "1m" at str, storing pointer to the first char after the number into *end
+static CelsNum LrmParseSize (const char* str, char** end)
+{
+    CelsNum size = strtoll(str, end, 10);
+    if (*end == str)  return -1;
+    switch (**end)
+    {
+        case 'g': size <<= 10;  // fallthrough
+        case 'm': size <<= 10;  // fallthrough
+        case 'k': size <<= 10;  ++*end;
+    }
+    return size;
+}
+
+// Format memory size into the shortest form accepted by LrmParseSize
+static int LrmFormatSize (char* str, CelsNum size)
+{
+    static const char* suffix[] = {"", "k", "m", "g"};
+    int i = 0;
+    while (size >= 1024  &&  size % 1024 == 0  &&  i < 3)
+        size /= 1024,  i++;
+    return sprintf(str, "%lld%s", (long long) size, suffix[i]);
+}
+
+static int LrmIsPowerOf2 (CelsNum x)
+{
+    return x > 0  &&  (x & (x-1)) == 0;
+}
+
+static int LrmLog2 (CelsNum x)
+{
+    int bits = 0;
+    while (x > 1)  x >>= 1,  bits++;
+    return bits;
+}
+
+// Positions are sampled once per 2^LrmSampleBits bytes on average
+static int LrmSampleBits (LrmCodec* codec)
+{
+    return LrmLog2 (codec->MinMatch);
+}
+
+// Sampled positions are at least that far apart, limiting the number of candidates on repetitive data
+static size_t LrmMinGap (LrmCodec* codec)
+{
+    return ((size_t)1 << LrmSampleBits(codec)) / 4;
+}
+
+// Number of sparse index entries for the given window
+static CelsNum LrmIndexEntries (LrmCodec* codec, CelsNum window)
+{
+    return window >> LrmSampleBits(codec);
+}
+
+// Candidates of all segments of the block, including one extra candidate per segment
+static CelsNum LrmMaxCandidates (LrmCodec* codec)
+{
+    return LRM_BLOCKSIZE / LrmMinGap(codec) + LRM_MAX_SEGMENTS;
+}
+
+static CelsNum LrmMemoryUsage (LrmCodec* codec, bool compression, CelsNum window)
+{
+    CelsNum buffers = LRM_BLOCKSIZE + 2 * (LRM_BLOCKSIZE + LRM_ENCODING_SLACK);
+    CelsNum index = (compression?  LrmIndexEntries(codec, window) * sizeof(LrmIndexEntry) + LrmMaxCandidates(codec) * sizeof(LrmCandidate) : 0);
+    CelsNum backend = 0;
+    if (codec->Backend[0]) {
+        backend = CELS_MAX_PARSED_METHOD_SIZE;
+        CelsResult mem = (CelsApi?  CelsApi (codec->Backend, compression? CELS_GET_COMPRESSION_MEMORY : CELS_GET_DECOMPRESSION_MEMORY,0, NULL,0, NULL,0, NULL,NULL) : 0);
+        if (mem > 0)  backend += mem;
+    }
+    return window + index + buffers + backend;
+}
+
+
+// *** Rolling hash *********************************************************************************************************
+
+const uint64_t LRM_HASH_BASE = 0x9E3779B185EBCA87ULL;
+
+// Finalize the rolling hash, so its top bits used for sampling depend on all bytes of the string
+static inline uint64_t LrmMix (uint64_t h)
+{
+    h ^= h >> 29;
+    h *= 0xC2B2AE3D27D4EB4FULL;
+    return h ^ (h >> 32);
+}
+
+// Part of the block processed by a single task
+struct LrmSegment
+{
+    const unsigned char* buf;               // block start
+    size_t from, to;                        // positions sampled by this segment; buf[pos..pos+minMatch) should be available for all of them
+    size_t minMatch, minGap;
+    int sampleBits;
+    uint64_t basePower;                     // LRM_HASH_BASE ** (minMatch-1)
+    LrmCandidate* candidates;               // room for (to-from)/minGap+1 candidates
+    size_t count;                           // number of candidates found
+};
+
+// Find sampled positions of the segment. Hashing restarts at the segment start, so the result doesn't depend
+// on the number of threads involved
+static void __cdecl LrmHashSegment (void* arg)
+{
+    LrmSegment* s = (LrmSegment*) arg;
+    const unsigned char* buf = s->buf;
+    s->count = 0;
+    if (s->from >= s->to)  return;
+
+    uint64_t h = 0;
+    for (size_t i = 0;  i < s->minMatch;  i++)
+        h = h * LRM_HASH_BASE + buf[s->from + i];
+
+    int shift = 64 - s->sampleBits;
+    size_t next = s->from;      // the first position where the next candidate may be placed
+    for (size_t pos = s->from;;)
+    {
+        uint64_t hash = LrmMix (h);
+        if ((hash >> shift) == 0  &&  pos >= next) {
+            LrmCandidate c = {hash, pos};
+            s->candidates[s->count++] = c;
+            next = pos + s->minGap;
+        }
+        if (++pos >= s->to)  break;
+        h = (h - buf[pos-1] * s->basePower) * LRM_HASH_BASE + buf[pos-1 + s->minMatch];
+    }
+}
+
+// Hash positions [0,size) of the block, splitting them into segments processed by the framework thread pool,
+// the last one being processed by this thread
+static void LrmHashBlock (LrmCodec* codec, const unsigned char* buf, size_t size, LrmCandidate* candidates, LrmSegment* segment, size_t* segments)
+{
+    size_t minMatch = (size_t) codec->MinMatch,  minGap = LrmMinGap(codec);
+    uint64_t basePower = 1;
+    for (size_t i = 1;  i < minMatch;  i++)
+        basePower *= LRM_HASH_BASE;
+
+    CelsResult threads = (CelsApi? CelsGetThreads (CelsApi) : 1);
+    CelsTaskGroup group = {0};
+    size_t n = 0;
+    for (size_t from = 0;  from < size;  from += LRM_SEGMENT, n++)
+    {
+        size_t to = (size-from < (size_t)LRM_SEGMENT? size : from+LRM_SEGMENT);
+        LrmSegment s = {buf, from, to, minMatch, minGap, LrmSampleBits(codec), basePower, candidates, 0};
+        segment[n] = s;
+        candidates += (to-from) / minGap + 1;
+        if (to == size  ||  threads < 2  ||  CelsSubmitTask (CelsApi, &group, LrmHashSegment, &segment[n]) < CELS_OK)
+            LrmHashSegment (&segment[n]);
+    }
+    if (threads >= 2)
+        CelsWaitTasks (CelsApi, &group);
+    *segments = n;
+}
+
+
+// *** Window and tokens ****************************************************************************************************
+
+// The window is a ring buffer holding the last `mask+1` bytes of the stream
+static void LrmRingPut (char* ring, size_t mask, uint64_t pos, const char* buf, size_t len)
+{
+    size_t start = (size_t)(pos & mask),  first = (len < mask+1-start? len : mask+1-start);
+    memcpy (ring + start, buf, first);
+    memcpy (ring, buf + first, len - first);
+}
+
+static void LrmRingGet (const char* ring, size_t mask, uint64_t pos, char* buf, size_t len)
+{
+    size_t start = (size_t)(pos & mask),  first = (len < mask+1-start? len : mask+1-start);
+    memcpy (buf, ring + start, first);
+    memcpy (buf + first, ring, len - first);
+}
+
+// Length of the common prefix of two buffers, compared by 8-byte words
+static size_t LrmCommonPrefix (const char* a, const char* b, size_t len)
+{
+    size_t i = 0;
+    for (; i+8 <= len; i += 8) {
+        uint64_t x, y;
+        memcpy (&x, a+i, 8);
+        memcpy (&y, b+i, 8);
+        if (x != y)  break;
+    }
+    while (i < len  &&  a[i] == b[i])
+        i++;
+    return i;
+}
+
+// Length of the match between the window data starting at the stream position `pos` and buf, up to maxLen bytes
+static size_t LrmRingMatch (const char* ring, size_t mask, uint64_t pos, const char* buf, size_t maxLen)
+{
+    size_t len = 0;
+    while (len < maxLen) {
+        size_t start = (size_t)((pos+len) & mask),  piece = (maxLen-len < mask+1-start? maxLen-len : mask+1-start);
+        size_t common = LrmCommonPrefix (ring + start, buf + len, piece);
+        len += common;
+        if (common < piece)  break;
+    }
+    return len;
+}
+
+static char* LrmPutVarint (char* ptr, uint64_t value)
+{
+    while (value >= 128)
+        *ptr++ = (char)(value | 128),  value >>= 7;
+    *ptr++ = (char)value;
+    return ptr;
+}
+
+// Returns NULL if the varint isn't finished before the end of buffer
+static const char* LrmGetVarint (const char* ptr, const char* end, uint64_t* value)
+{
+    *value = 0;
+    for (int shift = 0;  ptr < end  &&  shift < 64;  shift += 7) {
+        unsigned char c = *ptr++;
+        *value |= (uint64_t)(c & 127) << shift;
+        if (c < 128)  return ptr;
+    }
+    return NULL;
+}
+
+static char* LrmPutLiterals (char* out, const char* buf, size_t len)
+{
+    out = LrmPutVarint (out, (uint64_t)len*2);
+    memcpy (out, buf, len);
+    return out + len;
+}
+
+
+// *** Codec ****************************************************************************************************************
+
+// Compress the preprocessed block with the backend and write it
+static CelsResult LrmWriteBlock (char* parsed, char* encoded, CelsNum encodedSize, char* compressed, CelsNum origSize, void* ud, CelsCallback* cb)
+{
+    char header[LRM_HEADER_SIZE];
+    char* data = encoded;
+    CelsResult dataSize = encodedSize;
+    header[0] = 0;
+
+    // Compressed data should be smaller than the preprocessed ones, otherwise we store the block
+    if (parsed) {
+        CelsResult compressedSize = CelsApi (parsed, CELS_COMPRESS,0, encoded,encodedSize, compressed,encodedSize, NULL,NULL);
+        if (compressedSize >= CELS_OK  &&  compressedSize < encodedSize)
+            header[0] = 1,  data = compressed,  dataSize = compressedSize;
+    }
+
+    CelsSerializeInt (dataSize,    header+1, 4);
+    CelsSerializeInt (encodedSize, header+5, 4);
+    CelsSerializeInt (origSize,    header+9, 4);
+    CelsIoVec iov[2] = {{header, LRM_HEADER_SIZE}, {data, dataSize}};
+    CelsResult result = CelsWritev(cb,ud, iov, 2);
+    return (result == LRM_HEADER_SIZE+dataSize? CELS_OK : result < CELS_OK? result : CELS_ERROR_WRITE);
+}
+
+
+// Stream compression employing callbacks for I/O
+CelsResult CELS_LRM_compress (LrmCodec* codec, void* ud, CelsCallback* cb)
+{
+    size_t window = (size_t) codec->WindowSize,  mask = window-1;
+    size_t indexSize = (size_t) LrmIndexEntries (codec, codec->WindowSize);
+    size_t maxCandidates = (size_t) LrmMaxCandidates (codec);
+    size_t parsedSize = (codec->Backend[0]? CELS_MAX_PARSED_METHOD_SIZE : 0);
+    char* buf = (char*) CelsMemAlloc(cb,ud, indexSize*sizeof(LrmIndexEntry) + maxCandidates*sizeof(LrmCandidate) + parsedSize + window
+                                            + LRM_BLOCKSIZE + 2*(LRM_BLOCKSIZE + LRM_ENCODING_SLACK));
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    LrmIndexEntry* index = (LrmIndexEntry*) buf;   // placed first for alignment
+    LrmCandidate* candidates = (LrmCandidate*) (index + indexSize);
+    char* ring = (char*) (candidates + maxCandidates);
+    char* parsed = ring + window;
+    char* inbuf = parsed + parsedSize;
+    char* encoded = inbuf + LRM_BLOCKSIZE;
+    char* compressed = encoded + LRM_BLOCKSIZE + LRM_ENCODING_SLACK;
+    memset (index, 0, indexSize*sizeof(LrmIndexEntry));
+
+    CelsResult errcode = CELS_OK;
+    if (parsedSize) {
+        errcode = CelsApi (codec->Backend, CELS_PARSE,0, NULL,0, parsed,CELS_MAX_PARSED_METHOD_SIZE, NULL,NULL);
+        if (errcode < CELS_OK)  {CelsMemFree(cb,ud, buf);  return errcode;}
+        errcode = CELS_OK;
+    }
+
+    char streamHeader = (char) LrmLog2 (window);
+    CELS_WRITE_EXACTLY(&streamHeader, 1);
+
+    {
+        size_t minMatch = (size_t) codec->MinMatch;
+        uint64_t maxDist = window - LRM_BLOCKSIZE;     // the whole block is put into the window before matching, so the source should survive that
+        uint64_t pos = 0;           // stream position of inbuf[0]
+        size_t filled = 0;          // amount of data in the inbuf
+        bool eof = false;
+        for(;;)
+        {
+            if (!eof) {
+                CelsResult result = CelsRead(cb,ud, inbuf+filled, LRM_BLOCKSIZE-filled);
+                if (result < CELS_OK)  CELS_RETURN(result);
+                eof = (result < LRM_BLOCKSIZE - (CelsResult)filled);
+                filled += result;
+            }
+            if (filled == 0)  break;
+
+            // Strings starting in the last minMatch-1 bytes can't be hashed until more data are read
+            size_t hashed = (filled >= minMatch? filled-minMatch+1 : 0);
+            size_t end = (eof? filled : hashed);
+            LrmSegment segment[LRM_MAX_SEGMENTS];
+            size_t segments;
+            LrmHashBlock (codec, (unsigned char*)inbuf, hashed, candidates, segment, &segments);
+            LrmRingPut (ring, mask, pos, inbuf, filled);
+
+            // Check every candidate against the index, and then replace the index entry with it
+            char* out = encoded;
+            size_t literals = 0;        // the first byte not encoded yet
+            for (size_t i = 0;  i < segments;  i++)
+                for (size_t k = 0;  k < segment[i].count;  k++)
+                {
+                    LrmCandidate* c = &segment[i].candidates[k];
+                    LrmIndexEntry* entry = &index[c->hash & (indexSize-1)];
+                    uint64_t target = pos + c->pos,  source = entry->pos;
+
+                    if (c->pos >= literals  &&  entry->check == (uint32_t)(c->hash >> 32)  &&  source < target  &&  target - source <= maxDist)
+                    {
+                        uint64_t dist = target - source;
+                        size_t start = c->pos;
+                        size_t len = LrmRingMatch (ring, mask, source, inbuf+start, filled-start);
+                        while (start > literals  &&  source > 0  &&  ring[(source-1) & mask] == inbuf[start-1])
+                            start--,  source--,  len++;
+                        if (len >= minMatch) {
+                            if (literals < start)
+                                out = LrmPutLiterals (out, inbuf+literals, start-literals);
+                            out = LrmPutVarint (out, (uint64_t)len*2+1);
+                            out = LrmPutVarint (out, dist);
+                            literals = start + len;
+                        }
+                    }
+
+                    entry->check = (uint32_t)(c->hash >> 32);
+                    entry->pos   = target;
+                }
+
+            // Match may go beyond the hashed part of the block
+            if (end < literals)  end = literals;
+            if (literals < end)
+                out = LrmPutLiterals (out, inbuf+literals, end-literals);
+
+            errcode = LrmWriteBlock (parsedSize? parsed : NULL, encoded, out-encoded, compressed, end, ud,cb);
+            if (errcode < CELS_OK)  goto finished;
+
+            memmove (inbuf, inbuf+end, filled-end);
+            filled -= end;
+            pos += end;
+        }
+    }
+
+finished:
+    if (parsedSize)  CelsApi (parsed, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback0*)CelsApi);
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+
+// Stream decompression employing callbacks for I/O
+CelsResult CELS_LRM_decompress (LrmCodec* codec, void* ud, CelsCallback* cb)
+{
+    size_t window = (size_t) codec->WindowSize,  mask = window-1;
+    size_t parsedSize = (codec->Backend[0]? CELS_MAX_PARSED_METHOD_SIZE : 0);
+    char* buf = (char*) CelsMemAlloc(cb,ud, parsedSize + window + LRM_BLOCKSIZE + 2*(LRM_BLOCKSIZE + LRM_ENCODING_SLACK));
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* ring = buf;
+    char* parsed = ring + window;
+    char* origBuf = parsed + parsedSize;
+    char* encoded = origBuf + LRM_BLOCKSIZE;
+    char* compressed = encoded + LRM_BLOCKSIZE + LRM_ENCODING_SLACK;
+
+    CelsResult errcode = CELS_OK;
+    if (parsedSize) {
+        errcode = CelsApi (codec->Backend, CELS_PARSE,0, NULL,0, parsed,CELS_MAX_PARSED_METHOD_SIZE, NULL,NULL);
+        if (errcode < CELS_OK)  {CelsMemFree(cb,ud, buf);  return errcode;}
+        errcode = CELS_OK;
+    }
+
+    {
+        // The stream can't refer further back than our window
+        char streamHeader;
+        CELS_READ_EXACTLY_OR_EOF(&streamHeader, 1);
+        if (streamHeader < 0  ||  streamHeader > LrmLog2 (window))  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+        uint64_t pos = 0;
+        for(;;)
+        {
+            char header[LRM_HEADER_SIZE];
+            CELS_READ_EXACTLY_OR_EOF(header, LRM_HEADER_SIZE);
+
+            int compressedBlock = header[0];
+            CelsResult compressedSize = CelsDeserializeInt(header+1, 4);
+            CelsResult encodedSize    = CelsDeserializeInt(header+5, 4);
+            CelsResult origSize       = CelsDeserializeInt(header+9, 4);
+            if (compressedBlock > 1  ||  (compressedBlock && !parsedSize)  ||  (!compressedBlock && compressedSize != encodedSize)
+                ||  compressedSize > LRM_BLOCKSIZE + LRM_ENCODING_SLACK  ||  encodedSize > LRM_BLOCKSIZE + LRM_ENCODING_SLACK  ||  origSize > LRM_BLOCKSIZE)
+                CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+            if (compressedBlock) {
+                CELS_READ_EXACTLY(compressed, compressedSize);
+                CelsResult result = CelsApi (parsed, CELS_DECOMPRESS,0, compressed,compressedSize, encoded,encodedSize, NULL,NULL);
+                if (result != encodedSize)  CELS_RETURN2(result, CELS_ERROR_BAD_COMPRESSED_DATA);
+            } else {
+                CELS_READ_EXACTLY(encoded, encodedSize);
+            }
+
+            // Decode tokens, appending every one to the window, so the following matches may use it
+            const char *ptr = encoded,  *end = encoded + encodedSize;
+            uint64_t done = 0;
+            while (ptr < end)
+            {
+                uint64_t token, len, dist;
+                ptr = LrmGetVarint (ptr, end, &token);
+                if (ptr == NULL)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+                len = token / 2;
+                if (len == 0  ||  len > (uint64_t)origSize - done)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+                if (token & 1) {
+                    ptr = LrmGetVarint (ptr, end, &dist);
+                    if (ptr == NULL  ||  dist == 0  ||  dist > window  ||  dist > pos)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+                    // Copy in pieces no longer than the distance, since the match may overlap its own output
+                    while (len) {
+                        size_t piece = (size_t)(len < dist? len : dist);
+                        LrmRingGet (ring, mask, pos-dist, origBuf+done, piece);
+                        LrmRingPut (ring, mask, pos, origBuf+done, piece);
+                        pos += piece,  done += piece,  len -= piece;
+                    }
+                } else {
+                    if (len > (uint64_t)(end - ptr))  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+                    memcpy (origBuf+done, ptr, len);
+                    LrmRingPut (ring, mask, pos, ptr, len);
+                    ptr += len,  pos += len,  done += len;
+                }
+            }
+            if (done != (uint64_t)origSize)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+            CELS_WRITE_EXACTLY(origBuf, origSize);
+        }
+    }
+
+finished:
+    if (parsedSize)  CelsApi (parsed, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback0*)CelsApi);
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+
+static CelsResult __cdecl LrmMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    LrmCodec *codec = (LrmCodec*)self;
+
+    switch (service)
+    {
+    case CELS_LOAD_CODEC:
+        CelsApi = cb;
+        return CELS_OK;
+
+    case CELS_PARSE:
+        {
+            if (outsize < (CelsNum)sizeof(LrmCodec))  return CELS_ERROR_GENERAL;
+
+            codec = (LrmCodec*)outbuf;
+            codec->WindowSize = LRM_DEFAULT_WINDOW;
+            codec->MinMatch = LRM_DEFAULT_MINMATCH;
+            strcpy (codec->Backend, "lz4");
+            bool backendSet = false;
+
+            // Skip param[0] since it contains the method name
+            char** param = (char**)inbuf;
+            while (*++param)
+            {
+                char* end;
+                if (**param=='w'  &&  isdigit((unsigned char)(*param)[1])) {
+                    codec->WindowSize = LrmParseSize(*param+1, &end);
+                    if (*end || !LrmIsPowerOf2(codec->WindowSize) || codec->WindowSize < LRM_MIN_WINDOW || codec->WindowSize > LRM_MAX_WINDOW)  return CELS_ERROR_INVALID_COMPRESSOR;
+                    continue;
+                }
+                if (**param=='m'  &&  isdigit((unsigned char)(*param)[1])) {
+                    codec->MinMatch = LrmParseSize(*param+1, &end);
+                    if (*end || codec->MinMatch < LRM_MIN_MINMATCH || codec->MinMatch > LRM_MAX_MINMATCH)  return CELS_ERROR_INVALID_COMPRESSOR;
+                    continue;
+                }
+
+                // Anything else is the backend method
+                size_t len = strlen(*param);
+                if (backendSet  ||  len >= LRM_BACKEND_SIZE)  return CELS_ERROR_INVALID_COMPRESSOR;
+                for (size_t i=0; i<=len; i++)
+                    codec->Backend[i] = ((*param)[i]=='/'? CELS_METHOD_PARAMETERS_DELIMITER : (*param)[i]);
+                if (!strcmp(codec->Backend, "store"))
+                    codec->Backend[0] = '\0';
+                backendSet = true;
+            }
+            return sizeof(LrmCodec);
+        }
+
+    case CELS_UNPARSE:
+        {
+            char str[CELS_MAX_METHOD_STRING_SIZE];
+            int len = sprintf(str, "lrm");
+            if (codec->WindowSize != LRM_DEFAULT_WINDOW)  len += sprintf(str+len, ":w"),  len += LrmFormatSize(str+len, codec->WindowSize);
+            if (codec->MinMatch != LRM_DEFAULT_MINMATCH)  len += sprintf(str+len, ":m"),  len += LrmFormatSize(str+len, codec->MinMatch);
+
+            if (!codec->Backend[0]) {
+                len += sprintf(str+len, ":store");
+            } else if (strcmp(codec->Backend, "lz4")) {
+                size_t backendLen = strlen(codec->Backend);
+                if (len + 1 + backendLen >= sizeof(str))  return CELS_ERROR_GENERAL;
+                str[len++] = CELS_METHOD_PARAMETERS_DELIMITER;
+                for (size_t i=0; i<backendLen; i++)
+                    str[len++] = (codec->Backend[i]==CELS_METHOD_PARAMETERS_DELIMITER? '/' : codec->Backend[i]);
+                str[len] = '\0';
+            }
+
+            if (len >= outsize)  return CELS_ERROR_GENERAL;
+            strcpy ((char*)outbuf, str);
+            return CELS_OK;
+        }
+
+    case CELS_GET_DICTIONARY_SIZE:
+        return codec->WindowSize;
+
+    case CELS_SET_DICTIONARY_SIZE:
+        {
+            CelsNum window = LRM_MIN_WINDOW;
+            while (window*2 <= insize  &&  window < LRM_MAX_WINDOW)
+                window *= 2;
+            codec->WindowSize = window;
+            return CELS_OK;
+        }
+
+    case CELS_GET_MAX_COMPRESSED_SIZE:
+        // Blocks may be shorter than LRM_BLOCKSIZE by less than the minimal match length
+        return 1 + insize + (insize / (LRM_BLOCKSIZE/2) + 1) * (LRM_HEADER_SIZE + LRM_ENCODING_SLACK);
+
+    case CELS_GET_COMPRESSION_MEMORY:
+    case CELS_GET_DECOMPRESSION_MEMORY:
+        return LrmMemoryUsage (codec, service==CELS_GET_COMPRESSION_MEMORY, codec->WindowSize);
+
+    case CELS_GET_MINIMUM_COMPRESSION_MEMORY:
+    case CELS_GET_MINIMUM_DECOMPRESSION_MEMORY:
+        return LrmMemoryUsage (codec, service==CELS_GET_MINIMUM_COMPRESSION_MEMORY, LRM_MIN_WINDOW);
+
+    case CELS_SET_COMPRESSION_MEMORY:
+    case CELS_SET_DECOMPRESSION_MEMORY:
+        {
+            // Find the largest window (and index following it) fitting into the memory limit.
+            // The same window is used by the decompressor, so both limits are simultaneously reduced
+            CelsNum window = codec->WindowSize;
+            while (window > LRM_MIN_WINDOW  &&  LrmMemoryUsage(codec, service==CELS_SET_COMPRESSION_MEMORY, window) > insize)
+                window /= 2;
+            codec->WindowSize = window;
+            return CELS_OK;
+        }
+
+    case CELS_GET_BLOCKSIZE:
+        return 0;   // all blocks share the window
+
+    case CELS_SET_MINIMAL_INPUT_SIZE:
+        {
+            // Window larger than the entire input just wastes memory
+            CelsNum window = LRM_MIN_WINDOW;
+            while (window < insize  &&  window < codec->WindowSize)
+                window *= 2;
+            if (window < codec->WindowSize)
+                codec->WindowSize = window;
+            return CELS_OK;
+        }
+
+    case CELS_COMPRESS:
+        if (inbuf || outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb || (codec->Backend[0] && !CelsApi))  return CELS_ERROR_GENERAL;
+        return CELS_LRM_compress(codec, ud,cb);
+
+    case CELS_DECOMPRESS:
+        if (inbuf || outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb || (codec->Backend[0] && !CelsApi))  return CELS_ERROR_GENERAL;
+        return CELS_LRM_decompress(codec, ud,cb);
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+
+#ifdef CELS_REGISTER_CODECS
+static CelsResult dummy = CelsRegister ("lrm", NULL, LrmMain);
+#else
+// Loaded from DLL: register the codec under its own name, so CELS_LOAD_CODEC delivers Cels() to LrmMain
+CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (service == CELS_LOAD_MODULE)
+        return cb(NULL, CELS_REGISTER,0, (void*)"lrm",0, NULL,0, NULL,(CelsCallback0*)LrmMain);
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+#endif
@@ -0,0 +1,4 @@
+@set lib=../../lib
+gcc -c -O3 -I%lib% cels-lrm.cpp
+dllwrap --driver-name c++ cels-lrm.o -def %lib%/CELS.def -s -o cels-lrm.dll
+@del *.o
@@ -26,11 +26,49 @@
        - CELS repository: https://github.com/Bulat-Ziganshin/CELS
 */
 
+// Method string: "lz4[:aN][:bN][:sN][:tN][:pN][:f[:xc][:xb]]", where
+//   aN - acceleration (1 by default), i.e. the last parameter of LZ4_compress_fast*
+//   bN - size of stream chunks (1m by default, optional k/m/g suffix), reduced by the memory/input size limits
+//   sN - adaptive mode: target stream compression speed in MB/s
+//   tN - adaptive mode: time limit for processing of a single stream chunk in milliseconds
+//   pN - report progress once per N input bytes (with optional k/m/g suffix), by default after every stream chunk
+//   f  - use the standard LZ4 frame format with independent blocks, readable by the lz4 utility
+//   xc - frame format: add the content checksum
+//   xb - add checksum to every frame block, or CRC32C of the original data to every chunk of our stream format
+//        and to the memory buffer compressed by a single LZ4 block
+// In the adaptive mode, stream compression raises acceleration above the aN value when compression
+// can't keep up with the target, and lowers it back (but not below aN) when there is enough time.
+// Every change is reported to the application by CELS_REPORT_PARAMETER named "acceleration", so operations
+// sharing the parsed method report their own levels, while the method itself stays intact.
+// The compressed stream format doesn't depend on acceleration, so any decoder can decompress it.
+// Memory buffer (de)compression is a single LZ4_*() call producing a single LZ4 block, so it reports
+// progress only once. Mixed modes (memory buffer on one side, callback on the other) use the stream format,
+// reading inbuf/writing outbuf in-place without staging copies. Batches of memory buffers reuse the single
+// LZ4 state. Push-mode streams (CELS_STREAM_*) natively produce and consume the same stream format.
+// The frame format stores the content size for memory buffer compression. Since LZ4F can't change
+// the compression level inside a frame, the adaptive mode isn't supported for frames.
+// CRC32C added by "xb" to our formats is computed by the framework checksum service right after
+// (de)compression of every chunk, while its data are still in the cache. It's stored after the compressed
+// data and counted in the chunk size, so decoders unaware of checksums can't silently misinterpret the stream.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
 #include "lz4/lib/lz4.c"
+#include "lz4/lib/lz4frame.h"
 #include "CELS.h"
 
 const int LZ4_CHUNKSIZE_WIDTH = 4;        // Width of the size fields in the compressed stream
 const int LZ4_STREAM_CHUNKSIZE = 1<<20;   // Stream compression splits input data into chunks of this size
+const int LZ4_MIN_STREAM_CHUNKSIZE = 1<<10;   // Limits for the chunk size set by the "b" parameter and memory limits
+const int LZ4_MAX_STREAM_CHUNKSIZE = 1<<30;
+const int LZ4_MAX_ADAPTIVE_ACCELERATION = 128;   // Adaptive mode never goes above this acceleration
+const int LZ4_CHECKSUM_SIZE = 4;          // Width of CRC32C stored after every chunk with the "xb" parameter
+const size_t LZ4_HISTORY_SIZE = 64<<10;   // LZ4 matches never reach further back
+
+// Cels() of the application, saved at codec registration and used to reach the framework checksum service
+static CelsCallback* CelsApi = NULL;
 
 // Structure representing the parsed codec
 struct Lz4Codec
@@ -38,18 +76,172 @@ struct Lz4Codec
     int acceleration;           // compression speed AKA the last parameter of LZ4_compress_fast*
     double MinCompression;      // minimal compression ratio, 0.99 means that data should be reduced by 1% at least
     size_t StreamChunkSize;     // size of chunks in the stream compression
+    double TargetSpeed;         // adaptive mode: target stream compression speed in MB/s (0 - no target)
+    double ChunkDeadline;       // adaptive mode: time limit for processing of a single chunk in milliseconds (0 - no limit)
+    CelsNum ProgressGranularity;// report progress once per this amount of input bytes (0 - after every chunk)
+    int FrameFormat;            // 1: use the standard LZ4 frame format, 0: use our own lightweight stream format
+    int ContentChecksum;        // frame format: add the content checksum
+    int BlockChecksum;          // add checksum to every frame block, or CRC32C to every chunk of our formats
+};
+
+
+// Parse memory size like "64k" or "1m" at str, storing pointer to the first char after the number into *end
+static CelsNum Lz4ParseSize (const char* str, char** end)
+{
+    CelsNum size = strtoll(str, end, 10);
+    if (*end == str)  return -1;
+    switch (**end)
+    {
+        case 'g': size <<= 10;  // fallthrough
+        case 'm': size <<= 10;  // fallthrough
+        case 'k': size <<= 10;  ++*end;
+    }
+    return size;
+}
+
+// Format memory size into the shortest form accepted by Lz4ParseSize
+static int Lz4FormatSize (char* str, CelsNum size)
+{
+    static const char* suffix[] = {"", "k", "m", "g"};
+    int i = 0;
+    while (size >= 1024  &&  size % 1024 == 0  &&  i < 3)
+        size /= 1024,  i++;
+    return sprintf(str, "%lld%s", (long long) size, suffix[i]);
+}
+
+
+// Progress reporting to the application. Callbacks are probed at the first call,
+// and once the application returned CELS_ERROR_NOT_IMPLEMENTED, they are never called again
+struct Lz4Progress
+{
+    CelsCallback* cb;  void* ud;
+    CelsNum granularity;        // report once per this amount of input bytes
+    CelsNum insize, outsize;    // amounts accumulated since the last report
+    bool progress;              // application supports CELS_PROGRESS
+    bool quasiWrite;            // application supports CELS_QUASI_WRITE
+    bool reportParameter;       // application supports CELS_REPORT_PARAMETER
+    int acceleration;           // acceleration reported last time (0 - not reported yet)
+
+    Lz4Progress (Lz4Codec* codec, void* _ud, CelsCallback* _cb)
+    {
+        cb = _cb;  ud = _ud;
+        granularity = codec->ProgressGranularity;
+        insize = outsize = 0;
+        quasiWrite = reportParameter = (cb != NULL);
+        acceleration = 0;
+        progress = (cb != NULL)  &&  CelsProgress(cb,ud, 0,0) != CELS_ERROR_NOT_IMPLEMENTED;
+    }
+
+    // Input advanced by _insize bytes, producing _outsize bytes of output
+    void report (CelsNum _insize, CelsNum _outsize)
+    {
+        if (!progress)  return;
+        insize += _insize;  outsize += _outsize;
+        if (insize >= granularity)  flush();
+    }
+
+    void flush()
+    {
+        if (!progress  ||  (insize==0 && outsize==0))  return;
+        if (CelsProgress(cb,ud, insize,outsize) == CELS_ERROR_NOT_IMPLEMENTED)  progress = false;
+        insize = outsize = 0;
+    }
+
+    // The output of _outsize bytes is ready, but it may take a while to write it
+    void quasi_write (CelsNum _outsize)
+    {
+        if (quasiWrite  &&  _outsize > 0  &&  CelsQuasiWrite(cb,ud, _outsize) == CELS_ERROR_NOT_IMPLEMENTED)  quasiWrite = false;
+    }
+
+    // The adaptive mode compressed the chunk with _acceleration: report it once it differs from the previous chunk
+    void level (int _acceleration)
+    {
+        if (!reportParameter  ||  _acceleration == acceleration)  return;
+        acceleration = _acceleration;
+        if (CelsReportParameter(cb,ud, "acceleration", acceleration) == CELS_ERROR_NOT_IMPLEMENTED)  reportParameter = false;
+    }
 };
 
 
+// Compute CRC32C of (buf,size) and store it at dest
+static CelsResult Lz4PutChecksum (const void* buf, CelsNum size, char* dest)
+{
+    CelsChecksum state;
+    unsigned long long crc = 0;
+    CelsResult result = (CelsApi?  CelsChecksumStart(CelsApi, &state, CELS_CHECKSUM_CRC32C) : CELS_ERROR_NOT_IMPLEMENTED);
+    if (result >= CELS_OK)  result = CelsChecksumUpdate(CelsApi, &state, buf, size);
+    if (result >= CELS_OK)  result = CelsChecksumDigest(CelsApi, &state, &crc);
+    CelsSerializeInt(crc, dest, LZ4_CHECKSUM_SIZE);
+    return result;
+}
+
+// Compare CRC32C of (buf,size) with the one stored at stored
+static CelsResult Lz4VerifyChecksum (const void* buf, CelsNum size, const char* stored)
+{
+    char crc[LZ4_CHECKSUM_SIZE];
+    CelsResult result = Lz4PutChecksum(buf, size, crc);
+    if (result < CELS_OK)  return result;
+    return (memcmp(crc, stored, LZ4_CHECKSUM_SIZE)==0?  CELS_OK : CELS_ERROR_BAD_CRC);
+}
+
+// Size of the checksum following every chunk in our formats
+static int Lz4ChecksumSize (Lz4Codec* codec)
+{
+    return (codec->BlockChecksum && !codec->FrameFormat?  LZ4_CHECKSUM_SIZE : 0);
+}
+
+
+// Current time in seconds, used to measure the stream compression speed
+static double Lz4Time()
+{
+    return std::chrono::duration<double> (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Choose acceleration for the next chunk based on time spent on compression and writing of the last chunk
+static int Lz4AdaptAcceleration (Lz4Codec* codec, int acceleration, CelsNum origSize, double compressTime, double writeTime)
+{
+    // Time budget per chunk is the lowest one among defined by the target speed and by the deadline
+    double budget = 1e100;
+    if (codec->TargetSpeed > 0)    budget = origSize / (codec->TargetSpeed * 1e6);
+    if (codec->ChunkDeadline > 0  &&  codec->ChunkDeadline / 1000 < budget)   budget = codec->ChunkDeadline / 1000;
+
+    if (compressTime + writeTime > budget) {
+        // Too slow. When the output is the bottleneck, faster compression only increases amount of data
+        // to write, so we step back to better compression. Otherwise, we make compression faster.
+        if (writeTime > compressTime)
+            acceleration /= 2;
+        else
+            acceleration *= 2;
+    }
+    else if (compressTime + writeTime < budget / 2) {
+        // Plenty of time: return to better compression
+        acceleration /= 2;
+    }
+
+    if (acceleration > LZ4_MAX_ADAPTIVE_ACCELERATION)   acceleration = LZ4_MAX_ADAPTIVE_ACCELERATION;
+    if (acceleration < codec->acceleration)             acceleration = codec->acceleration;
+    return acceleration;
+}
+
+
 // Memory buffer compression: from inbuf to outbuf
 CelsResult CELS_LZ4_compress_membuf (Lz4Codec *codec, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
 {
+    int checksumSize = Lz4ChecksumSize(codec);
+    if (outsize < checksumSize)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
     void *LZ4_state = CelsMemAlloc(cb,ud, LZ4_sizeofState());
     if (LZ4_state == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    Lz4Progress progress(codec, ud,cb);
 
     // LZ4_compress*() returns compressed size, or 0 if compression failed for any reason
-    outsize = LZ4_compress_fast_extState(LZ4_state, (const char*)inbuf, (char*)outbuf, insize, outsize, codec->acceleration);
+    outsize = LZ4_compress_fast_extState(LZ4_state, (const char*)inbuf, (char*)outbuf, insize, outsize - checksumSize, codec->acceleration);
     CelsMemFree(cb,ud, LZ4_state);
+    if (outsize > 0  &&  checksumSize) {
+        CelsResult result = Lz4PutChecksum(inbuf, insize, (char*)outbuf + outsize);
+        if (result < CELS_OK)  return result;
+        outsize += checksumSize;
+    }
+    if (outsize > 0)  progress.report(insize, outsize),  progress.flush();
 
     if (codec->MinCompression > 0  &&  outsize > insize * codec->MinCompression)
         return CELS_ERROR_OUTBLOCK_TOO_SMALL;
@@ -61,10 +253,381 @@ CelsResult CELS_LZ4_compress_membuf (Lz4Codec *codec, void* inbuf, CelsNum insiz
 // Memory buffer decompression: from inbuf to outbuf
 CelsResult CELS_LZ4_decompress_membuf (Lz4Codec *codec, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
 {
+    int checksumSize = Lz4ChecksumSize(codec);
+    if (insize < checksumSize)  return CELS_ERROR_BAD_COMPRESSED_DATA;
+    Lz4Progress progress(codec, ud,cb);
+
     // LZ4_decompress_safe() returns output size, or negative value if decompression failed
-    outsize = LZ4_decompress_safe((const char*)inbuf, (char*)outbuf, insize, outsize);
+    outsize = LZ4_decompress_safe((const char*)inbuf, (char*)outbuf, insize - checksumSize, outsize);
+    if (outsize < 0)  return CELS_ERROR_BAD_COMPRESSED_DATA;
+    if (checksumSize) {
+        CelsResult result = Lz4VerifyChecksum(outbuf, outsize, (char*)inbuf + insize - checksumSize);
+        if (result < CELS_OK)  return result;
+    }
+    progress.report(insize, outsize),  progress.flush();
+    return outsize;
+}
+
+
+// Batch compression of independent memory buffers, reusing the single LZ4 state for all of them
+CelsResult CELS_LZ4_compress_batch (Lz4Codec *codec, CelsBatchItem* items, CelsNum num_items, void* ud, CelsCallback* cb)
+{
+    void *LZ4_state = CelsMemAlloc(cb,ud, LZ4_sizeofState());
+    if (LZ4_state == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    LZ4_initStream(LZ4_state, LZ4_sizeofState());
+    Lz4Progress progress(codec, ud,cb);
+
+    for (CelsBatchItem* item = items;  item < items + num_items;  item++)
+    {
+        if (!item->inbuf || !item->outbuf)  {item->result = CELS_ERROR_NOT_IMPLEMENTED;  continue;}
+
+        // The state was initialized by the LZ4_initStream() or the previous LZ4_compress*() call, so the cheap reset is enough
+        int outsize = LZ4_compress_fast_extState_fastReset(LZ4_state, (const char*)item->inbuf, (char*)item->outbuf, item->insize, item->outsize, codec->acceleration);
+        if (outsize > 0)  progress.report(item->insize, outsize);
+
+        item->result = (outsize <= 0?  CELS_ERROR_GENERAL :
+                        codec->MinCompression > 0  &&  outsize > item->insize * codec->MinCompression?  CELS_ERROR_OUTBLOCK_TOO_SMALL :
+                        outsize);
+    }
+
+    progress.flush();
+    CelsMemFree(cb,ud, LZ4_state);
+    return CELS_OK;
+}
+
+
+// Batch decompression of independent memory buffers
+CelsResult CELS_LZ4_decompress_batch (Lz4Codec *codec, CelsBatchItem* items, CelsNum num_items, void* ud, CelsCallback* cb)
+{
+    Lz4Progress progress(codec, ud,cb);
+
+    for (CelsBatchItem* item = items;  item < items + num_items;  item++)
+    {
+        if (!item->inbuf || !item->outbuf)  {item->result = CELS_ERROR_NOT_IMPLEMENTED;  continue;}
+
+        int outsize = LZ4_decompress_safe((const char*)item->inbuf, (char*)item->outbuf, item->insize, item->outsize);
+        if (outsize >= 0)  progress.report(item->insize, outsize);
+
+        item->result = (outsize >= 0 ?  outsize : CELS_ERROR_BAD_COMPRESSED_DATA);
+    }
+
+    progress.flush();
+    return CELS_OK;
+}
+
+
+// Fill LZ4 frame preferences according to the codec parameters
+static void Lz4FramePreferences (Lz4Codec* codec, LZ4F_preferences_t* prefs, CelsNum contentSize)
+{
+    memset (prefs, 0, sizeof(*prefs));
+    size_t chunk = codec->StreamChunkSize;
+    prefs->frameInfo.blockSizeID = chunk <= (64<<10)? LZ4F_max64KB : chunk <= (256<<10)? LZ4F_max256KB : chunk <= (1<<20)? LZ4F_max1MB : LZ4F_max4MB;
+    prefs->frameInfo.blockMode = LZ4F_blockIndependent;
+    prefs->frameInfo.contentChecksumFlag = codec->ContentChecksum? LZ4F_contentChecksumEnabled : LZ4F_noContentChecksum;
+    prefs->frameInfo.blockChecksumFlag = codec->BlockChecksum? LZ4F_blockChecksumEnabled : LZ4F_noBlockChecksum;
+    prefs->frameInfo.contentSize = contentSize;
+    prefs->compressionLevel = 1 - codec->acceleration;   // negative levels are translated back into acceleration by LZ4F
+    prefs->autoFlush = 1;
+}
+
+
+// Memory buffer compression into the LZ4 frame. Input is fed to LZ4F by blocks, reporting progress after each one.
+// LZ4F refuses to compress a block unless the room left is enough for the worst case, so near the end of the outbuf
+// blocks are compressed into the temporary buffer and copied once their actual size is known
+CelsResult CELS_LZ4F_compress_membuf (Lz4Codec *codec, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    LZ4F_preferences_t prefs;
+    Lz4FramePreferences (codec, &prefs, insize);
+    size_t blockSize = (codec->StreamChunkSize < (4<<20)?  codec->StreamChunkSize : (4<<20));   // the largest LZ4F block
+    size_t tempBufSize = LZ4F_compressBound(blockSize, &prefs);
+
+    LZ4F_cctx* cctx;
+    if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    CelsResult errcode = CELS_OK;
+    char* tempBuf = NULL;
+    char* out = (char*)outbuf;
+    char* outEnd = (char*)outbuf + outsize;
+    Lz4Progress progress(codec, ud,cb);
+
+    size_t compressedSize = LZ4F_compressBegin(cctx, out, outEnd - out, &prefs);
+    if (LZ4F_isError(compressedSize))  CELS_RETURN(CELS_ERROR_OUTBLOCK_TOO_SMALL);
+    out += compressedSize;
+    progress.report(0, compressedSize);
+
+    for (char* origBuf = (char*)inbuf;  origBuf < (char*)inbuf + insize; )
+    {
+        size_t origSize = ((char*)inbuf + insize - origBuf < (CelsNum)blockSize?  (char*)inbuf + insize - origBuf : blockSize);
+
+        if ((size_t)(outEnd - out) >= tempBufSize) {
+            compressedSize = LZ4F_compressUpdate(cctx, out, outEnd - out, origBuf, origSize, NULL);
+            if (LZ4F_isError(compressedSize))  CELS_RETURN(CELS_ERROR_GENERAL);
+        } else {
+            if (tempBuf == NULL  &&  (tempBuf = (char*) CelsMemAlloc(cb,ud, tempBufSize)) == NULL)  CELS_RETURN(CELS_ERROR_NOT_ENOUGH_MEMORY);
+            compressedSize = LZ4F_compressUpdate(cctx, tempBuf, tempBufSize, origBuf, origSize, NULL);
+            if (LZ4F_isError(compressedSize))  CELS_RETURN(CELS_ERROR_GENERAL);
+            if (compressedSize > (size_t)(outEnd - out))  CELS_RETURN(CELS_ERROR_OUTBLOCK_TOO_SMALL);
+            memcpy (out, tempBuf, compressedSize);
+        }
+        out += compressedSize;
+        origBuf += origSize;
+        progress.report(origSize, compressedSize);
+    }
+
+    // Frame end takes at most 8 bytes, that is less than any tempBufSize
+    if ((size_t)(outEnd - out) >= tempBufSize) {
+        compressedSize = LZ4F_compressEnd(cctx, out, outEnd - out, NULL);
+    } else {
+        char end[16];
+        compressedSize = LZ4F_compressEnd(cctx, end, sizeof(end), NULL);
+        if (!LZ4F_isError(compressedSize)  &&  compressedSize > (size_t)(outEnd - out))  CELS_RETURN(CELS_ERROR_OUTBLOCK_TOO_SMALL);
+        if (!LZ4F_isError(compressedSize))  memcpy (out, end, compressedSize);
+    }
+    if (LZ4F_isError(compressedSize))  CELS_RETURN(CELS_ERROR_GENERAL);
+    out += compressedSize;
+    progress.report(0, compressedSize);
+
+    if (codec->MinCompression > 0  &&  out - (char*)outbuf > insize * codec->MinCompression)
+        CELS_RETURN(CELS_ERROR_OUTBLOCK_TOO_SMALL);
+
+finished:
+    progress.flush();
+    if (tempBuf)  CelsMemFree(cb,ud, tempBuf);
+    LZ4F_freeCompressionContext(cctx);
+    return (errcode == CELS_OK?  out - (char*)outbuf : errcode);
+}
+
+
+// Memory buffer decompression of the LZ4 frame(s)
+CelsResult CELS_LZ4F_decompress_membuf (Lz4Codec *codec, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    LZ4F_dctx* dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    CelsResult errcode = CELS_OK;
+    Lz4Progress progress(codec, ud,cb);
+    char *src = (char*)inbuf, *dst = (char*)outbuf;
+    size_t hint = 0;
+    while (src < (char*)inbuf + insize)
+    {
+        size_t srcSize = (char*)inbuf + insize - src;
+        size_t dstSize = (char*)outbuf + outsize - dst;
+        hint = LZ4F_decompress(dctx, dst, &dstSize, src, &srcSize, NULL);
+        if (LZ4F_isError(hint))  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+        if (srcSize == 0  &&  dstSize == 0)  CELS_RETURN(CELS_ERROR_OUTBLOCK_TOO_SMALL);   // no progress since outbuf is full
+        src += srcSize;
+        dst += dstSize;
+        progress.report(srcSize, dstSize);
+    }
+    progress.flush();
+    // Non-zero hint means that the last frame isn't finished
+    errcode = (hint == 0?  dst - (char*)outbuf : CELS_ERROR_BAD_COMPRESSED_DATA);
+
+finished:
+    LZ4F_freeDecompressionContext(dctx);
+    return errcode;
+}
+
+
+// Stream compression into the LZ4 frame, employing callbacks for I/O
+CelsResult CELS_LZ4F_compress_stream (Lz4Codec* codec, void* ud, CelsCallback* cb)
+{
+    LZ4F_preferences_t prefs;
+    Lz4FramePreferences (codec, &prefs, 0);
+
+    size_t origBufSize = codec->StreamChunkSize;
+    size_t compressedBufSize = LZ4F_compressBound(origBufSize, &prefs) + LZ4F_HEADER_SIZE_MAX;
+
+    LZ4F_cctx* cctx;
+    if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    CelsResult errcode = CELS_OK;
+    char* buf = (char*) CelsMemAlloc(cb,ud, origBufSize + compressedBufSize);
+    if (buf == NULL)  {LZ4F_freeCompressionContext(cctx);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+
+    char* origBuf = buf;
+    char* compressedBuf = buf + origBufSize;
+    Lz4Progress progress(codec, ud,cb);
+
+    size_t compressedSize = LZ4F_compressBegin(cctx, compressedBuf, compressedBufSize, &prefs);
+    if (LZ4F_isError(compressedSize))  CELS_RETURN(CELS_ERROR_GENERAL);
+    progress.report(0, compressedSize);
+    CELS_WRITE_EXACTLY(compressedBuf, (CelsNum)compressedSize);
+
+    for(;;)
+    {
+        CelsResult origSize;
+        CELS_READ_OR_EOF(origSize, origBuf, origBufSize);
+
+        compressedSize = LZ4F_compressUpdate(cctx, compressedBuf, compressedBufSize, origBuf, origSize, NULL);
+        if (LZ4F_isError(compressedSize))  CELS_RETURN(CELS_ERROR_GENERAL);
+
+        progress.report(origSize, compressedSize);
+        progress.quasi_write(compressedSize);
+        if (compressedSize > 0)  CELS_WRITE_EXACTLY(compressedBuf, (CelsNum)compressedSize);
+    }
+
+finished:
+    // Finish the frame, but only if all went well
+    if (errcode == CELS_OK) {
+        compressedSize = LZ4F_compressEnd(cctx, compressedBuf, compressedBufSize, NULL);
+        if (LZ4F_isError(compressedSize))  errcode = CELS_ERROR_GENERAL;
+        else {
+            progress.report(0, compressedSize);
+            CelsResult result = CelsWrite(cb,ud, compressedBuf, compressedSize);
+            if (result != (CelsResult) compressedSize)   errcode = (result < CELS_OK? result : CELS_ERROR_WRITE);
+        }
+    }
+    progress.flush();
+    CelsMemFree(cb,ud, buf);
+    LZ4F_freeCompressionContext(cctx);
+    return errcode;
+}
+
+
+// Stream decompression of the LZ4 frame(s), employing callbacks for I/O
+CelsResult CELS_LZ4F_decompress_stream (Lz4Codec* codec, void* ud, CelsCallback* cb)
+{
+    // Frames produced by other programs may have any block size, but LZ4F buffers data internally,
+    // so we can use buffers of any size
+    size_t origBufSize = codec->StreamChunkSize;
+    size_t compressedBufSize = codec->StreamChunkSize;
+
+    LZ4F_dctx* dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    CelsResult errcode = CELS_OK;
+    char* buf = (char*) CelsMemAlloc(cb,ud, origBufSize + compressedBufSize);
+    if (buf == NULL)  {LZ4F_freeDecompressionContext(dctx);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+
+    char* origBuf = buf;
+    char* compressedBuf = buf + origBufSize;
+    Lz4Progress progress(codec, ud,cb);
+    size_t hint = 0;
+
+    for(;;)
+    {
+        CelsResult compressedSize;
+        CELS_READ_OR_EOF(compressedSize, compressedBuf, compressedBufSize);
+
+        for (char* src = compressedBuf;  src < compressedBuf + compressedSize; )
+        {
+            size_t srcSize = compressedBuf + compressedSize - src;
+            size_t origSize = origBufSize;
+            hint = LZ4F_decompress(dctx, origBuf, &origSize, src, &srcSize, NULL);
+            if (LZ4F_isError(hint))  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+            src += srcSize;
+
+            progress.report(srcSize, origSize);
+            progress.quasi_write(origSize);
+            if (origSize > 0)  CELS_WRITE_EXACTLY(origBuf, (CelsNum)origSize);
+        }
+    }
+
+finished:
+    progress.flush();
+    // At EOF, non-zero hint means that the last frame isn't finished
+    if (errcode == CELS_OK  &&  hint != 0)   errcode = CELS_ERROR_BAD_COMPRESSED_DATA;
+    CelsMemFree(cb,ud, buf);
+    LZ4F_freeDecompressionContext(dctx);
+    return errcode;
+}
+
+// Frame compression from memory buffer into the stream, feeding chunks of inbuf directly to LZ4F
+CelsResult CELS_LZ4F_compress_from_membuf (Lz4Codec* codec, void* inbuf, CelsNum insize, void* ud, CelsCallback* cb)
+{
+    LZ4F_preferences_t prefs;
+    Lz4FramePreferences (codec, &prefs, insize);
+
+    size_t origBufSize = codec->StreamChunkSize;
+    size_t compressedBufSize = LZ4F_compressBound(origBufSize, &prefs) + LZ4F_HEADER_SIZE_MAX;
+
+    LZ4F_cctx* cctx;
+    if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    CelsResult errcode = CELS_OK;
+    char* compressedBuf = (char*) CelsMemAlloc(cb,ud, compressedBufSize);
+    if (compressedBuf == NULL)  {LZ4F_freeCompressionContext(cctx);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+
+    CelsNum totalCompressedSize = 0;
+    Lz4Progress progress(codec, ud,cb);
+
+    size_t compressedSize = LZ4F_compressBegin(cctx, compressedBuf, compressedBufSize, &prefs);
+    if (LZ4F_isError(compressedSize))  CELS_RETURN(CELS_ERROR_GENERAL);
+    totalCompressedSize += compressedSize;
+    progress.report(0, compressedSize);
+    CELS_WRITE_EXACTLY(compressedBuf, (CelsNum)compressedSize);
+
+    for (char* origBuf = (char*)inbuf;  origBuf < (char*)inbuf + insize; )
+    {
+        size_t origSize = ((char*)inbuf + insize - origBuf < (CelsNum)origBufSize?  (char*)inbuf + insize - origBuf : origBufSize);
 
-    return (outsize >= 0 ?  outsize : CELS_ERROR_BAD_COMPRESSED_DATA);
+        compressedSize = LZ4F_compressUpdate(cctx, compressedBuf, compressedBufSize, origBuf, origSize, NULL);
+        if (LZ4F_isError(compressedSize))  CELS_RETURN(CELS_ERROR_GENERAL);
+        origBuf += origSize;
+        totalCompressedSize += compressedSize;
+
+        progress.report(origSize, compressedSize);
+        progress.quasi_write(compressedSize);
+        if (compressedSize > 0)  CELS_WRITE_EXACTLY(compressedBuf, (CelsNum)compressedSize);
+    }
+
+    compressedSize = LZ4F_compressEnd(cctx, compressedBuf, compressedBufSize, NULL);
+    if (LZ4F_isError(compressedSize))  CELS_RETURN(CELS_ERROR_GENERAL);
+    totalCompressedSize += compressedSize;
+    progress.report(0, compressedSize);
+    CELS_WRITE_EXACTLY(compressedBuf, (CelsNum)compressedSize);
+
+finished:
+    progress.flush();
+    CelsMemFree(cb,ud, compressedBuf);
+    LZ4F_freeCompressionContext(cctx);
+    return (errcode == CELS_OK?  totalCompressedSize : errcode);
+}
+
+
+// Decompression of the LZ4 frame(s) from the stream into memory buffer, letting LZ4F decode directly into the outbuf
+CelsResult CELS_LZ4F_decompress_to_membuf (Lz4Codec* codec, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    size_t compressedBufSize = codec->StreamChunkSize;
+
+    LZ4F_dctx* dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    CelsResult errcode = CELS_OK;
+    char* compressedBuf = (char*) CelsMemAlloc(cb,ud, compressedBufSize);
+    if (compressedBuf == NULL)  {LZ4F_freeDecompressionContext(dctx);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+
+    char* dst = (char*)outbuf;
+    Lz4Progress progress(codec, ud,cb);
+    size_t hint = 0;
+
+    for(;;)
+    {
+        CelsResult compressedSize;
+        CELS_READ_OR_EOF(compressedSize, compressedBuf, compressedBufSize);
+
+        for (char* src = compressedBuf;  src < compressedBuf + compressedSize; )
+        {
+            size_t srcSize = compressedBuf + compressedSize - src;
+            size_t dstSize = (char*)outbuf + outsize - dst;
+            hint = LZ4F_decompress(dctx, dst, &dstSize, src, &srcSize, NULL);
+            if (LZ4F_isError(hint))  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+            if (srcSize == 0  &&  dstSize == 0)  CELS_RETURN(CELS_ERROR_OUTBLOCK_TOO_SMALL);   // no progress since outbuf is full
+            src += srcSize;
+            dst += dstSize;
+            progress.report(srcSize, dstSize);
+        }
+    }
+
+finished:
+    progress.flush();
+    // Non-zero hint at EOF means that the last frame isn't finished
+    if (errcode == CELS_OK)
+        errcode = (hint == 0?  dst - (char*)outbuf : CELS_ERROR_BAD_COMPRESSED_DATA);
+    CelsMemFree(cb,ud, compressedBuf);
+    LZ4F_freeDecompressionContext(dctx);
+    return errcode;
 }
 
 
@@ -73,8 +636,9 @@ CelsResult CELS_LZ4_compress_stream (Lz4Codec* codec, void* ud, CelsCallback* cb
 {
     size_t origBufSize = codec->StreamChunkSize;
     size_t compressedBufSize = LZ4_compressBound(origBufSize);
+    int checksumSize = Lz4ChecksumSize(codec);
 
-    char* buf = (char*) CelsMemAlloc(cb,ud, 2*origBufSize + LZ4_sizeofState() + LZ4_CHUNKSIZE_WIDTH + compressedBufSize);
+    char* buf = (char*) CelsMemAlloc(cb,ud, 2*origBufSize + LZ4_sizeofState() + LZ4_CHUNKSIZE_WIDTH + compressedBufSize + checksumSize);
     if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
 
     char* origBuf[2] = {buf, buf + origBufSize};
@@ -82,6 +646,9 @@ CelsResult CELS_LZ4_compress_stream (Lz4Codec* codec, void* ud, CelsCallback* cb
     char* compressedBuf = LZ4_state + LZ4_sizeofState();
 
     CelsResult errcode = CELS_OK;
+    int adaptive = (codec->TargetSpeed > 0  ||  codec->ChunkDeadline > 0);
+    int acceleration = codec->acceleration;
+    Lz4Progress progress(codec, ud,cb);
     LZ4_stream_t* lz4Stream = LZ4_initStream(LZ4_state, LZ4_sizeofState());
     if (lz4Stream == NULL)  CELS_RETURN(CELS_ERROR_INTERNAL);
 
@@ -90,14 +657,30 @@ CelsResult CELS_LZ4_compress_stream (Lz4Codec* codec, void* ud, CelsCallback* cb
         CelsResult origSize;
         CELS_READ_OR_EOF(origSize, origBuf[i], origBufSize);
 
+        double startTime = adaptive? Lz4Time() : 0;
         int compressedSize = LZ4_compress_fast_continue(lz4Stream,
-            origBuf[i], compressedBuf + LZ4_CHUNKSIZE_WIDTH, origSize, compressedBufSize, codec->acceleration);
+            origBuf[i], compressedBuf + LZ4_CHUNKSIZE_WIDTH, origSize, compressedBufSize, acceleration);
         if(compressedSize <= 0)   CELS_RETURN(CELS_ERROR_GENERAL);
+        if (adaptive)  progress.level(acceleration);
+        if (checksumSize) {
+            CelsResult result = Lz4PutChecksum(origBuf[i], origSize, compressedBuf + LZ4_CHUNKSIZE_WIDTH + compressedSize);
+            if (result < CELS_OK)  CELS_RETURN(result);
+            compressedSize += checksumSize;
+        }
 
+        progress.report(origSize, compressedSize + LZ4_CHUNKSIZE_WIDTH);
+        progress.quasi_write(compressedSize + LZ4_CHUNKSIZE_WIDTH);
+
+        double compressedTime = adaptive? Lz4Time() : 0;
         CELS_WRITE_WITH_SIZE(compressedSize,LZ4_CHUNKSIZE_WIDTH, compressedBuf);
+
+        // Time spent in CelsWrite measures the output backpressure
+        if (adaptive)
+            acceleration = Lz4AdaptAcceleration (codec, acceleration, origSize, compressedTime - startTime, Lz4Time() - compressedTime);
     }
 
 finished:
+    progress.flush();
     CelsMemFree(cb,ud, buf);
     return errcode;
 }
@@ -107,7 +690,8 @@ finished:
 CelsResult CELS_LZ4_decompress_stream (Lz4Codec* codec, void* ud, CelsCallback* cb)
 {
     size_t origBufSize = codec->StreamChunkSize;
-    size_t compressedBufSize = LZ4_compressBound(origBufSize);
+    int checksumSize = Lz4ChecksumSize(codec);
+    size_t compressedBufSize = LZ4_compressBound(origBufSize) + checksumSize;
 
     char* buf = (char*) CelsMemAlloc(cb,ud, 2*origBufSize + compressedBufSize);
     if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
@@ -116,68 +700,509 @@ CelsResult CELS_LZ4_decompress_stream (Lz4Codec* codec, void* ud, CelsCallback*
     char* compressedBuf = buf + 2*origBufSize;
 
     CelsResult errcode = CELS_OK;
+    Lz4Progress progress(codec, ud,cb);
     LZ4_streamDecode_t lz4Stream[1];
     if (1 != LZ4_setStreamDecode(lz4Stream, NULL, 0))  CELS_RETURN(CELS_ERROR_INTERNAL);
 
     for(int i=0; ; i^=1)
     {
         CelsResult compressedSize;
-        CELS_READ_WITH_SIZE_OR_EOF(compressedSize,LZ4_CHUNKSIZE_WIDTH, compressedBuf,compressedBufSize);
+        CELS_READ_WITH_SIZE_OR_EOF(compressedSize,LZ4_CHUNKSIZE_WIDTH, compressedBuf,(CelsNum)compressedBufSize);
+        if (compressedSize <= checksumSize)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
 
         int origSize = LZ4_decompress_safe_continue(lz4Stream,
-            compressedBuf, origBuf[i], compressedSize, origBufSize);
+            compressedBuf, origBuf[i], compressedSize - checksumSize, origBufSize);
         if(origSize <= 0)   CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+        if (checksumSize) {
+            CelsResult result = Lz4VerifyChecksum(origBuf[i], origSize, compressedBuf + compressedSize - checksumSize);
+            if (result < CELS_OK)  CELS_RETURN(result);
+        }
 
+        progress.report(compressedSize + LZ4_CHUNKSIZE_WIDTH, origSize);
+        progress.quasi_write(origSize);
         CELS_WRITE_EXACTLY(origBuf[i], origSize);
     }
 
 finished:
+    progress.flush();
     CelsMemFree(cb,ud, buf);
     return errcode;
 }
 
 
+// Compression from memory buffer into the stream. The inbuf is compressed in-place, serving as the history window,
+// and the output is the same sequence of size-prefixed chunks as produced by CELS_LZ4_compress_stream.
+// Matches don't reach beyond the previous chunk, so any stream decoder can handle the output
+CelsResult CELS_LZ4_compress_from_membuf (Lz4Codec* codec, void* inbuf, CelsNum insize, void* ud, CelsCallback* cb)
+{
+    size_t origBufSize = codec->StreamChunkSize;
+    size_t compressedBufSize = LZ4_compressBound(origBufSize);
+    int checksumSize = Lz4ChecksumSize(codec);
+
+    char* buf = (char*) CelsMemAlloc(cb,ud, LZ4_sizeofState() + LZ4_CHUNKSIZE_WIDTH + compressedBufSize + checksumSize);
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* LZ4_state = buf;
+    char* compressedBuf = LZ4_state + LZ4_sizeofState();
+
+    CelsResult errcode = CELS_OK;
+    CelsNum totalCompressedSize = 0;
+    int adaptive = (codec->TargetSpeed > 0  ||  codec->ChunkDeadline > 0);
+    int acceleration = codec->acceleration;
+    Lz4Progress progress(codec, ud,cb);
+    LZ4_stream_t* lz4Stream = LZ4_initStream(LZ4_state, LZ4_sizeofState());
+    if (lz4Stream == NULL)  CELS_RETURN(CELS_ERROR_INTERNAL);
+
+    for (char* origBuf = (char*)inbuf;  origBuf < (char*)inbuf + insize; )
+    {
+        int origSize = ((char*)inbuf + insize - origBuf < (CelsNum)origBufSize?  (char*)inbuf + insize - origBuf : origBufSize);
+
+        // Stream decoders keep only the previous chunk, so with chunks smaller than 64 KB the history is limited to it
+        if (origBuf > (char*)inbuf  &&  origBufSize < LZ4_HISTORY_SIZE)
+            LZ4_loadDict(lz4Stream, origBuf - origBufSize, origBufSize);
+
+        double startTime = adaptive? Lz4Time() : 0;
+        int compressedSize = LZ4_compress_fast_continue(lz4Stream,
+            origBuf, compressedBuf + LZ4_CHUNKSIZE_WIDTH, origSize, compressedBufSize, acceleration);
+        if(compressedSize <= 0)   CELS_RETURN(CELS_ERROR_GENERAL);
+        if (adaptive)  progress.level(acceleration);
+        if (checksumSize) {
+            CelsResult result = Lz4PutChecksum(origBuf, origSize, compressedBuf + LZ4_CHUNKSIZE_WIDTH + compressedSize);
+            if (result < CELS_OK)  CELS_RETURN(result);
+            compressedSize += checksumSize;
+        }
+        origBuf += origSize;
+        totalCompressedSize += compressedSize + LZ4_CHUNKSIZE_WIDTH;
+
+        progress.report(origSize, compressedSize + LZ4_CHUNKSIZE_WIDTH);
+        progress.quasi_write(compressedSize + LZ4_CHUNKSIZE_WIDTH);
+
+        double compressedTime = adaptive? Lz4Time() : 0;
+        CELS_WRITE_WITH_SIZE(compressedSize,LZ4_CHUNKSIZE_WIDTH, compressedBuf);
+
+        if (adaptive)
+            acceleration = Lz4AdaptAcceleration (codec, acceleration, origSize, compressedTime - startTime, Lz4Time() - compressedTime);
+    }
+
+finished:
+    progress.flush();
+    CelsMemFree(cb,ud, buf);
+    return (errcode == CELS_OK?  totalCompressedSize : errcode);
+}
+
+
+// Decompression from the stream into memory buffer. Chunks are decompressed directly into consecutive parts
+// of the outbuf, so the previously decompressed data serve as the history window without any extra copying
+CelsResult CELS_LZ4_decompress_to_membuf (Lz4Codec* codec, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    size_t origBufSize = codec->StreamChunkSize;
+    int checksumSize = Lz4ChecksumSize(codec);
+    size_t compressedBufSize = LZ4_compressBound(origBufSize) + checksumSize;
+
+    char* compressedBuf = (char*) CelsMemAlloc(cb,ud, compressedBufSize);
+    if (compressedBuf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    CelsResult errcode = CELS_OK;
+    char* origBuf = (char*)outbuf;
+    Lz4Progress progress(codec, ud,cb);
+    LZ4_streamDecode_t lz4Stream[1];
+    if (1 != LZ4_setStreamDecode(lz4Stream, NULL, 0))  CELS_RETURN(CELS_ERROR_INTERNAL);
+
+    for(;;)
+    {
+        CelsResult compressedSize;
+        CELS_READ_WITH_SIZE_OR_EOF(compressedSize,LZ4_CHUNKSIZE_WIDTH, compressedBuf,(CelsNum)compressedBufSize);
+        if (compressedSize <= checksumSize)  CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+        // Decompression failure in the partially filled outbuf most probably means that the chunk doesn't fit
+        size_t room = (char*)outbuf + outsize - origBuf;
+        int origSize = LZ4_decompress_safe_continue(lz4Stream,
+            compressedBuf, origBuf, compressedSize - checksumSize, (room < origBufSize? room : origBufSize));
+        if(origSize <= 0)   CELS_RETURN(room < origBufSize?  CELS_ERROR_OUTBLOCK_TOO_SMALL : CELS_ERROR_BAD_COMPRESSED_DATA);
+        if (checksumSize) {
+            CelsResult result = Lz4VerifyChecksum(origBuf, origSize, compressedBuf + compressedSize - checksumSize);
+            if (result < CELS_OK)  CELS_RETURN(result);
+        }
+        origBuf += origSize;
+
+        progress.report(compressedSize + LZ4_CHUNKSIZE_WIDTH, origSize);
+    }
+
+finished:
+    progress.flush();
+    CelsMemFree(cb,ud, compressedBuf);
+    return (errcode == CELS_OK?  origBuf - (char*)outbuf : errcode);
+}
+
+
+// Push-mode stream state. Pushed data are collected into chunks of the StreamChunkSize, so the compressed stream
+// is the same as produced by CELS_LZ4_compress_stream, and compressed chunks are collected prior to decompression
+struct Lz4PushStream
+{
+    Lz4Codec* codec;
+    bool compression;
+    char* origBuf[2];           // two buffers for original data, so the previous chunk serves as the history window
+    int i;                      // index of the current origBuf
+    char* compressedBuf;        // compressed chunk prefixed with LZ4_CHUNKSIZE_WIDTH bytes of its size
+    int checksumSize;           // size of the checksum following the compressed chunk
+    size_t filled;              // amount of data collected in origBuf[i] (compression) or compressedBuf (decompression)
+    bool eof;                   // decompression: the zero-sized chunk terminated the stream
+    int adaptive, acceleration; // compression: current acceleration, modified in the adaptive mode
+    LZ4_stream_t* lz4Stream;
+    LZ4_streamDecode_t lz4StreamDecode[1];
+    Lz4Progress progress;
+};
+
+// Start push-mode (de)compression, allocating the stream state together with all buffers
+CelsResult CELS_LZ4_stream_open (Lz4Codec* codec, bool compression, void** state, void* ud, CelsCallback* cb)
+{
+    size_t origBufSize = codec->StreamChunkSize;
+    size_t compressedBufSize = LZ4_compressBound(origBufSize);
+
+    size_t stateSize = (compression? LZ4_sizeofState() : 0);
+    int checksumSize = Lz4ChecksumSize(codec);
+    char* buf = (char*) CelsMemAlloc(cb,ud, sizeof(Lz4PushStream) + stateSize + 2*origBufSize + LZ4_CHUNKSIZE_WIDTH + compressedBufSize + checksumSize);
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    // LZ4 state goes first since it should be aligned
+    Lz4PushStream* stream = (Lz4PushStream*) buf;
+    char* LZ4_state = buf + sizeof(Lz4PushStream);
+    stream->codec = codec;
+    stream->compression = compression;
+    stream->origBuf[0] = LZ4_state + stateSize;
+    stream->origBuf[1] = stream->origBuf[0] + origBufSize;
+    stream->compressedBuf = stream->origBuf[1] + origBufSize;
+    stream->checksumSize = checksumSize;
+    stream->i = 0;
+    stream->filled = 0;
+    stream->eof = false;
+    stream->adaptive = (codec->TargetSpeed > 0  ||  codec->ChunkDeadline > 0);
+    stream->acceleration = codec->acceleration;
+    stream->progress = Lz4Progress(codec, ud,cb);
+
+    if (compression)
+        stream->lz4Stream = LZ4_initStream(LZ4_state, stateSize);
+    if (compression?  stream->lz4Stream == NULL  :  1 != LZ4_setStreamDecode(stream->lz4StreamDecode, NULL, 0))
+        {CelsMemFree(cb,ud, buf);  return CELS_ERROR_INTERNAL;}
+
+    *state = stream;
+    return CELS_OK;
+}
+
+// Compress the data collected in the current origBuf and write them as the next chunk
+static CelsResult Lz4PushCompressChunk (Lz4PushStream* stream, void* ud, CelsCallback* cb)
+{
+    Lz4Codec* codec = stream->codec;
+    CelsResult errcode = CELS_OK;
+    int origSize = stream->filled;
+    char* compressedBuf = stream->compressedBuf;
+
+    double startTime = stream->adaptive? Lz4Time() : 0;
+    int compressedSize = LZ4_compress_fast_continue(stream->lz4Stream,
+        stream->origBuf[stream->i], compressedBuf + LZ4_CHUNKSIZE_WIDTH, origSize, LZ4_compressBound(codec->StreamChunkSize), stream->acceleration);
+    if(compressedSize <= 0)   CELS_RETURN(CELS_ERROR_GENERAL);
+    if (stream->adaptive)  stream->progress.level(stream->acceleration);
+    if (stream->checksumSize) {
+        CelsResult result = Lz4PutChecksum(stream->origBuf[stream->i], origSize, compressedBuf + LZ4_CHUNKSIZE_WIDTH + compressedSize);
+        if (result < CELS_OK)  CELS_RETURN(result);
+        compressedSize += stream->checksumSize;
+    }
+    stream->i ^= 1;
+    stream->filled = 0;
+
+    stream->progress.report(origSize, compressedSize + LZ4_CHUNKSIZE_WIDTH);
+    stream->progress.quasi_write(compressedSize + LZ4_CHUNKSIZE_WIDTH);
+
+    {
+        double compressedTime = stream->adaptive? Lz4Time() : 0;
+        CELS_WRITE_WITH_SIZE(compressedSize,LZ4_CHUNKSIZE_WIDTH, compressedBuf);
+
+        if (stream->adaptive)
+            stream->acceleration = Lz4AdaptAcceleration (codec, stream->acceleration, origSize, compressedTime - startTime, Lz4Time() - compressedTime);
+    }
+
+finished:
+    return errcode;
+}
+
+// Decompress the chunk collected in the compressedBuf and write the decompressed data
+static CelsResult Lz4PushDecompressChunk (Lz4PushStream* stream, CelsNum compressedSize, void* ud, CelsCallback* cb)
+{
+    if (compressedSize <= stream->checksumSize)  return CELS_ERROR_BAD_COMPRESSED_DATA;
+    CelsResult errcode = CELS_OK;
+    char* origBuf = stream->origBuf[stream->i];
+
+    int origSize = LZ4_decompress_safe_continue(stream->lz4StreamDecode,
+        stream->compressedBuf + LZ4_CHUNKSIZE_WIDTH, origBuf, compressedSize - stream->checksumSize, stream->codec->StreamChunkSize);
+    if(origSize <= 0)   CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+    if (stream->checksumSize) {
+        CelsResult result = Lz4VerifyChecksum(origBuf, origSize, stream->compressedBuf + LZ4_CHUNKSIZE_WIDTH + compressedSize - stream->checksumSize);
+        if (result < CELS_OK)  CELS_RETURN(result);
+    }
+    stream->i ^= 1;
+    stream->filled = 0;
+
+    stream->progress.report(compressedSize + LZ4_CHUNKSIZE_WIDTH, origSize);
+    stream->progress.quasi_write(origSize);
+    CELS_WRITE_EXACTLY(origBuf, origSize);
+
+finished:
+    return errcode;
+}
+
+// Process the next part of input data, (de)compressing every chunk once it's filled up
+CelsResult CELS_LZ4_stream_push (Lz4PushStream* stream, char* inbuf, CelsNum insize, void* ud, CelsCallback* cb)
+{
+    size_t origBufSize = stream->codec->StreamChunkSize;
+    size_t compressedBufSize = LZ4_compressBound(origBufSize) + stream->checksumSize;
+
+    while (insize > 0)
+    {
+        CelsResult errcode = CELS_OK;
+        if (stream->compression) {
+            size_t bytes = ((CelsNum)(origBufSize - stream->filled) < insize?  origBufSize - stream->filled : insize);
+            memcpy(stream->origBuf[stream->i] + stream->filled, inbuf, bytes);
+            stream->filled += bytes;  inbuf += bytes;  insize -= bytes;
+            if (stream->filled == origBufSize)
+                errcode = Lz4PushCompressChunk(stream, ud,cb);
+        } else {
+            if (stream->eof)  return CELS_ERROR_NO_MORE_DATA_REQUIRED;
+
+            // Collect the size field first, then the chunk itself
+            CelsNum compressedSize = 0;
+            size_t need = LZ4_CHUNKSIZE_WIDTH;
+            if (stream->filled >= LZ4_CHUNKSIZE_WIDTH) {
+                compressedSize = CelsDeserializeInt(stream->compressedBuf, LZ4_CHUNKSIZE_WIDTH);
+                need += compressedSize;
+            }
+            size_t bytes = ((CelsNum)(need - stream->filled) < insize?  need - stream->filled : insize);
+            memcpy(stream->compressedBuf + stream->filled, inbuf, bytes);
+            stream->filled += bytes;  inbuf += bytes;  insize -= bytes;
+
+            if (stream->filled == LZ4_CHUNKSIZE_WIDTH) {
+                compressedSize = CelsDeserializeInt(stream->compressedBuf, LZ4_CHUNKSIZE_WIDTH);
+                if (compressedSize == 0)                           {stream->eof = true;  stream->filled = 0;}   // terminator, not a truncated chunk
+                if (compressedSize > (CelsNum)compressedBufSize)   return CELS_ERROR_BAD_COMPRESSED_DATA;
+            }
+            else if (stream->filled == need)
+                errcode = Lz4PushDecompressChunk(stream, compressedSize, ud,cb);
+        }
+        if (errcode < CELS_OK)  return errcode;
+    }
+    return CELS_OK;
+}
+
+// Process the end of input data and free the stream state
+CelsResult CELS_LZ4_stream_finish (Lz4PushStream* stream, void* ud, CelsCallback* cb)
+{
+    CelsResult errcode = CELS_OK;
+    if (stream->filled > 0)
+        errcode = (stream->compression?  Lz4PushCompressChunk(stream, ud,cb)  :  CELS_ERROR_BAD_COMPRESSED_DATA);   // truncated chunk
+
+    stream->progress.flush();
+    CelsMemFree(cb,ud, stream);
+    return errcode;
+}
+
+
+// Memory used by (de)compression with the given chunk size
+static CelsNum Lz4MemoryUsage (Lz4Codec* codec, bool compression, size_t chunk)
+{
+    if (codec->FrameFormat)   // our buffers plus LZ4F internal buffers, that are about the same size
+        return 2 * (chunk + LZ4_compressBound(chunk))
+             + (compression? LZ4_sizeofState() : 0);
+    return 2 * chunk + LZ4_compressBound(chunk) + Lz4ChecksumSize(codec)
+         + (compression? LZ4_sizeofState() + LZ4_CHUNKSIZE_WIDTH : 0);
+}
+
+
 CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
 {
     Lz4Codec *codec = (Lz4Codec*)self;
 
     switch (service)
     {
+    case CELS_LOAD_CODEC:
+        CelsApi = cb;
+        return CELS_OK;
+
     case CELS_PARSE:
         {
+            if (outsize < (CelsNum)sizeof(Lz4Codec))  return CELS_ERROR_GENERAL;
+
             codec = (Lz4Codec*)outbuf;
             codec->acceleration = 1;
             codec->MinCompression = 0;
             codec->StreamChunkSize = LZ4_STREAM_CHUNKSIZE;
+            codec->TargetSpeed = 0;
+            codec->ChunkDeadline = 0;
+            codec->FrameFormat = 0;
+            codec->ContentChecksum = 0;
+            codec->BlockChecksum = 0;
+            codec->ProgressGranularity = 0;
+
+            // Skip param[0] since it contains the method name
+            char** param = (char**)inbuf;
+            while (*++param)
+            {
+                char* end;
+                if (**param=='a')  {codec->acceleration  = strtol(*param+1, &end, 10);  if (*end || codec->acceleration < 1)  return CELS_ERROR_INVALID_COMPRESSOR;  continue;}
+                if (**param=='b')  {CelsNum size = Lz4ParseSize(*param+1, &end);  if (*end || size < LZ4_MIN_STREAM_CHUNKSIZE || size > LZ4_MAX_STREAM_CHUNKSIZE)  return CELS_ERROR_INVALID_COMPRESSOR;  codec->StreamChunkSize = size;  continue;}
+                if (**param=='s')  {codec->TargetSpeed   = strtod(*param+1, &end);      if (*end || codec->TargetSpeed <= 0)   return CELS_ERROR_INVALID_COMPRESSOR;  continue;}
+                if (**param=='t')  {codec->ChunkDeadline = strtod(*param+1, &end);      if (*end || codec->ChunkDeadline <= 0) return CELS_ERROR_INVALID_COMPRESSOR;  continue;}
+                if (**param=='p')  {codec->ProgressGranularity = Lz4ParseSize(*param+1, &end);  if (*end || codec->ProgressGranularity < 0)  return CELS_ERROR_INVALID_COMPRESSOR;  continue;}
+                if (!strcmp(*param,"f"))   {codec->FrameFormat = 1;      continue;}
+                if (!strcmp(*param,"xc"))  {codec->ContentChecksum = 1;  continue;}
+                if (!strcmp(*param,"xb"))  {codec->BlockChecksum = 1;    continue;}
+                return CELS_ERROR_INVALID_COMPRESSOR;
+            }
+            if (codec->ContentChecksum  &&  !codec->FrameFormat)
+                return CELS_ERROR_INVALID_COMPRESSOR;
+
             return sizeof(Lz4Codec);
         }
 
+    case CELS_UNPARSE:
+        {
+            char str[CELS_MAX_METHOD_STRING_SIZE];
+            int len = sprintf(str, "lz4");
+            if (codec->acceleration != 1)   len += sprintf(str+len, ":a%d", codec->acceleration);
+            if (codec->StreamChunkSize != LZ4_STREAM_CHUNKSIZE)  len += sprintf(str+len, ":b"),  len += Lz4FormatSize(str+len, codec->StreamChunkSize);
+            if (codec->TargetSpeed > 0)     len += sprintf(str+len, ":s%g", codec->TargetSpeed);
+            if (codec->ChunkDeadline > 0)   len += sprintf(str+len, ":t%g", codec->ChunkDeadline);
+            if (codec->ProgressGranularity) len += sprintf(str+len, ":p"),  len += Lz4FormatSize(str+len, codec->ProgressGranularity);
+            if (codec->FrameFormat)         len += sprintf(str+len, ":f");
+            if (codec->ContentChecksum)     len += sprintf(str+len, ":xc");
+            if (codec->BlockChecksum)       len += sprintf(str+len, ":xb");
+
+            if (len >= outsize)  return CELS_ERROR_GENERAL;
+            strcpy ((char*)outbuf, str);
+            return CELS_OK;
+        }
+
+    case CELS_GET_CAPABILITIES:
+        {
+            // Modes of this instance: frames and checksummed blocks are batched by the framework one-by-one,
+            // and frames are pushed via the framework coroutine. Cost hints not filled here are completed by the framework
+            if (outsize < (CelsNum)sizeof(CelsCapabilities))  return CELS_ERROR_GENERAL;
+            CelsCapabilities* caps = (CelsCapabilities*)outbuf;
+            CelsNum modes = (codec->FrameFormat || codec->BlockChecksum?  0 : CELS_CAP_BATCH)  |  (codec->FrameFormat?  0 : CELS_CAP_PUSH);
+            caps->compress   = CELS_CAP_CALLBACKS | CELS_CAP_MEMBUF | CELS_CAP_MEMBUF_INPUT  | modes;
+            caps->decompress = CELS_CAP_CALLBACKS | CELS_CAP_MEMBUF | CELS_CAP_MEMBUF_OUTPUT | modes;
+            caps->compress_known = caps->decompress_known = CELS_CAP_CALLBACKS | CELS_CAP_MEMBUF | CELS_CAP_MEMBUF_INPUT | CELS_CAP_MEMBUF_OUTPUT
+                                   | CELS_CAP_BUFFER_SHARING | CELS_CAP_BATCH | CELS_CAP_PUSH | CELS_CAP_MULTI_STREAM | CELS_CAP_CACHING;
+            caps->compression_memory   = Lz4MemoryUsage (codec, true,  codec->StreamChunkSize);
+            caps->decompression_memory = Lz4MemoryUsage (codec, false, codec->StreamChunkSize);
+            return CELS_OK;
+        }
+
     case CELS_GET_DICTIONARY_SIZE:
         return (LZ4_DISTANCE_MAX + 128) & ~255;  // round in order to avoid odd values
 
     case CELS_GET_MAX_COMPRESSED_SIZE:
-        {
+        if (codec->FrameFormat) {
+            LZ4F_preferences_t prefs;
+            Lz4FramePreferences (codec, &prefs, 0);
+            CelsNum full_chunks = insize / codec->StreamChunkSize;
+            return full_chunks * LZ4F_compressBound(codec->StreamChunkSize, &prefs)
+                 + LZ4F_compressBound(insize % codec->StreamChunkSize, &prefs)
+                 + LZ4F_HEADER_SIZE_MAX;
+        }
+        else {
             CelsNum full_chunks = insize / codec->StreamChunkSize;
             return full_chunks * LZ4_compressBound(codec->StreamChunkSize)
                  + LZ4_compressBound(insize % codec->StreamChunkSize)
-                 + (full_chunks + 1 + 1) * LZ4_CHUNKSIZE_WIDTH;  // +1 for possible extra zero word at the end of compressed stream
+                 + (full_chunks + 1 + 1) * LZ4_CHUNKSIZE_WIDTH   // +1 for possible extra zero word at the end of compressed stream
+                 + (full_chunks + 1) * Lz4ChecksumSize(codec);
         }
 
     case CELS_GET_COMPRESSION_MEMORY:
     case CELS_GET_DECOMPRESSION_MEMORY:
-        return 2 * codec->StreamChunkSize + LZ4_compressBound(codec->StreamChunkSize)
-             + (service==CELS_GET_COMPRESSION_MEMORY? LZ4_sizeofState() + LZ4_CHUNKSIZE_WIDTH : 0);
+        return Lz4MemoryUsage (codec, service==CELS_GET_COMPRESSION_MEMORY, codec->StreamChunkSize);
+
+    case CELS_GET_MINIMUM_COMPRESSION_MEMORY:
+    case CELS_GET_MINIMUM_DECOMPRESSION_MEMORY:
+        return Lz4MemoryUsage (codec, service==CELS_GET_MINIMUM_COMPRESSION_MEMORY, LZ4_MIN_STREAM_CHUNKSIZE);
+
+    case CELS_SET_COMPRESSION_MEMORY:
+    case CELS_SET_DECOMPRESSION_MEMORY:
+        {
+            // Find the largest power-of-2 chunk size fitting into the memory limit.
+            // The same chunk size is used by the decompressor, so both limits are simultaneously reduced
+            size_t chunk = LZ4_MAX_STREAM_CHUNKSIZE;
+            while (chunk > LZ4_MIN_STREAM_CHUNKSIZE  &&  Lz4MemoryUsage(codec, service==CELS_SET_COMPRESSION_MEMORY, chunk) > insize)
+                chunk /= 2;
+            codec->StreamChunkSize = chunk;
+            return CELS_OK;
+        }
+
+    case CELS_GET_BLOCKSIZE:
+        // Only frame blocks are independent, while the chunks of our own stream format share the history
+        return (codec->FrameFormat? codec->StreamChunkSize : 0);
+
+    case CELS_SET_BLOCKSIZE:
+        codec->StreamChunkSize = (insize < LZ4_MIN_STREAM_CHUNKSIZE? LZ4_MIN_STREAM_CHUNKSIZE :
+                                  insize > LZ4_MAX_STREAM_CHUNKSIZE? LZ4_MAX_STREAM_CHUNKSIZE : insize);
+        return CELS_OK;
+
+    case CELS_GET_MINIMAL_INPUT_SIZE:
+        return codec->StreamChunkSize;
+
+    case CELS_SET_MINIMAL_INPUT_SIZE:
+        {
+            // Chunks larger than the entire input just waste memory, so reduce the chunk size
+            // to the smallest power of 2 covering the input
+            size_t chunk = LZ4_MIN_STREAM_CHUNKSIZE;
+            while ((CelsNum)chunk < insize  &&  chunk < codec->StreamChunkSize)
+                chunk *= 2;
+            if (chunk < codec->StreamChunkSize)
+                codec->StreamChunkSize = chunk;
+            return CELS_OK;
+        }
 
     case CELS_COMPRESS:
+        if (codec->FrameFormat) {
+            if (inbuf && outbuf)    return CELS_LZ4F_compress_membuf(codec, inbuf,insize, outbuf,outsize, ud,cb);
+            if (inbuf)              return CELS_LZ4F_compress_from_membuf(codec, inbuf,insize, ud,cb);
+            if (!outbuf)            return CELS_LZ4F_compress_stream(codec, ud,cb);
+            return CELS_ERROR_NOT_IMPLEMENTED;
+        }
         if (inbuf && outbuf)    return CELS_LZ4_compress_membuf(codec, inbuf,insize, outbuf,outsize, ud,cb);
-        if (!inbuf && !outbuf)  return CELS_LZ4_compress_stream(codec, ud,cb);
+        if (inbuf)              return CELS_LZ4_compress_from_membuf(codec, inbuf,insize, ud,cb);
+        if (!outbuf)            return CELS_LZ4_compress_stream(codec, ud,cb);
         return CELS_ERROR_NOT_IMPLEMENTED;
 
     case CELS_DECOMPRESS:
+        if (codec->FrameFormat) {
+            if (inbuf && outbuf)    return CELS_LZ4F_decompress_membuf(codec, inbuf,insize, outbuf,outsize, ud,cb);
+            if (outbuf)             return CELS_LZ4F_decompress_to_membuf(codec, outbuf,outsize, ud,cb);
+            if (!inbuf)             return CELS_LZ4F_decompress_stream(codec, ud,cb);
+            return CELS_ERROR_NOT_IMPLEMENTED;
+        }
         if (inbuf && outbuf)    return CELS_LZ4_decompress_membuf(codec, inbuf,insize, outbuf,outsize, ud,cb);
-        if (!inbuf && !outbuf)  return CELS_LZ4_decompress_stream(codec, ud,cb);
+        if (outbuf)             return CELS_LZ4_decompress_to_membuf(codec, outbuf,outsize, ud,cb);
+        if (!inbuf)             return CELS_LZ4_decompress_stream(codec, ud,cb);
         return CELS_ERROR_NOT_IMPLEMENTED;
 
+    case CELS_COMPRESS_BATCH:
+        if (codec->FrameFormat || codec->BlockChecksum)  return CELS_ERROR_NOT_IMPLEMENTED;   // let the framework compress frames or checksummed blocks one-by-one
+        return CELS_LZ4_compress_batch(codec, (CelsBatchItem*)inbuf, insize, ud,cb);
+
+    case CELS_DECOMPRESS_BATCH:
+        if (codec->FrameFormat || codec->BlockChecksum)  return CELS_ERROR_NOT_IMPLEMENTED;
+        return CELS_LZ4_decompress_batch(codec, (CelsBatchItem*)inbuf, insize, ud,cb);
+
+    case CELS_STREAM_OPEN:
+        if (codec->FrameFormat)  return CELS_ERROR_NOT_IMPLEMENTED;   // let the framework run the frame (de)compression in a coroutine
+        if (subservice != CELS_COMPRESS  &&  subservice != CELS_DECOMPRESS)  return CELS_ERROR_NOT_IMPLEMENTED;
+        return CELS_LZ4_stream_open(codec, subservice==CELS_COMPRESS, (void**)outbuf, ud,cb);
+
+    case CELS_STREAM_PUSH:
+        return CELS_LZ4_stream_push((Lz4PushStream*)outbuf, (char*)inbuf, insize, ud,cb);
+
+    case CELS_STREAM_FINISH:
+        return CELS_LZ4_stream_finish((Lz4PushStream*)outbuf, ud,cb);
+
     default:
         return CELS_ERROR_NOT_IMPLEMENTED;
     }
@@ -1,4 +1,4 @@
 @set lib=../../lib
-gcc -c -O3 -I%lib% cels-lz4.cpp
-dllwrap --driver-name c++ cels-lz4.o -def %lib%/CELS.def -s -o cels-lz4.dll
+gcc -c -O3 -I%lib% cels-lz4.cpp lz4/lib/lz4hc.c lz4/lib/lz4frame.c lz4/lib/xxhash.c
+dllwrap --driver-name c++ cels-lz4.o lz4hc.o lz4frame.o xxhash.o -def %lib%/CELS.def -s -o cels-lz4.dll
 @del *.o
@@ -0,0 +1,279 @@
+/*
+    cels-served: compression daemon for CELS - Framework and standard API for compression algorithms
+    Copyright (C) 2021, Bulat Ziganshin <Bulat.Ziganshin@gmail.com>
+
+    MIT License (https://opensource.org/licenses/MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+
+    You can contact the author at:
+       - CELS repository: https://github.com/Bulat-Ziganshin/CELS
+*/
+
+// Usage: cels-served [-s SOCKET] [-t THREADS] [-m MEMORY_MB] [-f]
+//   -s  Unix socket to listen on (CELS_SERVED_SOCKET environment variable or /tmp/cels-served.sock by default)
+//   -t  worker threads in the pool (one per CPU by default)
+//   -m  memory budget of all operations together (unlimited by default); operations not fitting into it wait
+//   -f  fit compression methods into the remaining budget rather than wait (decompression always waits,
+//       since the stream needs the resources it was compressed with)
+//
+// Serves the "served" codec of other processes: every operation received on a connection is started
+// with CelsCompressAsync/CelsDecompressAsync, so operations of all clients share the framework thread pool
+// and the memory budget, and codecs stay loaded with their caches warm between operations.
+// Codecs are linked into the daemon with CELS_REGISTER_CODECS. See cels-served.h for the protocol.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cels-served.h"
+
+// Input chunk announced by the client but not yet consumed
+struct ServedChunk
+{
+    CelsNum pos, size;
+};
+
+// Connection with the client and state of its current operation
+struct ServedClient
+{
+    int     sock;
+    char*   shm;                // input ring followed by the output ring
+    CelsNum ringSize;
+    bool    broken;             // socket failed or the protocol was violated, so the connection should be closed
+
+    // Input chunks queue (circular buffer growing when full)
+    ServedChunk* chunks;
+    int     numChunks, firstChunk, maxChunks;
+    CelsNum consumed;           // bytes consumed from the first chunk
+    bool    eof;                // end of input was received
+    ServedRing out;             // output ring
+};
+
+
+// Receive the next message, handling SERVED_FREE and queueing input chunks. Returns false when the connection is broken
+static bool ServedReceive (ServedClient* client)
+{
+    ServedMsg msg;
+    if (!ServedRecvAll (client->sock, &msg, sizeof(msg)))  return client->broken = true,  false;
+
+    if (msg.type == SERVED_FREE) {
+        client->out.freed = msg.pos;
+        return true;
+    }
+    if (msg.type != SERVED_DATA  ||  client->eof)  return client->broken = true,  false;
+    if (msg.size == 0) {
+        client->eof = true;
+        return true;
+    }
+    if (msg.size < 0  ||  msg.size > SERVED_MAX_CHUNK  ||  msg.pos < 0  ||  msg.pos % client->ringSize + msg.size > client->ringSize)
+        return client->broken = true,  false;
+
+    if (client->numChunks == client->maxChunks) {
+        int newMax = (client->maxChunks? 2*client->maxChunks : 64);
+        ServedChunk* chunks = (ServedChunk*) malloc (newMax * sizeof(ServedChunk));
+        if (!chunks)  return client->broken = true,  false;
+        for (int i = 0;  i < client->numChunks;  i++)
+            chunks[i] = client->chunks[(client->firstChunk + i) % client->maxChunks];
+        free (client->chunks);
+        client->chunks = chunks,  client->maxChunks = newMax,  client->firstChunk = 0;
+    }
+    ServedChunk chunk = {msg.pos, msg.size};
+    client->chunks[(client->firstChunk + client->numChunks++) % client->maxChunks] = chunk;
+    return true;
+}
+
+// Callback of the operation: CELS_READ copies data from the input ring, CELS_WRITE places data into the output ring
+static CelsResult __cdecl ServedCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    ServedClient* client = (ServedClient*)self;
+
+    if (service == CELS_READ)
+    {
+        // Fill the entire buffer unless input is finished, since codecs treat short reads as EOF
+        CelsNum read_bytes = 0;
+        while (read_bytes < insize) {
+            if (client->numChunks == 0) {
+                if (client->eof)  break;
+                if (!ServedReceive (client))  return CELS_ERROR_READ;
+                continue;
+            }
+            ServedChunk* chunk = &client->chunks[client->firstChunk];
+            CelsNum bytes = (chunk->size - client->consumed < insize - read_bytes ? chunk->size - client->consumed : insize - read_bytes);
+            memcpy ((char*)inbuf + read_bytes, client->shm + chunk->pos % client->ringSize + client->consumed, bytes);
+            read_bytes += bytes;
+            client->consumed += bytes;
+            if (client->consumed == chunk->size) {
+                if (!ServedSend (client->sock, SERVED_FREE, chunk->pos + chunk->size, 0))  return client->broken = true,  CELS_ERROR_READ;
+                client->firstChunk = (client->firstChunk + 1) % client->maxChunks;
+                client->numChunks--;
+                client->consumed = 0;
+            }
+        }
+        return read_bytes;
+    }
+
+    if (service == CELS_WRITE)
+    {
+        for (CelsNum done = 0;  done < outsize; ) {
+            CelsNum pos,  len = (outsize - done < SERVED_MAX_CHUNK ? outsize - done : SERVED_MAX_CHUNK);
+            char* chunk = ServedRingReserve (&client->out, len, &pos);
+            if (!chunk) {
+                if (!ServedReceive (client))  return CELS_ERROR_WRITE;   // wait for SERVED_FREE
+                continue;
+            }
+            memcpy (chunk, (char*)outbuf + done, len);
+            if (!ServedSend (client->sock, SERVED_DATA, pos, len))  return client->broken = true,  CELS_ERROR_WRITE;
+            client->out.written = pos + len;
+            done += len;
+        }
+        return outsize;
+    }
+
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+
+// Serve operations of the single client until it disconnects
+static void* ServedClientThread (void* arg)
+{
+    ServedClient* client = (ServedClient*)arg;
+    char method[CELS_MAX_METHOD_STRING_SIZE];
+
+    // Map the shared memory passed by the client
+    ServedMsg msg;
+    int fd;
+    if (!ServedRecvFd (client->sock, &msg, &fd)  ||  msg.type != SERVED_HELLO  ||  fd < 0
+        ||  msg.size < SERVED_MAX_CHUNK  ||  msg.size > (CelsNum(1) << 30))
+    {
+        if (fd >= 0)  close (fd);
+        goto finished;
+    }
+    client->ringSize = msg.size;
+    client->shm = (char*) mmap (NULL, 2*client->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (client->shm == MAP_FAILED)  {client->shm = NULL;  goto finished;}
+
+    while (ServedRecvAll (client->sock, &msg, sizeof(msg)))
+    {
+        // Space of the last output chunks is returned after SERVED_DONE of the previous operation
+        if (msg.type == SERVED_FREE)  continue;
+        if (msg.type != SERVED_START  ||  (msg.pos != CELS_COMPRESS && msg.pos != CELS_DECOMPRESS)
+            ||  msg.size <= 0  ||  msg.size >= CELS_MAX_METHOD_STRING_SIZE  ||  !ServedRecvAll (client->sock, method, msg.size))
+            break;
+        method[msg.size] = '\0';
+
+        ServedRing out = {client->shm + client->ringSize, client->ringSize, 0, 0};
+        client->out = out;
+        client->numChunks = client->firstChunk = 0;
+        client->consumed = 0;
+        client->eof = false;
+
+        // Run the operation in the pool, that will call ServedCallback from one of its workers
+        CelsAsyncJob* job;
+        CelsResult result = (msg.pos == CELS_COMPRESS? CelsCompressAsync : CelsDecompressAsync)
+                                (method, NULL,0, NULL,0, client, ServedCallback, &job);
+        if (job) {
+            result = CelsAsyncWait (job);
+            CelsAsyncRelease (job);
+        }
+        if (client->broken  ||  !ServedSend (client->sock, SERVED_DONE, result, 0))
+            break;
+
+        // Skip the rest of input up to its end
+        while (!client->eof  &&  ServedReceive (client))
+            client->numChunks = client->firstChunk = 0;
+        if (client->broken)
+            break;
+    }
+
+finished:
+    close (client->sock);
+    if (client->shm)  munmap (client->shm, 2*client->ringSize);
+    free (client->chunks);
+    delete client;
+    return NULL;
+}
+
+
+int main (int argc, char** argv)
+{
+    const char* path = ServedSocketPath();
+    int threads = 0;
+    CelsNum memory = 0;
+    int fitting = 0;
+
+    for (int i = 1;  i < argc;  i++) {
+        if (!strcmp(argv[i], "-s")  &&  i+1 < argc)       path = argv[++i];
+        else if (!strcmp(argv[i], "-t")  &&  i+1 < argc)  threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-m")  &&  i+1 < argc)  memory = CelsNum(atoi(argv[++i])) << 20;
+        else if (!strcmp(argv[i], "-f"))                  fitting = 1;
+        else {
+            printf("Usage: cels-served [-s SOCKET] [-t THREADS] [-m MEMORY_MB] [-f]\n");
+            return 1;
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket name %s is too long\n", path);
+        return 1;
+    }
+    strcpy (addr.sun_path, path);
+
+    signal (SIGPIPE, SIG_IGN);
+    CelsLoad();
+    CelsSetThreads (threads);
+    if (memory)  CelsSetMemoryBudget (memory, fitting);
+
+    // Only the user running the daemon may connect to it
+    int sock = socket (AF_UNIX, SOCK_STREAM, 0);
+    unlink (path);
+    mode_t mask = umask (077);
+    int bound = (sock >= 0  &&  bind (sock, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    umask (mask);
+    if (!bound  ||  listen (sock, 64) < 0) {
+        printf("Can't listen on %s\n", path);
+        return 1;
+    }
+
+    for(;;)
+    {
+        int client_sock = accept (sock, NULL, NULL);
+        if (client_sock < 0) {
+            if (errno == EINTR  ||  errno == ECONNABORTED)  continue;
+            printf("Can't accept connections on %s\n", path);
+            return 1;
+        }
+
+        ServedClient* client = new ServedClient;
+        memset (client, 0, sizeof(*client));
+        client->sock = client_sock;
+
+        pthread_t thread;
+        if (pthread_create (&thread, NULL, ServedClientThread, client) == 0)
+            pthread_detach (thread);
+        else
+            close (client_sock),  delete client;
+    }
+}
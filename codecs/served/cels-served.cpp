@@ -0,0 +1,297 @@
+/*
+    "served" codec for CELS - Framework and standard API for compression algorithms
+    Copyright (C) 2021, Bulat Ziganshin <Bulat.Ziganshin@gmail.com>
+
+    MIT License (https://opensource.org/licenses/MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+
+    You can contact the author at:
+       - CELS repository: https://github.com/Bulat-Ziganshin/CELS
+*/
+
+// Method string: "served[:backend]", where
+//   backend - method executed by the cels-served daemon, with ':' inside of it written as '/', f.e. "lz4/a8".
+//             "lz4" by default. It should be registered in the daemon, but not necessarily in the application.
+//
+// The codec sends the operation to the daemon listening on the Unix socket named by the CELS_SERVED_SOCKET
+// environment variable (/tmp/cels-served.sock by default), so short-lived processes use codecs already loaded
+// and warmed up in the daemon, and share its memory budget and thread pool. Compressed data are exactly
+// the output of the backend streaming via CELS_READ/CELS_WRITE, so they can be decompressed with or without the daemon.
+// When the daemon isn't running, the backend is executed locally via the Cels() pointer received at codec
+// registration. Connections are kept open after the operation and reused by the following ones.
+// See cels-served.h for the protocol.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "cels-served.h"
+
+const int SERVED_BACKEND_SIZE = 256;        // Space for the backend method string in the parsed method
+
+// Cels() of the application, saved at codec registration
+static CelsCallback* CelsApi = NULL;
+
+// Structure representing the parsed codec
+struct ServedCodec
+{
+    char Backend[SERVED_BACKEND_SIZE];      // method executed by the daemon (in the usual ':' notation)
+};
+
+// Connection to the daemon with its shared memory
+struct ServedConnection
+{
+    int   sock;
+    char* shm;                              // input ring followed by the output ring
+    ServedConnection* next;                 // next idle connection
+};
+
+// Connections not used by running operations
+static ServedConnection* IdleConnections = NULL;
+static pthread_mutex_t   IdleMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void ServedDisconnect (ServedConnection* conn)
+{
+    close (conn->sock);
+    munmap (conn->shm, 2*SERVED_RING_SIZE);
+    delete conn;
+}
+
+// True if the daemon has sent something
+static bool ServedPending (int sock)
+{
+    struct pollfd pfd = {sock, POLLIN, 0};
+    return poll (&pfd, 1, 0) > 0;
+}
+
+// Take an idle connection (if reuse is allowed), or open the new one. Returns NULL if the daemon isn't available
+static ServedConnection* ServedConnect (bool reuse)
+{
+    while (reuse) {
+        pthread_mutex_lock (&IdleMutex);
+        ServedConnection* conn = IdleConnections;
+        if (conn)  IdleConnections = conn->next;
+        pthread_mutex_unlock (&IdleMutex);
+        if (!conn)  break;
+        // The daemon never sends anything on the idle connection, so pending data or hangup mean that it was closed, f.e. by the daemon restart
+        if (!ServedPending (conn->sock))  return conn;
+        ServedDisconnect (conn);
+    }
+
+    struct sockaddr_un addr;
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    const char* path = ServedSocketPath();
+    if (strlen(path) >= sizeof(addr.sun_path))  return NULL;
+    strcpy (addr.sun_path, path);
+
+    int sock = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)  return NULL;
+    if (connect (sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)  {close (sock);  return NULL;}
+
+    // Anonymous shared memory: the name is removed right after creation, so only the descriptor refers to it
+    static int counter = 0;
+    char name[64];
+    int fd = -1;
+    for (int attempt = 0;  fd < 0  &&  attempt < 100;  attempt++) {
+        sprintf (name, "/cels-served-%d-%d", (int)getpid(), __sync_fetch_and_add (&counter, 1));
+        fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd < 0)  {close (sock);  return NULL;}
+    shm_unlink (name);
+
+    void* shm = MAP_FAILED;
+    if (ftruncate (fd, 2*SERVED_RING_SIZE) == 0)
+        shm = mmap (NULL, 2*SERVED_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ServedMsg hello = {SERVED_HELLO, 0, 0, SERVED_RING_SIZE};
+    if (shm == MAP_FAILED  ||  !ServedSendFd (sock, &hello, fd)) {
+        if (shm != MAP_FAILED)  munmap (shm, 2*SERVED_RING_SIZE);
+        close (fd);  close (sock);
+        return NULL;
+    }
+    close (fd);
+
+    ServedConnection* conn = new ServedConnection;
+    conn->sock = sock;
+    conn->shm = (char*)shm;
+    return conn;
+}
+
+static void ServedRelease (ServedConnection* conn)
+{
+    pthread_mutex_lock (&IdleMutex);
+    conn->next = IdleConnections;
+    IdleConnections = conn;
+    pthread_mutex_unlock (&IdleMutex);
+}
+
+// Send the operation header. On failure, the connection is closed and NULL is returned
+static ServedConnection* ServedStart (ServedConnection* conn, int service, const char* method)
+{
+    size_t methodLen = strlen(method);
+    if (conn  &&  !(ServedSend (conn->sock, SERVED_START, service, methodLen)  &&  ServedSendAll (conn->sock, method, methodLen)))
+        ServedDisconnect (conn),  conn = NULL;
+    return conn;
+}
+
+// Perform the operation by the daemon: push input into the first ring while it has free space,
+// and pass output chunks from the second ring to the application as they arrive
+static CelsResult CELS_SERVED_process (ServedCodec* codec, int service, void* ud, CelsCallback* cb)
+{
+    // No input is consumed until the operation is started, so the broken connection is replaced by the new one, and then by local execution
+    ServedConnection* conn = ServedStart (ServedConnect(true), service, codec->Backend);
+    if (!conn)  conn = ServedStart (ServedConnect(false), service, codec->Backend);
+    if (!conn)  return (CelsApi? CelsApi (codec->Backend, service,0, NULL,0, NULL,0, ud,(CelsCallback0*)cb) : CELS_ERROR_GENERAL);
+
+    int sock = conn->sock;
+    char* outring = conn->shm + SERVED_RING_SIZE;
+    ServedRing in = {conn->shm, SERVED_RING_SIZE, 0, 0};
+    CelsResult errcode = CELS_ERROR_GENERAL;
+    bool eof = false;
+
+    for(;;)
+    {
+        CelsNum pos;
+        char* chunk = (eof? NULL : ServedRingReserve (&in, SERVED_MAX_CHUNK, &pos));
+        if (chunk  &&  !ServedPending (sock)) {
+            CelsResult len = CelsRead (cb,ud, chunk, SERVED_MAX_CHUNK);
+            if (len < 0)  {errcode = len;  goto broken;}
+            if (!ServedSend (sock, SERVED_DATA, pos, len))  goto broken;
+            eof = (len == 0);
+            in.written = pos + len;
+            continue;
+        }
+
+        ServedMsg msg;
+        if (!ServedRecvAll (sock, &msg, sizeof(msg)))  goto broken;
+        if (msg.type == SERVED_DATA) {
+            if (msg.size <= 0  ||  msg.size > SERVED_MAX_CHUNK  ||  msg.pos % SERVED_RING_SIZE + msg.size > SERVED_RING_SIZE)  goto broken;
+            CelsResult result = CelsWrite (cb,ud, outring + msg.pos % SERVED_RING_SIZE, msg.size);
+            if (result != msg.size)  {errcode = (result < CELS_OK? result : CELS_ERROR_WRITE);  goto broken;}
+            if (!ServedSend (sock, SERVED_FREE, msg.pos + msg.size, 0))  goto broken;
+        } else if (msg.type == SERVED_FREE) {
+            in.freed = msg.pos;
+        } else if (msg.type == SERVED_DONE) {
+            // The operation may finish before reading the entire input, but the daemon expects the end of input anyway
+            if (!eof  &&  !ServedSend (sock, SERVED_DATA, 0, 0))  goto broken;
+            ServedRelease (conn);
+            return msg.pos;
+        } else {
+            goto broken;
+        }
+    }
+
+broken:
+    // The daemon aborts the operation once the connection is closed
+    ServedDisconnect (conn);
+    return errcode;
+}
+
+
+static CelsResult __cdecl ServedMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    ServedCodec *codec = (ServedCodec*)self;
+
+    switch (service)
+    {
+    case CELS_LOAD_CODEC:
+        CelsApi = cb;
+        return CELS_OK;
+
+    case CELS_UNLOAD_CODEC:
+        pthread_mutex_lock (&IdleMutex);
+        while (IdleConnections) {
+            ServedConnection* conn = IdleConnections;
+            IdleConnections = conn->next;
+            ServedDisconnect (conn);
+        }
+        pthread_mutex_unlock (&IdleMutex);
+        return CELS_OK;
+
+    case CELS_PARSE:
+        {
+            if (outsize < (CelsNum)sizeof(ServedCodec))  return CELS_ERROR_GENERAL;
+
+            codec = (ServedCodec*)outbuf;
+            strcpy (codec->Backend, "lz4");
+            bool backendSet = false;
+
+            // Skip param[0] since it contains the method name
+            char** param = (char**)inbuf;
+            while (*++param)
+            {
+                size_t len = strlen(*param);
+                if (backendSet  ||  len == 0  ||  len >= SERVED_BACKEND_SIZE)  return CELS_ERROR_INVALID_COMPRESSOR;
+                for (size_t i=0; i<=len; i++)
+                    codec->Backend[i] = ((*param)[i]=='/'? CELS_METHOD_PARAMETERS_DELIMITER : (*param)[i]);
+                backendSet = true;
+            }
+            return sizeof(ServedCodec);
+        }
+
+    case CELS_UNPARSE:
+        {
+            char str[CELS_MAX_METHOD_STRING_SIZE];
+            int len = sprintf(str, "served");
+            if (strcmp(codec->Backend, "lz4")) {
+                size_t backendLen = strlen(codec->Backend);
+                if (len + 1 + backendLen >= sizeof(str))  return CELS_ERROR_GENERAL;
+                str[len++] = CELS_METHOD_PARAMETERS_DELIMITER;
+                for (size_t i=0; i<backendLen; i++)
+                    str[len++] = (codec->Backend[i]==CELS_METHOD_PARAMETERS_DELIMITER? '/' : codec->Backend[i]);
+                str[len] = '\0';
+            }
+
+            if (len >= outsize)  return CELS_ERROR_GENERAL;
+            strcpy ((char*)outbuf, str);
+            return CELS_OK;
+        }
+
+    case CELS_GET_COMPRESSION_MEMORY:
+    case CELS_GET_DECOMPRESSION_MEMORY:
+        return 2*SERVED_RING_SIZE;   // shared memory of the connection, while the backend memory is accounted by the daemon
+
+    case CELS_COMPRESS:
+    case CELS_DECOMPRESS:
+        if (inbuf || outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb)  return CELS_ERROR_GENERAL;
+        return CELS_SERVED_process(codec, service, ud,cb);
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+
+#ifdef CELS_REGISTER_CODECS
+static CelsResult dummy = CelsRegister ("served", NULL, ServedMain);
+#else
+// Loaded from DLL: register the codec under its own name, so CELS_LOAD_CODEC delivers Cels() to ServedMain
+CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (service == CELS_LOAD_MODULE)
+        return cb(NULL, CELS_REGISTER,0, (void*)"served",0, NULL,0, NULL,(CelsCallback0*)ServedMain);
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+#endif
@@ -0,0 +1,172 @@
+/*
+    Protocol of the "served" codec and cels-served daemon for CELS - Framework and standard API for compression algorithms
+    Copyright (C) 2021, Bulat Ziganshin <Bulat.Ziganshin@gmail.com>
+
+    MIT License (https://opensource.org/licenses/MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+
+    You can contact the author at:
+       - CELS repository: https://github.com/Bulat-Ziganshin/CELS
+*/
+
+// The "served" codec forwards CELS_COMPRESS/CELS_DECOMPRESS to the cels-served daemon, that keeps codecs loaded
+// and runs operations of all its clients in the single memory-governed thread pool (POSIX only).
+//
+// Each client connection owns a shared memory block passed to the daemon with the SCM_RIGHTS message on the
+// Unix socket. The block holds two rings of SERVED_RING_SIZE bytes: input data travel from the client to the daemon
+// in the first one, output data travel back in the second one. Only fixed-size ServedMsg messages go through
+// the socket itself: a chunk placed into the ring is announced with SERVED_DATA, and its space is returned
+// to the writer with SERVED_FREE once the reader has consumed it. Positions in the rings grow monotonically,
+// a chunk is always contiguous, so the writer skips the tail of the ring when the chunk doesn't fit there.
+//
+// Connection starts with SERVED_HELLO carrying the shared memory descriptor, and then serves operations one by one:
+//   client: SERVED_START(service, method length) + method string, then SERVED_DATA chunks of input
+//           terminated by the empty chunk, that is sent even when the operation finished early
+//   daemon: SERVED_DATA chunks of output, then SERVED_DONE(result)
+// Any error of socket I/O or callback breaks the connection, aborting the operation on the other side.
+
+#ifndef CELS_SERVED_H
+#define CELS_SERVED_H
+
+#ifdef _WIN32
+#error "served" codec and cels-served daemon require POSIX sockets and shared memory
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "CELS.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0     // SIGPIPE should be ignored by the application instead
+#endif
+
+const char SERVED_DEFAULT_SOCKET[] = "/tmp/cels-served.sock";  // overridden by CELS_SERVED_SOCKET environment variable
+const CelsNum SERVED_RING_SIZE = 4<<20;                 // each of the two rings in the shared memory
+const CelsNum SERVED_MAX_CHUNK = SERVED_RING_SIZE/4;    // larger writes are split into chunks of this size
+
+enum {SERVED_HELLO = 1, SERVED_START, SERVED_DATA, SERVED_FREE, SERVED_DONE};
+
+struct ServedMsg
+{
+    int32_t type;           // SERVED_*
+    int32_t reserved;
+    int64_t pos;            // DATA: ring position of the chunk; FREE: ring position consumed up to; START: service; DONE: result
+    int64_t size;           // DATA: chunk size, 0 = end of input; START: length of the method string; HELLO: ring size
+};
+
+// Writer side of the ring
+struct ServedRing
+{
+    char*   base;
+    CelsNum size;
+    CelsNum written;        // position of the next chunk
+    CelsNum freed;          // position up to which the reader has consumed data
+};
+
+// Find place for the chunk of len bytes, returning NULL if there is no free space yet
+static inline char* ServedRingReserve (ServedRing* ring, CelsNum len, CelsNum* pos)
+{
+    CelsNum start = ring->written,  offset = start % ring->size;
+    if (offset + len > ring->size)
+        start += ring->size - offset,  offset = 0;
+    if (start + len - ring->freed > ring->size)  return NULL;
+    *pos = start;
+    return ring->base + offset;
+}
+
+static inline bool ServedSendAll (int sock, const void* buf, size_t size)
+{
+    for (const char* p = (const char*)buf;  size > 0; ) {
+        ssize_t n = send (sock, p, size, MSG_NOSIGNAL);
+        if (n < 0  &&  errno == EINTR)  continue;
+        if (n <= 0)  return false;
+        p += n,  size -= n;
+    }
+    return true;
+}
+
+// Returns false on error or EOF
+static inline bool ServedRecvAll (int sock, void* buf, size_t size)
+{
+    for (char* p = (char*)buf;  size > 0; ) {
+        ssize_t n = recv (sock, p, size, 0);
+        if (n < 0  &&  errno == EINTR)  continue;
+        if (n <= 0)  return false;
+        p += n,  size -= n;
+    }
+    return true;
+}
+
+static inline bool ServedSend (int sock, int type, CelsNum pos, CelsNum size)
+{
+    ServedMsg msg = {type, 0, pos, size};
+    return ServedSendAll (sock, &msg, sizeof(msg));
+}
+
+// Send the message together with the file descriptor
+static inline bool ServedSendFd (int sock, const ServedMsg* msg, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {(void*)msg, sizeof(*msg)};
+    struct msghdr hdr;
+    memset (&hdr, 0, sizeof(hdr));
+    memset (control, 0, sizeof(control));
+    hdr.msg_iov = &iov;  hdr.msg_iovlen = 1;
+    hdr.msg_control = control;  hdr.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy (CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg (sock, &hdr, MSG_NOSIGNAL) == sizeof(*msg);
+}
+
+// Receive the message together with the file descriptor (-1 if there was none)
+static inline bool ServedRecvFd (int sock, ServedMsg* msg, int* fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {msg, sizeof(*msg)};
+    struct msghdr hdr;
+    memset (&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;  hdr.msg_iovlen = 1;
+    hdr.msg_control = control;  hdr.msg_controllen = sizeof(control);
+    *fd = -1;
+    ssize_t n;
+    while ((n = recvmsg (sock, &hdr, 0)) < 0  &&  errno == EINTR)
+        ;
+    if (n <= 0)  return false;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);  cmsg;  cmsg = CMSG_NXTHDR(&hdr, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET  &&  cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy (fd, CMSG_DATA(cmsg), sizeof(int));
+    return n == sizeof(*msg)  ||  ServedRecvAll (sock, (char*)msg + n, sizeof(*msg) - n);
+}
+
+static inline const char* ServedSocketPath()
+{
+    const char* path = getenv ("CELS_SERVED_SOCKET");
+    return (path && *path? path : SERVED_DEFAULT_SOCKET);
+}
+
+#endif // CELS_SERVED_H
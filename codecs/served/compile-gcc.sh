@@ -0,0 +1,8 @@
+#!/bin/sh
+# POSIX only: the codec relies on Unix sockets, shm_open and SCM_RIGHTS.
+# CelsLoad() doesn't load codec modules outside of Windows, so cels-served.o is linked into applications
+# compiled with CELS_REGISTER_CODECS, the same way the daemon links the codecs it serves.
+lib=../../lib
+set -e
+g++ -c -O3 -I$lib -DCELS_REGISTER_CODECS cels-served.cpp -o cels-served.o
+gcc -O3 -I$lib -DCELS_REGISTER_CODECS $lib/CELS.c cels-served-daemon.cpp ../lz4/cels-lz4.cpp ../lz4/lz4/lib/lz4hc.c ../lz4/lz4/lib/lz4frame.c ../lz4/lz4/lib/xxhash.c ../dedup/cels-dedup.cpp ../shuffle/cels-shuffle.cpp -lstdc++ -lpthread -lrt -o cels-served
@@ -0,0 +1,854 @@
+/*
+    Shuffle filter codec for CELS - Framework and standard API for compression algorithms
+    Copyright (C) 2021, Bulat Ziganshin <Bulat.Ziganshin@gmail.com>
+
+    MIT License (https://opensource.org/licenses/MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+
+    You can contact the author at:
+       - CELS repository: https://github.com/Bulat-Ziganshin/CELS
+*/
+
+// Method string: "shuffle[:eN][:d][:bits][:bN][:backend]", where
+//   eN      - element size in bytes (4 by default, up to 64)
+//   d       - replace elements with differences to the previous ones (for element sizes 1/2/4/8),
+//             so slowly changing integers like counters and timestamps turn into small numbers
+//   bits    - bitshuffle: transpose bits rather than bytes of elements
+//   bN      - size of stream blocks (256k by default, optional k/m/g suffix)
+//   backend - method compressing the shuffled data, with ':' inside of it written as '/', f.e. "lz4/a8".
+//             It's called through the Cels() pointer received at codec registration, so it can be
+//             any method registered in the application, as far as it supports memory buffer (de)compression.
+//             "lz4" by default, "store" disables the backend.
+//
+// Shuffling stores the first bytes of all elements, then the second bytes and so on, so similar
+// bytes of numeric arrays become neighbours and LZ compressors find much more matches.
+// Elements are processed in groups of SHUFFLE_GROUP, the data beyond the last full group are kept as is.
+// Kernels are chosen at runtime: AVX2 and SSE2 for element sizes 2/4/8/16 (and bitshuffle of any size),
+// scalar code otherwise.
+//
+// Compressed stream is a sequence of blocks, each one is represented by
+//   1 byte:  1 if the block was compressed by the backend, 0 if it's stored
+//   4 bytes: compressed size
+//   4 bytes: original size
+//   and then compressed data.
+// Memory buffer compression produces a single block without sizes, i.e. 1 byte followed by the data.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "CELS.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SHUFFLE_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHUFFLE_TARGET(isa)
+#else
+#include <cpuid.h>
+#define SHUFFLE_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+const int SHUFFLE_GROUP = 16;               // Elements are transformed in groups of this size
+const int SHUFFLE_HEADER_SIZE = 1+4+4;      // Block header: backend flag + compressed size + original size
+const int SHUFFLE_MAX_ELEMENT_SIZE = 64;
+const int SHUFFLE_BACKEND_SIZE = 256;       // Space for the backend method string in the parsed method
+const CelsNum SHUFFLE_DEFAULT_BLOCKSIZE = 256<<10;
+const CelsNum SHUFFLE_MIN_BLOCKSIZE = 4<<10;    // Limits for the block size set by the "b" parameter and memory limits
+const CelsNum SHUFFLE_MAX_BLOCKSIZE = 64<<20;
+
+// Cels() of the application, saved at codec registration
+static CelsCallback* CelsApi = NULL;
+
+// Structure representing the parsed codec
+struct ShuffleCodec
+{
+    int ElementSize;                        // size of array elements in bytes
+    int Delta;                              // 1: store differences between elements
+    int BitShuffle;                         // 1: transpose bits, 0: transpose bytes
+    CelsNum BlockSize;                      // size of stream blocks
+    char Backend[SHUFFLE_BACKEND_SIZE];     // method compressing the shuffled data (in the usual ':' notation), "" if none
+};
+
+
+// Parse memory size like "64k" or "1m" at str, storing pointer to the first char after the number into *end
+static CelsNum ShuffleParseSize (const char* str, char** end)
+{
+    CelsNum size = strtoll(str, end, 10);
+    if (*end == str)  return -1;
+    switch (**end)
+    {
+        case 'g': size <<= 10;  // fallthrough
+        case 'm': size <<= 10;  // fallthrough
+        case 'k': size <<= 10;  ++*end;
+    }
+    return size;
+}
+
+// Format memory size into the shortest form accepted by ShuffleParseSize
+static int ShuffleFormatSize (char* str, CelsNum size)
+{
+    static const char* suffix[] = {"", "k", "m", "g"};
+    int i = 0;
+    while (size >= 1024  &&  size % 1024 == 0  &&  i < 3)
+        size /= 1024,  i++;
+    return sprintf(str, "%lld%s", (long long) size, suffix[i]);
+}
+
+
+// *** Scalar kernels *******************************************************************************************************
+
+// Byte shuffle of n elements: byte k of element i goes to out[k*stride + i]
+static void ShuffleBytesScalar (const unsigned char* in, unsigned char* out, size_t n, size_t stride, size_t e)
+{
+    for (size_t k=0; k<e; k++)
+        for (size_t i=0; i<n; i++)
+            out[k*stride + i] = in[i*e + k];
+}
+
+static void UnshuffleBytesScalar (const unsigned char* in, unsigned char* out, size_t n, size_t stride, size_t e)
+{
+    for (size_t k=0; k<e; k++)
+        for (size_t i=0; i<n; i++)
+            out[i*e + k] = in[k*stride + i];
+}
+
+// Bit transposition of n bytes (multiple of 16): bit i of in[j] goes to the bit plane i, i.e. out[i*n/8 + j/8], bit j%8
+static void TransposeBitsScalar (const unsigned char* in, unsigned char* out, size_t n)
+{
+    size_t m = n/8;
+    for (size_t q=0; q<m; q++)
+        for (int i=0; i<8; i++) {
+            unsigned char b = 0;
+            for (int r=0; r<8; r++)
+                b |= ((in[8*q+r] >> i) & 1) << r;
+            out[i*m + q] = b;
+        }
+}
+
+static void UntransposeBitsScalar (const unsigned char* in, unsigned char* out, size_t n)
+{
+    size_t m = n/8;
+    for (size_t q=0; q<m; q++)
+        for (int r=0; r<8; r++) {
+            unsigned char b = 0;
+            for (int i=0; i<8; i++)
+                b |= ((in[i*m + q] >> r) & 1) << i;
+            out[8*q+r] = b;
+        }
+}
+
+
+// *** SIMD kernels *********************************************************************************************************
+// Byte shuffle of 2^K-byte elements is K rounds of splitting pairs of vectors into their even and odd bytes.
+// After K rounds, vector k holds k-th bytes of the elements. Unshuffle applies the inverse interleaving K times.
+
+#ifdef SHUFFLE_X86
+SHUFFLE_TARGET("sse2")
+static inline __m128i ShuffleEven (__m128i a, __m128i b)
+{
+    __m128i mask = _mm_set1_epi16 (0xFF);
+    return _mm_packus_epi16 (_mm_and_si128 (a, mask), _mm_and_si128 (b, mask));
+}
+
+SHUFFLE_TARGET("sse2")
+static inline __m128i ShuffleOdd (__m128i a, __m128i b)
+{
+    return _mm_packus_epi16 (_mm_srli_epi16 (a, 8), _mm_srli_epi16 (b, 8));
+}
+
+template <int E>
+SHUFFLE_TARGET("sse2")
+static void ShuffleBytesSse2 (const unsigned char* in, unsigned char* out, size_t n, size_t stride)
+{
+    for (size_t i = 0;  i+16 <= n;  i += 16)
+    {
+        __m128i v[E], t[E];
+        for (int k=0; k<E; k++)
+            v[k] = _mm_loadu_si128 ((const __m128i*)(in + i*E + 16*k));
+        for (int round = E;  round > 1;  round /= 2) {
+            for (int j=0; j<E/2; j++)
+                t[j] = ShuffleEven (v[2*j], v[2*j+1]),  t[j+E/2] = ShuffleOdd (v[2*j], v[2*j+1]);
+            for (int k=0; k<E; k++)
+                v[k] = t[k];
+        }
+        for (int k=0; k<E; k++)
+            _mm_storeu_si128 ((__m128i*)(out + k*stride + i), v[k]);
+    }
+}
+
+template <int E>
+SHUFFLE_TARGET("sse2")
+static void UnshuffleBytesSse2 (const unsigned char* in, unsigned char* out, size_t n, size_t stride)
+{
+    for (size_t i = 0;  i+16 <= n;  i += 16)
+    {
+        __m128i v[E], t[E];
+        for (int k=0; k<E; k++)
+            v[k] = _mm_loadu_si128 ((const __m128i*)(in + k*stride + i));
+        for (int round = E;  round > 1;  round /= 2) {
+            for (int j=0; j<E/2; j++)
+                t[2*j] = _mm_unpacklo_epi8 (v[j], v[j+E/2]),  t[2*j+1] = _mm_unpackhi_epi8 (v[j], v[j+E/2]);
+            for (int k=0; k<E; k++)
+                v[k] = t[k];
+        }
+        for (int k=0; k<E; k++)
+            _mm_storeu_si128 ((__m128i*)(out + i*E + 16*k), v[k]);
+    }
+}
+
+// AVX2 pack/unpack work inside 128-bit lanes, so the results are fixed up by cross-lane permutes
+SHUFFLE_TARGET("avx2")
+static inline __m256i ShuffleEven256 (__m256i a, __m256i b)
+{
+    __m256i mask = _mm256_set1_epi16 (0xFF);
+    return _mm256_permute4x64_epi64 (_mm256_packus_epi16 (_mm256_and_si256 (a, mask), _mm256_and_si256 (b, mask)), 0xD8);
+}
+
+SHUFFLE_TARGET("avx2")
+static inline __m256i ShuffleOdd256 (__m256i a, __m256i b)
+{
+    return _mm256_permute4x64_epi64 (_mm256_packus_epi16 (_mm256_srli_epi16 (a, 8), _mm256_srli_epi16 (b, 8)), 0xD8);
+}
+
+template <int E>
+SHUFFLE_TARGET("avx2")
+static void ShuffleBytesAvx2 (const unsigned char* in, unsigned char* out, size_t n, size_t stride)
+{
+    size_t i = 0;
+    for (;  i+32 <= n;  i += 32)
+    {
+        __m256i v[E], t[E];
+        for (int k=0; k<E; k++)
+            v[k] = _mm256_loadu_si256 ((const __m256i*)(in + i*E + 32*k));
+        for (int round = E;  round > 1;  round /= 2) {
+            for (int j=0; j<E/2; j++)
+                t[j] = ShuffleEven256 (v[2*j], v[2*j+1]),  t[j+E/2] = ShuffleOdd256 (v[2*j], v[2*j+1]);
+            for (int k=0; k<E; k++)
+                v[k] = t[k];
+        }
+        for (int k=0; k<E; k++)
+            _mm256_storeu_si256 ((__m256i*)(out + k*stride + i), v[k]);
+    }
+    ShuffleBytesSse2<E> (in + i*E, out + i, n-i, stride);
+}
+
+template <int E>
+SHUFFLE_TARGET("avx2")
+static void UnshuffleBytesAvx2 (const unsigned char* in, unsigned char* out, size_t n, size_t stride)
+{
+    size_t i = 0;
+    for (;  i+32 <= n;  i += 32)
+    {
+        __m256i v[E], t[E];
+        for (int k=0; k<E; k++)
+            v[k] = _mm256_loadu_si256 ((const __m256i*)(in + k*stride + i));
+        for (int round = E;  round > 1;  round /= 2) {
+            for (int j=0; j<E/2; j++) {
+                __m256i lo = _mm256_unpacklo_epi8 (v[j], v[j+E/2]),  hi = _mm256_unpackhi_epi8 (v[j], v[j+E/2]);
+                t[2*j]   = _mm256_permute2x128_si256 (lo, hi, 0x20);
+                t[2*j+1] = _mm256_permute2x128_si256 (lo, hi, 0x31);
+            }
+            for (int k=0; k<E; k++)
+                v[k] = t[k];
+        }
+        for (int k=0; k<E; k++)
+            _mm256_storeu_si256 ((__m256i*)(out + i*E + 32*k), v[k]);
+    }
+    UnshuffleBytesSse2<E> (in + i, out + i*E, n-i, stride);
+}
+
+// Bit transposition with MOVEMASK collecting the top bits of all bytes at once
+SHUFFLE_TARGET("sse2")
+static void TransposeBitsSse2 (const unsigned char* in, unsigned char* out, size_t n)
+{
+    size_t m = n/8;
+    for (size_t j = 0;  j+16 <= n;  j += 16)
+    {
+        __m128i v = _mm_loadu_si128 ((const __m128i*)(in + j));
+        for (int i=7; i>=0; i--) {
+            uint16_t bits = (uint16_t) _mm_movemask_epi8 (v);
+            memcpy (out + i*m + j/8, &bits, 2);
+            v = _mm_add_epi8 (v, v);
+        }
+    }
+}
+
+// 16 output bytes need two bytes of every bit plane. Gathered into the vector as low bytes
+// followed by high bytes, they are transposed by MOVEMASK in the same way
+SHUFFLE_TARGET("sse2")
+static void UntransposeBitsSse2 (const unsigned char* in, unsigned char* out, size_t n)
+{
+    size_t m = n/8;
+    for (size_t j = 0;  j+16 <= n;  j += 16)
+    {
+        uint16_t w[8];
+        for (int i=0; i<8; i++)
+            memcpy (&w[i], in + i*m + j/8, 2);
+        __m128i v = _mm_set_epi16 (w[7], w[6], w[5], w[4], w[3], w[2], w[1], w[0]);
+        v = _mm_unpacklo_epi64 (ShuffleEven (v, _mm_setzero_si128()), ShuffleOdd (v, _mm_setzero_si128()));
+        for (int r=7; r>=0; r--) {
+            uint16_t bits = (uint16_t) _mm_movemask_epi8 (_mm_slli_epi16 (v, 7-r));
+            out[j+r]   = (unsigned char) bits;
+            out[j+8+r] = (unsigned char) (bits >> 8);
+        }
+    }
+}
+
+SHUFFLE_TARGET("avx2")
+static void TransposeBitsAvx2 (const unsigned char* in, unsigned char* out, size_t n)
+{
+    size_t m = n/8,  j = 0;
+    for (;  j+32 <= n;  j += 32)
+    {
+        __m256i v = _mm256_loadu_si256 ((const __m256i*)(in + j));
+        for (int i=7; i>=0; i--) {
+            uint32_t bits = (uint32_t) _mm256_movemask_epi8 (v);
+            memcpy (out + i*m + j/8, &bits, 4);
+            v = _mm256_add_epi8 (v, v);
+        }
+    }
+    if (j < n) {   // the last 16 bytes
+        __m128i v = _mm_loadu_si128 ((const __m128i*)(in + j));
+        for (int i=7; i>=0; i--) {
+            uint16_t bits = (uint16_t) _mm_movemask_epi8 (v);
+            memcpy (out + i*m + j/8, &bits, 2);
+            v = _mm_add_epi8 (v, v);
+        }
+    }
+}
+
+static void ShuffleCpuid (unsigned leaf, unsigned regs[4])
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex (r, leaf, 0);
+    for (int i=0; i<4; i++)  regs[i] = r[i];
+#else
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    if (__get_cpuid_max (0, NULL) >= leaf)
+        __cpuid_count (leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// 2: AVX2, 1: SSE2, 0: neither
+static int ShuffleSimdLevel()
+{
+    unsigned leaf1[4],  leaf7[4];
+    ShuffleCpuid (1, leaf1);
+    ShuffleCpuid (7, leaf7);
+    bool sse2 = (leaf1[3] >> 26) & 1;
+    bool avx  = ((leaf1[2] >> 27) & 1)  &&  ((leaf1[2] >> 28) & 1);
+    if (avx) {   // check OS support for saving the AVX state
+#ifdef _MSC_VER
+        avx = (_xgetbv(0) & 6) == 6;
+#else
+        unsigned lo, hi;
+        __asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        avx = (lo & 6) == 6;
+#endif
+    }
+    if (avx  &&  ((leaf7[1] >> 5) & 1))  return 2;
+    return (sse2? 1 : 0);
+}
+#endif // SHUFFLE_X86
+
+
+// *** Dispatchers **********************************************************************************************************
+
+static int ShuffleLevel()
+{
+#ifdef SHUFFLE_X86
+    static const int level = ShuffleSimdLevel();
+    return level;
+#else
+    return 0;
+#endif
+}
+
+static void ShuffleBytes (const unsigned char* in, unsigned char* out, size_t n, size_t e)
+{
+#ifdef SHUFFLE_X86
+    int level = ShuffleLevel();
+    if (level == 2) {
+        if (e == 2)   {ShuffleBytesAvx2<2>  (in, out, n, n);  return;}
+        if (e == 4)   {ShuffleBytesAvx2<4>  (in, out, n, n);  return;}
+        if (e == 8)   {ShuffleBytesAvx2<8>  (in, out, n, n);  return;}
+        if (e == 16)  {ShuffleBytesAvx2<16> (in, out, n, n);  return;}
+    }
+    if (level >= 1) {
+        if (e == 2)   {ShuffleBytesSse2<2>  (in, out, n, n);  return;}
+        if (e == 4)   {ShuffleBytesSse2<4>  (in, out, n, n);  return;}
+        if (e == 8)   {ShuffleBytesSse2<8>  (in, out, n, n);  return;}
+        if (e == 16)  {ShuffleBytesSse2<16> (in, out, n, n);  return;}
+    }
+#endif
+    ShuffleBytesScalar (in, out, n, n, e);
+}
+
+static void UnshuffleBytes (const unsigned char* in, unsigned char* out, size_t n, size_t e)
+{
+#ifdef SHUFFLE_X86
+    int level = ShuffleLevel();
+    if (level == 2) {
+        if (e == 2)   {UnshuffleBytesAvx2<2>  (in, out, n, n);  return;}
+        if (e == 4)   {UnshuffleBytesAvx2<4>  (in, out, n, n);  return;}
+        if (e == 8)   {UnshuffleBytesAvx2<8>  (in, out, n, n);  return;}
+        if (e == 16)  {UnshuffleBytesAvx2<16> (in, out, n, n);  return;}
+    }
+    if (level >= 1) {
+        if (e == 2)   {UnshuffleBytesSse2<2>  (in, out, n, n);  return;}
+        if (e == 4)   {UnshuffleBytesSse2<4>  (in, out, n, n);  return;}
+        if (e == 8)   {UnshuffleBytesSse2<8>  (in, out, n, n);  return;}
+        if (e == 16)  {UnshuffleBytesSse2<16> (in, out, n, n);  return;}
+    }
+#endif
+    UnshuffleBytesScalar (in, out, n, n, e);
+}
+
+static void TransposeBits (const unsigned char* in, unsigned char* out, size_t n)
+{
+#ifdef SHUFFLE_X86
+    int level = ShuffleLevel();
+    if (level == 2)  {TransposeBitsAvx2 (in, out, n);  return;}
+    if (level == 1)  {TransposeBitsSse2 (in, out, n);  return;}
+#endif
+    TransposeBitsScalar (in, out, n);
+}
+
+static void UntransposeBits (const unsigned char* in, unsigned char* out, size_t n)
+{
+#ifdef SHUFFLE_X86
+    if (ShuffleLevel() >= 1)  {UntransposeBitsSse2 (in, out, n);  return;}
+#endif
+    UntransposeBitsScalar (in, out, n);
+}
+
+// Differences between little-endian integer elements, the first element is kept as is
+template <typename T>
+static void DeltaEncode (const unsigned char* in, unsigned char* out, size_t n)
+{
+    T prev = 0;
+    for (size_t i=0; i<n; i++) {
+        T x;
+        memcpy (&x, in + i*sizeof(T), sizeof(T));
+        T d = (T)(x - prev);
+        memcpy (out + i*sizeof(T), &d, sizeof(T));
+        prev = x;
+    }
+}
+
+template <typename T>
+static void DeltaDecode (unsigned char* buf, size_t n)
+{
+    T prev = 0;
+    for (size_t i=0; i<n; i++) {
+        T d;
+        memcpy (&d, buf + i*sizeof(T), sizeof(T));
+        prev = (T)(prev + d);
+        memcpy (buf + i*sizeof(T), &prev, sizeof(T));
+    }
+}
+
+static void ShuffleDelta (const unsigned char* in, unsigned char* out, size_t n, size_t e)
+{
+    if (e == 1)  DeltaEncode<uint8_t>  (in, out, n);
+    if (e == 2)  DeltaEncode<uint16_t> (in, out, n);
+    if (e == 4)  DeltaEncode<uint32_t> (in, out, n);
+    if (e == 8)  DeltaEncode<uint64_t> (in, out, n);
+}
+
+static void UnshuffleDelta (unsigned char* buf, size_t n, size_t e)
+{
+    if (e == 1)  DeltaDecode<uint8_t>  (buf, n);
+    if (e == 2)  DeltaDecode<uint16_t> (buf, n);
+    if (e == 4)  DeltaDecode<uint32_t> (buf, n);
+    if (e == 8)  DeltaDecode<uint64_t> (buf, n);
+}
+
+
+// *** Filter ***************************************************************************************************************
+
+// Transform (in,size) into out, using tmp of the same size as the scratch space for delta and bitshuffle
+static void ShuffleForward (ShuffleCodec* codec, const unsigned char* in, unsigned char* out, unsigned char* tmp, size_t size)
+{
+    size_t e = codec->ElementSize;
+    size_t n = size / (SHUFFLE_GROUP*e) * SHUFFLE_GROUP;   // elements to transform
+    if (n) {
+        if (codec->Delta && codec->BitShuffle) {
+            ShuffleDelta (in, out, n, e);
+            ShuffleBytes (out, tmp, n, e);
+            for (size_t k=0; k<e; k++)  TransposeBits (tmp + k*n, out + k*n, n);
+        } else if (codec->Delta) {
+            ShuffleDelta (in, tmp, n, e);
+            ShuffleBytes (tmp, out, n, e);
+        } else if (codec->BitShuffle) {
+            ShuffleBytes (in, tmp, n, e);
+            for (size_t k=0; k<e; k++)  TransposeBits (tmp + k*n, out + k*n, n);
+        } else {
+            ShuffleBytes (in, out, n, e);
+        }
+    }
+    memcpy (out + n*e, in + n*e, size - n*e);
+}
+
+static void ShuffleBackward (ShuffleCodec* codec, const unsigned char* in, unsigned char* out, unsigned char* tmp, size_t size)
+{
+    size_t e = codec->ElementSize;
+    size_t n = size / (SHUFFLE_GROUP*e) * SHUFFLE_GROUP;
+    if (n) {
+        if (codec->BitShuffle) {
+            for (size_t k=0; k<e; k++)  UntransposeBits (in + k*n, tmp + k*n, n);
+            UnshuffleBytes (tmp, out, n, e);
+        } else {
+            UnshuffleBytes (in, out, n, e);
+        }
+        if (codec->Delta)  UnshuffleDelta (out, n, e);
+    }
+    memcpy (out + n*e, in + n*e, size - n*e);
+}
+
+// Compress the shuffled data with the backend into (out,size). Returns the compressed size or 0 if the data should be stored
+static CelsResult ShuffleCompressBackend (char* parsed, const unsigned char* in, CelsNum size, unsigned char* out)
+{
+    if (!parsed  ||  size == 0)  return 0;
+    CelsResult compressedSize = CelsApi (parsed, CELS_COMPRESS,0, (void*)in,size, out,size, NULL,NULL);
+    return (compressedSize >= CELS_OK  &&  compressedSize < size?  compressedSize : 0);
+}
+
+static CelsResult ShuffleParseBackend (ShuffleCodec* codec, char* parsed)
+{
+    CelsResult result = CelsApi (codec->Backend, CELS_PARSE,0, NULL,0, parsed,CELS_MAX_PARSED_METHOD_SIZE, NULL,NULL);
+    return (result < CELS_OK? result : CELS_OK);
+}
+
+static void ShuffleFreeBackend (char* parsed)
+{
+    CelsApi (parsed, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback0*)CelsApi);
+}
+
+
+// Read the buffer entirely unless EOF is reached
+static CelsResult ShuffleReadFull (void* buf, CelsNum size, void* ud, CelsCallback* cb)
+{
+    CelsNum done = 0;
+    while (done < size) {
+        CelsResult result = CelsRead(cb,ud, (char*)buf + done, size - done);
+        if (result < CELS_OK)  return result;
+        if (result == 0)  break;
+        done += result;
+    }
+    return done;
+}
+
+// Stream compression employing callbacks for I/O
+CelsResult CELS_SHUFFLE_compress (ShuffleCodec* codec, void* ud, CelsCallback* cb)
+{
+    size_t parsedSize = (codec->Backend[0]? CELS_MAX_PARSED_METHOD_SIZE : 0);
+    size_t bs = (size_t) codec->BlockSize;
+    char* buf = (char*) CelsMemAlloc(cb,ud, parsedSize + 3*bs + SHUFFLE_HEADER_SIZE + bs);
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* parsed = buf;
+    unsigned char* origBuf = (unsigned char*) parsed + parsedSize;
+    unsigned char* shuffled = origBuf + bs;
+    unsigned char* tmp = shuffled + bs;
+    unsigned char* compressedBuf = tmp + bs;
+
+    CelsResult errcode = (parsedSize? ShuffleParseBackend (codec, parsed) : CELS_OK);
+    if (errcode < CELS_OK)  {CelsMemFree(cb,ud, buf);  return errcode;}
+
+    for(;;)
+    {
+        CelsResult origSize = ShuffleReadFull (origBuf, bs, ud,cb);
+        if (origSize <= 0)  CELS_RETURN(origSize);
+
+        ShuffleForward (codec, origBuf, shuffled, tmp, origSize);
+        CelsResult compressedSize = ShuffleCompressBackend (parsedSize? parsed : NULL, shuffled, origSize, compressedBuf + SHUFFLE_HEADER_SIZE);
+        if (compressedSize == 0)
+            memcpy (compressedBuf + SHUFFLE_HEADER_SIZE, shuffled, origSize),  compressedSize = origSize;
+
+        compressedBuf[0] = (compressedSize < origSize);
+        CelsSerializeInt (compressedSize, (char*)compressedBuf+1, 4);
+        CelsSerializeInt (origSize,       (char*)compressedBuf+5, 4);
+        CELS_WRITE_EXACTLY(compressedBuf, SHUFFLE_HEADER_SIZE + compressedSize);
+    }
+
+finished:
+    if (parsedSize)  ShuffleFreeBackend (parsed);
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+// Stream decompression employing callbacks for I/O
+CelsResult CELS_SHUFFLE_decompress (ShuffleCodec* codec, void* ud, CelsCallback* cb)
+{
+    size_t parsedSize = (codec->Backend[0]? CELS_MAX_PARSED_METHOD_SIZE : 0);
+    size_t bs = (size_t) codec->BlockSize;
+    char* buf = (char*) CelsMemAlloc(cb,ud, parsedSize + 4*bs);
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* parsed = buf;
+    unsigned char* origBuf = (unsigned char*) parsed + parsedSize;
+    unsigned char* shuffled = origBuf + bs;
+    unsigned char* tmp = shuffled + bs;
+    unsigned char* compressedBuf = tmp + bs;
+
+    CelsResult errcode = (parsedSize? ShuffleParseBackend (codec, parsed) : CELS_OK);
+    if (errcode < CELS_OK)  {CelsMemFree(cb,ud, buf);  return errcode;}
+
+    for(;;)
+    {
+        char header[SHUFFLE_HEADER_SIZE];
+        CELS_READ_EXACTLY_OR_EOF(header, SHUFFLE_HEADER_SIZE);
+
+        int compressedBlock = header[0];
+        CelsResult compressedSize = CelsDeserializeInt(header+1, 4);
+        CelsResult origSize       = CelsDeserializeInt(header+5, 4);
+        if (compressedBlock > 1  ||  (compressedBlock && !parsedSize)  ||  (!compressedBlock && compressedSize != origSize)
+            ||  origSize > (CelsResult)bs  ||  compressedSize > origSize)
+            CELS_RETURN(CELS_ERROR_BAD_COMPRESSED_DATA);
+
+        if (compressedBlock) {
+            CELS_READ_EXACTLY(compressedBuf, compressedSize);
+            CelsResult result = CelsApi (parsed, CELS_DECOMPRESS,0, compressedBuf,compressedSize, shuffled,origSize, NULL,NULL);
+            if (result != origSize)  CELS_RETURN2(result, CELS_ERROR_BAD_COMPRESSED_DATA);
+        } else {
+            CELS_READ_EXACTLY(shuffled, origSize);
+        }
+
+        ShuffleBackward (codec, shuffled, origBuf, tmp, origSize);
+        CELS_WRITE_EXACTLY(origBuf, origSize);
+    }
+
+finished:
+    if (parsedSize)  ShuffleFreeBackend (parsed);
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+// Memory buffer compression: a single block with 1-byte header, transformed directly into the outbuf when stored
+CelsResult CELS_SHUFFLE_compress_membuf (ShuffleCodec* codec, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (outsize < insize+1)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+    size_t parsedSize = (codec->Backend[0]? CELS_MAX_PARSED_METHOD_SIZE : 0);
+    char* buf = (char*) CelsMemAlloc(cb,ud, parsedSize + 2*insize + 1);
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* parsed = buf;
+    unsigned char* shuffled = (unsigned char*) parsed + parsedSize;
+    unsigned char* tmp = shuffled + insize;
+    unsigned char* out = (unsigned char*) outbuf;
+
+    CelsResult errcode = (parsedSize? ShuffleParseBackend (codec, parsed) : CELS_OK);
+    if (errcode >= CELS_OK) {
+        ShuffleForward (codec, (unsigned char*)inbuf, (parsedSize? shuffled : out+1), tmp, insize);
+        CelsResult compressedSize = ShuffleCompressBackend (parsedSize? parsed : NULL, shuffled, insize, out+1);
+        if (parsedSize && compressedSize == 0)
+            memcpy (out+1, shuffled, insize);
+        out[0] = (compressedSize > 0);
+        errcode = 1 + (compressedSize > 0? compressedSize : insize);
+        if (parsedSize)  ShuffleFreeBackend (parsed);
+    }
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+CelsResult CELS_SHUFFLE_decompress_membuf (ShuffleCodec* codec, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    unsigned char* in = (unsigned char*) inbuf;
+    if (insize < 1  ||  in[0] > 1  ||  (in[0] && !codec->Backend[0]))  return CELS_ERROR_BAD_COMPRESSED_DATA;
+    if (!in[0]  &&  outsize < insize-1)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+
+    size_t parsedSize = (in[0]? CELS_MAX_PARSED_METHOD_SIZE : 0);
+    size_t shuffledSize = (in[0]? outsize : 0);
+    size_t tmpSize = (codec->BitShuffle? (in[0]? outsize : insize-1) : 0);
+    char* buf = (char*) CelsMemAlloc(cb,ud, parsedSize + shuffledSize + tmpSize + 1);
+    if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* parsed = buf;
+    unsigned char* shuffled = (unsigned char*) parsed + parsedSize;
+    unsigned char* tmp = shuffled + shuffledSize;
+
+    CelsResult errcode = CELS_OK;
+    if (in[0]) {
+        errcode = ShuffleParseBackend (codec, parsed);
+        if (errcode >= CELS_OK) {
+            errcode = CelsApi (parsed, CELS_DECOMPRESS,0, in+1,insize-1, shuffled,outsize, NULL,NULL);
+            if (errcode >= CELS_OK)  ShuffleBackward (codec, shuffled, (unsigned char*)outbuf, tmp, errcode);
+            ShuffleFreeBackend (parsed);
+        }
+    } else {
+        ShuffleBackward (codec, in+1, (unsigned char*)outbuf, tmp, insize-1);
+        errcode = insize-1;
+    }
+    CelsMemFree(cb,ud, buf);
+    return errcode;
+}
+
+
+static CelsNum ShuffleMemoryUsage (ShuffleCodec* codec, bool compression, CelsNum blocksize)
+{
+    CelsNum backend = 0;
+    if (codec->Backend[0]) {
+        backend = CELS_MAX_PARSED_METHOD_SIZE;
+        CelsResult mem = (CelsApi?  CelsApi (codec->Backend, compression? CELS_GET_COMPRESSION_MEMORY : CELS_GET_DECOMPRESSION_MEMORY,0, NULL,0, NULL,0, NULL,NULL) : 0);
+        if (mem > 0)  backend += mem;
+    }
+    return 4*blocksize + (compression? SHUFFLE_HEADER_SIZE : 0) + backend;
+}
+
+static CelsResult __cdecl ShuffleMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    ShuffleCodec *codec = (ShuffleCodec*)self;
+
+    switch (service)
+    {
+    case CELS_LOAD_CODEC:
+        CelsApi = cb;
+        return CELS_OK;
+
+    case CELS_PARSE:
+        {
+            if (outsize < (CelsNum)sizeof(ShuffleCodec))  return CELS_ERROR_GENERAL;
+
+            codec = (ShuffleCodec*)outbuf;
+            codec->ElementSize = 4;
+            codec->Delta = 0;
+            codec->BitShuffle = 0;
+            codec->BlockSize = SHUFFLE_DEFAULT_BLOCKSIZE;
+            strcpy (codec->Backend, "lz4");
+            bool backendSet = false;
+
+            // Skip param[0] since it contains the method name
+            char** param = (char**)inbuf;
+            while (*++param)
+            {
+                char* end;
+                if (!strcmp(*param,"d"))     {codec->Delta = 1;       continue;}
+                if (!strcmp(*param,"bits"))  {codec->BitShuffle = 1;  continue;}
+                if (**param=='e'  &&  isdigit((unsigned char)(*param)[1]))  {codec->ElementSize = strtol(*param+1, &end, 10);  if (*end || codec->ElementSize < 1 || codec->ElementSize > SHUFFLE_MAX_ELEMENT_SIZE)  return CELS_ERROR_INVALID_COMPRESSOR;  continue;}
+                if (**param=='b'  &&  isdigit((unsigned char)(*param)[1]))  {CelsNum size = ShuffleParseSize(*param+1, &end);  if (*end || size < SHUFFLE_MIN_BLOCKSIZE || size > SHUFFLE_MAX_BLOCKSIZE)  return CELS_ERROR_INVALID_COMPRESSOR;  codec->BlockSize = size;  continue;}
+
+                // Anything else is the backend method
+                size_t len = strlen(*param);
+                if (backendSet  ||  len >= SHUFFLE_BACKEND_SIZE)  return CELS_ERROR_INVALID_COMPRESSOR;
+                for (size_t i=0; i<=len; i++)
+                    codec->Backend[i] = ((*param)[i]=='/'? CELS_METHOD_PARAMETERS_DELIMITER : (*param)[i]);
+                if (!strcmp(codec->Backend, "store"))
+                    codec->Backend[0] = '\0';
+                backendSet = true;
+            }
+            int e = codec->ElementSize;
+            if (codec->Delta  &&  e != 1  &&  e != 2  &&  e != 4  &&  e != 8)
+                return CELS_ERROR_INVALID_COMPRESSOR;
+            return sizeof(ShuffleCodec);
+        }
+
+    case CELS_UNPARSE:
+        {
+            char str[CELS_MAX_METHOD_STRING_SIZE];
+            int len = sprintf(str, "shuffle");
+            if (codec->ElementSize != 4)  len += sprintf(str+len, ":e%d", codec->ElementSize);
+            if (codec->Delta)             len += sprintf(str+len, ":d");
+            if (codec->BitShuffle)        len += sprintf(str+len, ":bits");
+            if (codec->BlockSize != SHUFFLE_DEFAULT_BLOCKSIZE)  len += sprintf(str+len, ":b"),  len += ShuffleFormatSize(str+len, codec->BlockSize);
+
+            if (!codec->Backend[0]) {
+                len += sprintf(str+len, ":store");
+            } else if (strcmp(codec->Backend, "lz4")) {
+                size_t backendLen = strlen(codec->Backend);
+                if (len + 1 + backendLen >= sizeof(str))  return CELS_ERROR_GENERAL;
+                str[len++] = CELS_METHOD_PARAMETERS_DELIMITER;
+                for (size_t i=0; i<backendLen; i++)
+                    str[len++] = (codec->Backend[i]==CELS_METHOD_PARAMETERS_DELIMITER? '/' : codec->Backend[i]);
+                str[len] = '\0';
+            }
+
+            if (len >= outsize)  return CELS_ERROR_GENERAL;
+            strcpy ((char*)outbuf, str);
+            return CELS_OK;
+        }
+
+    case CELS_GET_MAX_COMPRESSED_SIZE:
+        return insize + (insize / codec->BlockSize + 1) * SHUFFLE_HEADER_SIZE;
+
+    case CELS_GET_COMPRESSION_MEMORY:
+    case CELS_GET_DECOMPRESSION_MEMORY:
+        return ShuffleMemoryUsage (codec, service==CELS_GET_COMPRESSION_MEMORY, codec->BlockSize);
+
+    case CELS_GET_MINIMUM_COMPRESSION_MEMORY:
+    case CELS_GET_MINIMUM_DECOMPRESSION_MEMORY:
+        return ShuffleMemoryUsage (codec, service==CELS_GET_MINIMUM_COMPRESSION_MEMORY, SHUFFLE_MIN_BLOCKSIZE);
+
+    case CELS_SET_COMPRESSION_MEMORY:
+    case CELS_SET_DECOMPRESSION_MEMORY:
+        {
+            // Find the largest block size fitting into the memory limit.
+            // The same block size is used by the decompressor, so both limits are simultaneously reduced
+            CelsNum blocksize = codec->BlockSize;
+            while (blocksize/2 >= SHUFFLE_MIN_BLOCKSIZE  &&  ShuffleMemoryUsage(codec, service==CELS_SET_COMPRESSION_MEMORY, blocksize) > insize)
+                blocksize /= 2;
+            codec->BlockSize = blocksize;
+            return CELS_OK;
+        }
+
+    case CELS_GET_BLOCKSIZE:
+        return codec->BlockSize;
+
+    case CELS_SET_BLOCKSIZE:
+        codec->BlockSize = (insize < SHUFFLE_MIN_BLOCKSIZE? SHUFFLE_MIN_BLOCKSIZE :
+                            insize > SHUFFLE_MAX_BLOCKSIZE? SHUFFLE_MAX_BLOCKSIZE : insize);
+        return CELS_OK;
+
+    case CELS_COMPRESS:
+        if (codec->Backend[0] && !CelsApi)  return CELS_ERROR_GENERAL;
+        if (inbuf && outbuf)    return CELS_SHUFFLE_compress_membuf(codec, inbuf,insize, outbuf,outsize, ud,cb);
+        if (inbuf || outbuf)    return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb)                return CELS_ERROR_GENERAL;
+        return CELS_SHUFFLE_compress(codec, ud,cb);
+
+    case CELS_DECOMPRESS:
+        if (codec->Backend[0] && !CelsApi)  return CELS_ERROR_GENERAL;
+        if (inbuf && outbuf)    return CELS_SHUFFLE_decompress_membuf(codec, inbuf,insize, outbuf,outsize, ud,cb);
+        if (inbuf || outbuf)    return CELS_ERROR_NOT_IMPLEMENTED;
+        if (!cb)                return CELS_ERROR_GENERAL;
+        return CELS_SHUFFLE_decompress(codec, ud,cb);
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+
+#ifdef CELS_REGISTER_CODECS
+static CelsResult dummy = CelsRegister ("shuffle", NULL, ShuffleMain);
+#else
+// Loaded from DLL: register the codec under its own name, so CELS_LOAD_CODEC delivers Cels() to ShuffleMain
+CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (service == CELS_LOAD_MODULE)
+        return cb(NULL, CELS_REGISTER,0, (void*)"shuffle",0, NULL,0, NULL,(CelsCallback0*)ShuffleMain);
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+#endif
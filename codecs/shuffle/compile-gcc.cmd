@@ -0,0 +1,4 @@
+@set lib=../../lib
+gcc -c -O3 -I%lib% cels-shuffle.cpp
+dllwrap --driver-name c++ cels-shuffle.o -def %lib%/CELS.def -s -o cels-shuffle.dll
+@del *.o
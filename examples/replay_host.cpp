@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CELS.h"
+
+// Record callback traffic of the stream (de)compression of a file, then replay it offline against any method:
+//   replay_host record [-x] [-d] METHOD INFILE OUTFILE RECORDING
+//   replay_host replay [-m METHOD] [-i INFILE] [-s SCALE] RECORDING
+
+CelsResult __cdecl ReadWrite (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    FILE** files = (FILE**)self;
+    switch(service)
+    {
+        case CELS_READ:   return fread ( inbuf, 1,  insize, files[0]);
+        case CELS_WRITE:  return fwrite(outbuf, 1, outsize, files[1]);
+        default:          return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+static int Usage()
+{
+    printf("Usage: replay_host record [-x] [-d] METHOD INFILE OUTFILE RECORDING\n"
+           "         -x: decompress instead of compress, -d: store input data in the recording\n"
+           "       replay_host replay [-m METHOD] [-i INFILE] [-s SCALE] RECORDING\n"
+           "         replay with another method or input, waiting SCALE * recorded host time (default 1, 0 - no waits)\n");
+    return 1;
+}
+
+static int Record (int argc, char **argv)
+{
+    int service = CELS_COMPRESS,  flags = 0;
+    for (; argc > 0  &&  argv[0][0] == '-';  argc--, argv++) {
+        if      (!strcmp(argv[0], "-x"))  service = CELS_DECOMPRESS;
+        else if (!strcmp(argv[0], "-d"))  flags |= CELS_RECORD_DATA;
+        else return Usage();
+    }
+    if (argc != 4)  return Usage();
+
+    FILE* files[2] = {fopen(argv[1], "rb"), fopen(argv[2], "wb")};
+    if (files[0] == NULL  ||  files[1] == NULL)  {printf("Can't open %s or %s\n", argv[1], argv[2]); return 2;}
+
+    CelsRecorder* recorder;
+    CelsResult result = CelsRecorderOpen(argv[3], argv[0], service, flags, files, ReadWrite, &recorder);
+    if (result < CELS_OK)  {printf("Can't create %s: %s\n", argv[3], CelsErrorMessage(result)); return 2;}
+    result = Cels(argv[0], service,0, 0,0, 0,0, recorder, CelsRecorderCallback);
+    CelsResult errcode = CelsRecorderClose(recorder);
+    fclose(files[0]);
+    fclose(files[1]);
+    if (result < CELS_OK)   {printf("Operation failed: %s\n", CelsErrorMessage(result)); return 3;}
+    if (errcode < CELS_OK)  {printf("Recording failed: %s\n", CelsErrorMessage(errcode)); return 3;}
+    return 0;
+}
+
+// Upper bound of the gap histogram bucket containing the given fraction of all gaps, in microseconds
+static double Percentile (const CelsReplayStats& stats, double fraction)
+{
+    CelsNum total = 0,  sum = 0;
+    for (int i = 0;  i < 64;  i++)  total += stats.gaps[i];
+    for (int i = 0;  i < 64;  i++) {
+        sum += stats.gaps[i];
+        if (sum >= total*fraction)  return double((1ll << i) < stats.max_gap_ns? (1ll << i) : stats.max_gap_ns) / 1000;
+    }
+    return 0;
+}
+
+static int Replay (int argc, char **argv)
+{
+    const char *method = NULL,  *input = NULL;
+    double scale = 1;
+    for (; argc > 1  &&  argv[0][0] == '-';  argc -= 2, argv += 2) {
+        if      (!strcmp(argv[0], "-m"))  method = argv[1];
+        else if (!strcmp(argv[0], "-i"))  input = argv[1];
+        else if (!strcmp(argv[0], "-s"))  scale = atof(argv[1]);
+        else return Usage();
+    }
+    if (argc != 1)  return Usage();
+
+    CelsReplayStats stats;
+    CelsResult result = CelsReplay(argv[0], method, input, scale, &stats, NULL, NULL);
+    if (result < CELS_OK)  printf("Operation failed: %s\n", CelsErrorMessage(result));
+
+    double total = stats.total_ns / 1e9,  codec = (stats.total_ns - stats.host_ns) / 1e9;
+    printf("Input %.3f MB, output %.3f MB (recorded %.3f MB), %lld reads, %lld writes\n",
+           stats.input / 1e6, stats.output / 1e6, stats.recorded_output / 1e6, (long long)stats.reads, (long long)stats.writes);
+    printf("Time %.3f s, host %.3f s, codec %.3f s (recorded host %.3f s, codec %.3f s)\n",
+           total, stats.host_ns / 1e9, codec, stats.recorded_host_ns / 1e9, stats.recorded_codec_ns / 1e9);
+    printf("Throughput %.1f MB/s, codec alone %.1f MB/s\n",
+           total > 0? stats.input / 1e6 / total : 0,  codec > 0? stats.input / 1e6 / codec : 0);
+    printf("Codec time between callbacks: p50 <= %.1f us, p99 <= %.1f us, max %.1f us\n",
+           Percentile(stats, 0.5), Percentile(stats, 0.99), stats.max_gap_ns / 1e3);
+    return (result < CELS_OK? 3 : 0);
+}
+
+int main (int argc, char **argv)
+{
+    CelsLoad();
+    if (argc > 1  &&  !strcmp(argv[1], "record"))  return Record(argc-2, argv+2);
+    if (argc > 1  &&  !strcmp(argv[1], "replay"))  return Replay(argc-2, argv+2);
+    return Usage();
+}
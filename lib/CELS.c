@@ -26,6 +26,10 @@
        - CELS repository: https://github.com/Bulat-Ziganshin/CELS
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE     // for CPU_SET()
+#endif
+
 #include <string.h>
 #include <stdlib.h>
 #include "CELS.h"
@@ -98,13 +102,123 @@ static CelsResult DllUnload (void* dll)
 }
 #endif
 
+// Portable threads and synchronization
+#ifdef _WIN32
+typedef HANDLE CelsThread;
+typedef SRWLOCK CelsMutex;
+typedef CONDITION_VARIABLE CelsCondVar;
+#define CELS_MUTEX_INITIALIZER    SRWLOCK_INIT
+#define CELS_CONDVAR_INITIALIZER  CONDITION_VARIABLE_INIT
+#define CELS_THREAD_LOCAL         __declspec(thread)
+#define CELS_THREAD_FUNCTION(name, arg)  DWORD WINAPI name (void* arg)
+static int  CelsThreadCreate (CelsThread* thread, LPTHREAD_START_ROUTINE func, void* arg)  {*thread = CreateThread (NULL,0, func,arg, 0,NULL);  return *thread != NULL;}
+static void CelsThreadDetach (CelsThread thread)  {CloseHandle (thread);}
+static void CelsThreadBind   (int cpu)            {SetThreadAffinityMask (GetCurrentThread(), (DWORD_PTR)1 << (cpu % (8*sizeof(DWORD_PTR))));}
+static void CelsMutexInit    (CelsMutex* mutex)   {InitializeSRWLock (mutex);}
+static void CelsMutexLock    (CelsMutex* mutex)   {AcquireSRWLockExclusive (mutex);}
+static void CelsMutexUnlock  (CelsMutex* mutex)   {ReleaseSRWLockExclusive (mutex);}
+static void CelsCondWait     (CelsCondVar* cond, CelsMutex* mutex)  {SleepConditionVariableSRW (cond, mutex, INFINITE, 0);}
+static void CelsCondSignal   (CelsCondVar* cond)  {WakeConditionVariable (cond);}
+static void CelsCondBroadcast(CelsCondVar* cond)  {WakeAllConditionVariable (cond);}
+static void CelsCondInit     (CelsCondVar* cond)  {InitializeConditionVariable (cond);}
+static void CelsMutexDestroy (CelsMutex* mutex)   {}
+static void CelsCondDestroy  (CelsCondVar* cond)  {}
+static int  CelsNumberOfCpus()                    {SYSTEM_INFO si;  GetSystemInfo (&si);  return si.dwNumberOfProcessors;}
+static CelsNum CelsTimeNs()                       {LARGE_INTEGER t, f;  QueryPerformanceCounter (&t);  QueryPerformanceFrequency (&f);  return (CelsNum) (t.QuadPart * (1e9 / f.QuadPart));}
+static void CelsSleepMs      (CelsNum ms)         {Sleep ((DWORD)ms);}
+
+// Atomic operations on CelsNum: loads acquire, stores release, read-modify-write and fences are sequentially consistent
+#define CelsAtomicLoad(ptr)               InterlockedCompareExchange64 ((volatile LONG64*)(ptr), 0, 0)
+#define CelsAtomicStore(ptr, value)       InterlockedExchange64 ((volatile LONG64*)(ptr), (value))
+#define CelsAtomicCas(ptr, old, value)    (InterlockedCompareExchange64 ((volatile LONG64*)(ptr), (value), (old)) == (old))
+#define CelsAtomicAdd(ptr, value)         InterlockedExchangeAdd64 ((volatile LONG64*)(ptr), (value))
+#define CelsAtomicFence()                 MemoryBarrier()
+
+// Coroutines switching between the caller and a function running on its own stack. The function should never return
+typedef struct {LPVOID fiber, caller;} CelsCoroutine;
+#define CELS_COROUTINE_FUNCTION(name, arg)  VOID CALLBACK name (LPVOID arg)
+static int  CelsCoroutineCreate (CelsCoroutine* co, size_t stack_size, LPFIBER_START_ROUTINE func, void* arg)  {co->fiber = CreateFiber (stack_size, func, arg);  return co->fiber != NULL;}
+static void CelsCoroutineEnter  (CelsCoroutine* co)  {co->caller = (IsThreadAFiber()? GetCurrentFiber() : ConvertThreadToFiber (NULL));  SwitchToFiber (co->fiber);}
+static void CelsCoroutineYield  (CelsCoroutine* co)  {SwitchToFiber (co->caller);}
+static void CelsCoroutineDelete (CelsCoroutine* co)  {DeleteFiber (co->fiber);}
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+typedef pthread_t CelsThread;
+typedef pthread_mutex_t CelsMutex;
+typedef pthread_cond_t CelsCondVar;
+#define CELS_MUTEX_INITIALIZER    PTHREAD_MUTEX_INITIALIZER
+#define CELS_CONDVAR_INITIALIZER  PTHREAD_COND_INITIALIZER
+#define CELS_THREAD_LOCAL         __thread
+#define CELS_THREAD_FUNCTION(name, arg)  void* name (void* arg)
+static int  CelsThreadCreate (CelsThread* thread, void* (*func)(void*), void* arg)  {return pthread_create (thread, NULL, func, arg) == 0;}
+static void CelsThreadDetach (CelsThread thread)  {pthread_detach (thread);}
+#ifdef __linux__
+#include <sched.h>
+static void CelsThreadBind   (int cpu)            {cpu_set_t set;  CPU_ZERO (&set);  CPU_SET (cpu % CPU_SETSIZE, &set);  sched_setaffinity (0, sizeof(set), &set);}
+#else
+static void CelsThreadBind   (int cpu)            {}
+#endif
+static void CelsMutexInit    (CelsMutex* mutex)   {pthread_mutex_init (mutex, NULL);}
+static void CelsMutexLock    (CelsMutex* mutex)   {pthread_mutex_lock (mutex);}
+static void CelsMutexUnlock  (CelsMutex* mutex)   {pthread_mutex_unlock (mutex);}
+static void CelsCondWait     (CelsCondVar* cond, CelsMutex* mutex)  {pthread_cond_wait (cond, mutex);}
+static void CelsCondSignal   (CelsCondVar* cond)  {pthread_cond_signal (cond);}
+static void CelsCondBroadcast(CelsCondVar* cond)  {pthread_cond_broadcast (cond);}
+static void CelsCondInit     (CelsCondVar* cond)  {pthread_cond_init (cond, NULL);}
+static void CelsMutexDestroy (CelsMutex* mutex)   {pthread_mutex_destroy (mutex);}
+static void CelsCondDestroy  (CelsCondVar* cond)  {pthread_cond_destroy (cond);}
+static int  CelsNumberOfCpus()                    {long n = sysconf (_SC_NPROCESSORS_ONLN);  return n > 0? (int)n : 1;}
+static CelsNum CelsTimeNs()                       {struct timespec t;  clock_gettime (CLOCK_MONOTONIC, &t);  return (CelsNum)t.tv_sec*1000000000 + t.tv_nsec;}
+static void CelsSleepMs      (CelsNum ms)         {struct timespec t = {(time_t)(ms/1000), (long)(ms%1000)*1000000};  nanosleep (&t, NULL);}
+
+// Atomic operations on CelsNum: loads acquire, stores release, read-modify-write and fences are sequentially consistent
+#define CelsAtomicLoad(ptr)               __atomic_load_n ((ptr), __ATOMIC_ACQUIRE)
+#define CelsAtomicStore(ptr, value)       __atomic_store_n ((ptr), (value), __ATOMIC_RELEASE)
+#define CelsAtomicCas(ptr, old, value)    __sync_bool_compare_and_swap ((ptr), (old), (value))
+#define CelsAtomicAdd(ptr, value)         __atomic_fetch_add ((ptr), (value), __ATOMIC_SEQ_CST)
+#define CelsAtomicFence()                 __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
+// Coroutines switching between the caller and a function running on its own stack. The function should never return
+#include <ucontext.h>
+typedef struct {ucontext_t context, caller;  void* stack;  void (*func)(void*);  void* arg;} CelsCoroutine;
+#define CELS_COROUTINE_FUNCTION(name, arg)  void name (void* arg)
+static CELS_THREAD_LOCAL CelsCoroutine* CoroutineStarting;   // makecontext() can't portably pass a pointer to the function
+static void CelsCoroutineMain()  {CelsCoroutine* co = CoroutineStarting;  co->func (co->arg);}
+static int  CelsCoroutineCreate (CelsCoroutine* co, size_t stack_size, void (*func)(void*), void* arg)
+{
+    co->stack = malloc (stack_size);
+    if (co->stack == NULL  ||  getcontext (&co->context) != 0)  {free (co->stack);  return 0;}
+    co->context.uc_stack.ss_sp   = co->stack;
+    co->context.uc_stack.ss_size = stack_size;
+    co->context.uc_link = &co->caller;
+    co->func = func;  co->arg = arg;
+    makecontext (&co->context, CelsCoroutineMain, 0);
+    return 1;
+}
+static void CelsCoroutineEnter  (CelsCoroutine* co)  {CoroutineStarting = co;  swapcontext (&co->caller, &co->context);}
+static void CelsCoroutineYield  (CelsCoroutine* co)  {swapcontext (&co->context, &co->caller);}
+static void CelsCoroutineDelete (CelsCoroutine* co)  {free (co->stack);}
+#endif
+
 
 // ****************************************************************************************************************************
 // Method registering/parsing *************************************************************************************************
 // ****************************************************************************************************************************
 
+// Operation modes of the codec learned from trial calls. Modes reported by CELS_GET_CAPABILITIES may depend on
+// the instance parameters, so they are asked from every instance rather than cached here.
+// Allocated separately from the RegCodec, since parsed instances refer to it while RegisteredCodecs may be reallocated
+typedef struct {
+    CelsNum compress, decompress;           // CELS_CAP_* bits as in CelsCapabilities
+    CelsNum compress_known, decompress_known;
+    CelsNum compress_reported, decompress_reported;   // CELS_CAP_* modes reported by the instances themselves
+    CelsNum queried;                        // CELS_GET_CAPABILITIES was already asked
+} RegModes;
+
 typedef struct {
-    const char *name;  void* self;  CelsFunction* CelsMain;  unsigned hash;
+    const char *name;  void* self;  CelsFunction* CelsMain;  unsigned hash;  RegModes* modes;
 } RegCodec;
 static RegCodec* RegisteredCodecs = NULL;
 static int NumRegisteredCodecs = 0;
@@ -123,11 +237,13 @@ CelsResult CelsRegister (const char* name, void* ud, CelsFunction* CelsMain)
     codec->self     = ud;
     codec->CelsMain = CelsMain;
     codec->hash     = wildcard? wildcard-name : StringHash(name);   // wildcard: size of fixed part, otherwise: hash of the method name
+    codec->modes    = (RegModes*) calloc (1, sizeof(RegModes));
+    if (codec->modes==NULL)  {--NumRegisteredCodecs;  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
 
     // Initialize the codec
     CelsResult result = codec->CelsMain (codec->self, CELS_LOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
     if (result == CELS_ERROR_NOT_IMPLEMENTED)   result = CELS_OK;
-    if (result < CELS_OK)                       --NumRegisteredCodecs;
+    if (result < CELS_OK)                       free (codec->modes),  --NumRegisteredCodecs;
     return result;
 }
 
@@ -139,16 +255,121 @@ typedef struct
     void*         CodecSelf;
     CelsFunction* CelsMain;
     const char*   CodecName;
+    RegModes*     Modes;
 } CELS_CODEC_INSTANCE;
 
 const int CELS_HEADER = sizeof(CELS_CODEC_INSTANCE);
 
+static void CelsAtomicOr (CelsNum* ptr, CelsNum bits)
+{
+    CelsNum old;
+    do  old = CelsAtomicLoad (ptr);
+    while (!CelsAtomicCas (ptr, old, old | bits));
+}
+
+// Add the mode to the codec cache, unless its support is already known or reported by the instances
+static void CelsLearnMode (RegModes* modes, int service, CelsNum mode, int supported)
+{
+    int compression = (service==CELS_COMPRESS || service==CELS_COMPRESS_BATCH);
+    if (modes==NULL  ||  (CelsAtomicLoad (compression? &modes->compress_known : &modes->decompress_known) & mode))  return;
+    if (CelsAtomicLoad (compression? &modes->compress_reported : &modes->decompress_reported) & mode)  return;
+    if (supported)
+        CelsAtomicOr (compression? &modes->compress : &modes->decompress, mode);
+    CelsAtomicOr (compression? &modes->compress_known : &modes->decompress_known, mode);
+}
+
+// Support of the mode by the parsed instance: 1 - supported, 0 - not supported, -1 - unknown
+static int CelsKnownMode (CELS_CODEC_INSTANCE* instance, int service, CelsNum mode)
+{
+    int compression = (service==CELS_COMPRESS || service==CELS_COMPRESS_BATCH);
+    RegModes* modes = instance->Modes;
+    if (CelsAtomicLoad (compression? &modes->compress_reported : &modes->decompress_reported) & mode) {
+        CelsCapabilities caps;
+        caps.compress = caps.decompress = caps.compress_known = caps.decompress_known = 0;
+        if (instance->CelsMain (instance+1, CELS_GET_CAPABILITIES,0, NULL,0, &caps,sizeof(caps), NULL,(CelsCallback*)Cels) < CELS_OK
+            ||  !((compression? caps.compress_known : caps.decompress_known) & mode))  return -1;
+        return ((compression? caps.compress : caps.decompress) & mode) != 0;
+    }
+    if (!(CelsAtomicLoad (compression? &modes->compress_known : &modes->decompress_known) & mode))  return -1;
+    return (CelsAtomicLoad (compression? &modes->compress : &modes->decompress) & mode) != 0;
+}
+
+// Ask the codec once, on the first instance, which modes its instances report
+static void CelsQueryModes (CELS_CODEC_INSTANCE* instance)
+{
+    CelsCapabilities caps;
+    RegModes* modes = instance->Modes;
+    if (CelsAtomicLoad (&modes->queried))  return;
+    caps.compress_known = caps.decompress_known = 0;
+    if (instance->CelsMain (instance+1, CELS_GET_CAPABILITIES,0, NULL,0, &caps,sizeof(caps), NULL,(CelsCallback*)Cels) >= CELS_OK) {
+        CelsAtomicStore (&modes->compress_reported,   caps.compress_known);
+        CelsAtomicStore (&modes->decompress_reported, caps.decompress_known);
+    }
+    CelsAtomicStore (&modes->queried, 1);
+}
+
+// Serve CELS_GET_CAPABILITIES: ask the codec and complete its answer with the cached modes and CELS_GET_* services
+static CelsResult CelsInstanceCapabilities (CELS_CODEC_INSTANCE* instance, CelsCapabilities* caps, CelsNum size, void* ud, CelsCallback* cb)
+{
+    CelsNum* hints[5];  int i;
+    const int hint_services[5] = {CELS_GET_COMPRESSION_MEMORY, CELS_GET_DECOMPRESSION_MEMORY,
+                                  CELS_GET_COMPRESSION_CPU_LOAD, CELS_GET_DECOMPRESSION_CPU_LOAD, CELS_GET_MAX_COMPRESSED_SIZE};
+    if (caps==NULL  ||  size < (CelsNum)sizeof(CelsCapabilities))  return CELS_ERROR_GENERAL;
+
+    caps->compress = caps->decompress = caps->compress_known = caps->decompress_known = 0;
+    hints[0] = &caps->compression_memory;    hints[1] = &caps->decompression_memory;
+    hints[2] = &caps->compression_cpu_load;  hints[3] = &caps->decompression_cpu_load;
+    hints[4] = &caps->max_compressed_1m;
+    for (i=0; i<5; i++)  *hints[i] = CELS_ERROR_NOT_IMPLEMENTED;
+
+    CelsResult result = instance->CelsMain (instance+1, CELS_GET_CAPABILITIES,0, NULL,0, caps,size, ud,cb);
+    if (result < CELS_OK  &&  result != CELS_ERROR_NOT_IMPLEMENTED)  return result;
+
+    // Hints not filled by the codec
+    for (i=0; i<5; i++)
+        if (*hints[i] == CELS_ERROR_NOT_IMPLEMENTED)
+            *hints[i] = instance->CelsMain (instance+1, hint_services[i],0, NULL,(i==4? 1<<20 : 0), NULL,0, ud,cb);
+
+    // Modes not reported by the codec
+    if (instance->Modes) {
+        RegModes* modes = instance->Modes;
+        CelsNum compress_known   = CelsAtomicLoad (&modes->compress_known)   & ~caps->compress_known;
+        CelsNum decompress_known = CelsAtomicLoad (&modes->decompress_known) & ~caps->decompress_known;
+        caps->compress   |= CelsAtomicLoad (&modes->compress)   & compress_known;
+        caps->decompress |= CelsAtomicLoad (&modes->decompress) & decompress_known;
+        caps->compress_known   |= compress_known;
+        caps->decompress_known |= decompress_known;
+    }
+    if (!(caps->compress_known & caps->decompress_known & CELS_CAP_CACHING)) {
+        if (instance->CelsMain (instance+1, CELS_GET_CACHING,0, NULL,0, NULL,0, ud,cb) > 0)
+            caps->compress |= CELS_CAP_CACHING,  caps->decompress |= CELS_CAP_CACHING;
+        caps->compress_known |= CELS_CAP_CACHING,  caps->decompress_known |= CELS_CAP_CACHING;
+    }
+    return CELS_OK;
+}
+
+// Modes cache of the parsed method, or NULL for method strings
+static RegModes* CelsMethodModes (const void* method)
+{
+    CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
+    return (*(const char*)method == 0? instance->Modes : NULL);
+}
+
+// Support of the mode by the method: 1 - supported, 0 - not supported, -1 - unknown (always for method strings)
+static int CelsMethodMode (const void* method, int service, CelsNum mode)
+{
+    return (CelsMethodModes (method)? CelsKnownMode ((CELS_CODEC_INSTANCE*) method, service, mode) : -1);
+}
+
 // Execute operation on parsed codec instance.
-// Only this function and CelsParseSplitted() deals with instance internals.
+// Only this function, CelsBind() and CelsParseSplitted() deal with instance internals.
 static CelsResult CallCels (void* method, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
 {
     CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
-    if (IS_CELS_INSTANCE_SERVICE(service)) {
+    if (service==CELS_GET_CAPABILITIES) {
+        return CelsInstanceCapabilities (instance, (CelsCapabilities*)outbuf,outsize, ud,cb);
+    }
+    else if (IS_CELS_INSTANCE_SERVICE(service)) {
         // Run requested service on the instance
         CelsNum result = instance->CelsMain (instance+1, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
         if (result==CELS_ERROR_NOT_IMPLEMENTED && service==CELS_UNPARSE && instance->CodecName) {
@@ -165,6 +386,16 @@ static CelsResult CallCels (void* method, int service, CelsNum subservice, void*
     }
 }
 
+// Resolve parsed method into the function and data of the codec instance, so they can be called directly
+CelsResult CelsBind (const void* method, CelsBoundMethod* bound)
+{
+    CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
+    if (*(char*)instance != 0)  return CELS_ERROR_INVALID_COMPRESSOR;   // method string rather than parsed method
+    bound->CelsMain = instance->CelsMain;
+    bound->self     = instance+1;
+    return CELS_OK;
+}
+
 // Parse method already splitted into separate parameters and save parsed method into (method,method_size) buffer.
 // Only this function creates new codec instances.
 CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
@@ -180,7 +411,7 @@ CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsN
         // Try only registered codecs with matching name (including wildcards like "aes*")
         int exact_name_match  =  codec->hash==hash && !strcmp(codec->name, name);   // check for exact name match
         if (exact_name_match ||  codec->hash<=len && !strncmp(codec->name, name, codec->hash)
-                                 &&  strlen(codec->name) < codec->hash  &&  codec->name[codec->hash]=='*')
+                                 &&  strlen(codec->name) > codec->hash  &&  codec->name[codec->hash]=='*')
         {
             CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
             *(char*)instance    = 0;
@@ -188,6 +419,7 @@ CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsN
             instance->CodecSelf = codec->self;
             instance->CelsMain  = codec->CelsMain;
             instance->CodecName = NULL;
+            instance->Modes     = codec->modes;
 
             errcode_or_size = codec->CelsMain (codec->self, CELS_PARSE,0, (void*)parameters,0,
                                                instance+1, method_size-CELS_HEADER, ud,cb);
@@ -203,6 +435,7 @@ CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsN
                 CelsResult result = CallCels (method, CELS_INITIALIZE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
                 if (result < CELS_OK  &&  result != CELS_ERROR_NOT_IMPLEMENTED)
                     return result;
+                CelsQueryModes (instance);
 
                 // Successful parsing - errcode_or_size contains size of parsed record
                 return CELS_HEADER + errcode_or_size;
@@ -371,6 +604,7 @@ void CelsUnload()
     while (NumRegisteredCodecs > 0) {
         RegCodec *codec  =  & RegisteredCodecs[--NumRegisteredCodecs];
         codec->CelsMain (codec->self, CELS_UNLOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+        free (codec->modes);
     }
     free(RegisteredCodecs);
     RegisteredCodecs = NULL;
@@ -389,6 +623,690 @@ void CelsUnload()
 }
 
 
+// ****************************************************************************************************************************
+// Framework thread pool shared by codecs and asynchronous operations                                                         *
+// ****************************************************************************************************************************
+
+// Task waiting for execution
+typedef struct
+{
+    CelsTask*      task;
+    void*          arg;
+    CelsTaskGroup* group;       // group counting the task, or NULL
+} CelsPoolTask;
+
+// Double-ended queue of tasks: the owner pushes and pops tasks at the tail, while other threads steal them from the head
+typedef struct
+{
+    CelsMutex     mutex;
+    CelsPoolTask* tasks;        // ring buffer
+    int           size;         // capacity of the ring buffer
+    int           head, count;  // position of the oldest task and number of tasks
+} CelsDeque;
+
+static CelsMutex   PoolMutex     = CELS_MUTEX_INITIALIZER;    // protects all pool variables except for contents of the deques
+static CelsCondVar PoolWorkReady = CELS_CONDVAR_INITIALIZER;  // signalled when a task is submitted
+static CelsCondVar PoolTaskDone  = CELS_CONDVAR_INITIALIZER;  // broadcasted when a task group or an asynchronous job is finished
+static CelsDeque*  PoolDeques = NULL;   // one deque per worker, plus the last one shared by threads outside of the pool
+static int         PoolWorkers = 0;     // number of workers (and their deques)
+static int         PoolQueuedTasks = 0; // total number of tasks in all deques
+static int         PoolThreads = 0;     // number of workers to start (0 - one per CPU)
+static int         PoolAffinity = 0;    // bind workers to CPUs
+static int         PoolStarted = 0;     // 1 - workers were started, -1 - failed to start them
+static CELS_THREAD_LOCAL int PoolWorkerId = 0;   // 1 + index of the current worker, or 0 outside of the pool
+
+static int CelsDequePush (CelsDeque* deque, const CelsPoolTask* task)
+{
+    CelsMutexLock (&deque->mutex);
+    if (deque->count == deque->size) {
+        // Grow the ring buffer, moving the oldest task to its start
+        int i, new_size = deque->size * 2 + 64;
+        CelsPoolTask* tasks = (CelsPoolTask*) malloc (new_size * sizeof(CelsPoolTask));
+        if (tasks == NULL)  {CelsMutexUnlock (&deque->mutex);  return 0;}
+        for (i = 0;  i < deque->count;  i++)
+            tasks[i] = deque->tasks[(deque->head + i) % deque->size];
+        free (deque->tasks);
+        deque->tasks = tasks;
+        deque->size  = new_size;
+        deque->head  = 0;
+    }
+    deque->tasks[(deque->head + deque->count++) % deque->size] = *task;
+    CelsMutexUnlock (&deque->mutex);
+    return 1;
+}
+
+// Take the newest task (for the owner) or the oldest one (for thieves)
+static int CelsDequePop (CelsDeque* deque, CelsPoolTask* task, int steal)
+{
+    int found = 0;
+    CelsMutexLock (&deque->mutex);
+    if (deque->count > 0) {
+        found = 1;
+        deque->count--;
+        if (steal) {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->size;
+        } else {
+            *task = deque->tasks[(deque->head + deque->count) % deque->size];
+        }
+    }
+    CelsMutexUnlock (&deque->mutex);
+    return found;
+}
+
+// Find a task to run: the newest one in our own deque, otherwise steal the oldest one from other deques,
+// starting with the nearest neighbours, that usually share the NUMA node when workers are bound to CPUs
+static int CelsPoolTake (CelsPoolTask* task)
+{
+    int i,  self = (PoolWorkerId? PoolWorkerId-1 : PoolWorkers);
+    int found = CelsDequePop (&PoolDeques[self], task, PoolWorkerId==0);   // shared deque is served in FIFO order
+    for (i = 1;  i <= PoolWorkers  &&  !found;  i++)
+        found = CelsDequePop (&PoolDeques[(self+i) % (PoolWorkers+1)], task, 1);
+    if (found) {
+        CelsMutexLock (&PoolMutex);
+        PoolQueuedTasks--;
+        CelsMutexUnlock (&PoolMutex);
+    }
+    return found;
+}
+
+static void CelsPoolRun (const CelsPoolTask* task)
+{
+    task->task (task->arg);
+    if (task->group) {
+        CelsMutexLock (&PoolMutex);
+        if (--task->group->pending == 0)  CelsCondBroadcast (&PoolTaskDone);
+        CelsMutexUnlock (&PoolMutex);
+    }
+}
+
+// Worker thread running tasks until the program finishes
+static CELS_THREAD_FUNCTION (CelsPoolWorker, arg)
+{
+    PoolWorkerId = 1 + (int)(size_t)arg;
+    if (PoolAffinity)  CelsThreadBind (PoolWorkerId-1);
+    for(;;) {
+        CelsPoolTask task;
+        if (CelsPoolTake (&task))  {CelsPoolRun (&task);  continue;}
+
+        CelsMutexLock (&PoolMutex);
+        while (PoolQueuedTasks == 0)
+            CelsCondWait (&PoolWorkReady, &PoolMutex);
+        CelsMutexUnlock (&PoolMutex);
+    }
+    return 0;
+}
+
+// Start workers on the first use (PoolMutex should be locked)
+static void CelsPoolStart()
+{
+    int i, workers = (PoolThreads > 0? PoolThreads : CelsNumberOfCpus());
+    PoolStarted = -1;
+    PoolDeques = (CelsDeque*) calloc (workers+1, sizeof(CelsDeque));
+    if (PoolDeques == NULL)  return;
+    for (i = 0;  i <= workers;  i++)
+        CelsMutexInit (&PoolDeques[i].mutex);
+    PoolWorkers = workers;
+
+    for (i = 0;  i < workers;  i++) {
+        CelsThread thread;
+        if (! CelsThreadCreate (&thread, CelsPoolWorker, (void*)(size_t)i))  break;
+        CelsThreadDetach (thread);
+    }
+    if (i > 0)  PoolStarted = 1;   // deques of workers that failed to start just remain empty
+}
+
+// Queue the task for execution, counting it in the group. When the pool can't be started, the task is executed immediately.
+static CelsResult CelsPoolSubmit (CelsTaskGroup* group, CelsTask* task, void* arg)
+{
+    CelsPoolTask t = {task, arg, group};
+    CelsMutexLock (&PoolMutex);
+    if (PoolStarted == 0)  CelsPoolStart();
+    int started = (PoolStarted > 0);
+    if (group)  group->pending++;
+    CelsMutexUnlock (&PoolMutex);
+
+    if (started  &&  CelsDequePush (&PoolDeques[PoolWorkerId? PoolWorkerId-1 : PoolWorkers], &t)) {
+        CelsMutexLock (&PoolMutex);
+        PoolQueuedTasks++;
+        CelsCondSignal (&PoolWorkReady);
+        CelsMutexUnlock (&PoolMutex);
+    } else {
+        CelsPoolRun (&t);
+    }
+    return CELS_OK;
+}
+
+// Wait for all tasks of the group, running queued tasks meanwhile
+static CelsResult CelsPoolWait (CelsTaskGroup* group)
+{
+    for(;;) {
+        CelsMutexLock (&PoolMutex);
+        if (group->pending > 0  &&  PoolQueuedTasks == 0)
+            CelsCondWait (&PoolTaskDone, &PoolMutex);
+        CelsNum pending = group->pending;
+        int started = (PoolStarted > 0);
+        CelsMutexUnlock (&PoolMutex);
+        if (pending == 0)  return CELS_OK;
+
+        CelsPoolTask task;
+        if (started  &&  CelsPoolTake (&task))  CelsPoolRun (&task);
+    }
+}
+
+static CelsResult CelsPoolThreads()
+{
+    CelsMutexLock (&PoolMutex);
+    int threads = (PoolStarted > 0? PoolWorkers : PoolStarted < 0? 1 : PoolThreads > 0? PoolThreads : CelsNumberOfCpus());
+    CelsMutexUnlock (&PoolMutex);
+    return threads;
+}
+
+CelsResult CelsSetThreads (int threads)
+{
+    CelsMutexLock (&PoolMutex);
+    CelsResult errcode = (PoolStarted? CELS_ERROR_GENERAL : CELS_OK);   // too late
+    if (errcode == CELS_OK)  PoolThreads = threads;
+    CelsMutexUnlock (&PoolMutex);
+    return errcode;
+}
+
+CelsResult CelsSetThreadAffinity (int enable)
+{
+    CelsMutexLock (&PoolMutex);
+    CelsResult errcode = (PoolStarted? CELS_ERROR_GENERAL : CELS_OK);   // too late
+    if (errcode == CELS_OK)  PoolAffinity = enable;
+    CelsMutexUnlock (&PoolMutex);
+    return errcode;
+}
+
+
+// ****************************************************************************************************************************
+// Framework checksums: CRC32C and XXH3 with incremental update                                                               *
+// ****************************************************************************************************************************
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CELS_CHECKSUM_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CELS_TARGET(isa)
+#else
+#include <cpuid.h>
+#define CELS_TARGET(isa)  __attribute__((target(isa)))
+#endif
+#endif
+
+typedef unsigned long long CelsU64;
+
+static CelsU64 CelsReadLE64 (const unsigned char* p)  {CelsU64 x = 0;  int i;  for (i=7; i>=0; i--)  x = (x << 8) | p[i];  return x;}
+static unsigned CelsReadLE32 (const unsigned char* p)  {return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);}
+
+// *** CRC32C ***
+
+#define CRC32C_POLY   0x82F63B78u   // Castagnoli polynomial, bit-reflected
+#define CRC32C_LONG   8192          // Hardware kernel computes three interleaved streams of this size...
+#define CRC32C_SHORT  256           // ...or this size, combining them afterwards
+
+static unsigned Crc32cTable[8][256];                // slicing-by-8 tables for the portable kernel
+static unsigned Crc32cLongShift[2], Crc32cShortShift[2];    // constants shifting CRC by one and two streams
+static int      Crc32cHardware, Xxh3Level;          // kernels chosen: SSE4.2+PCLMUL for CRC32C; 0/1/2 = scalar/SSE2/AVX2 for XXH3
+static CelsNum  ChecksumReady;
+static CelsMutex ChecksumMutex = CELS_MUTEX_INITIALIZER;
+
+// Product of two polynomials modulo CRC32C_POLY, in the bit-reflected representation
+static unsigned Crc32cMultModP (unsigned a, unsigned b)
+{
+    unsigned m = 1u << 31,  p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m-1)) == 0)  break;
+        }
+        m >>= 1;
+        b = (b & 1? (b >> 1) ^ CRC32C_POLY : b >> 1);
+    }
+    return p;
+}
+
+// x^n modulo CRC32C_POLY
+static unsigned Crc32cXPowN (CelsU64 n)
+{
+    unsigned p = 1u << 31,  xp = 1u << 30;   // x^0, x^1
+    for (;  n;  n >>= 1) {
+        if (n & 1)  p = Crc32cMultModP (xp, p);
+        xp = Crc32cMultModP (xp, xp);
+    }
+    return p;
+}
+
+static unsigned Crc32cPortable (unsigned crc, const unsigned char* p, size_t len)
+{
+    for (;  len >= 8;  p += 8, len -= 8) {
+        CelsU64 w = CelsReadLE64 (p) ^ crc;
+        crc = Crc32cTable[7][ w        & 0xFF] ^ Crc32cTable[6][(w >>  8) & 0xFF] ^ Crc32cTable[5][(w >> 16) & 0xFF] ^ Crc32cTable[4][(w >> 24) & 0xFF]
+            ^ Crc32cTable[3][(w >> 32) & 0xFF] ^ Crc32cTable[2][(w >> 40) & 0xFF] ^ Crc32cTable[1][(w >> 48) & 0xFF] ^ Crc32cTable[0][ w >> 56        ];
+    }
+    while (len--)
+        crc = Crc32cTable[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CELS_CHECKSUM_X86
+// Shift CRC by the amount of data represented by the constant x^(8*bytes-33). PCLMUL multiplies it by the constant,
+// and the CRC32 instruction reduces 64-bit product modulo the polynomial, additionally multiplying it by x^33
+CELS_TARGET("sse4.2,pclmul")
+static unsigned Crc32cShift (unsigned crc, unsigned constant)
+{
+    __m128i product = _mm_clmulepi64_si128 (_mm_cvtsi32_si128 (crc), _mm_cvtsi32_si128 (constant), 0);
+    return (unsigned) _mm_crc32_u64 (0, (CelsU64) _mm_cvtsi128_si64 (product));
+}
+
+// The CRC32 instruction has latency 3 and throughput 1, so three independent streams keep it busy
+CELS_TARGET("sse4.2,pclmul")
+static unsigned Crc32cHw (unsigned crc, const unsigned char* p, size_t len)
+{
+    CelsU64 crc0 = crc;
+    size_t stream;
+    for (stream = CRC32C_LONG;  stream >= CRC32C_SHORT;  stream = (stream == CRC32C_LONG? CRC32C_SHORT : 0))
+    {
+        const unsigned* shift = (stream == CRC32C_LONG? Crc32cLongShift : Crc32cShortShift);
+        for (;  len >= 3*stream;  p += 3*stream, len -= 3*stream) {
+            CelsU64 crc1 = 0,  crc2 = 0;
+            const unsigned char* end = p + stream;
+            const unsigned char* q;
+            for (q = p;  q < end;  q += 8) {
+                CelsU64 w0, w1, w2;
+                memcpy (&w0, q, 8);  memcpy (&w1, q + stream, 8);  memcpy (&w2, q + 2*stream, 8);
+                crc0 = _mm_crc32_u64 (crc0, w0);
+                crc1 = _mm_crc32_u64 (crc1, w1);
+                crc2 = _mm_crc32_u64 (crc2, w2);
+            }
+            crc0 = Crc32cShift ((unsigned)crc0, shift[1]) ^ Crc32cShift ((unsigned)crc1, shift[0]) ^ crc2;
+        }
+    }
+    for (;  len >= 8;  p += 8, len -= 8) {
+        CelsU64 w;
+        memcpy (&w, p, 8);
+        crc0 = _mm_crc32_u64 (crc0, w);
+    }
+    crc = (unsigned) crc0;
+    while (len--)
+        crc = _mm_crc32_u8 (crc, *p++);
+    return crc;
+}
+#endif
+
+static unsigned Crc32cUpdate (unsigned crc, const unsigned char* p, size_t len)
+{
+#ifdef CELS_CHECKSUM_X86
+    if (Crc32cHardware)  return Crc32cHw (crc, p, len);
+#endif
+    return Crc32cPortable (crc, p, len);
+}
+
+
+// *** XXH3 (64-bit, default secret and zero seed) ***
+
+#define XXH3_STRIPE            64
+#define XXH3_STRIPES_PER_BLOCK 16     // (sizeof(Xxh3Secret) - XXH3_STRIPE) / 8
+#define XXH3_BUFFER            256    // sizeof(CelsChecksum::buf)
+#define XXH3_MIDSIZE_MAX       240    // longer inputs are hashed by stripes
+
+#define XXH_PRIME32_1  0x9E3779B1u
+#define XXH_PRIME32_2  0x85EBCA77u
+#define XXH_PRIME32_3  0xC2B2AE3Du
+#define XXH_PRIME64_1  0x9E3779B185EBCA87ull
+#define XXH_PRIME64_2  0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME64_3  0x165667B19E3779F9ull
+#define XXH_PRIME64_4  0x85EBCA77C2B2AE63ull
+#define XXH_PRIME64_5  0x27D4EB2F165667C5ull
+#define XXH_PRIME_MX1  0x165667919E3779F9ull
+#define XXH_PRIME_MX2  0x9FB21C651E98DF25ull
+
+static const unsigned char Xxh3Secret[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static CelsU64 Xxh3Rotl (CelsU64 x, int r)  {return (x << r) | (x >> (64 - r));}
+
+static CelsU64 Xxh3Swap64 (CelsU64 x)
+{
+    x = ((x & 0x00FF00FF00FF00FFull) << 8)  | ((x >> 8)  & 0x00FF00FF00FF00FFull);
+    x = ((x & 0x0000FFFF0000FFFFull) << 16) | ((x >> 16) & 0x0000FFFF0000FFFFull);
+    return (x << 32) | (x >> 32);
+}
+
+// Fold 128-bit product of a and b into 64 bits
+static CelsU64 Xxh3MulFold (CelsU64 a, CelsU64 b)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (CelsU64)product ^ (CelsU64)(product >> 64);
+#else
+    CelsU64 lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF),  hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    CelsU64 lo_hi = (a & 0xFFFFFFFF) * (b >> 32),         hi_hi = (a >> 32) * (b >> 32);
+    CelsU64 cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    CelsU64 upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    CelsU64 lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static CelsU64 Xxh64Avalanche (CelsU64 h)  {h ^= h >> 33;  h *= XXH_PRIME64_2;  h ^= h >> 29;  h *= XXH_PRIME64_3;  return h ^ (h >> 32);}
+static CelsU64 Xxh3Avalanche  (CelsU64 h)  {h ^= h >> 37;  h *= XXH_PRIME_MX1;  return h ^ (h >> 32);}
+
+static CelsU64 Xxh3Mix16 (const unsigned char* p, const unsigned char* secret)
+{
+    return Xxh3MulFold (CelsReadLE64 (p) ^ CelsReadLE64 (secret), CelsReadLE64 (p+8) ^ CelsReadLE64 (secret+8));
+}
+
+// Inputs up to XXH3_MIDSIZE_MAX bytes are hashed at once
+static CelsU64 Xxh3Short (const unsigned char* p, size_t len)
+{
+    const unsigned char* s = Xxh3Secret;
+    if (len == 0)
+        return Xxh64Avalanche (CelsReadLE64 (s+56) ^ CelsReadLE64 (s+64));
+    if (len <= 3) {
+        unsigned combined = ((unsigned)p[0] << 16) | ((unsigned)p[len>>1] << 24) | p[len-1] | ((unsigned)len << 8);
+        return Xxh64Avalanche (combined ^ (CelsU64)(CelsReadLE32 (s) ^ CelsReadLE32 (s+4)));
+    }
+    if (len <= 8) {
+        CelsU64 h = ((CelsU64)CelsReadLE32 (p) << 32) + CelsReadLE32 (p+len-4);
+        h ^= CelsReadLE64 (s+8) ^ CelsReadLE64 (s+16);
+        h ^= Xxh3Rotl (h, 49) ^ Xxh3Rotl (h, 24);
+        h *= XXH_PRIME_MX2;
+        h ^= (h >> 35) + len;
+        h *= XXH_PRIME_MX2;
+        return h ^ (h >> 28);
+    }
+    if (len <= 16) {
+        CelsU64 lo = CelsReadLE64 (p)       ^ CelsReadLE64 (s+24) ^ CelsReadLE64 (s+32);
+        CelsU64 hi = CelsReadLE64 (p+len-8) ^ CelsReadLE64 (s+40) ^ CelsReadLE64 (s+48);
+        return Xxh3Avalanche (len + Xxh3Swap64 (lo) + hi + Xxh3MulFold (lo, hi));
+    }
+    if (len <= 128) {
+        CelsU64 acc = len * XXH_PRIME64_1;
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96)
+                    acc += Xxh3Mix16 (p+48, s+96) + Xxh3Mix16 (p+len-64, s+112);
+                acc += Xxh3Mix16 (p+32, s+64) + Xxh3Mix16 (p+len-48, s+80);
+            }
+            acc += Xxh3Mix16 (p+16, s+32) + Xxh3Mix16 (p+len-32, s+48);
+        }
+        acc += Xxh3Mix16 (p, s) + Xxh3Mix16 (p+len-16, s+16);
+        return Xxh3Avalanche (acc);
+    } else {
+        CelsU64 acc = len * XXH_PRIME64_1;
+        size_t i,  rounds = len / 16;
+        for (i = 0;  i < 8;  i++)
+            acc += Xxh3Mix16 (p + 16*i, s + 16*i);
+        acc = Xxh3Avalanche (acc);
+        for (i = 8;  i < rounds;  i++)
+            acc += Xxh3Mix16 (p + 16*i, s + 16*(i-8) + 3);
+        acc += Xxh3Mix16 (p+len-16, s + 136 - 17);
+        return Xxh3Avalanche (acc);
+    }
+}
+
+// Accumulate n stripes, using secret shifted by 8 bytes per stripe
+static void Xxh3StripesScalar (CelsU64* acc, const unsigned char* p, const unsigned char* secret, size_t n)
+{
+    for (;  n--;  p += XXH3_STRIPE, secret += 8) {
+        int i;
+        for (i = 0;  i < 8;  i++) {
+            CelsU64 data = CelsReadLE64 (p + 8*i);
+            CelsU64 key = data ^ CelsReadLE64 (secret + 8*i);
+            acc[i^1] += data;
+            acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+        }
+    }
+}
+
+static void Xxh3ScrambleScalar (CelsU64* acc, const unsigned char* secret)
+{
+    int i;
+    for (i = 0;  i < 8;  i++) {
+        CelsU64 a = acc[i];
+        a ^= a >> 47;
+        a ^= CelsReadLE64 (secret + 8*i);
+        acc[i] = a * XXH_PRIME32_1;
+    }
+}
+
+#ifdef CELS_CHECKSUM_X86
+CELS_TARGET("sse2")
+static void Xxh3StripesSse2 (CelsU64* acc, const unsigned char* p, const unsigned char* secret, size_t n)
+{
+    __m128i a[4];
+    int i;
+    for (i = 0;  i < 4;  i++)  a[i] = _mm_loadu_si128 ((const __m128i*)acc + i);
+    for (;  n--;  p += XXH3_STRIPE, secret += 8)
+        for (i = 0;  i < 4;  i++) {
+            __m128i data = _mm_loadu_si128 ((const __m128i*)p + i);
+            __m128i key  = _mm_xor_si128 (data, _mm_loadu_si128 ((const __m128i*)secret + i));
+            __m128i product = _mm_mul_epu32 (key, _mm_srli_epi64 (key, 32));
+            a[i] = _mm_add_epi64 (a[i], _mm_add_epi64 (product, _mm_shuffle_epi32 (data, _MM_SHUFFLE(1,0,3,2))));
+        }
+    for (i = 0;  i < 4;  i++)  _mm_storeu_si128 ((__m128i*)acc + i, a[i]);
+}
+
+CELS_TARGET("sse2")
+static void Xxh3ScrambleSse2 (CelsU64* acc, const unsigned char* secret)
+{
+    const __m128i prime = _mm_set1_epi32 ((int)XXH_PRIME32_1);
+    int i;
+    for (i = 0;  i < 4;  i++) {
+        __m128i a = _mm_loadu_si128 ((const __m128i*)acc + i);
+        a = _mm_xor_si128 (_mm_xor_si128 (a, _mm_srli_epi64 (a, 47)), _mm_loadu_si128 ((const __m128i*)secret + i));
+        __m128i lo = _mm_mul_epu32 (a, prime),  hi = _mm_mul_epu32 (_mm_srli_epi64 (a, 32), prime);
+        _mm_storeu_si128 ((__m128i*)acc + i, _mm_add_epi64 (lo, _mm_slli_epi64 (hi, 32)));
+    }
+}
+
+CELS_TARGET("avx2")
+static void Xxh3StripesAvx2 (CelsU64* acc, const unsigned char* p, const unsigned char* secret, size_t n)
+{
+    __m256i a0 = _mm256_loadu_si256 ((const __m256i*)acc),  a1 = _mm256_loadu_si256 ((const __m256i*)acc + 1);
+    for (;  n--;  p += XXH3_STRIPE, secret += 8) {
+        __m256i data0 = _mm256_loadu_si256 ((const __m256i*)p),  data1 = _mm256_loadu_si256 ((const __m256i*)p + 1);
+        __m256i key0 = _mm256_xor_si256 (data0, _mm256_loadu_si256 ((const __m256i*)secret));
+        __m256i key1 = _mm256_xor_si256 (data1, _mm256_loadu_si256 ((const __m256i*)secret + 1));
+        a0 = _mm256_add_epi64 (a0, _mm256_add_epi64 (_mm256_mul_epu32 (key0, _mm256_srli_epi64 (key0, 32)), _mm256_shuffle_epi32 (data0, _MM_SHUFFLE(1,0,3,2))));
+        a1 = _mm256_add_epi64 (a1, _mm256_add_epi64 (_mm256_mul_epu32 (key1, _mm256_srli_epi64 (key1, 32)), _mm256_shuffle_epi32 (data1, _MM_SHUFFLE(1,0,3,2))));
+    }
+    _mm256_storeu_si256 ((__m256i*)acc, a0);
+    _mm256_storeu_si256 ((__m256i*)acc + 1, a1);
+}
+#endif
+
+static void Xxh3Stripes (CelsU64* acc, const unsigned char* p, const unsigned char* secret, size_t n)
+{
+#ifdef CELS_CHECKSUM_X86
+    if (Xxh3Level == 2)  {Xxh3StripesAvx2 (acc, p, secret, n);  return;}
+    if (Xxh3Level == 1)  {Xxh3StripesSse2 (acc, p, secret, n);  return;}
+#endif
+    Xxh3StripesScalar (acc, p, secret, n);
+}
+
+static void Xxh3Scramble (CelsU64* acc, const unsigned char* secret)
+{
+#ifdef CELS_CHECKSUM_X86
+    if (Xxh3Level >= 1)  {Xxh3ScrambleSse2 (acc, secret);  return;}
+#endif
+    Xxh3ScrambleScalar (acc, secret);
+}
+
+// Process n stripes, scrambling accumulators at the end of every block
+static void Xxh3Consume (CelsChecksum* state, const unsigned char* p, size_t n)
+{
+    while (n > 0) {
+        size_t stripes = XXH3_STRIPES_PER_BLOCK - state->stripes;
+        if (stripes > n)  stripes = n;
+        Xxh3Stripes (state->acc, p, Xxh3Secret + 8*state->stripes, stripes);
+        state->stripes += (unsigned) stripes;
+        p += stripes * XXH3_STRIPE;
+        n -= stripes;
+        if (state->stripes == XXH3_STRIPES_PER_BLOCK) {
+            Xxh3Scramble (state->acc, Xxh3Secret + sizeof(Xxh3Secret) - XXH3_STRIPE);
+            state->stripes = 0;
+        }
+    }
+}
+
+// Since the last stripe is hashed differently, data are consumed only when more input follows them.
+// The buffer keeps unconsumed input at the start and the last consumed stripe at the end
+static void Xxh3Update (CelsChecksum* state, const unsigned char* p, size_t len)
+{
+    while (len > 0) {
+        if (state->buffered == XXH3_BUFFER) {
+            Xxh3Consume (state, state->buf, XXH3_BUFFER / XXH3_STRIPE);
+            state->buffered = 0;
+        }
+        if (state->buffered == 0  &&  len > XXH3_BUFFER) {
+            size_t n = (len-1) / XXH3_STRIPE;
+            Xxh3Consume (state, p, n);
+            memcpy (state->buf + XXH3_BUFFER - XXH3_STRIPE, p + (n-1) * XXH3_STRIPE, XXH3_STRIPE);
+            p += n * XXH3_STRIPE;
+            len -= n * XXH3_STRIPE;
+        }
+        {
+            size_t bytes = XXH3_BUFFER - state->buffered;
+            if (bytes > len)  bytes = len;
+            memcpy (state->buf + state->buffered, p, bytes);
+            state->buffered += (unsigned) bytes;
+            p += bytes;
+            len -= bytes;
+        }
+    }
+}
+
+static CelsU64 Xxh3Digest (const CelsChecksum* state)
+{
+    if (state->total <= XXH3_MIDSIZE_MAX)
+        return Xxh3Short (state->buf, (size_t) state->total);
+
+    CelsChecksum copy = *state;
+    unsigned char last[XXH3_STRIPE];
+    size_t i;
+    if (copy.buffered >= XXH3_STRIPE) {
+        Xxh3Consume (&copy, copy.buf, (copy.buffered-1) / XXH3_STRIPE);
+        memcpy (last, state->buf + state->buffered - XXH3_STRIPE, XXH3_STRIPE);
+    } else {   // join the tail of the previous stripe with the buffered data
+        size_t catchup = XXH3_STRIPE - state->buffered;
+        memcpy (last, state->buf + XXH3_BUFFER - catchup, catchup);
+        memcpy (last + catchup, state->buf, state->buffered);
+    }
+    Xxh3StripesScalar (copy.acc, last, Xxh3Secret + sizeof(Xxh3Secret) - XXH3_STRIPE - 7, 1);
+
+    CelsU64 result = state->total * XXH_PRIME64_1;
+    for (i = 0;  i < 4;  i++)
+        result += Xxh3MulFold (copy.acc[2*i] ^ CelsReadLE64 (Xxh3Secret + 11 + 16*i), copy.acc[2*i+1] ^ CelsReadLE64 (Xxh3Secret + 11 + 16*i + 8));
+    return Xxh3Avalanche (result);
+}
+
+
+// *** Service ***
+
+// Choose kernels and fill tables on the first use
+static void ChecksumSetup()
+{
+    if (CelsAtomicLoad (&ChecksumReady))  return;
+    CelsMutexLock (&ChecksumMutex);
+    if (! ChecksumReady)
+    {
+        unsigned n, k;
+        for (n = 0;  n < 256;  n++) {
+            unsigned c = n;
+            for (k = 0;  k < 8;  k++)
+                c = (c & 1? (c >> 1) ^ CRC32C_POLY : c >> 1);
+            Crc32cTable[0][n] = c;
+        }
+        for (n = 0;  n < 256;  n++)
+            for (k = 1;  k < 8;  k++)
+                Crc32cTable[k][n] = Crc32cTable[0][Crc32cTable[k-1][n] & 0xFF] ^ (Crc32cTable[k-1][n] >> 8);
+        for (k = 0;  k < 2;  k++) {
+            Crc32cLongShift[k]  = Crc32cXPowN (8ull * CRC32C_LONG  * (k+1) - 33);
+            Crc32cShortShift[k] = Crc32cXPowN (8ull * CRC32C_SHORT * (k+1) - 33);
+        }
+
+#ifdef CELS_CHECKSUM_X86
+        {
+            unsigned ecx = 0, edx = 0, ebx7 = 0, xcr0 = 0;
+#ifdef _MSC_VER
+            int r[4];
+            __cpuid (r, 1);  ecx = r[2];  edx = r[3];
+            __cpuidex (r, 7, 0);  ebx7 = r[1];
+            if ((ecx >> 27) & 1)  xcr0 = (unsigned) _xgetbv (0);
+#else
+            unsigned eax, ebx, ecx7, edx7;
+            __cpuid (1, eax, ebx, ecx, edx);
+            if (__get_cpuid_max (0, NULL) >= 7)  __cpuid_count (7, 0, eax, ebx7, ecx7, edx7);
+            if ((ecx >> 27) & 1)  __asm__ __volatile__ ("xgetbv" : "=a"(xcr0), "=d"(edx7) : "c"(0));
+#endif
+            Crc32cHardware = ((ecx >> 20) & 1)  &&  ((ecx >> 1) & 1);              // SSE4.2 and PCLMUL
+            Xxh3Level = ((ecx >> 28) & 1)  &&  (xcr0 & 6) == 6  &&  ((ebx7 >> 5) & 1)?  2  :  (edx >> 26) & 1;   // AVX2 or SSE2
+        }
+#endif
+        CelsAtomicStore (&ChecksumReady, 1);
+    }
+    CelsMutexUnlock (&ChecksumMutex);
+}
+
+static CelsResult CelsChecksumService (CelsNum operation, void* inbuf, CelsNum insize, CelsChecksum* state, CelsNum outsize)
+{
+    if (state == NULL  ||  outsize < (CelsNum) sizeof(CelsChecksum))  return CELS_ERROR_GENERAL;
+
+    if (operation == CELS_CHECKSUM_START) {
+        if (insize != CELS_CHECKSUM_CRC32C  &&  insize != CELS_CHECKSUM_XXH3)  return CELS_ERROR_NOT_IMPLEMENTED;
+        ChecksumSetup();
+        memset (state, 0, sizeof(*state));
+        state->algorithm = (int) insize;
+        if (insize == CELS_CHECKSUM_CRC32C) {
+            state->acc[0] = 0xFFFFFFFF;
+        } else {
+            state->acc[0] = XXH_PRIME32_3;  state->acc[1] = XXH_PRIME64_1;  state->acc[2] = XXH_PRIME64_2;  state->acc[3] = XXH_PRIME64_3;
+            state->acc[4] = XXH_PRIME64_4;  state->acc[5] = XXH_PRIME32_2;  state->acc[6] = XXH_PRIME64_5;  state->acc[7] = XXH_PRIME32_1;
+        }
+        return CELS_OK;
+    }
+    else if (operation == CELS_CHECKSUM_UPDATE) {
+        if (insize < 0  ||  (inbuf == NULL && insize > 0))  return CELS_ERROR_GENERAL;
+        if (state->algorithm == CELS_CHECKSUM_CRC32C)
+            state->acc[0] = Crc32cUpdate ((unsigned) state->acc[0], (const unsigned char*) inbuf, (size_t) insize);
+        else if (state->algorithm == CELS_CHECKSUM_XXH3)
+            Xxh3Update (state, (const unsigned char*) inbuf, (size_t) insize);
+        else
+            return CELS_ERROR_GENERAL;
+        state->total += insize;
+        return CELS_OK;
+    }
+    else if (operation == CELS_CHECKSUM_DIGEST) {
+        if (inbuf == NULL)  return CELS_ERROR_GENERAL;
+        if (state->algorithm == CELS_CHECKSUM_CRC32C)
+            *(unsigned long long*)inbuf = (unsigned) state->acc[0] ^ 0xFFFFFFFF;
+        else if (state->algorithm == CELS_CHECKSUM_XXH3)
+            *(unsigned long long*)inbuf = Xxh3Digest (state);
+        else
+            return CELS_ERROR_GENERAL;
+        return CELS_OK;
+    }
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+
+
 // ****************************************************************************************************************************
 // Providing actual services **************************************************************************************************
 // ****************************************************************************************************************************
@@ -409,10 +1327,33 @@ CelsResult Cels (const void* method_str, int service, CelsNum subservice, void*
         CelsUnload();
         return CELS_OK;
     }
+    else if (service==CELS_SUBMIT_TASK) {
+        return CelsPoolSubmit ((CelsTaskGroup*)inbuf, (CelsTask*)cb, ud);   // Run task cb(ud) counted in the group inbuf
+    }
+    else if (service==CELS_WAIT_TASKS) {
+        return CelsPoolWait ((CelsTaskGroup*)inbuf);
+    }
+    else if (service==CELS_GET_THREADS) {
+        return CelsPoolThreads();
+    }
+    else if (service==CELS_CHECKSUM) {
+        return CelsChecksumService (subservice, inbuf,insize, (CelsChecksum*)outbuf,outsize);   // Operation on the checksum state outbuf
+    }
 
     // Then, try to process it as parsed method
     CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method_str;
-    if (*(char*)instance == 0)   return CallCels (instance, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    if (*(char*)instance == 0) {
+        if (! IS_CELS_SET_INSTANCE_PARAM_SERVICE(service))
+            return CallCels (instance, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+
+        // "Set parameter" services modify the parsed method in-place and then unparse it, same as for the string methods
+        CelsResult result = CallCels (instance, service,subservice, inbuf,insize, NULL,0, ud,cb);
+        if (result >= CELS_OK  &&  outbuf && outsize > 0) {
+            CelsResult errcode = CallCels (instance, CELS_UNPARSE,CELS_UNPARSE_FULL, NULL,0, outbuf,outsize, ud,cb);
+            if (errcode < CELS_OK)   result = errcode;
+        }
+        return result;
+    }
 
     // And finally, parse method string, execute the service on the parsed method and unparse it back if necessary
     char method[CELS_MAX_PARSED_METHOD_SIZE];
@@ -469,6 +1410,8 @@ const char* CelsErrorMessage (CelsResult errcode)
     if (errcode == CELS_ERROR_BAD_PASSWORD)             return "Password/keyfile failed checkcode test";
     if (errcode == CELS_ERROR_BAD_HEADERS)              return "Archive headers are corrupted";
     if (errcode == CELS_ERROR_INTERNAL)                 return "It should never happen: implementation error. Please report this bug to developers!";
+    if (errcode == CELS_ERROR_PENDING)                  return "Asynchronous operation isn't yet finished";
+    if (errcode == CELS_ERROR_QUEUE_FULL)               return "Too many asynchronous operations are waiting for execution";
     else                                                return "Unknown error";
 }
 
@@ -479,26 +1422,145 @@ const char* CelsErrorMessage (CelsResult errcode)
 // ****************************************************************************************************************************
 
 // ****************************************************************************************************************************
-// (De)compress data from memory buffer (input) to another memory buffer (output).                                            *
-// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.                                      *
+// Memory budget shared by concurrent operations                                                                              *
 // ****************************************************************************************************************************
 
-// Internal structure keeping read/write buffer positions for in-memory (de)compression operations
-typedef struct
+static CelsMutex   MemMutex   = CELS_MUTEX_INITIALIZER;     // protects all Mem* variables except for MemReservedByThread
+static CelsCondVar MemChanged = CELS_CONDVAR_INITIALIZER;   // broadcasted when the queue advances or memory is released
+static CelsNum     MemBudget = 0;          // memory available to all operations together (0 - unlimited)
+static CelsNum     MemReserved = 0;        // memory reserved by running operations
+static int         MemFitting = 0;         // reduce memory usage of the method rather than wait for memory release
+static CelsNum     MemNextTicket = 0;      // ticket of the next operation entering the queue
+static CelsNum     MemServedTicket = 0;    // ticket of the operation at the head of the queue
+static CELS_THREAD_LOCAL CelsNum MemReservedByThread = 0;   // memory reserved by the operations running in the current thread
+
+// Shrink compression memory of the method to the limit, storing the modified copy of the method into fitted[],
+// so the instance of the caller, that may be shared with other threads, stays intact. Returns new memory usage or error code.
+static CelsResult CelsMemFit (const void** method, CelsNum limit, char* fitted, void* ud, CelsCallback* cb)
 {
-    char    *readPtr;           // current read position in inbuf (or NULL for redirecting reads to the original callback)
-    size_t   readLeft;          // remaining bytes in the inbuf
-    char    *writePtr;          // current write position in outbuf (or NULL for redirecting writes to the original callback)
-    size_t   writeLeft;         // remaining bytes in the outbuf
-    void    *userdata;          // data passed to the original callback
-    CelsCallback* callback;     // original callback to serve all other requests
-} CelsMemBuf;
+    char method_str[CELS_MAX_METHOD_STRING_SIZE];
+    CelsResult errcode = CelsCanonize (*method, method_str);
+    if (errcode < CELS_OK)  return errcode;
+    errcode = CelsParseStr (method_str, fitted,CELS_MAX_PARSED_METHOD_SIZE, ud,cb);
+    if (errcode < CELS_OK)  return errcode;
+    errcode = CelsLimitCompressionMem (fitted, limit, NULL);
+    if (errcode < CELS_OK)  {CelsFree (fitted);  return errcode;}
+    *method = fitted;
+    return CelsGetCompressionMem (fitted);
+}
+
+// Reserve memory required by the operation, waiting in the fair queue while it doesn't fit into the budget.
+// With fitting enabled, the compression method may be replaced by its version stored in fitted[] that should be freed after use.
+// Decompression isn't fitted since the stream requires the same resources it was compressed with.
+// Returns the amount of reserved memory, that should be passed to CelsMemRelease() once the operation is finished.
+static CelsNum CelsMemAcquire (const void** method, int service, char* fitted, void* ud, CelsCallback* cb)
+{
+    if (CelsAtomicLoad (&MemBudget) == 0)  return 0;   // no budget - don't serialize operations on the mutex
+
+    int compression = (service==CELS_COMPRESS || service==CELS_COMPRESS_BATCH);
+    CelsNum size = Cels (*method, compression? CELS_GET_COMPRESSION_MEMORY : CELS_GET_DECOMPRESSION_MEMORY,0, 0,0, 0,0, 0,0);
+    if (size <= 0)  return 0;   // codec doesn't report its memory usage
+
+    CelsMutexLock (&MemMutex);
+    // Operations started from inside of another operation (f.e. via the thread pool) don't wait, otherwise they may deadlock
+    if (MemBudget > 0  &&  MemReservedByThread == 0) {
+        CelsNum ticket = MemNextTicket++;
+        int fitted_once = !(MemFitting && compression);
+        while (ticket != MemServedTicket)
+            CelsCondWait (&MemChanged, &MemMutex);
+
+        // At the head of the queue: wait until the operation fits, but admit it anyway once nothing else is running
+        while ((MemReserved > 0  &&  MemReserved + size > MemBudget)  ||  (size > MemBudget  &&  !fitted_once)) {
+            if (!fitted_once  &&  MemReserved < MemBudget) {
+                CelsNum limit = MemBudget - MemReserved;
+                fitted_once = 1;
+                CelsMutexUnlock (&MemMutex);
+                CelsResult new_size = CelsMemFit (method, limit, fitted, ud,cb);
+                CelsMutexLock (&MemMutex);
+                if (new_size > 0)  size = new_size;
+                continue;
+            }
+            if (MemReserved == 0)  break;
+            CelsCondWait (&MemChanged, &MemMutex);
+        }
+        MemServedTicket++;
+        CelsCondBroadcast (&MemChanged);
+    }
+    MemReserved += size;
+    MemReservedByThread += size;
+    CelsMutexUnlock (&MemMutex);
+    return size;
+}
+
+static void CelsMemRelease (CelsNum size)
+{
+    if (size == 0)  return;
+    CelsMutexLock (&MemMutex);
+    MemReserved -= size;
+    MemReservedByThread -= size;
+    CelsCondBroadcast (&MemChanged);
+    CelsMutexUnlock (&MemMutex);
+}
+
+CelsResult CelsSetMemoryBudget (CelsNum budget, int fitting)
+{
+    CelsMutexLock (&MemMutex);
+    CelsAtomicStore (&MemBudget, budget);
+    MemFitting = fitting;
+    CelsCondBroadcast (&MemChanged);
+    CelsMutexUnlock (&MemMutex);
+    return CELS_OK;
+}
+
+
+// ****************************************************************************************************************************
+// (De)compress data from memory buffer (input) to another memory buffer (output).                                            *
+// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.                                      *
+// ****************************************************************************************************************************
+
+// Serve CELS_READV/CELS_WRITEV with CELS_READ/CELS_WRITE of every buffer, for callbacks handling them in-process
+static CelsResult CelsSplitVectored (void* self, CelsCallback* callback, int service, CelsIoVec* iov, CelsNum count)
+{
+    CelsNum i, done;
+    CelsResult result = 0;
+    for (i = 0;  i < count;  i++) {
+        for (done = 0;  done < iov[i].size; ) {
+            char* buf = (char*)iov[i].buf + done;
+            CelsResult bytes = (service==CELS_READV? callback (self, CELS_READ,0,  buf,iov[i].size-done, 0,0, 0,0)
+                                                   : callback (self, CELS_WRITE,0, 0,0, buf,iov[i].size-done, 0,0));
+            if (bytes < CELS_OK)  return bytes;
+            if (bytes == 0)       return result + done;   // EOF
+            done += bytes;
+        }
+        result += done;
+    }
+    return result;
+}
+
+// Internal structure keeping read/write buffer positions for in-memory (de)compression operations
+typedef struct
+{
+    char    *readPtr;           // current read position in inbuf (or NULL for redirecting reads to the original callback)
+    size_t   readLeft;          // remaining bytes in the inbuf
+    char    *writePtr;          // current write position in outbuf (or NULL for redirecting writes to the original callback)
+    size_t   writeLeft;         // remaining bytes in the outbuf
+    void    *userdata;          // data passed to the original callback
+    CelsCallback* callback;     // original callback to serve all other requests
+} CelsMemBuf;
 
 // Callback emulating CELS_READ/CELS_WRITE for in-memory (de)compression operations
 static CelsResult __cdecl CelsReadWriteMem (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
 {
     CelsMemBuf *membuf = (CelsMemBuf*)self;
-    if (service==CELS_READ  &&  membuf->readPtr)
+    // Buffers hold stream 0, requests for other streams of multi-stream codecs go to the original callback
+    if (service==CELS_READ_STREAM   &&  subservice==0)  service = CELS_READ;
+    if (service==CELS_WRITE_STREAM  &&  subservice==0)  service = CELS_WRITE;
+    if ((service==CELS_READV  &&  membuf->readPtr)  ||  (service==CELS_WRITEV  &&  membuf->writePtr))
+    {
+        return CelsSplitVectored (self, CelsReadWriteMem, service, (CelsIoVec*)(service==CELS_READV? inbuf : outbuf),
+                                                                   (service==CELS_READV? insize : outsize));
+    }
+    else if (service==CELS_READ  &&  membuf->readPtr)
     {
         // Copy data from readPtr to inbuf and advance the read pointer
         size_t read_bytes = membuf->readLeft<insize ? membuf->readLeft : insize;
@@ -524,32 +1586,2029 @@ static CelsResult __cdecl CelsReadWriteMem (void* self, int service, CelsNum sub
     }
 }
 
-// Compress buffer (inbuf,insize) into buffer (outbuf,outsize) and return compressed size or error_code<0.
-// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.
-CelsResult CelsCompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+// Perform CELS_COMPRESS/CELS_DECOMPRESS operation within the memory budget
+static CelsResult CelsProcessMem (const void* method, int service, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
 {
-    CelsResult result = Cels(method, CELS_COMPRESS,0, inbuf,insize, outbuf,outsize, ud,cb);
-    if (result != CELS_ERROR_NOT_IMPLEMENTED) {
+    // Parse method string only once for all calls below
+    if (*(const char*)method != 0) {
+        char parsed[CELS_MAX_PARSED_METHOD_SIZE];
+        CelsResult result = CelsParseStr ((const char*) method, parsed,sizeof(parsed), ud,cb);
+        if (result < CELS_OK)  return result;
+        result = CelsProcessMem (parsed, service, inbuf,insize, outbuf,outsize, ud,cb);
+        CelsFree (parsed);
         return result;
-    } else {
+    }
+
+    char fitted[CELS_MAX_PARSED_METHOD_SIZE];
+    CelsNum reserved = CelsMemAcquire (&method, service, fitted, ud,cb);
+
+    // Skip the direct call when the codec is known to lack buffers support, emulating them with callbacks
+    CelsNum mode = (inbuf && outbuf? CELS_CAP_MEMBUF : inbuf? CELS_CAP_MEMBUF_INPUT : outbuf? CELS_CAP_MEMBUF_OUTPUT : CELS_CAP_CALLBACKS);
+    RegModes* modes = CelsMethodModes (method);
+    CelsResult result = CELS_ERROR_NOT_IMPLEMENTED;
+    if (mode == CELS_CAP_CALLBACKS  ||  CelsMethodMode (method, service, mode) != 0) {
+        result = Cels(method, service,0, inbuf,insize, outbuf,outsize, ud,cb);
+        if (mode != CELS_CAP_CALLBACKS)
+            CelsLearnMode (modes, service, mode, result != CELS_ERROR_NOT_IMPLEMENTED);
+    }
+    if (result == CELS_ERROR_NOT_IMPLEMENTED  &&  mode != CELS_CAP_CALLBACKS) {
         CelsMemBuf membuf = {(char*)inbuf,(size_t)insize, (char*)outbuf,(size_t)outsize, ud,cb};
-        result = CelsCompress (method, &membuf, CelsReadWriteMem);
+        result = Cels(method, service,0, 0,0, 0,0, &membuf, CelsReadWriteMem);
         // Return error code or number of bytes written to the buffer
-        return result<CELS_OK ? result : outsize-membuf.writeLeft;
+        if (result >= CELS_OK)  result = outsize-membuf.writeLeft;
     }
+
+    CelsMemRelease (reserved);
+    if (method == fitted)  CelsFree (fitted);
+    return result;
+}
+
+// Compress buffer (inbuf,insize) into buffer (outbuf,outsize) and return compressed size or error_code<0.
+// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.
+CelsResult CelsCompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    return CelsProcessMem (method, CELS_COMPRESS, inbuf,insize, outbuf,outsize, ud,cb);
 }
 
 // Decompress buffer (inbuf,insize) into buffer (outbuf,outsize) and return decompressed size or error_code<0.
 // When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.
 CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
 {
-    CelsResult result = Cels(method, CELS_DECOMPRESS,0, inbuf,insize, outbuf,outsize, ud,cb);
-    if (result != CELS_ERROR_NOT_IMPLEMENTED) {
-        return result;
+    return CelsProcessMem (method, CELS_DECOMPRESS, inbuf,insize, outbuf,outsize, ud,cb);
+}
+
+
+// ****************************************************************************************************************************
+// Multi-stream I/O: route requests of every codec stream to its own callback                                                 *
+// ****************************************************************************************************************************
+
+// Stream number of CELS_READ*/CELS_WRITE* request is looked up in the targets, everything else goes to the default callback
+CelsResult __cdecl CelsMultiStreamCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsMultiStream* router = (CelsMultiStream*)self;
+    CelsNum stream = (service==CELS_READ_STREAM || service==CELS_WRITE_STREAM)? subservice : 0;
+    if ((service==CELS_READ || service==CELS_READ_STREAM)  &&  stream>=0  &&  stream < router->num_inputs  &&  router->inputs[stream].cb)
+        return router->inputs[stream].cb (router->inputs[stream].ud, CELS_READ,0, inbuf,insize, 0,0, ud,cb);
+    if ((service==CELS_WRITE || service==CELS_WRITE_STREAM)  &&  stream>=0  &&  stream < router->num_outputs  &&  router->outputs[stream].cb)
+        return router->outputs[stream].cb (router->outputs[stream].ud, CELS_WRITE,0, 0,0, outbuf,outsize, ud,cb);
+    // Vectored requests belong to stream 0; targets not implementing them make the codec fall back to CELS_READ/CELS_WRITE
+    if (service==CELS_READV  &&  router->num_inputs > 0  &&  router->inputs[0].cb)
+        return router->inputs[0].cb (router->inputs[0].ud, service,0, inbuf,insize, 0,0, ud,cb);
+    if (service==CELS_WRITEV  &&  router->num_outputs > 0  &&  router->outputs[0].cb)
+        return router->outputs[0].cb (router->outputs[0].ud, service,0, 0,0, outbuf,outsize, ud,cb);
+    return (router->cb? router->cb (router->ud, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                      : CELS_ERROR_NOT_IMPLEMENTED);
+}
+
+// Read from/append to the memory buffer
+CelsResult __cdecl CelsMemStreamCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsMemStream* mem = (CelsMemStream*)self;
+    CelsNum left = mem->size - mem->pos;
+    if (service == CELS_READV)   return CelsSplitVectored (self, CelsMemStreamCallback, service, (CelsIoVec*)inbuf,  insize);
+    if (service == CELS_WRITEV)  return CelsSplitVectored (self, CelsMemStreamCallback, service, (CelsIoVec*)outbuf, outsize);
+    if (service == CELS_READ) {
+        CelsNum read_bytes = (left<insize ? left : insize);
+        memcpy (inbuf, (char*)mem->buf + mem->pos, read_bytes);
+        mem->pos += read_bytes;
+        return read_bytes;
+    }
+    if (service == CELS_WRITE) {
+        if (outsize > left)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        memcpy ((char*)mem->buf + mem->pos, outbuf, outsize);
+        mem->pos += outsize;
+        return outsize;
+    }
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+
+// Perform CELS_COMPRESS/CELS_DECOMPRESS operation with streams in memory buffers, within the memory budget
+static CelsResult CelsProcessMemStreams (const void* method, int service, CelsMemStream* inputs, CelsNum num_inputs, CelsMemStream* outputs, CelsNum num_outputs, void* ud, CelsCallback* cb)
+{
+    char fitted[CELS_MAX_PARSED_METHOD_SIZE];
+    CelsMultiStream router = {NULL,num_inputs, NULL,num_outputs, ud,cb};
+    CelsNum i, reserved;
+    CelsResult result;
+
+    CelsStreamTarget* targets = (CelsStreamTarget*) malloc ((num_inputs+num_outputs+1) * sizeof(CelsStreamTarget));
+    if (!targets)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    for (i=0; i<num_inputs; i++)
+        targets[i].ud = &inputs[i],  targets[i].cb = CelsMemStreamCallback;
+    for (i=0; i<num_outputs; i++)
+        targets[num_inputs+i].ud = &outputs[i],  targets[num_inputs+i].cb = CelsMemStreamCallback;
+    router.inputs  = targets;
+    router.outputs = targets + num_inputs;
+
+    reserved = CelsMemAcquire (&method, service, fitted, ud,cb);
+    result = Cels(method, service,0, 0,0, 0,0, &router, CelsMultiStreamCallback);
+    CelsMemRelease (reserved);
+    if (method == fitted)  CelsFree (fitted);
+    free (targets);
+    return (result > CELS_OK? CELS_OK : result);
+}
+
+CelsResult CelsCompressMemStreams (const void* method, CelsMemStream* inputs, CelsNum num_inputs, CelsMemStream* outputs, CelsNum num_outputs, void* ud, CelsCallback* cb)
+{
+    return CelsProcessMemStreams (method, CELS_COMPRESS, inputs,num_inputs, outputs,num_outputs, ud,cb);
+}
+
+CelsResult CelsDecompressMemStreams (const void* method, CelsMemStream* inputs, CelsNum num_inputs, CelsMemStream* outputs, CelsNum num_outputs, void* ud, CelsCallback* cb)
+{
+    return CelsProcessMemStreams (method, CELS_DECOMPRESS, inputs,num_inputs, outputs,num_outputs, ud,cb);
+}
+
+
+// ****************************************************************************************************************************
+// Verify-after-compress: compressed output is decompressed by the second thread as it's produced and compared with input     *
+// ****************************************************************************************************************************
+
+#define CELS_VERIFY_DEFAULT_WINDOW (16*1024*1024)
+
+// Chunk of retained input or queued compressed data, followed by the data itself
+typedef struct CelsVerifyChunk
+{
+    struct CelsVerifyChunk* next;
+    CelsNum                 size;
+} CelsVerifyChunk;
+
+// FIFO of chunks: the compressing thread appends, the verifying thread consumes
+typedef struct
+{
+    CelsVerifyChunk *first, *last;
+    CelsNum          bytes;     // unconsumed bytes in the list
+    CelsNum          consumed;  // bytes of the first chunk already consumed
+} CelsVerifyList;
+
+typedef struct CelsVerifier
+{
+    const void*    method;      // parsed method for the decompressor
+    char*          parsed;      // own instance of the method, or NULL if the codec can't be canonized and it's shared with the compressor
+    void*          userdata;    // data passed to the original callback
+    CelsCallback*  callback;    // original callback: receives compressed data (unless outbuf is used) and all other requests
+    char*          outbuf;      // buffer for compressed data, or NULL to pass it to the original callback
+    CelsNum        outsize, outpos;
+    const char*    inbuf;       // entire input when it's in memory, otherwise copies of input are retained in the `input`
+    CelsNum        insize;
+    CelsNum        window;      // limit for retained input plus queued compressed data
+    CelsVerifyList input;       // input not yet matched with decompressed data
+    CelsVerifyList output;      // compressed data not yet consumed by the decompressor
+    CelsNum        received;    // input bytes passed to the compressor
+    CelsNum        verified;    // input bytes matched with decompressed data
+    int            eof;         // compression finished, there will be no more compressed data
+    int            starving;    // decompressor waits for compressed data
+    int            done;        // decompressor finished (or was never started)
+    int            failed;      // mismatch found, or (de)compression failed
+    CelsResult     result;      // result of decompression
+    CelsThread     thread;
+    CelsMutex      mutex;
+    CelsCondVar    changed;     // broadcasted on every change of the state above
+} CelsVerifier;
+
+static void CelsVerifyFreeList (CelsVerifyList* list)
+{
+    while (list->first) {
+        CelsVerifyChunk* chunk = list->first;
+        list->first = chunk->next;
+        free (chunk);
+    }
+    list->last = NULL;
+    list->bytes = list->consumed = 0;
+}
+
+// Copy the data to a new chunk at the end of the list. The window is enforced by waiting for the decompressor, unless it
+// has consumed all queued compressed data and needs more of it to proceed (so waiting would never end)
+static CelsResult CelsVerifyAppend (CelsVerifier* v, CelsVerifyList* list, const void* buf, CelsNum size)
+{
+    if (size <= 0)  return CELS_OK;
+    CelsVerifyChunk* chunk = (CelsVerifyChunk*) malloc (sizeof(CelsVerifyChunk) + size);
+    if (chunk == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    chunk->next = NULL;
+    chunk->size = size;
+    memcpy (chunk+1, buf, size);
+
+    CelsMutexLock (&v->mutex);
+    while (v->input.bytes + v->output.bytes + size > v->window  &&  !v->failed  &&  !v->done  &&  !(v->starving && v->output.bytes==0))
+        CelsCondWait (&v->changed, &v->mutex);
+    int failed = v->failed;
+    if (list == &v->input)  v->received += size;
+    if (v->done  ||  failed) {
+        free (chunk);   // nobody will consume it
     } else {
-        CelsMemBuf membuf = {(char*)inbuf,(size_t)insize, (char*)outbuf,(size_t)outsize, ud,cb};
-        result = CelsDecompress (method, &membuf, CelsReadWriteMem);
-        // Return error code or number of bytes written to the buffer
-        return result<CELS_OK ? result : outsize-membuf.writeLeft;
+        if (list->last)  list->last->next = chunk;  else  list->first = chunk;
+        list->last = chunk;
+        list->bytes += size;
+        CelsCondBroadcast (&v->changed);
+    }
+    CelsMutexUnlock (&v->mutex);
+    return (failed? CELS_ERROR_BAD_COMPRESSED_DATA : CELS_OK);
+}
+
+// Callback of the compressor: retains input read via CELS_READ, queues compressed data for the decompressor and passes them on
+static CelsResult __cdecl CelsVerifyCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsVerifier* v = (CelsVerifier*)self;
+    if (service == CELS_READV)   return CelsSplitVectored (self, CelsVerifyCallback, service, (CelsIoVec*)inbuf,  insize);
+    if (service == CELS_WRITEV)  return CelsSplitVectored (self, CelsVerifyCallback, service, (CelsIoVec*)outbuf, outsize);
+    if (service == CELS_READ) {
+        CelsResult result = (v->callback? v->callback (v->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb) : CELS_ERROR_NOT_IMPLEMENTED);
+        if (result > 0  &&  v->inbuf == NULL) {
+            CelsResult errcode = CelsVerifyAppend (v, &v->input, inbuf, result);
+            if (errcode < CELS_OK)  return errcode;
+        }
+        return result;
+    }
+    if (service == CELS_WRITE) {
+        if (v->outbuf  &&  outsize > v->outsize - v->outpos)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        CelsResult errcode = CelsVerifyAppend (v, &v->output, outbuf, outsize);
+        if (errcode < CELS_OK)  return errcode;
+        if (v->outbuf) {
+            memcpy (v->outbuf + v->outpos, outbuf, outsize);
+            v->outpos += outsize;
+            return outsize;
+        }
+    }
+    return (v->callback? v->callback (v->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                       : CELS_ERROR_NOT_IMPLEMENTED);
+}
+
+// Callback of the decompressor: CELS_READ waits for compressed data, CELS_WRITE compares decompressed data with the input.
+// All other requests go to the original callback from the verifying thread
+static CelsResult __cdecl CelsVerifyDecompressCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsVerifier* v = (CelsVerifier*)self;
+    if (service == CELS_READV)   return CelsSplitVectored (self, CelsVerifyDecompressCallback, service, (CelsIoVec*)inbuf,  insize);
+    if (service == CELS_WRITEV)  return CelsSplitVectored (self, CelsVerifyDecompressCallback, service, (CelsIoVec*)outbuf, outsize);
+    if (service == CELS_READ) {
+        CelsNum read_bytes = 0;
+        while (read_bytes < insize) {
+            CelsMutexLock (&v->mutex);
+            while (v->output.bytes == 0  &&  !v->eof  &&  !v->failed) {
+                v->starving = 1;
+                CelsCondBroadcast (&v->changed);
+                CelsCondWait (&v->changed, &v->mutex);
+            }
+            v->starving = 0;
+            int failed = v->failed;
+            CelsVerifyChunk* chunk = v->output.first;
+            CelsNum consumed = v->output.consumed;
+            CelsMutexUnlock (&v->mutex);
+            if (failed)         return CELS_ERROR_BAD_COMPRESSED_DATA;
+            if (chunk == NULL)  break;   // eof
+
+            // Only this thread removes chunks, so the first one may be copied outside of the lock
+            CelsNum bytes = (chunk->size-consumed < insize-read_bytes ? chunk->size-consumed : insize-read_bytes);
+            memcpy ((char*)inbuf + read_bytes, (char*)(chunk+1) + consumed, bytes);
+            read_bytes += bytes;
+
+            CelsMutexLock (&v->mutex);
+            v->output.bytes    -= bytes;
+            v->output.consumed += bytes;
+            if (v->output.consumed == chunk->size) {
+                v->output.first = chunk->next;
+                if (v->output.first == NULL)  v->output.last = NULL;
+                v->output.consumed = 0;
+            } else {
+                chunk = NULL;
+            }
+            CelsCondBroadcast (&v->changed);
+            CelsMutexUnlock (&v->mutex);
+            free (chunk);
+        }
+        return read_bytes;
+    }
+
+    if (service == CELS_WRITE) {
+        CelsNum pos = 0;
+        int mismatch = 0;
+        while (pos < outsize  &&  !mismatch) {
+            CelsNum bytes = outsize - pos;
+            CelsVerifyChunk* chunk = NULL;
+            if (v->inbuf) {
+                // Only this thread modifies v->verified
+                mismatch = (bytes > v->insize - v->verified)  ||  memcmp ((char*)outbuf + pos, v->inbuf + v->verified, bytes) != 0;
+                CelsMutexLock (&v->mutex);
+            } else {
+                CelsMutexLock (&v->mutex);
+                chunk = v->input.first;
+                if (chunk == NULL)  {mismatch = 1;  CelsMutexUnlock (&v->mutex);  break;}   // more data than input
+                CelsNum consumed = v->input.consumed;
+                if (bytes > chunk->size - consumed)  bytes = chunk->size - consumed;
+                CelsMutexUnlock (&v->mutex);
+                mismatch = memcmp ((char*)outbuf + pos, (char*)(chunk+1) + consumed, bytes) != 0;
+                CelsMutexLock (&v->mutex);
+                v->input.bytes    -= bytes;
+                v->input.consumed += bytes;
+                if (v->input.consumed == chunk->size) {
+                    v->input.first = chunk->next;
+                    if (v->input.first == NULL)  v->input.last = NULL;
+                    v->input.consumed = 0;
+                } else {
+                    chunk = NULL;
+                }
+            }
+            if (!mismatch)  v->verified += bytes;
+            if (mismatch)   v->failed = 1;
+            CelsCondBroadcast (&v->changed);
+            CelsMutexUnlock (&v->mutex);
+            free (chunk);
+            pos += bytes;
+        }
+        return (mismatch? CELS_ERROR_BAD_COMPRESSED_DATA : outsize);
+    }
+
+    return (v->callback? v->callback (v->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                       : CELS_ERROR_NOT_IMPLEMENTED);
+}
+
+static CELS_THREAD_FUNCTION (CelsVerifyThread, arg)
+{
+    CelsVerifier* v = (CelsVerifier*)arg;
+    // Not counted in the memory budget: the compressor holding its reservation may wait for us
+    CelsResult result = Cels (v->method, CELS_DECOMPRESS,0, 0,0, 0,0, v, CelsVerifyDecompressCallback);
+    CelsMutexLock (&v->mutex);
+    v->result = result;
+    v->done = 1;
+    if (result < CELS_OK)  v->failed = 1;   // don't waste time on compressing the rest
+    CelsCondBroadcast (&v->changed);
+    CelsMutexUnlock (&v->mutex);
+    return 0;
+}
+
+// Prepare the verifier; input is either in (inbuf,insize) or retained as read/pushed. Compressed data go to (outbuf,outsize)
+// or to the CELS_WRITE of the original callback
+static void CelsVerifyInit (CelsVerifier* v, const void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, CelsNum window, void* ud, CelsCallback* cb)
+{
+    memset (v, 0, sizeof(CelsVerifier));
+    v->inbuf    = (const char*)inbuf;
+    v->insize   = insize;
+    v->outbuf   = (char*)outbuf;
+    v->outsize  = outsize;
+    v->window   = (window > 0? window : CELS_VERIFY_DEFAULT_WINDOW);
+    v->userdata = ud;
+    v->callback = cb;
+    v->done     = 1;
+    CelsMutexInit (&v->mutex);
+    CelsCondInit (&v->changed);
+}
+
+// Start the decompressor thread with its own copy of the method, since codecs may update their instances while compressing
+static CelsResult CelsVerifyStart (CelsVerifier* v, const void* method)
+{
+    char method_str[CELS_MAX_METHOD_STRING_SIZE];
+    v->method = method;
+    if (CelsCanonize (method, method_str) >= CELS_OK) {
+        v->parsed = (char*) malloc (CELS_MAX_PARSED_METHOD_SIZE);
+        if (v->parsed == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        CelsResult errcode = CelsParseStr (method_str, v->parsed,CELS_MAX_PARSED_METHOD_SIZE, v->userdata,v->callback);
+        if (errcode < CELS_OK)  {free (v->parsed);  v->parsed = NULL;  return errcode;}
+        v->method = v->parsed;
+    }
+    v->done = 0;
+    if (! CelsThreadCreate (&v->thread, CelsVerifyThread, v))  {v->done = 1;  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+    CelsThreadDetach (v->thread);
+    return CELS_OK;
+}
+
+// Wait for the decompressor and combine the compression result with the verification result
+static CelsResult CelsVerifyFinish (CelsVerifier* v, CelsResult result)
+{
+    CelsMutexLock (&v->mutex);
+    int failed = v->failed;   // the compressor may report verification failure as some other error
+    v->eof = 1;
+    if (result < CELS_OK)  v->failed = 1;   // stop the decompressor ASAP
+    CelsCondBroadcast (&v->changed);
+    while (! v->done)
+        CelsCondWait (&v->changed, &v->mutex);
+    CelsMutexUnlock (&v->mutex);
+
+    CelsVerifyFreeList (&v->input);
+    CelsVerifyFreeList (&v->output);
+    if (v->parsed)  CelsFree (v->parsed),  free (v->parsed);
+    CelsMutexDestroy (&v->mutex);
+    CelsCondDestroy (&v->changed);
+    if (failed)            return CELS_ERROR_BAD_COMPRESSED_DATA;
+    if (result < CELS_OK)  return result;
+    if (v->failed  ||  v->result < CELS_OK  ||  v->verified != (v->inbuf? v->insize : v->received))
+        return CELS_ERROR_BAD_COMPRESSED_DATA;
+    return result;
+}
+
+// Compress like CelsCompressMem, while decompressing the compressed data in the second thread and comparing them with input
+CelsResult CelsCompressMemVerified (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, CelsNum window, void* ud, CelsCallback* cb)
+{
+    // Parse method string only once for the compressor and, in the buffer-to-buffer case, the decompressor
+    if (*(const char*)method != 0) {
+        char parsed[CELS_MAX_PARSED_METHOD_SIZE];
+        CelsResult result = CelsParseStr ((const char*) method, parsed,sizeof(parsed), ud,cb);
+        if (result < CELS_OK)  return result;
+        result = CelsCompressMemVerified (parsed, inbuf,insize, outbuf,outsize, window, ud,cb);
+        CelsFree (parsed);
+        return result;
+    }
+
+    // Buffer-to-buffer codecs produce the whole output at once (possibly in the format of their own), so there is nothing
+    // to overlap with: decompress the output the same way and compare
+    if (inbuf  &&  outbuf) {
+        CelsResult result = CelsProcessMem (method, CELS_COMPRESS, inbuf,insize, outbuf,outsize, ud,cb);
+        if (result < CELS_OK)  return result;
+        char* copy = (char*) malloc (insize+1);
+        if (copy == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        CelsResult decompressed = CelsProcessMem (method, CELS_DECOMPRESS, outbuf,result, copy,insize, ud,cb);
+        if (decompressed != insize  ||  memcmp (copy, inbuf, insize) != 0)  result = CELS_ERROR_BAD_COMPRESSED_DATA;
+        free (copy);
+        return result;
+    }
+
+    CelsVerifier v;
+    CelsVerifyInit (&v, inbuf,insize, outbuf,outsize, window, ud,cb);
+    CelsResult result = CelsVerifyStart (&v, method);
+    if (result < CELS_OK)  return CelsVerifyFinish (&v, result);
+    // Compressed data always pass through the verifier callback, while input is taken directly from inbuf if possible
+    result = CelsProcessMem (method, CELS_COMPRESS, inbuf,insize, NULL,0, &v, CelsVerifyCallback);
+    result = CelsVerifyFinish (&v, result);
+    if (result >= CELS_OK  &&  outbuf)  result = v.outpos;
+    return result;
+}
+
+
+// ****************************************************************************************************************************
+// (De)compress many independent memory buffers in a single call                                                              *
+// ****************************************************************************************************************************
+
+// Part of the batch processed by a single thread
+typedef struct
+{
+    const void*    method;      // parsed method
+    int            service;     // CELS_COMPRESS_BATCH or CELS_DECOMPRESS_BATCH
+    CelsBatchItem* items;
+    CelsNum        num_items;
+    void*          userdata;
+    CelsCallback*  callback;
+    CelsResult     errcode;     // result of processing the entire part
+} CelsBatchJob;
+
+// Process the batch with the codec service, or item-by-item if the codec doesn't support batches
+static void CelsRunBatch (CelsBatchJob* job)
+{
+    CelsNum i;
+    const void* method = job->method;
+    char fitted[CELS_MAX_PARSED_METHOD_SIZE];
+    RegModes* modes = CelsMethodModes (method);
+    job->errcode = CELS_ERROR_NOT_IMPLEMENTED;
+    if (CelsMethodMode (method, job->service, CELS_CAP_BATCH) != 0) {
+        CelsNum reserved = CelsMemAcquire (&method, job->service, fitted, job->userdata,job->callback);
+        job->errcode = Cels (method, job->service,0, job->items,job->num_items, NULL,0, job->userdata,job->callback);
+        CelsMemRelease (reserved);
+        if (method == fitted)  CelsFree (fitted);
+        CelsLearnMode (modes, job->service, CELS_CAP_BATCH, job->errcode != CELS_ERROR_NOT_IMPLEMENTED);
+    }
+    if (job->errcode != CELS_ERROR_NOT_IMPLEMENTED)  return;
+
+    for (i = 0;  i < job->num_items;  i++) {
+        CelsBatchItem* item = &job->items[i];
+        item->result = (job->service==CELS_COMPRESS_BATCH? CelsCompressMem : CelsDecompressMem)
+                           (job->method, item->inbuf,item->insize, item->outbuf,item->outsize, job->userdata,job->callback);
+    }
+    job->errcode = CELS_OK;
+}
+
+static void __cdecl CelsBatchTask (void* arg)
+{
+    CelsRunBatch ((CelsBatchJob*) arg);
+}
+
+static CelsResult CelsBatch (const void* method, int service, CelsBatchItem* items, CelsNum num_items, int threads, void* ud, CelsCallback* cb)
+{
+    // Parse method string only once for the entire batch
+    if (*(const char*)method != 0) {
+        char parsed[CELS_MAX_PARSED_METHOD_SIZE];
+        CelsResult result = CelsParseStr ((const char*) method, parsed,sizeof(parsed), ud,cb);
+        if (result < CELS_OK)  return result;
+        result = CelsBatch (parsed, service, items,num_items, threads, ud,cb);
+        CelsFree (parsed);
+        return result;
+    }
+
+    if (threads > num_items)  threads = (int) num_items;
+    if (threads <= 1) {
+        CelsBatchJob job = {method, service, items,num_items, ud,cb, CELS_OK};
+        CelsRunBatch (&job);
+        return job.errcode;
+    }
+
+    // Split the batch into equal parts, queueing all but the first one to the framework thread pool
+    CelsBatchJob* jobs = (CelsBatchJob*) malloc (threads * sizeof(CelsBatchJob));
+    if (jobs == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    CelsTaskGroup group = {0};
+    CelsResult errcode = CELS_OK;
+    int i;
+
+    for (i = 0;  i < threads;  i++) {
+        CelsNum first = num_items * i / threads,  last = num_items * (i+1) / threads;
+        CelsBatchJob job = {method, service, items+first,last-first, ud,cb, CELS_OK};
+        jobs[i] = job;
+        if (i > 0)  CelsPoolSubmit (&group, CelsBatchTask, &jobs[i]);
+    }
+    CelsRunBatch (&jobs[0]);
+    CelsPoolWait (&group);
+
+    for (i = 0;  i < threads;  i++)
+        if (jobs[i].errcode < CELS_OK  &&  errcode == CELS_OK)  errcode = jobs[i].errcode;
+    free (jobs);
+    return errcode;
+}
+
+// (De)compress num_items independent buffers and return CELS_OK or error code of the entire batch
+CelsResult CelsCompressBatch (const void* method, CelsBatchItem* items, CelsNum num_items, int threads, void* ud, CelsCallback* cb)
+{
+    return CelsBatch (method, CELS_COMPRESS_BATCH, items,num_items, threads, ud,cb);
+}
+
+CelsResult CelsDecompressBatch (const void* method, CelsBatchItem* items, CelsNum num_items, int threads, void* ud, CelsCallback* cb)
+{
+    return CelsBatch (method, CELS_DECOMPRESS_BATCH, items,num_items, threads, ud,cb);
+}
+
+
+// ****************************************************************************************************************************
+// Asynchronous (de)compression in the framework thread pool                                                                  *
+// ****************************************************************************************************************************
+
+struct CelsAsyncJob
+{
+    const void*   method;       // parsed method
+    int           service;      // CELS_COMPRESS or CELS_DECOMPRESS
+    void*         inbuf;   CelsNum insize;
+    void*         outbuf;  CelsNum outsize;
+    void*         userdata;     // data passed to the original callback
+    CelsCallback* callback;     // original callback
+    volatile int  cancelled;    // set by CelsAsyncCancel()
+    int           done;         // result is ready
+    int           refcount;     // job is freed when both the application and the pool released it
+    CelsResult    result;       // result of the operation
+    char*         parsed;       // buffer for the method string parsed by the job itself, allocated right after the job
+};
+
+static int AsyncQueueLength = 0;       // number of jobs waiting for execution (protected by PoolMutex)
+static int AsyncMaxQueueLength = 0;    // 0 - unlimited
+
+// Callback passed to the codec: terminates the operation once it was cancelled, otherwise passes all calls to the original callback
+static CelsResult __cdecl CelsAsyncCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsAsyncJob* job = (CelsAsyncJob*)self;
+    if (job->cancelled  &&  service != CELS_MEM_FREE)   // memory should be freed anyway
+        return CELS_ERROR_OPERATION_TERMINATED;
+    return (job->callback? job->callback (job->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                         : CELS_ERROR_NOT_IMPLEMENTED);
+}
+
+// Drop one reference to the job (PoolMutex should be locked)
+static void CelsAsyncUnref (CelsAsyncJob* job)
+{
+    if (--job->refcount == 0)  free (job);
+}
+
+// Perform the operation and notify the application
+static void CelsAsyncRun (CelsAsyncJob* job)
+{
+    CelsResult result = CELS_ERROR_OPERATION_TERMINATED;
+    if (! job->cancelled)
+        result = (job->service==CELS_COMPRESS? CelsCompressMem : CelsDecompressMem)
+                     (job->method, job->inbuf,job->insize, job->outbuf,job->outsize, job, CelsAsyncCallback);
+    if (job->cancelled)
+        result = CELS_ERROR_OPERATION_TERMINATED;
+    if (job->method == job->parsed)
+        CelsFree (job->parsed);
+
+    // Notify via callback prior to waking up waiters, since they may free data used by the callback
+    if (job->callback)
+        job->callback (job->userdata, CELS_ASYNC_COMPLETED,result, job,0, NULL,0, NULL,NULL);
+
+    CelsMutexLock (&PoolMutex);
+    job->result = result;
+    job->done = 1;
+    CelsCondBroadcast (&PoolTaskDone);
+    CelsAsyncUnref (job);
+    CelsMutexUnlock (&PoolMutex);
+}
+
+static void __cdecl CelsAsyncTask (void* arg)
+{
+    CelsMutexLock (&PoolMutex);
+    AsyncQueueLength--;
+    CelsMutexUnlock (&PoolMutex);
+    CelsAsyncRun ((CelsAsyncJob*) arg);
+}
+
+static CelsResult CelsAsync (const void* method, int service, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb, CelsAsyncJob** handle)
+{
+    *handle = NULL;
+    CelsAsyncJob* job = (CelsAsyncJob*) malloc (sizeof(CelsAsyncJob) + CELS_MAX_PARSED_METHOD_SIZE);
+    if (job == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    job->method = method;
+    job->service = service;
+    job->inbuf = inbuf;    job->insize = insize;
+    job->outbuf = outbuf;  job->outsize = outsize;
+    job->userdata = ud;
+    job->callback = cb;
+    job->cancelled = 0;
+    job->done = 0;
+    job->refcount = 2;     // the application and the pool
+    job->result = CELS_ERROR_PENDING;
+    job->parsed = (char*)(job+1);
+
+    // Parse the method string right now, reporting errors immediately
+    if (*(const char*)method != 0) {
+        CelsResult errcode = CelsParseStr ((const char*) method, job->parsed,CELS_MAX_PARSED_METHOD_SIZE, ud,cb);
+        if (errcode < CELS_OK)  {free (job);  return errcode;}
+        job->method = job->parsed;
+    }
+
+    CelsMutexLock (&PoolMutex);
+    int full = (AsyncMaxQueueLength > 0  &&  AsyncQueueLength >= AsyncMaxQueueLength);
+    if (! full)  AsyncQueueLength++;
+    CelsMutexUnlock (&PoolMutex);
+
+    if (full) {
+        if (job->method == job->parsed)  CelsFree (job->parsed);
+        free (job);
+        return CELS_ERROR_QUEUE_FULL;
+    }
+    *handle = job;
+    return CelsPoolSubmit (NULL, CelsAsyncTask, job);
+}
+
+CelsResult CelsCompressAsync (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb, CelsAsyncJob** job)
+{
+    return CelsAsync (method, CELS_COMPRESS, inbuf,insize, outbuf,outsize, ud,cb, job);
+}
+
+CelsResult CelsDecompressAsync (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb, CelsAsyncJob** job)
+{
+    return CelsAsync (method, CELS_DECOMPRESS, inbuf,insize, outbuf,outsize, ud,cb, job);
+}
+
+CelsResult CelsAsyncPoll (CelsAsyncJob* job)
+{
+    CelsMutexLock (&PoolMutex);
+    CelsResult result = job->done? job->result : CELS_ERROR_PENDING;
+    CelsMutexUnlock (&PoolMutex);
+    return result;
+}
+
+CelsResult CelsAsyncWait (CelsAsyncJob* job)
+{
+    CelsMutexLock (&PoolMutex);
+    while (! job->done)
+        CelsCondWait (&PoolTaskDone, &PoolMutex);
+    CelsResult result = job->result;
+    CelsMutexUnlock (&PoolMutex);
+    return result;
+}
+
+void CelsAsyncCancel (CelsAsyncJob* job)
+{
+    job->cancelled = 1;
+}
+
+void CelsAsyncRelease (CelsAsyncJob* job)
+{
+    CelsMutexLock (&PoolMutex);
+    CelsAsyncUnref (job);
+    CelsMutexUnlock (&PoolMutex);
+}
+
+CelsResult CelsSetAsyncQueueDepth (int depth)
+{
+    CelsMutexLock (&PoolMutex);
+    AsyncMaxQueueLength = depth;
+    CelsMutexUnlock (&PoolMutex);
+    return CELS_OK;
+}
+
+
+// ****************************************************************************************************************************
+// Push-mode (de)compression: application pushes input data, codec writes output via callback                                 *
+// ****************************************************************************************************************************
+
+struct CelsStream
+{
+    const void*   method;       // parsed method
+    int           service;      // CELS_COMPRESS or CELS_DECOMPRESS
+    void*         userdata;     // data passed to the original callback
+    CelsCallback* callback;     // original callback
+    void*         state;        // state of the codec natively supporting push mode, or NULL when the codec runs in the coroutine
+    CelsCoroutine coroutine;    // coroutine running the ordinary pull-mode operation
+    char*         input;        // unprocessed part of the buffer passed to CelsStreamPush()
+    CelsNum       inputLeft;
+    int           eof;          // CelsStreamFinish() was called, so there will be no more input
+    int           finished;     // the coroutine finished the operation
+    CelsResult    result;       // result of the operation
+    char*         parsed;       // buffer for the method string parsed by the stream itself, allocated right after the stream
+    CelsVerifier* verifier;     // verifier of the compressed output (userdata of the stream), or NULL
+};
+
+static CelsNum StreamStackSize = 256*1024;
+
+// Callback passed to the codec running in the coroutine: CELS_READ switches back to the application until it pushes
+// enough data to fill the entire buffer (or finishes the stream), all other calls go to the original callback
+static CelsResult __cdecl CelsStreamCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsStream* stream = (CelsStream*)self;
+    if (service == CELS_READV)
+        return CelsSplitVectored (self, CelsStreamCallback, service, (CelsIoVec*)inbuf, insize);
+    if (service == CELS_READ) {
+        CelsNum read_bytes = 0;
+        while (read_bytes < insize) {
+            if (stream->inputLeft == 0) {
+                if (stream->eof)  break;
+                CelsCoroutineYield (&stream->coroutine);   // wait for the next CelsStreamPush() or CelsStreamFinish()
+                continue;
+            }
+            CelsNum bytes = (stream->inputLeft < insize-read_bytes ? stream->inputLeft : insize-read_bytes);
+            memcpy ((char*)inbuf + read_bytes, stream->input, bytes);
+            stream->input     += bytes;
+            stream->inputLeft -= bytes;
+            read_bytes        += bytes;
+        }
+        return read_bytes;
+    }
+    return (stream->callback? stream->callback (stream->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                            : CELS_ERROR_NOT_IMPLEMENTED);
+}
+
+static CELS_COROUTINE_FUNCTION (CelsStreamCoroutine, arg)
+{
+    CelsStream* stream = (CelsStream*)arg;
+    stream->result = Cels (stream->method, stream->service,0, 0,0, 0,0, stream, CelsStreamCallback);
+    stream->finished = 1;
+    for(;;)  CelsCoroutineYield (&stream->coroutine);
+}
+
+CelsResult CelsStreamOpen (const void* method, int service, void* ud, CelsCallback* cb, CelsStream** handle)
+{
+    *handle = NULL;
+    CelsStream* stream = (CelsStream*) malloc (sizeof(CelsStream) + CELS_MAX_PARSED_METHOD_SIZE);
+    if (stream == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    memset (stream, 0, sizeof(CelsStream));
+    stream->method = method;
+    stream->service = service;
+    stream->userdata = ud;
+    stream->callback = cb;
+    stream->parsed = (char*)(stream+1);
+
+    CelsResult errcode = CELS_OK;
+    if (*(const char*)method != 0) {
+        errcode = CelsParseStr ((const char*) method, stream->parsed,CELS_MAX_PARSED_METHOD_SIZE, ud,cb);
+        if (errcode < CELS_OK)  {free (stream);  return errcode;}
+        stream->method = stream->parsed;
+    }
+
+    // Prefer the native push mode, otherwise run the ordinary operation in the coroutine
+    errcode = Cels (stream->method, CELS_STREAM_OPEN,service, 0,0, &stream->state,0, ud,cb);
+    if (errcode == CELS_ERROR_NOT_IMPLEMENTED) {
+        stream->state = NULL;
+        errcode = CelsCoroutineCreate (&stream->coroutine, (size_t)StreamStackSize, CelsStreamCoroutine, stream)?  CELS_OK : CELS_ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if (errcode < CELS_OK) {
+        if (stream->method == stream->parsed)  CelsFree (stream->parsed);
+        free (stream);
+        return errcode;
+    }
+    *handle = stream;
+    return CELS_OK;
+}
+
+// Compression stream with the output verified like in CelsCompressMemVerified
+CelsResult CelsStreamOpenVerified (const void* method, CelsNum window, void* ud, CelsCallback* cb, CelsStream** handle)
+{
+    *handle = NULL;
+    CelsVerifier* verifier = (CelsVerifier*) malloc (sizeof(CelsVerifier));
+    if (verifier == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    CelsVerifyInit (verifier, NULL,0, NULL,0, window, ud,cb);
+
+    CelsResult errcode = CelsStreamOpen (method, CELS_COMPRESS, verifier, CelsVerifyCallback, handle);
+    if (errcode >= CELS_OK)
+        errcode = CelsVerifyStart (verifier, (*handle)->method);
+    if (errcode < CELS_OK) {
+        if (*handle)  CelsStreamFinish (*handle),  *handle = NULL;
+        CelsVerifyFinish (verifier, errcode);
+        free (verifier);
+        return errcode;
     }
+    (*handle)->verifier = verifier;
+    return CELS_OK;
+}
+
+CelsResult CelsStreamPush (CelsStream* stream, void* buf, CelsNum size)
+{
+    if (stream->verifier) {
+        CelsResult errcode = CelsVerifyAppend (stream->verifier, &stream->verifier->input, buf, size);
+        if (errcode < CELS_OK)  return errcode;
+    }
+    if (stream->state)
+        return Cels (stream->method, CELS_STREAM_PUSH,0, buf,size, stream->state,0, stream->userdata,stream->callback);
+
+    if (! stream->finished) {
+        stream->input = (char*)buf;
+        stream->inputLeft = size;
+        CelsCoroutineEnter (&stream->coroutine);   // returns once the codec consumed all the data or finished the operation
+    }
+    if (stream->finished  &&  stream->result < CELS_OK)  return stream->result;
+    if (stream->finished  &&  stream->inputLeft > 0)     return CELS_ERROR_NO_MORE_DATA_REQUIRED;
+    return CELS_OK;
+}
+
+CelsResult CelsStreamFinish (CelsStream* stream)
+{
+    CelsResult result;
+    if (stream->state) {
+        result = Cels (stream->method, CELS_STREAM_FINISH,0, 0,0, stream->state,0, stream->userdata,stream->callback);
+    } else {
+        stream->eof = 1;
+        stream->inputLeft = 0;
+        if (! stream->finished)
+            CelsCoroutineEnter (&stream->coroutine);
+        CelsCoroutineDelete (&stream->coroutine);
+        result = stream->result;
+    }
+    if (stream->verifier) {
+        result = CelsVerifyFinish (stream->verifier, result);
+        free (stream->verifier);
+    }
+
+    if (stream->method == stream->parsed)  CelsFree (stream->parsed);
+    free (stream);
+    return result;
+}
+
+CelsResult CelsSetStreamStackSize (CelsNum size)
+{
+    StreamStackSize = size;
+    return CELS_OK;
+}
+
+
+// ****************************************************************************************************************************
+// Host side of the buffer-sharing API: buffer pools circulating via lock-free rings                                          *
+// ****************************************************************************************************************************
+
+#define CELS_CACHE_LINE 64
+
+// Element of the ring, stamped with the sequence number (D. Vyukov's bounded MPMC queue)
+typedef struct
+{
+    volatile CelsNum sequence;  // == position for the free cell, position+1 for the filled one
+    void*            buf;
+    CelsNum          size;
+} CelsRingCell;
+
+// Bounded ring of buffers. Any number of threads may send and receive simultaneously without locks, the mutex is used
+// only to sleep while the ring is empty or full. Positions written by senders and receivers occupy separate cache lines.
+typedef struct
+{
+    CelsRingCell*    cells;
+    CelsNum          mask;      // capacity-1, capacity is a power of 2
+    char             pad1 [CELS_CACHE_LINE];
+    volatile CelsNum sendPos;   // == number of buffers sent
+    char             pad2 [CELS_CACHE_LINE];
+    volatile CelsNum receivePos;// == number of buffers received
+    char             pad3 [CELS_CACHE_LINE];
+    volatile CelsNum waiters;   // number of threads sleeping on the cond
+    CelsMutex        mutex;
+    CelsCondVar      cond;
+    int              closed;    // receivers get size 0 once the ring is empty (protected by the mutex)
+    CelsNum          receiveWaits, sendWaits;   // protected by the mutex
+} CelsRing;
+
+static int CelsRingTrySend (CelsRing* ring, void* buf, CelsNum size)
+{
+    CelsNum pos = CelsAtomicLoad (&ring->sendPos);
+    for(;;) {
+        CelsRingCell* cell = &ring->cells[pos & ring->mask];
+        CelsNum diff = CelsAtomicLoad (&cell->sequence) - pos;
+        if (diff == 0) {
+            if (CelsAtomicCas (&ring->sendPos, pos, pos+1)) {
+                cell->buf  = buf;
+                cell->size = size;
+                CelsAtomicStore (&cell->sequence, pos+1);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;   // full
+        }
+        pos = CelsAtomicLoad (&ring->sendPos);
+    }
+}
+
+static int CelsRingTryReceive (CelsRing* ring, void** buf, CelsNum* size)
+{
+    CelsNum pos = CelsAtomicLoad (&ring->receivePos);
+    for(;;) {
+        CelsRingCell* cell = &ring->cells[pos & ring->mask];
+        CelsNum diff = CelsAtomicLoad (&cell->sequence) - (pos+1);
+        if (diff == 0) {
+            if (CelsAtomicCas (&ring->receivePos, pos, pos+1)) {
+                *buf  = cell->buf;
+                *size = cell->size;
+                CelsAtomicStore (&cell->sequence, pos + ring->mask + 1);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;   // empty
+        }
+        pos = CelsAtomicLoad (&ring->receivePos);
+    }
+}
+
+// Wake up threads sleeping on the ring after its state was changed
+static void CelsRingWake (CelsRing* ring)
+{
+    CelsAtomicFence();
+    if (CelsAtomicLoad (&ring->waiters) > 0) {
+        CelsMutexLock (&ring->mutex);
+        CelsCondBroadcast (&ring->cond);
+        CelsMutexUnlock (&ring->mutex);
+    }
+}
+
+// Send the buffer, waiting while the ring is full
+static void CelsRingSend (CelsRing* ring, void* buf, CelsNum size)
+{
+    if (! CelsRingTrySend (ring, buf, size)) {
+        CelsMutexLock (&ring->mutex);
+        CelsAtomicAdd (&ring->waiters, 1);
+        ring->sendWaits++;
+        while (! CelsRingTrySend (ring, buf, size))
+            CelsCondWait (&ring->cond, &ring->mutex);
+        CelsAtomicAdd (&ring->waiters, -1);
+        CelsMutexUnlock (&ring->mutex);
+    }
+    CelsRingWake (ring);
+}
+
+// Receive the buffer, waiting while the ring is empty. Returns 0 once the ring is closed and empty
+static int CelsRingReceive (CelsRing* ring, void** buf, CelsNum* size)
+{
+    int received = CelsRingTryReceive (ring, buf, size);
+    if (! received) {
+        CelsMutexLock (&ring->mutex);
+        CelsAtomicAdd (&ring->waiters, 1);
+        ring->receiveWaits++;
+        while (! (received = CelsRingTryReceive (ring, buf, size))  &&  ! ring->closed)
+            CelsCondWait (&ring->cond, &ring->mutex);
+        CelsAtomicAdd (&ring->waiters, -1);
+        CelsMutexUnlock (&ring->mutex);
+    }
+    if (received)  CelsRingWake (ring);
+    return received;
+}
+
+static void CelsRingClose (CelsRing* ring)
+{
+    CelsMutexLock (&ring->mutex);
+    ring->closed = 1;
+    CelsCondBroadcast (&ring->cond);
+    CelsMutexUnlock (&ring->mutex);
+}
+
+// Rings indexed in the order of buffer-sharing services
+enum {CELS_RING_FILLED_INBUFS, CELS_RING_EMPTY_INBUFS, CELS_RING_EMPTY_OUTBUFS, CELS_RING_FILLED_OUTBUFS, CELS_RINGS};
+
+struct CelsBufferQueues
+{
+    CelsRing      rings[CELS_RINGS];
+    CelsNum       inbufSize, outbufSize;
+    void*         userdata;     // data passed to the original callback
+    CelsCallback* callback;     // original callback
+    void*         memory;       // allocated block holding the structure, all ring cells and buffers
+};
+
+static CelsNum CelsAlignUp (CelsNum size)  {return (size + CELS_CACHE_LINE-1) & ~(CelsNum)(CELS_CACHE_LINE-1);}
+
+CelsResult CelsBufferQueuesCreate (CelsNum num_inbufs, CelsNum inbuf_size, CelsNum num_outbufs, CelsNum outbuf_size, void* ud, CelsCallback* cb, CelsBufferQueues** handle)
+{
+    *handle = NULL;
+    if (num_inbufs <= 0  ||  inbuf_size <= 0  ||  num_outbufs <= 0  ||  outbuf_size <= 0)  return CELS_ERROR_GENERAL;
+
+    // Every ring can hold all buffers of its kind, so sending never waits in the usual buffer circulation
+    CelsNum i, n, capacity[CELS_RINGS];
+    for (i = 0;  i < CELS_RINGS;  i++) {
+        CelsNum num_bufs = (i < CELS_RING_EMPTY_OUTBUFS? num_inbufs : num_outbufs);
+        for (capacity[i] = 1;  capacity[i] < num_bufs;  capacity[i] *= 2);
+    }
+
+    CelsNum total = CelsAlignUp (sizeof(CelsBufferQueues)) + num_inbufs * CelsAlignUp (inbuf_size) + num_outbufs * CelsAlignUp (outbuf_size);
+    for (i = 0;  i < CELS_RINGS;  i++)
+        total += CelsAlignUp (capacity[i] * sizeof(CelsRingCell));
+    char* memory = (char*) malloc (total + CELS_CACHE_LINE);
+    if (memory == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    char* ptr = memory + CELS_CACHE_LINE - (size_t)memory % CELS_CACHE_LINE;
+    CelsBufferQueues* queues = (CelsBufferQueues*) ptr;
+    memset (queues, 0, sizeof(CelsBufferQueues));
+    ptr += CelsAlignUp (sizeof(CelsBufferQueues));
+    queues->inbufSize  = inbuf_size;
+    queues->outbufSize = outbuf_size;
+    queues->userdata = ud;
+    queues->callback = cb;
+    queues->memory = memory;
+
+    for (i = 0;  i < CELS_RINGS;  i++) {
+        CelsRing* ring = &queues->rings[i];
+        ring->cells = (CelsRingCell*) ptr;
+        ring->mask = capacity[i] - 1;
+        for (n = 0;  n < capacity[i];  n++)
+            ring->cells[n].sequence = n;
+        ptr += CelsAlignUp (capacity[i] * sizeof(CelsRingCell));
+        CelsMutexInit (&ring->mutex);
+        CelsCondInit (&ring->cond);
+    }
+
+    // Initially, all buffers are empty
+    for (n = 0;  n < num_inbufs;  n++, ptr += CelsAlignUp (inbuf_size))
+        CelsRingTrySend (&queues->rings[CELS_RING_EMPTY_INBUFS], ptr, inbuf_size);
+    for (n = 0;  n < num_outbufs;  n++, ptr += CelsAlignUp (outbuf_size))
+        CelsRingTrySend (&queues->rings[CELS_RING_EMPTY_OUTBUFS], ptr, outbuf_size);
+
+    *handle = queues;
+    return CELS_OK;
+}
+
+void CelsBufferQueuesFree (CelsBufferQueues* queues)
+{
+    free (queues->memory);
+}
+
+// Callback serving buffer-sharing services from the rings and passing all other requests to the original callback
+CelsResult __cdecl CelsBufferQueuesCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsBufferQueues* queues = (CelsBufferQueues*)self;
+    CelsNum size = 0;
+    if (service==CELS_RECEIVE_FILLED_INBUF) {
+        if (! CelsRingReceive (&queues->rings[CELS_RING_FILLED_INBUFS], (void**)inbuf, &size))  *(void**)inbuf = NULL;
+        return size;
+    }
+    else if (service==CELS_SEND_EMPTY_INBUF) {
+        CelsRingSend (&queues->rings[CELS_RING_EMPTY_INBUFS], inbuf, queues->inbufSize);
+        return CELS_OK;
+    }
+    else if (service==CELS_RECEIVE_EMPTY_OUTBUF) {
+        if (! CelsRingReceive (&queues->rings[CELS_RING_EMPTY_OUTBUFS], (void**)outbuf, &size))  *(void**)outbuf = NULL;
+        return size;
+    }
+    else if (service==CELS_SEND_FILLED_OUTBUF) {
+        CelsRingSend (&queues->rings[CELS_RING_FILLED_OUTBUFS], outbuf, outsize);
+        return CELS_OK;
+    }
+    else {
+        return (queues->callback? queues->callback (queues->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                                : CELS_ERROR_NOT_IMPLEMENTED);
+    }
+}
+
+CelsResult CelsGetEmptyInbuf (CelsBufferQueues* queues, void** buf)
+{
+    CelsNum size = 0;
+    if (! CelsRingReceive (&queues->rings[CELS_RING_EMPTY_INBUFS], buf, &size))  *buf = NULL;
+    return size;
+}
+
+CelsResult CelsPutFilledInbuf (CelsBufferQueues* queues, void* buf, CelsNum size)
+{
+    CelsRingSend (&queues->rings[CELS_RING_FILLED_INBUFS], buf, size);
+    return CELS_OK;
+}
+
+CelsResult CelsCloseInput (CelsBufferQueues* queues)
+{
+    CelsRingClose (&queues->rings[CELS_RING_FILLED_INBUFS]);
+    return CELS_OK;
+}
+
+CelsResult CelsGetFilledOutbuf (CelsBufferQueues* queues, void** buf)
+{
+    CelsNum size = 0;
+    if (! CelsRingReceive (&queues->rings[CELS_RING_FILLED_OUTBUFS], buf, &size))  *buf = NULL;
+    return size;
+}
+
+CelsResult CelsPutEmptyOutbuf (CelsBufferQueues* queues, void* buf)
+{
+    CelsRingSend (&queues->rings[CELS_RING_EMPTY_OUTBUFS], buf, queues->outbufSize);
+    return CELS_OK;
+}
+
+CelsResult CelsCloseOutput (CelsBufferQueues* queues)
+{
+    CelsRingClose (&queues->rings[CELS_RING_FILLED_OUTBUFS]);
+    CelsRingClose (&queues->rings[CELS_RING_EMPTY_OUTBUFS]);   // the codec shouldn't wait for output buffers anymore
+    return CELS_OK;
+}
+
+void CelsBufferQueuesStats (CelsBufferQueues* queues, CelsBufferQueueStats stats[4])
+{
+    int i;
+    for (i = 0;  i < CELS_RINGS;  i++) {
+        CelsRing* ring = &queues->rings[i];
+        CelsMutexLock (&ring->mutex);
+        stats[i].sent         = CelsAtomicLoad (&ring->sendPos);
+        stats[i].received     = CelsAtomicLoad (&ring->receivePos);
+        stats[i].receiveWaits = ring->receiveWaits;
+        stats[i].sendWaits    = ring->sendWaits;
+        CelsMutexUnlock (&ring->mutex);
+    }
+}
+
+
+// ****************************************************************************************************************************
+// File I/O callback with read-ahead and asynchronous writes via io_uring (Linux), falling back to pread/pwrite               *
+// ****************************************************************************************************************************
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CELS_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#define __NR_io_uring_enter     426
+#define __NR_io_uring_register  427
+#endif
+#endif
+#endif
+
+#define CELS_FILEIO_ALIGNMENT 4096   // O_DIRECT requirement for buffer addresses, file offsets and sizes
+#define CELS_FILEIO_MAX_IOV   64     // buffers per pwritev() call
+
+// States of file buffers
+enum {CELS_FILEBUF_FREE, CELS_FILEBUF_BUSY, CELS_FILEBUF_READY, CELS_FILEBUF_LENT, CELS_FILEBUF_FILLING};
+
+typedef struct
+{
+    char*    buf;
+    int      state;
+    CelsNum  offset;            // file position of the data
+    CelsNum  size;              // amount of data requested by I/O operation in flight, or valid data in the buffer, or error code
+} CelsFileBuf;
+
+struct CelsFileIO
+{
+    int           infd, outfd;
+    CelsNum       bufsize;
+    int           depth;            // number of buffers in each direction
+    CelsFileBuf*  bufs;             // bufs[0..depth-1] are used for reading, bufs[depth..2*depth-1] for writing
+    char*         memory;           // all buffers
+    CelsNum       readOffset;       // position of the next read request
+    CelsNum       consumeOffset;    // position of the next buffer to pass to the codec
+    CelsNum       consumePos;       // amount of data of this buffer already copied by CELS_READ
+    int           readEof;          // don't issue read requests anymore
+    CelsNum       writeOffset;      // position of the next write request
+    int           filling;          // write buffer collecting data of CELS_WRITE calls, or -1
+    CelsResult    writeError;       // the first failed write
+    int           inDirect, outDirect;  // O_DIRECT was set by us
+    CelsMutex     mutex;            // serializes all requests
+    void*         userdata;         // data passed to the original callback
+    CelsCallback* callback;         // original callback
+#ifdef CELS_IO_URING
+    int           ringfd;           // -1 when io_uring isn't used
+    int           fixed;            // buffers were registered
+    unsigned     *sqTail, *sqMask, *sqArray, *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void         *sqRing, *cqRing;
+    size_t        sqRingSize, cqRingSize, sqesSize;
+#endif
+};
+
+// Synchronous positioned I/O of the entire buffer. Returns amount of data transferred (less than size only at EOF) or error code
+static CelsResult CelsFileSyncIO (int fd, int write, char* buf, CelsNum size, CelsNum offset)
+{
+    CelsNum done = 0;
+    while (done < size) {
+        ssize_t bytes = (write? pwrite (fd, buf+done, size-done, offset+done)
+                              : pread  (fd, buf+done, size-done, offset+done));
+        if (bytes < 0  &&  errno == EINTR)  continue;
+        if (bytes < 0)   return (write? CELS_ERROR_WRITE : CELS_ERROR_READ);
+        if (bytes == 0)  break;
+        done += bytes;
+    }
+    return (write  &&  done < size?  CELS_ERROR_WRITE : done);
+}
+
+// Process the finished I/O operation, completing short and failed ones synchronously
+static void CelsFileComplete (CelsFileIO* io, int index, CelsResult result)
+{
+    CelsFileBuf* fb = &io->bufs[index];
+    int write = (index >= io->depth);
+    int fd = (write? io->outfd : io->infd);
+    if (result < 0)  result = 0;   // f.e. operation unsupported by this kernel - retry it with pread/pwrite
+    if (result < fb->size) {
+        CelsResult rest = CelsFileSyncIO (fd, write, fb->buf + result, fb->size - result, fb->offset + result);
+        result = (rest < CELS_OK? rest : result + rest);
+    }
+
+    if (write) {
+        if (result < CELS_OK  &&  io->writeError == CELS_OK)  io->writeError = result;
+        fb->state = CELS_FILEBUF_FREE;
+    } else {
+        if (result < fb->size)  io->readEof = 1;   // EOF or error
+        fb->size  = result;
+        fb->state = CELS_FILEBUF_READY;
+    }
+}
+
+#ifdef CELS_IO_URING
+static int CelsUringSetup (CelsFileIO* io, unsigned entries)
+{
+    struct io_uring_params p;
+    memset (&p, 0, sizeof(p));
+    io->ringfd = (int) syscall (__NR_io_uring_setup, entries, &p);
+    if (io->ringfd < 0)  return 0;
+
+    io->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cqRingSize = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cqRingSize > io->sqRingSize)  io->sqRingSize = io->cqRingSize;
+        io->cqRingSize = io->sqRingSize;
+    }
+    io->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    io->sqRing = mmap (NULL, io->sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, io->ringfd, IORING_OFF_SQ_RING);
+    io->cqRing = (p.features & IORING_FEAT_SINGLE_MMAP?  io->sqRing :
+                  mmap (NULL, io->cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, io->ringfd, IORING_OFF_CQ_RING));
+    io->sqes   = (struct io_uring_sqe*) mmap (NULL, io->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, io->ringfd, IORING_OFF_SQES);
+    if (io->sqRing == MAP_FAILED  ||  io->cqRing == MAP_FAILED  ||  io->sqes == MAP_FAILED) {
+        if (io->sqRing != MAP_FAILED)  munmap (io->sqRing, io->sqRingSize);
+        if (io->cqRing != MAP_FAILED  &&  io->cqRing != io->sqRing)  munmap (io->cqRing, io->cqRingSize);
+        if (io->sqes   != MAP_FAILED)  munmap (io->sqes, io->sqesSize);
+        close (io->ringfd);
+        io->ringfd = -1;
+        return 0;
+    }
+
+    io->sqTail  = (unsigned*) ((char*)io->sqRing + p.sq_off.tail);
+    io->sqMask  = (unsigned*) ((char*)io->sqRing + p.sq_off.ring_mask);
+    io->sqArray = (unsigned*) ((char*)io->sqRing + p.sq_off.array);
+    io->cqHead  = (unsigned*) ((char*)io->cqRing + p.cq_off.head);
+    io->cqTail  = (unsigned*) ((char*)io->cqRing + p.cq_off.tail);
+    io->cqMask  = (unsigned*) ((char*)io->cqRing + p.cq_off.ring_mask);
+    io->cqes    = (struct io_uring_cqe*) ((char*)io->cqRing + p.cq_off.cqes);
+    return 1;
+}
+
+static void CelsUringCleanup (CelsFileIO* io)
+{
+    munmap (io->sqes, io->sqesSize);
+    if (io->cqRing != io->sqRing)  munmap (io->cqRing, io->cqRingSize);
+    munmap (io->sqRing, io->sqRingSize);
+    close (io->ringfd);
+}
+
+// Wait for the next finished operation and process it
+static void CelsUringWait (CelsFileIO* io)
+{
+    for(;;) {
+        unsigned head = *io->cqHead;
+        if (head != __atomic_load_n (io->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &io->cqes[head & *io->cqMask];
+            int index = (int) cqe->user_data;
+            CelsResult result = cqe->res;
+            __atomic_store_n (io->cqHead, head+1, __ATOMIC_RELEASE);
+            CelsFileComplete (io, index, result);
+            return;
+        }
+        syscall (__NR_io_uring_enter, io->ringfd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+}
+#endif
+
+// Start I/O operation on the buffer in the BUSY state
+static void CelsFileSubmit (CelsFileIO* io, int index)
+{
+    CelsFileBuf* fb = &io->bufs[index];
+    int write = (index >= io->depth);
+#ifdef CELS_IO_URING
+    if (io->ringfd >= 0) {
+        unsigned tail = *io->sqTail,  slot = tail & *io->sqMask;
+        struct io_uring_sqe* sqe = &io->sqes[slot];
+        memset (sqe, 0, sizeof(*sqe));
+        sqe->opcode    = (io->fixed?  (write? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED)
+                                   :  (write? IORING_OP_WRITE       : IORING_OP_READ));
+        sqe->fd        = (write? io->outfd : io->infd);
+        sqe->addr      = (unsigned long long)(size_t) fb->buf;
+        sqe->len       = (unsigned) fb->size;
+        sqe->off       = fb->offset;
+        sqe->buf_index = index;
+        sqe->user_data = index;
+        io->sqArray[slot] = slot;
+        __atomic_store_n (io->sqTail, tail+1, __ATOMIC_RELEASE);
+        if (syscall (__NR_io_uring_enter, io->ringfd, 1, 0, 0, NULL, 0) == 1)  return;
+        __atomic_store_n (io->sqTail, tail, __ATOMIC_RELEASE);   // not submitted, perform it synchronously
+    }
+#endif
+    CelsFileComplete (io, index, 0);
+}
+
+// Wait until any I/O operation finishes. Returns 0 if there are no operations in flight
+static int CelsFileWaitAny (CelsFileIO* io)
+{
+    int i;
+    for (i = 0;  i < 2*io->depth;  i++)
+        if (io->bufs[i].state == CELS_FILEBUF_BUSY)  break;
+    if (i == 2*io->depth)  return 0;
+#ifdef CELS_IO_URING
+    CelsUringWait (io);
+#endif
+    return 1;
+}
+
+// Reuse the read buffer for the next part of the file
+static void CelsFileStartRead (CelsFileIO* io, int index)
+{
+    CelsFileBuf* fb = &io->bufs[index];
+    if (io->readEof  ||  io->infd < 0)  {fb->state = CELS_FILEBUF_FREE;  return;}
+    fb->state  = CELS_FILEBUF_BUSY;
+    fb->offset = io->readOffset;
+    fb->size   = io->bufsize;
+    io->readOffset += io->bufsize;
+    CelsFileSubmit (io, index);
+}
+
+// Find the read buffer following the data already passed to the codec and wait for its data.
+// Returns -1 at EOF, or when all buffers are held by the codec
+static int CelsFileNextRead (CelsFileIO* io)
+{
+    int i;
+    for (i = 0;  i < io->depth;  i++) {
+        CelsFileBuf* fb = &io->bufs[i];
+        if ((fb->state == CELS_FILEBUF_BUSY  ||  fb->state == CELS_FILEBUF_READY)  &&  fb->offset == io->consumeOffset) {
+            while (fb->state == CELS_FILEBUF_BUSY)
+                CelsFileWaitAny (io);
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Pass the read buffer to the codec entirely
+static void CelsFileConsumed (CelsFileIO* io, int index)
+{
+    io->consumeOffset += io->bufsize;
+    io->consumePos = 0;
+    CelsFileStartRead (io, index);
+}
+
+static CelsResult CelsFileRead (CelsFileIO* io, char* buf, CelsNum size)
+{
+    CelsNum done = 0;
+    while (done < size) {
+        int index = CelsFileNextRead (io);
+        if (index < 0)  break;
+        CelsFileBuf* fb = &io->bufs[index];
+        if (fb->size < CELS_OK)  return fb->size;
+
+        CelsNum bytes = (fb->size - io->consumePos < size - done?  fb->size - io->consumePos : size - done);
+        memcpy (buf + done, fb->buf + io->consumePos, bytes);
+        io->consumePos += bytes;
+        done += bytes;
+        if (io->consumePos < fb->size)  continue;
+        int last = (fb->size < io->bufsize);
+        CelsFileConsumed (io, index);
+        if (last)  break;
+    }
+    return done;
+}
+
+static CelsResult CelsFileReceiveInbuf (CelsFileIO* io, void** buf)
+{
+    *buf = NULL;
+    int index = CelsFileNextRead (io);
+    if (index < 0)  return (io->readEof? 0 : CELS_ERROR_NOT_ENOUGH_MEMORY);   // codec holds all buffers
+    CelsFileBuf* fb = &io->bufs[index];
+    CelsResult size = fb->size - io->consumePos;
+    if (fb->size <= 0)  {CelsFileConsumed (io, index);  return fb->size;}
+    *buf = fb->buf + io->consumePos;
+    fb->state = CELS_FILEBUF_LENT;
+    io->consumeOffset += io->bufsize;
+    io->consumePos = 0;
+    return size;
+}
+
+static int CelsFileFindBuf (CelsFileIO* io, void* buf, int first, int last)
+{
+    int i;
+    for (i = first;  i < last;  i++)
+        if ((char*)buf >= io->bufs[i].buf  &&  (char*)buf < io->bufs[i].buf + io->bufsize)  return i;
+    return -1;
+}
+
+// Write the buffer with data, dropping O_DIRECT once the write isn't aligned
+static void CelsFileStartWrite (CelsFileIO* io, int index, CelsNum size)
+{
+    CelsFileBuf* fb = &io->bufs[index];
+    if (size == 0)  {fb->state = CELS_FILEBUF_FREE;  return;}
+    if (io->outDirect  &&  (io->writeOffset % CELS_FILEIO_ALIGNMENT  ||  size % CELS_FILEIO_ALIGNMENT)) {
+        fcntl (io->outfd, F_SETFL, fcntl (io->outfd, F_GETFL) & ~O_DIRECT);
+        io->outDirect = 0;
+    }
+    fb->state  = CELS_FILEBUF_BUSY;
+    fb->offset = io->writeOffset;
+    fb->size   = size;
+    io->writeOffset += size;
+    CelsFileSubmit (io, index);
+}
+
+// Find the free write buffer, waiting for finish of write operations if required
+static int CelsFileFreeWriteBuf (CelsFileIO* io)
+{
+    for(;;) {
+        int i;
+        for (i = io->depth;  i < 2*io->depth;  i++)
+            if (io->bufs[i].state == CELS_FILEBUF_FREE)  return i;
+        if (! CelsFileWaitAny (io))  return -1;
+    }
+}
+
+// Write the data collected from CELS_WRITE calls
+static void CelsFileFlush (CelsFileIO* io)
+{
+    if (io->filling >= 0)
+        CelsFileStartWrite (io, io->filling, io->bufs[io->filling].size);
+    io->filling = -1;
+}
+
+static CelsResult CelsFileWrite (CelsFileIO* io, char* buf, CelsNum size)
+{
+    CelsNum done = 0;
+    if (io->writeError < CELS_OK)  return io->writeError;
+    while (done < size) {
+        if (io->filling < 0) {
+            io->filling = CelsFileFreeWriteBuf (io);
+            if (io->filling < 0)  return CELS_ERROR_NOT_ENOUGH_MEMORY;   // codec holds all buffers
+            io->bufs[io->filling].state = CELS_FILEBUF_FILLING;
+            io->bufs[io->filling].size  = 0;
+        }
+        CelsFileBuf* fb = &io->bufs[io->filling];
+        CelsNum bytes = (io->bufsize - fb->size < size - done?  io->bufsize - fb->size : size - done);
+        memcpy (fb->buf + fb->size, buf + done, bytes);
+        fb->size += bytes;
+        done += bytes;
+        if (fb->size == io->bufsize)  CelsFileFlush (io);
+    }
+    return size;
+}
+
+// Synchronous positioned write of the entire vector, modifying it on short writes
+static CelsResult CelsFileSyncWritev (int fd, struct iovec* vec, int count, CelsNum offset)
+{
+    while (count > 0) {
+        ssize_t bytes = pwritev (fd, vec, count, offset);
+        if (bytes < 0  &&  errno == EINTR)  continue;
+        if (bytes <= 0)  return CELS_ERROR_WRITE;
+        offset += bytes;
+        while (count > 0  &&  (size_t)bytes >= vec->iov_len)
+            bytes -= vec->iov_len,  vec++,  count--;
+        if (count > 0)
+            vec->iov_base = (char*)vec->iov_base + bytes,  vec->iov_len -= bytes;
+    }
+    return CELS_OK;
+}
+
+// Write the gathered buffers. Requests of at least bufsize bytes go straight to the file with pwritev(), saving the copy
+// to the write buffers; they occupy their own file range, so writes of the buffers may still be in flight
+static CelsResult CelsFileWritev (CelsFileIO* io, CelsIoVec* iov, CelsNum count)
+{
+    CelsNum i, total = 0;
+    if (io->writeError < CELS_OK)  return io->writeError;
+    for (i = 0;  i < count;  i++)
+        total += iov[i].size;
+
+    if (total < io->bufsize  ||  io->outDirect) {
+        for (i = 0;  i < count;  i++) {
+            CelsResult result = CelsFileWrite (io, (char*)iov[i].buf, iov[i].size);
+            if (result < CELS_OK)  return result;
+        }
+        return total;
+    }
+
+    CelsFileFlush (io);   // data collected so far precede ours
+    CelsNum offset = io->writeOffset;
+    io->writeOffset += total;
+    for (i = 0;  i < count; ) {
+        struct iovec vec[CELS_FILEIO_MAX_IOV];
+        int n = 0;
+        CelsNum size = 0;
+        for (;  i < count  &&  n < CELS_FILEIO_MAX_IOV;  i++) {
+            if (iov[i].size == 0)  continue;
+            vec[n].iov_base = iov[i].buf;
+            vec[n].iov_len  = (size_t) iov[i].size;
+            size += iov[i].size;
+            n++;
+        }
+        CelsResult result = CelsFileSyncWritev (io->outfd, vec, n, offset);
+        if (result < CELS_OK)  return (io->writeError = result);
+        offset += size;
+    }
+    return total;
+}
+
+static CelsResult CelsFileReceiveOutbuf (CelsFileIO* io, void** buf)
+{
+    CelsFileFlush (io);   // keep the data order when CELS_WRITE calls are mixed with buffer sharing
+    int index = CelsFileFreeWriteBuf (io);
+    *buf = (index < 0? NULL : io->bufs[index].buf);
+    if (index < 0)  return CELS_ERROR_NOT_ENOUGH_MEMORY;   // codec holds all buffers
+    io->bufs[index].state = CELS_FILEBUF_LENT;
+    return io->bufsize;
+}
+
+static CelsResult CelsFileSendOutbuf (CelsFileIO* io, void* buf, CelsNum size)
+{
+    int index = CelsFileFindBuf (io, buf, io->depth, 2*io->depth);
+    if (index < 0  ||  buf != io->bufs[index].buf)  return CelsFileWrite (io, (char*)buf, size);   // not our buffer
+    CelsFileFlush (io);
+    CelsFileStartWrite (io, index, size);
+    return (io->writeError < CELS_OK? io->writeError : CELS_OK);
+}
+
+// Set O_DIRECT on the file if the current position is aligned. Returns 1 if the flag was set by us
+static int CelsFileSetDirect (int fd, CelsNum offset)
+{
+    int flags = fcntl (fd, F_GETFL);
+    if (fd < 0  ||  flags < 0  ||  (flags & O_DIRECT)  ||  offset % CELS_FILEIO_ALIGNMENT)  return 0;
+    return fcntl (fd, F_SETFL, flags | O_DIRECT) == 0;
+}
+
+CelsResult CelsFileIOOpen (int infd, int outfd, CelsNum bufsize, int depth, int flags, void* ud, CelsCallback* cb, CelsFileIO** handle)
+{
+    *handle = NULL;
+    if (bufsize <= 0  ||  depth <= 0)  return CELS_ERROR_GENERAL;
+    bufsize = (bufsize + CELS_FILEIO_ALIGNMENT-1) / CELS_FILEIO_ALIGNMENT * CELS_FILEIO_ALIGNMENT;
+
+    CelsFileIO* io = (CelsFileIO*) calloc (1, sizeof(CelsFileIO) + 2*depth*sizeof(CelsFileBuf));
+    if (io == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    void* memory = NULL;
+    if (posix_memalign (&memory, CELS_FILEIO_ALIGNMENT, 2*depth*bufsize) != 0)  {free (io);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+
+    int i;
+    io->infd = infd;
+    io->outfd = outfd;
+    io->bufsize = bufsize;
+    io->depth = depth;
+    io->bufs = (CelsFileBuf*) (io+1);
+    io->memory = (char*) memory;
+    for (i = 0;  i < 2*depth;  i++)
+        io->bufs[i].buf = io->memory + i*bufsize;
+    io->readOffset = io->consumeOffset = (infd  >= 0? lseek (infd,  0, SEEK_CUR) : 0);
+    io->writeOffset                    = (outfd >= 0? lseek (outfd, 0, SEEK_CUR) : 0);
+    if (io->readOffset < 0)   io->readOffset = io->consumeOffset = 0;
+    if (io->writeOffset < 0)  io->writeOffset = 0;
+    io->filling = -1;
+    io->writeError = CELS_OK;
+    io->userdata = ud;
+    io->callback = cb;
+    CelsMutexInit (&io->mutex);
+
+    if (flags & CELS_FILEIO_DIRECT) {
+        io->inDirect  = CelsFileSetDirect (infd,  io->readOffset);
+        io->outDirect = CelsFileSetDirect (outfd, io->writeOffset);
+    }
+
+#ifdef CELS_IO_URING
+    io->ringfd = -1;
+    if (! (flags & CELS_FILEIO_NO_URING)  &&  CelsUringSetup (io, 2*depth)) {
+        if (flags & CELS_FILEIO_FIXED_BUFFERS) {
+            struct iovec* iov = (struct iovec*) malloc (2*depth * sizeof(struct iovec));
+            if (iov) {
+                for (i = 0;  i < 2*depth;  i++)
+                    iov[i].iov_base = io->bufs[i].buf,  iov[i].iov_len = bufsize;
+                io->fixed = (syscall (__NR_io_uring_register, io->ringfd, IORING_REGISTER_BUFFERS, iov, 2*depth) == 0);
+                free (iov);
+            }
+        }
+    }
+#endif
+
+    // Start reading ahead right now
+    for (i = 0;  i < depth;  i++)
+        CelsFileStartRead (io, i);
+
+    *handle = io;
+    return CELS_OK;
+}
+
+CelsResult CelsFileIOClose (CelsFileIO* io)
+{
+    CelsFileFlush (io);
+    while (CelsFileWaitAny (io));   // wait for all writes, as well as reads in flight
+    CelsResult errcode = io->writeError;
+
+#ifdef CELS_IO_URING
+    if (io->ringfd >= 0)  CelsUringCleanup (io);
+#endif
+    if (io->inDirect)   fcntl (io->infd,  F_SETFL, fcntl (io->infd,  F_GETFL) & ~O_DIRECT);
+    if (io->outDirect)  fcntl (io->outfd, F_SETFL, fcntl (io->outfd, F_GETFL) & ~O_DIRECT);
+    if (io->outfd >= 0)  lseek (io->outfd, io->writeOffset, SEEK_SET);   // position after the written data, as sequential writes would do
+    free (io->memory);
+    free (io);
+    return errcode;
+}
+
+// Callback serving CELS_READ/CELS_WRITE, their vectored versions and buffer-sharing services, passing all other requests
+// to the original callback
+CelsResult __cdecl CelsFileIOCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsFileIO* io = (CelsFileIO*)self;
+    CelsResult result;
+    if (service==CELS_READ  ||  service==CELS_READV  ||  service==CELS_RECEIVE_FILLED_INBUF  ||  service==CELS_SEND_EMPTY_INBUF
+        ||  service==CELS_WRITE  ||  service==CELS_WRITEV  ||  service==CELS_RECEIVE_EMPTY_OUTBUF  ||  service==CELS_SEND_FILLED_OUTBUF)
+    {
+        CelsMutexLock (&io->mutex);
+        if (service==CELS_READ) {
+            result = CelsFileRead (io, (char*)inbuf, insize);
+        }
+        else if (service==CELS_READV) {
+            CelsIoVec* iov = (CelsIoVec*)inbuf;
+            CelsNum i;
+            for (i = 0, result = 0;  i < insize;  i++) {
+                CelsResult bytes = CelsFileRead (io, (char*)iov[i].buf, iov[i].size);
+                if (bytes < CELS_OK)  {result = bytes;  break;}
+                result += bytes;
+                if (bytes < iov[i].size)  break;   // EOF
+            }
+        }
+        else if (service==CELS_WRITEV) {
+            result = CelsFileWritev (io, (CelsIoVec*)outbuf, outsize);
+        }
+        else if (service==CELS_RECEIVE_FILLED_INBUF) {
+            result = CelsFileReceiveInbuf (io, (void**)inbuf);
+        }
+        else if (service==CELS_SEND_EMPTY_INBUF) {
+            int index = CelsFileFindBuf (io, inbuf, 0, io->depth);
+            if (index >= 0  &&  io->bufs[index].state == CELS_FILEBUF_LENT)  CelsFileStartRead (io, index);
+            result = (index >= 0? CELS_OK : CELS_ERROR_GENERAL);
+        }
+        else if (service==CELS_WRITE) {
+            result = CelsFileWrite (io, (char*)outbuf, outsize);
+        }
+        else if (service==CELS_RECEIVE_EMPTY_OUTBUF) {
+            result = CelsFileReceiveOutbuf (io, (void**)outbuf);
+        }
+        else {
+            result = CelsFileSendOutbuf (io, outbuf, outsize);
+        }
+        CelsMutexUnlock (&io->mutex);
+        return result;
+    }
+    return (io->callback? io->callback (io->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                        : CELS_ERROR_NOT_IMPLEMENTED);
+}
+#endif // _WIN32
+
+
+// ****************************************************************************************************************************
+// Record the callback traffic of the host and replay it offline against any codec                                           *
+// ****************************************************************************************************************************
+
+#include <stdio.h>
+#ifdef _WIN32
+#define CelsFileSeek _fseeki64
+#define CelsFileTell _ftelli64
+#else
+#define CelsFileSeek fseeko
+#define CelsFileTell ftello
+#endif
+
+// Recording starts with the magic, followed by varints: flags, service, method length and the method string itself.
+// Then every CELS_READ/CELS_WRITE goes as the type byte and varints: requested size, result (zigzag-encoded),
+// codec time since the previous callback returned and time spent in the host (ns), and read data with CELS_RECORD_DATA
+static const char CelsRecordMagic[8] = {'C','E','L','S','R','E','C','1'};
+enum {CELS_RECORD_READ, CELS_RECORD_WRITE};
+
+struct CelsRecorder
+{
+    FILE*         file;
+    int           flags;
+    CelsNum       last;             // time when the previous callback returned
+    CelsResult    error;            // the first failed write to the file
+    CelsMutex     mutex;            // serializes records of requests from several threads
+    void*         userdata;         // data passed to the original callback
+    CelsCallback* callback;         // original callback
+};
+
+static void CelsPutVarint (FILE* file, unsigned long long value)
+{
+    while (value >= 0x80)  putc ((int)(value & 0x7F) | 0x80, file),  value >>= 7;
+    putc ((int)value, file);
+}
+
+static int CelsGetVarint (FILE* file, unsigned long long* value)
+{
+    int shift, c;
+    *value = 0;
+    for (shift = 0;  shift < 64;  shift += 7) {
+        if ((c = getc (file)) == EOF)  return 0;
+        *value |= (unsigned long long)(c & 0x7F) << shift;
+        if (c < 0x80)  return 1;
+    }
+    return 0;
+}
+
+CelsResult CelsRecorderOpen (const char* filename, const char* method, int service, int flags, void* ud, CelsCallback* cb, CelsRecorder** handle)
+{
+    *handle = NULL;
+    CelsRecorder* recorder = (CelsRecorder*) calloc (1, sizeof(CelsRecorder));
+    if (recorder == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    recorder->file = fopen (filename, "wb");
+    if (recorder->file == NULL)  {free (recorder);  return CELS_ERROR_WRITE;}
+    setvbuf (recorder->file, NULL, _IOFBF, 1<<20);
+
+    size_t len = (method? strlen (method) : 0);
+    fwrite (CelsRecordMagic, 1, sizeof(CelsRecordMagic), recorder->file);
+    CelsPutVarint (recorder->file, (unsigned)flags);
+    CelsPutVarint (recorder->file, (unsigned)service);
+    CelsPutVarint (recorder->file, len);
+    fwrite (method, 1, len, recorder->file);
+
+    recorder->flags = flags;
+    recorder->error = CELS_OK;
+    recorder->userdata = ud;
+    recorder->callback = cb;
+    CelsMutexInit (&recorder->mutex);
+    recorder->last = CelsTimeNs();
+    *handle = recorder;
+    return CELS_OK;
+}
+
+CelsResult CelsRecorderClose (CelsRecorder* recorder)
+{
+    CelsResult errcode = recorder->error;
+    if (fclose (recorder->file) != 0)  errcode = CELS_ERROR_WRITE;
+    free (recorder);
+    return errcode;
+}
+
+// Pass the request to the original callback, recording CELS_READ/CELS_WRITE and their vectored versions
+CelsResult __cdecl CelsRecorderCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsRecorder* recorder = (CelsRecorder*)self;
+    if (service==CELS_READ_STREAM   &&  subservice==0)  service = CELS_READ;
+    if (service==CELS_WRITE_STREAM  &&  subservice==0)  service = CELS_WRITE;
+    int read = (service==CELS_READ || service==CELS_READV);
+    CelsNum start = CelsTimeNs();
+    CelsResult result = (recorder->callback? recorder->callback (recorder->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                                           : CELS_ERROR_NOT_IMPLEMENTED);
+    if (!read  &&  service!=CELS_WRITE  &&  service!=CELS_WRITEV)  return result;
+    if ((service==CELS_READV || service==CELS_WRITEV)  &&  result==CELS_ERROR_NOT_IMPLEMENTED)  return result;   // recorded as the fallback requests
+
+    CelsNum end = CelsTimeNs();
+    CelsIoVec single = {read? inbuf : outbuf,  read? insize : outsize};
+    CelsIoVec* iov = &single;
+    CelsNum i, count = 1, requested = 0;
+    if (service==CELS_READV)   iov = (CelsIoVec*)inbuf,   count = insize;
+    if (service==CELS_WRITEV)  iov = (CelsIoVec*)outbuf,  count = outsize;
+    for (i = 0;  i < count;  i++)
+        requested += iov[i].size;
+
+    CelsMutexLock (&recorder->mutex);
+    FILE* file = recorder->file;
+    putc (read? CELS_RECORD_READ : CELS_RECORD_WRITE, file);
+    CelsPutVarint (file, requested);
+    CelsPutVarint (file, ((unsigned long long)result << 1) ^ (unsigned long long)(result >> 63));
+    CelsPutVarint (file, start > recorder->last? start - recorder->last : 0);
+    CelsPutVarint (file, end - start);
+    if (read  &&  (recorder->flags & CELS_RECORD_DATA)  &&  result > 0) {
+        CelsNum left = result;
+        for (i = 0;  i < count  &&  left > 0;  i++) {
+            CelsNum bytes = (iov[i].size < left? iov[i].size : left);
+            fwrite (iov[i].buf, 1, (size_t)bytes, file);
+            left -= bytes;
+        }
+    }
+    if (ferror (file)  &&  recorder->error == CELS_OK)  recorder->error = CELS_ERROR_WRITE;
+    recorder->last = CelsTimeNs();
+    CelsMutexUnlock (&recorder->mutex);
+    return result;
+}
+
+typedef struct
+{
+    int        type;            // CELS_RECORD_READ or CELS_RECORD_WRITE
+    CelsNum    requested;
+    CelsResult result;
+    CelsNum    hostNs;          // time spent in the host
+    long long  dataPos;         // position of the read data in the recording, or -1
+} CelsReplayRecord;
+
+typedef struct
+{
+    FILE*             file;         // recording
+    FILE*             input;        // input data when they aren't recorded
+    CelsReplayRecord* records;
+    CelsNum           numRecords;
+    CelsNum           nextRead, nextWrite;  // next records to replay
+    CelsNum           deliveryLeft; // bytes of the current recorded read not yet passed to the codec
+    long long         deliveryPos;  // position of these bytes in the recording, or -1
+    int               deliveryShort;// the current recorded read returned less than requested
+    CelsNum           writeNs, writes;  // total and count of recorded write times, for writes beyond the recording
+    double            scale;        // multiplier of host times
+    CelsNum           last;         // time when the previous callback returned
+    CelsReplayStats*  stats;
+    CelsMutex         mutex;
+    void*             userdata;     // data passed to the original callback
+    CelsCallback*     callback;     // original callback serving other requests
+} CelsReplayer;
+
+// Emulate the time spent in the host. Sleeping is imprecise, so the last millisecond is spun
+static void CelsReplayDelay (CelsReplayer* replayer, CelsNum ns)
+{
+    ns = (CelsNum) (ns * replayer->scale);
+    if (ns <= 0)  return;
+    CelsNum deadline = CelsTimeNs() + ns;
+    if (ns > 2000000)  CelsSleepMs (ns/1000000 - 1);
+    while (CelsTimeNs() < deadline);
+}
+
+static void CelsReplayGap (CelsReplayer* replayer)
+{
+    CelsNum gap = CelsTimeNs() - replayer->last;
+    int bucket = 0;
+    while (bucket < 63  &&  ((CelsNum)1 << bucket) <= gap)  bucket++;
+    replayer->stats->gaps[bucket]++;
+    if (gap > replayer->stats->max_gap_ns)  replayer->stats->max_gap_ns = gap;
+}
+
+// Copy the data of the current delivery into buf
+static CelsResult CelsReplayData (CelsReplayer* replayer, char* buf, CelsNum size)
+{
+    FILE* file = (replayer->deliveryPos >= 0? replayer->file : replayer->input);
+    if (replayer->deliveryPos >= 0) {
+        if (CelsFileSeek (file, replayer->deliveryPos, SEEK_SET) != 0)  return CELS_ERROR_READ;
+        replayer->deliveryPos += size;
+    }
+    return (fread (buf, 1, (size_t)size, file) == (size_t)size? size : CELS_ERROR_READ);
+}
+
+// Recorded reads are delivered as they were returned by the host: a codec request may take a read by parts or span
+// several ones, but ends with a short one, as well as before EOF or error. Writes take the host time of the recorded
+// write with the same number
+static CelsResult __cdecl CelsReplayCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsReplayer* replayer = (CelsReplayer*)self;
+    CelsReplayStats* stats = replayer->stats;
+    CelsResult result;
+    if (service==CELS_READ_STREAM   &&  subservice==0)  service = CELS_READ;
+    if (service==CELS_WRITE_STREAM  &&  subservice==0)  service = CELS_WRITE;
+    if (service==CELS_READV)
+        return CelsSplitVectored (self, CelsReplayCallback, service, (CelsIoVec*)inbuf, insize);
+    if (service==CELS_WRITEV) {
+        CelsIoVec* iov = (CelsIoVec*)outbuf;
+        CelsNum i, total = 0;
+        for (i = 0;  i < outsize;  i++)
+            total += iov[i].size;
+        return CelsReplayCallback (self, CELS_WRITE,0, 0,0, NULL,total, ud,cb);
+    }
+    if (service!=CELS_READ  &&  service!=CELS_WRITE)
+        return (replayer->callback? replayer->callback (replayer->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                                  : CELS_ERROR_NOT_IMPLEMENTED);
+
+    CelsMutexLock (&replayer->mutex);
+    CelsReplayGap (replayer);
+    CelsNum start = CelsTimeNs();
+    if (service==CELS_READ) {
+        CelsNum read_bytes = 0;
+        result = 0;
+        while (read_bytes < insize) {
+            if (replayer->deliveryLeft == 0) {
+                while (replayer->nextRead < replayer->numRecords  &&  replayer->records[replayer->nextRead].type != CELS_RECORD_READ)
+                    replayer->nextRead++;
+                if (replayer->nextRead == replayer->numRecords)  break;
+                CelsReplayRecord* record = &replayer->records[replayer->nextRead];
+                if (record->result <= 0  &&  read_bytes > 0)  break;   // return data first
+                replayer->nextRead++;
+                CelsReplayDelay (replayer, record->hostNs);
+                if (record->result <= 0)  {result = record->result;  break;}   // recorded EOF and errors are reproduced too
+                replayer->deliveryLeft  = record->result;
+                replayer->deliveryPos   = record->dataPos;
+                replayer->deliveryShort = (record->result < record->requested);
+            }
+            CelsNum bytes = (replayer->deliveryLeft < insize-read_bytes? replayer->deliveryLeft : insize-read_bytes);
+            result = CelsReplayData (replayer, (char*)inbuf + read_bytes, bytes);
+            if (result < CELS_OK)  break;
+            read_bytes += bytes;
+            replayer->deliveryLeft -= bytes;
+            result = read_bytes;
+            if (replayer->deliveryLeft == 0  &&  replayer->deliveryShort)  break;
+        }
+        if (result > 0)  stats->input += result;
+        stats->reads++;
+    } else {
+        while (replayer->nextWrite < replayer->numRecords  &&  replayer->records[replayer->nextWrite].type != CELS_RECORD_WRITE)
+            replayer->nextWrite++;
+        result = outsize;
+        if (replayer->nextWrite < replayer->numRecords) {
+            CelsReplayRecord* record = &replayer->records[replayer->nextWrite++];
+            CelsReplayDelay (replayer, record->hostNs);
+            if (record->result < CELS_OK)  result = record->result;
+        } else if (replayer->writes > 0) {
+            CelsReplayDelay (replayer, replayer->writeNs / replayer->writes);
+        }
+        if (result > 0)  stats->output += result;
+        stats->writes++;
+    }
+    replayer->last = CelsTimeNs();
+    stats->host_ns += replayer->last - start;
+    CelsMutexUnlock (&replayer->mutex);
+    return result;
+}
+
+// Load the recording and perform the recorded operation, with method and input overriding the recorded ones if given
+CelsResult CelsReplay (const char* filename, const void* method, const char* input, double scale, CelsReplayStats* stats, void* ud, CelsCallback* cb)
+{
+    CelsReplayer replayer;
+    unsigned long long flags, service, len, requested, result, gap, host;
+    char magic[sizeof(CelsRecordMagic)];
+    char recorded[CELS_MAX_METHOD_STRING_SIZE];
+    CelsNum capacity = 0;
+    CelsResult errcode = CELS_OK;
+
+    memset (stats, 0, sizeof(CelsReplayStats));
+    memset (&replayer, 0, sizeof(replayer));
+    replayer.scale = scale;
+    replayer.stats = stats;
+    replayer.userdata = ud;
+    replayer.callback = cb;
+    CelsMutexInit (&replayer.mutex);
+    replayer.file = fopen (filename, "rb");
+    if (replayer.file == NULL)  return CELS_ERROR_READ;
+
+    if (fread (magic, 1, sizeof(magic), replayer.file) != sizeof(magic)  ||  memcmp (magic, CelsRecordMagic, sizeof(magic)) != 0
+        ||  !CelsGetVarint (replayer.file, &flags)  ||  !CelsGetVarint (replayer.file, &service)  ||  !CelsGetVarint (replayer.file, &len)
+        ||  len >= sizeof(recorded)  ||  fread (recorded, 1, (size_t)len, replayer.file) != len)
+        CELS_RETURN (CELS_ERROR_BAD_HEADERS);
+    recorded[len] = 0;
+    if (method == NULL) {
+        if (len == 0)  CELS_RETURN (CELS_ERROR_INVALID_COMPRESSOR);   // recorded without the method string, so it should be given
+        method = recorded;
+    }
+
+    if (input) {
+        replayer.input = fopen (input, "rb");
+        if (replayer.input == NULL)  CELS_RETURN (CELS_ERROR_READ);
+    } else if (! (flags & CELS_RECORD_DATA)) {
+        CELS_RETURN (CELS_ERROR_READ);   // nothing to feed the codec with
+    }
+
+    for(;;) {
+        int type = getc (replayer.file);
+        if (type == EOF)  break;
+        if ((type != CELS_RECORD_READ  &&  type != CELS_RECORD_WRITE)
+            ||  !CelsGetVarint (replayer.file, &requested)  ||  !CelsGetVarint (replayer.file, &result)
+            ||  !CelsGetVarint (replayer.file, &gap)  ||  !CelsGetVarint (replayer.file, &host))
+            CELS_RETURN (CELS_ERROR_BAD_HEADERS);
+        if (replayer.numRecords == capacity) {
+            capacity = (capacity? capacity*2 : 4096);
+            CelsReplayRecord* records = (CelsReplayRecord*) realloc (replayer.records, (size_t)capacity * sizeof(CelsReplayRecord));
+            if (records == NULL)  CELS_RETURN (CELS_ERROR_NOT_ENOUGH_MEMORY);
+            replayer.records = records;
+        }
+        CelsReplayRecord* record = &replayer.records[replayer.numRecords++];
+        record->type      = type;
+        record->requested = (CelsNum) requested;
+        record->result    = (CelsResult) ((result >> 1) ^ (0 - (result & 1)));
+        record->hostNs    = (CelsNum) host;
+        record->dataPos   = -1;
+        stats->recorded_codec_ns += (CelsNum) gap;
+        stats->recorded_host_ns  += record->hostNs;
+        if (type == CELS_RECORD_WRITE) {
+            replayer.writeNs += record->hostNs,  replayer.writes++;
+            if (record->result > 0)  stats->recorded_output += record->result;
+        }
+        if (type == CELS_RECORD_READ  &&  (flags & CELS_RECORD_DATA)  &&  record->result > 0) {
+            record->dataPos = CelsFileTell (replayer.file);
+            if (CelsFileSeek (replayer.file, record->result, SEEK_CUR) != 0)  CELS_RETURN (CELS_ERROR_BAD_HEADERS);
+        }
+        if (input)  record->dataPos = -1;
+    }
+
+    CelsNum start = CelsTimeNs();
+    replayer.last = start;
+    errcode = Cels (method, (int)service,0, 0,0, 0,0, &replayer, CelsReplayCallback);
+    stats->total_ns = CelsTimeNs() - start;
+
+finished:
+    free (replayer.records);
+    if (replayer.input)  fclose (replayer.input);
+    fclose (replayer.file);
+    return errcode;
 }
@@ -65,11 +65,17 @@ const int CELS_FREE                             = 0x00000001;   // Last operatio
 const int CELS_UNPARSE                          = 0x00000002;   // Put into (outbuf,outsize) buffer some variant of string representing the method instance, where variant is defined by the insize containing one of CELS_UNPARSE_* constants
 const int CELS_COMPRESS                         = 0x00000004;   // Compress (encode) data using CELS_READ/CELS_WRITE callbacks (and optionally CELS_PROGRESS/CELS_QUASI_WRITE to inform application about operation progress). Also: Compress buffer (inbuf,insize) into buffer (outbuf,outsize) and return compressed size. When inbuf and/or outbuf is NULL, read/write data via callbacks or return CELS_ERROR_NOT_IMPLEMENTED
 const int CELS_DECOMPRESS                       = 0x00000005;   // Like above but decompress (decode)
+const int CELS_COMPRESS_BATCH                   = 0x00000006;   // Compress insize independent buffers described by CelsBatchItem array in the inbuf, storing compressed size or error code into each item->result. Retcode: CELS_OK, or error code when the entire batch failed
+const int CELS_DECOMPRESS_BATCH                 = 0x00000007;   // Like above but decompress (decode)
+const int CELS_STREAM_OPEN                      = 0x00000008;   // Start push-mode operation (subservice = CELS_COMPRESS or CELS_DECOMPRESS) and store pointer to its state into *(void**)outbuf
+const int CELS_STREAM_PUSH                      = 0x00000009;   // Process next part (inbuf,insize) of input data of the push-mode operation with state outbuf, writing output via CELS_WRITE callback
+const int CELS_STREAM_FINISH                    = 0x0000000A;   // Process the end of input data of the push-mode operation with state outbuf, free the state and return the operation result
 // Information requests
 const int CELS_GET_EXPAND_DATA                  = 0x01000000;   // Can this compressor expand data (like precomp)?
 const int CELS_GET_NUM_INPUT_STREAMS            = 0x01000001;   // Number of input streams for compression (== number of output streams for decompression)
 const int CELS_GET_NUM_OUTPUT_STREAMS           = 0x01000002;   // Number of output streams for compression (== number of input streams for decompression)
 const int CELS_GET_MAX_COMPRESSED_SIZE          = 0x01000003;   // Upper limit of compressed size for given insize
+const int CELS_GET_CAPABILITIES                 = 0x01000004;   // Fill CelsCapabilities structure (outbuf,outsize) with supported modes and cost hints of the instance. Answered by the framework for codecs that don't implement it
 // Get algorithm parameters
 const int CELS_GET_COMPRESSION_MEMORY           = 0x02000000;   // How much memory for compression?
 const int CELS_GET_DECOMPRESSION_MEMORY         = 0x02000001;   // How much memory for decompression?
@@ -106,6 +112,13 @@ const int CELS_RECEIVE_EMPTY_OUTBUF             = 0x10000006;   // Receive next
 const int CELS_SEND_FILLED_OUTBUF               = 0x10000007;   // Send filled output buffer (outbuf,outsize) into the queue
 const int CELS_MEM_ALLOC                        = 0x10000008;   // Alloc outsize memory bytes and return pointer in *outbuf
 const int CELS_MEM_FREE                         = 0x10000009;   // Free memory pointed by inbuf (should be implemented if and only if CELS_MEM_ALLOC is also implemented)
+const int CELS_ASYNC_COMPLETED                  = 0x1000000A;   // Asynchronous operation (inbuf) was finished with result passed in the subservice. Called from the worker thread
+const int CELS_REQUEST_KEY                      = 0x1000000B;   // Store the encryption key of outsize bytes for the method named by the C string inbuf into outbuf. Keys are never passed in method strings
+const int CELS_READ_STREAM                      = 0x1000000C;   // Read up to insize bytes of the input stream number subservice into inbuf. Stream 0 is the one served by CELS_READ. Retcode: the same as CELS_READ
+const int CELS_WRITE_STREAM                     = 0x1000000D;   // Write outsize bytes from outbuf into the output stream number subservice. Stream 0 is the one served by CELS_WRITE. Retcode: the same
+const int CELS_READV                            = 0x1000000E;   // Read into insize buffers described by the CelsIoVec array inbuf, filling every buffer before the next one. Retcode: the same as CELS_READ for the total size
+const int CELS_WRITEV                           = 0x1000000F;   // Write outsize buffers described by the CelsIoVec array outbuf, as a single CELS_WRITE of their concatenation. Retcode: the same
+const int CELS_REPORT_PARAMETER                 = 0x10000010;   // Informs application that the running operation switched its parameter named by the C string inbuf to the value passed in the subservice, f.e. the level chosen by adaptive compression for the following data
 
 // Operations that can be implemented by codec in CelsMain()
 inline static int IS_CELS_CODEC_SERVICE (int service)  {return (service&0xFF000000)==0x04000000;}   // Family of codec services
@@ -123,6 +136,10 @@ inline static int IS_CELS_GLOBAL_SERVICE (int service)  {return (service&0xFF000
 const int CELS_LOAD                             = 0x06000000;   // CelsLoad() == Load cels*.dll
 const int CELS_UNLOAD                           = 0x06000001;   // CelsUnload() == Deregister all codecs and free all dlls
 const int CELS_REGISTER                         = 0x06000002;   // CelsRegister(inbuf,ud,cb) == Register codec
+const int CELS_SUBMIT_TASK                      = 0x06000003;   // Run task cb(ud) in the framework thread pool, counting it in the CelsTaskGroup pointed by inbuf (or NULL)
+const int CELS_WAIT_TASKS                       = 0x06000004;   // Wait for all tasks of the CelsTaskGroup pointed by inbuf, running queued tasks meanwhile
+const int CELS_GET_THREADS                      = 0x06000005;   // Number of worker threads in the framework thread pool
+const int CELS_CHECKSUM                         = 0x06000006;   // Checksum operation (subservice) on the CelsChecksum state pointed by outbuf: start algorithm insize, update with (inbuf,insize), or store digest into *inbuf
 
 // Code ranges reserved for applications and 3rd-party libraries
 const int CELS_LIBRARY_CODES                    = 0x40000000;   // Codes available for 3rd-party libraries
@@ -133,6 +150,9 @@ const int CELS_APPLICATION_CODES                = 0xC0000000;   // Codes availab
 const int CELS_UNPARSE_FULL                     = 0;    // Return string with canonical representation of the compression method
 const int CELS_UNPARSE_DISPLAY                  = 1;    // Return method string prepared for display, with sensitive information like encryption keys removed
 const int CELS_UNPARSE_PURE                     = 2;    // Return method string prepared for storing in archive, with sensitive information and compression-specific parameters removed
+const int CELS_CHECKSUM_START                   = 0;    // CELS_CHECKSUM operations
+const int CELS_CHECKSUM_UPDATE                  = 1;
+const int CELS_CHECKSUM_DIGEST                  = 2;
 
 // Error codes
 const int CELS_OK                               =   0;  // ALL RIGHT
@@ -151,6 +171,8 @@ const int CELS_ERROR_BAD_CRC                    = -12;  // File failed CRC check
 const int CELS_ERROR_BAD_PASSWORD               = -13;  // Password/keyfile failed checkcode test
 const int CELS_ERROR_BAD_HEADERS                = -14;  // Archive headers are corrupted
 const int CELS_ERROR_INTERNAL                   = -15;  // It should never happen: implementation error. Please report this bug to developers!
+const int CELS_ERROR_PENDING                    = -16;  // Asynchronous operation isn't yet finished
+const int CELS_ERROR_QUEUE_FULL                 = -17;  // Too many asynchronous operations are waiting for execution
 
 // Various sizes
 const int CELS_MAX_PARSED_METHOD_SIZE           = 1024;
@@ -161,11 +183,55 @@ const char CELS_METHOD_PARAMETERS_DELIMITER     =  ':';
 // Handy operation shortcuts
 inline static CelsResult CelsRead  (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_READ,0,  buf,size, 0,0, 0,0);}
 inline static CelsResult CelsWrite (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_WRITE,0, 0,0, buf,size, 0,0);}
+// Stream-indexed I/O for codecs with several input/output streams (see CELS_GET_NUM_INPUT_STREAMS). Stream 0 goes via
+// plain CELS_READ/CELS_WRITE, so single-stream hosts keep working. Different streams may be served by different threads
+inline static CelsResult CelsReadStream  (CelsCallback* cb, void* ud, CelsNum stream, void* buf, CelsNum size)  {return stream? cb(ud, CELS_READ_STREAM,stream,  buf,size, 0,0, 0,0) : CelsRead (cb,ud, buf,size);}
+inline static CelsResult CelsWriteStream (CelsCallback* cb, void* ud, CelsNum stream, void* buf, CelsNum size)  {return stream? cb(ud, CELS_WRITE_STREAM,stream, 0,0, buf,size, 0,0) : CelsWrite(cb,ud, buf,size);}
+// Scatter/gather I/O: a single request for several buffers, f.e. block header and data. Hosts not implementing
+// CELS_READV/CELS_WRITEV get a CELS_READ/CELS_WRITE per buffer instead
+typedef struct
+{
+    void*   buf;
+    CelsNum size;
+} CelsIoVec;
+inline static CelsResult CelsReadv (CelsCallback* cb, void* ud, CelsIoVec* iov, CelsNum count)
+{
+    CelsResult result = cb(ud, CELS_READV,0, iov,count, 0,0, 0,0);
+    if (result != CELS_ERROR_NOT_IMPLEMENTED)  return result;
+    CelsNum i, done;
+    for (i = 0, result = 0;  i < count;  i++) {
+        for (done = 0;  done < iov[i].size; ) {
+            CelsResult bytes = CelsRead(cb,ud, (char*)iov[i].buf + done, iov[i].size - done);
+            if (bytes < CELS_OK)  return bytes;
+            if (bytes == 0)       return result + done;   // EOF
+            done += bytes;
+        }
+        result += done;
+    }
+    return result;
+}
+inline static CelsResult CelsWritev (CelsCallback* cb, void* ud, CelsIoVec* iov, CelsNum count)
+{
+    CelsResult result = cb(ud, CELS_WRITEV,0, 0,0, iov,count, 0,0);
+    if (result != CELS_ERROR_NOT_IMPLEMENTED)  return result;
+    CelsNum i;
+    for (i = 0, result = 0;  i < count;  i++) {
+        if (iov[i].size == 0)  continue;
+        CelsResult bytes = CelsWrite(cb,ud, iov[i].buf, iov[i].size);
+        if (bytes < CELS_OK)  return bytes;
+        result += bytes;
+        if (bytes != iov[i].size)  break;
+    }
+    return result;
+}
 inline static CelsResult CelsProgress (CelsCallback* cb, void* ud, CelsNum insize, CelsNum outsize)    {return cb(ud, CELS_PROGRESS,0, 0,insize, 0,outsize, 0,0);}
+inline static CelsResult CelsQuasiWrite (CelsCallback* cb, void* ud, CelsNum outsize)                  {return cb(ud, CELS_QUASI_WRITE,0, 0,0, 0,outsize, 0,0);}
 inline static CelsResult CelsReceiveFilledInbuf (CelsCallback* cb, void* ud, void** buf)               {return cb(ud, CELS_RECEIVE_FILLED_INBUF,0,  buf,0,    0,0, 0,0);}
 inline static CelsResult CelsSendEmptyInbuf     (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_SEND_EMPTY_INBUF,0,      buf,size, 0,0, 0,0);}
 inline static CelsResult CelsReceiveEmptyOutbuf (CelsCallback* cb, void* ud, void** buf)               {return cb(ud, CELS_RECEIVE_EMPTY_OUTBUF,0,  0,0,    buf,0, 0,0);}
 inline static CelsResult CelsSendFilledOutbuf   (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_SEND_FILLED_OUTBUF,0,    0,0, buf,size, 0,0);}
+inline static CelsResult CelsRequestKey (CelsCallback* cb, void* ud, const char* name, void* key, CelsNum size)  {return cb? cb(ud, CELS_REQUEST_KEY,0, (void*)name,0, key,size, 0,0) : CELS_ERROR_NOT_IMPLEMENTED;}
+inline static CelsResult CelsReportParameter (CelsCallback* cb, void* ud, const char* name, CelsNum value)  {return cb? cb(ud, CELS_REPORT_PARAMETER,value, (void*)name,0, 0,0, 0,0) : CELS_ERROR_NOT_IMPLEMENTED;}
 
 // Ask host to alloc memory for us, falling back to malloc if host doesn't implement the service
 inline static void* CelsMemAlloc (CelsCallback* cb, void* ud, CelsNum size)
@@ -251,6 +317,112 @@ CELS_DEFINE_GETTER_AND_SETTER (Caching,             CACHING);
 #undef CELS_DEFINE_SETTER
 
 
+// *** Bound methods: direct calls to the codec instance, bypassing Cels() dispatch ***************************************
+
+// Parsed method resolved into the function serving the instance and the instance data.
+// It remains valid while the parsed method itself is alive and isn't modified by CELS_SET_* services.
+typedef struct
+{
+    CelsFunction* CelsMain;     // function serving the codec instance
+    void*         self;         // codec instance data inside the parsed method
+} CelsBoundMethod;
+
+CelsResult CelsBind (const void* method, CelsBoundMethod* bound);   // method should be already parsed
+
+// Unlike CelsCompressMem/CelsDecompressMem, these calls don't emulate buffers missing in the codec,
+// returning CELS_ERROR_NOT_IMPLEMENTED instead
+inline static CelsResult CelsBoundCompress (const CelsBoundMethod* bound, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+        {return bound->CelsMain(bound->self, CELS_COMPRESS,0, inbuf,insize, outbuf,outsize, ud,cb);}
+
+inline static CelsResult CelsBoundDecompress (const CelsBoundMethod* bound, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+        {return bound->CelsMain(bound->self, CELS_DECOMPRESS,0, inbuf,insize, outbuf,outsize, ud,cb);}
+
+
+// *** Codec capabilities *************************************************************************************************
+
+// Operation modes, reported separately for compression and decompression
+const int CELS_CAP_CALLBACKS        = 0x0001;   // CELS_[DE]COMPRESS with input and output via CELS_READ/CELS_WRITE
+const int CELS_CAP_MEMBUF           = 0x0002;   // CELS_[DE]COMPRESS from inbuf to outbuf
+const int CELS_CAP_MEMBUF_INPUT     = 0x0004;   // CELS_[DE]COMPRESS from inbuf, writing output via callback
+const int CELS_CAP_MEMBUF_OUTPUT    = 0x0008;   // CELS_[DE]COMPRESS to outbuf, reading input via callback
+const int CELS_CAP_BUFFER_SHARING   = 0x0010;   // CELS_RECEIVE_FILLED_INBUF and other buffer-sharing requests are used
+const int CELS_CAP_BATCH            = 0x0020;   // CELS_[DE]COMPRESS_BATCH
+const int CELS_CAP_PUSH             = 0x0040;   // CELS_STREAM_OPEN/PUSH/FINISH
+const int CELS_CAP_MULTI_STREAM     = 0x0080;   // CELS_READ_STREAM/CELS_WRITE_STREAM are used
+const int CELS_CAP_CACHING          = 0x0100;   // memory may be kept allocated between operations
+
+// Everything the host needs to choose the processing path, in one call. Codecs report modes of the particular
+// instance, and the framework asks the instance about them before choosing the path, so they may depend on its parameters.
+// For codecs that don't implement CELS_GET_CAPABILITIES, the framework fills cost hints with CELS_GET_* services,
+// and the per-codec cache records modes found (un)supported by CelsCompressMem/CelsDecompressMem and batch
+// trial calls, so they aren't tried again. Modes reported by the codec are never cached this way.
+typedef struct
+{
+    CelsNum compress, decompress;       // CELS_CAP_* modes supported
+    CelsNum compress_known, decompress_known;   // CELS_CAP_* modes whose support is known; the rest can be found only by trying
+    CelsNum compression_memory, decompression_memory;           // as returned by CelsGet[De]CompressionMem()
+    CelsNum compression_cpu_load, decompression_cpu_load;       // as returned by CelsGet[De]CompressionCpuLoad()
+    CelsNum max_compressed_1m;          // CelsGetMaxCompressedSize() for 1 MiB of input
+} CelsCapabilities;
+
+inline static CelsResult CelsGetCapabilities (const void* method, CelsCapabilities* caps)
+        {return Cels(method, CELS_GET_CAPABILITIES,0, 0,0, caps,sizeof(CelsCapabilities), 0,0);}
+
+
+// *** Framework thread pool **********************************************************************************************
+
+// Tasks are run by the work-stealing pool shared by all codecs and asynchronous operations in the process.
+// Codecs reach it via the Cels pointer received in the CELS_LOAD_CODEC/CELS_INITIALIZE cb.
+typedef void __cdecl CelsTask (void* arg);
+typedef struct
+{
+    CelsNum pending;            // number of unfinished tasks; should be zero-initialized before the first task submission
+} CelsTaskGroup;
+
+inline static CelsResult CelsSubmitTask (CelsCallback* api, CelsTaskGroup* group, CelsTask* task, void* arg)
+        {return api(NULL, CELS_SUBMIT_TASK,0, group,0, 0,0, arg,(CelsCallback0*)task);}
+
+inline static CelsResult CelsWaitTasks (CelsCallback* api, CelsTaskGroup* group)
+        {return api(NULL, CELS_WAIT_TASKS,0, group,0, 0,0, 0,0);}
+
+inline static CelsResult CelsGetThreads (CelsCallback* api)
+        {return api(NULL, CELS_GET_THREADS,0, 0,0, 0,0, 0,0);}
+
+// Process-wide limits, that should be set by the application before the first use of the pool:
+// number of worker threads (0 - one per CPU), and binding of workers to consecutive CPUs
+CelsResult CelsSetThreads (int threads);
+CelsResult CelsSetThreadAffinity (int enable);
+
+
+// *** Framework checksums ************************************************************************************************
+
+// Incremental checksums shared by codecs and applications. Codecs reach them via the Cels pointer received
+// in CELS_LOAD_CODEC, applications call them with (CelsCallback*)Cels. Kernels are chosen at runtime:
+// CRC32C uses SSE4.2 CRC32 instruction on three interleaved streams combined with PCLMUL, XXH3 uses AVX2 or SSE2
+const int CELS_CHECKSUM_CRC32C  = 1;    // CRC-32C (Castagnoli), as used by iSCSI/ext4/LevelDB
+const int CELS_CHECKSUM_XXH3    = 2;    // 64-bit XXH3 with the default secret and zero seed, as XXH3_64bits()
+
+typedef struct
+{
+    int algorithm;                      // CELS_CHECKSUM_*
+    unsigned stripes;                   // XXH3: stripes consumed in the current block
+    unsigned buffered;                  // XXH3: bytes waiting in buf
+    unsigned long long total;           // bytes hashed so far
+    unsigned long long acc[8];          // CRC32C register in acc[0], or XXH3 accumulators
+    unsigned char buf[256];             // XXH3: unconsumed input at the start, the last consumed stripe at the end
+} CelsChecksum;
+
+inline static CelsResult CelsChecksumStart (CelsCallback* api, CelsChecksum* state, int algorithm)
+        {return api(NULL, CELS_CHECKSUM,CELS_CHECKSUM_START, 0,algorithm, state,sizeof(CelsChecksum), 0,0);}
+
+inline static CelsResult CelsChecksumUpdate (CelsCallback* api, CelsChecksum* state, const void* buf, CelsNum size)
+        {return api(NULL, CELS_CHECKSUM,CELS_CHECKSUM_UPDATE, (void*)buf,size, state,sizeof(CelsChecksum), 0,0);}
+
+// State isn't modified, so the digest of data hashed so far can be taken at any moment
+inline static CelsResult CelsChecksumDigest (CelsCallback* api, const CelsChecksum* state, unsigned long long* digest)
+        {return api(NULL, CELS_CHECKSUM,CELS_CHECKSUM_DIGEST, digest,0, (void*)state,sizeof(CelsChecksum), 0,0);}
+
+
 // *** Extensions (not required for CELS functioning and use only official API) *******************************************
 
 // Compress/decompress data with CELS_COMPRESS/CELS_DECOMPRESS services from/to buffers or using callbacks.
@@ -259,6 +431,163 @@ CELS_DEFINE_GETTER_AND_SETTER (Caching,             CACHING);
 CelsResult CelsCompressMem   (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
 CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
 
+// Multi-stream I/O: every input/output stream of the codec is backed by its own ud/cb (f.e. CelsFileIO, CelsBufferQueues
+// or CelsMemStream), receiving CELS_READ_STREAM/CELS_WRITE_STREAM of this stream as plain CELS_READ/CELS_WRITE.
+// Stream 0 also serves CELS_READ/CELS_WRITE. Pass the CelsMultiStream as ud and CelsMultiStreamCallback as cb to the codec;
+// requests for streams without a target and all other requests go to the ud/cb of the CelsMultiStream.
+// The router keeps no state, so streams may be served simultaneously by different threads as far as their targets allow.
+typedef struct
+{
+    void*         ud;   CelsCallback* cb;       // callback serving CELS_READ (input stream) or CELS_WRITE (output stream)
+} CelsStreamTarget;
+typedef struct
+{
+    CelsStreamTarget* inputs;   CelsNum num_inputs;
+    CelsStreamTarget* outputs;  CelsNum num_outputs;
+    void*             ud;       CelsCallback* cb;
+} CelsMultiStream;
+CelsResult __cdecl CelsMultiStreamCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
+
+// Memory buffer as a stream target: CELS_READ reads from and CELS_WRITE appends to (buf,size), advancing pos
+typedef struct
+{
+    void*   buf;  CelsNum size;
+    CelsNum pos;                                // bytes read/written so far
+} CelsMemStream;
+CelsResult __cdecl CelsMemStreamCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
+
+// Multi-stream counterparts of CelsCompressMem/CelsDecompressMem: stream i is read from inputs[i] and written to outputs[i],
+// starting at their pos. Returns CELS_OK or error code; sizes of the output streams are left in outputs[i].pos
+CelsResult CelsCompressMemStreams   (const void* method, CelsMemStream* inputs, CelsNum num_inputs, CelsMemStream* outputs, CelsNum num_outputs, void* ud, CelsCallback* cb);
+CelsResult CelsDecompressMemStreams (const void* method, CelsMemStream* inputs, CelsNum num_inputs, CelsMemStream* outputs, CelsNum num_outputs, void* ud, CelsCallback* cb);
+
+// Compress like CelsCompressMem, verifying the result: compressed data are fed to CELS_DECOMPRESS of the same method
+// in a second thread as they are produced, and decompressed data are compared with the input. Input read via callback
+// is retained until verified, and together with not yet decompressed data it's limited to the window bytes (0 - 16 MB),
+// exceeded only while the decompressor needs more compressed data to proceed. Mismatch, decompression failure
+// or missing data fail the operation with CELS_ERROR_BAD_COMPRESSED_DATA. Callback requests of the decompressor
+// (except for CELS_READ/CELS_WRITE) go to the callback from the second thread, so they should be thread-safe.
+// With both inbuf and outbuf, the output is verified after compression, decompressing it into a temporary buffer.
+CelsResult CelsCompressMemVerified (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, CelsNum window, void* ud, CelsCallback* cb);
+
+// Process-wide memory budget (0 - unlimited) for operations started by CelsCompressMem/CelsDecompressMem and their batch
+// and asynchronous versions. Each operation reserves CelsGet[De]CompressionMem() bytes prior to start and releases them
+// on finish. Operations not fitting into the remaining budget wait in FIFO order. With fitting enabled, compression at the
+// head of the queue first tries to reduce memory usage of its private copy of the method with CelsLimitCompressionMem()
+// to the remaining budget. Decompression is never fitted, since the stream needs the resources it was compressed with.
+CelsResult CelsSetMemoryBudget (CelsNum budget, int fitting);
+
+// Single buffer of the batch (de)compression
+typedef struct
+{
+    void*      inbuf;   CelsNum insize;     // input buffer
+    void*      outbuf;  CelsNum outsize;    // output buffer
+    CelsResult result;                      // filled by the operation: output size or error code
+} CelsBatchItem;
+
+// (De)compress num_items independent buffers with CELS_[DE]COMPRESS_BATCH service of the codec,
+// falling back to CelsCompressMem/CelsDecompressMem of every item. Method string is parsed only once.
+// With threads>1, the batch is split between threads, so the callback should be thread-safe.
+// Returns CELS_OK or error code when the entire batch failed, while results of items are stored in items[i].result
+CelsResult CelsCompressBatch   (const void* method, CelsBatchItem* items, CelsNum num_items, int threads, void* ud, CelsCallback* cb);
+CelsResult CelsDecompressBatch (const void* method, CelsBatchItem* items, CelsNum num_items, int threads, void* ud, CelsCallback* cb);
+
+// Start (de)compression in the framework thread pool, storing the operation handle to *job. Arguments are the same as for
+// CelsCompressMem/CelsDecompressMem, but buffers and parsed method should be kept alive until the operation is finished.
+// Method string is parsed immediately, so parsing errors are returned here. Once the operation is finished,
+// CELS_ASYNC_COMPLETED callback is called. Each started operation should be released by the CelsAsyncRelease().
+typedef struct CelsAsyncJob CelsAsyncJob;
+CelsResult CelsCompressAsync   (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb, CelsAsyncJob** job);
+CelsResult CelsDecompressAsync (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb, CelsAsyncJob** job);
+CelsResult CelsAsyncPoll    (CelsAsyncJob* job);   // Result of the operation, or CELS_ERROR_PENDING if it isn't yet finished
+CelsResult CelsAsyncWait    (CelsAsyncJob* job);   // Wait for the operation to finish and return its result
+void       CelsAsyncCancel  (CelsAsyncJob* job);   // Ask the operation to finish ASAP with CELS_ERROR_OPERATION_TERMINATED
+void       CelsAsyncRelease (CelsAsyncJob* job);   // Free the handle; the operation itself continues until finished
+// Maximum number of operations waiting for a free worker (0 - unlimited); beyond that, CELS_ERROR_QUEUE_FULL is returned
+CelsResult CelsSetAsyncQueueDepth (int depth);
+
+
+// Push-mode (de)compression: instead of the codec reading input via CELS_READ, the application pushes input data as it arrives,
+// f.e. from network packets, and receives output via CELS_WRITE callback. Codecs implementing CELS_STREAM_* services run
+// natively, others run in a coroutine (fiber) with its own stack, so no thread is blocked waiting for the next input part.
+// Method string is parsed immediately; parsed method should be kept alive until the stream is finished.
+// Push/Finish calls of the same stream may be performed by different threads, but not simultaneously.
+typedef struct CelsStream CelsStream;
+CelsResult CelsStreamOpen   (const void* method, int service, void* ud, CelsCallback* cb, CelsStream** stream);   // service = CELS_COMPRESS or CELS_DECOMPRESS
+CelsResult CelsStreamPush   (CelsStream* stream, void* buf, CelsNum size);   // CELS_OK, or error code once the operation failed
+CelsResult CelsStreamFinish (CelsStream* stream);   // Finish the operation, free the stream and return the operation result
+// Compression stream verified like CelsCompressMemVerified, pushed data are retained until verified
+CelsResult CelsStreamOpenVerified (const void* method, CelsNum window, void* ud, CelsCallback* cb, CelsStream** stream);
+// Stack size of coroutines running codecs without native push-mode support (also used by CELS_WRITE and other callbacks)
+CelsResult CelsSetStreamStackSize (CelsNum size);
+
+// Ready-made host side of the buffer-sharing API: fixed pools of cache-line-aligned input and output buffers circulating
+// via four lock-free bounded rings. Pass the queues as ud and CelsBufferQueuesCallback as cb to the codec, and other
+// callback requests will be passed to the ud/cb given here. Application threads feed input and drain output with
+// the functions below, that block while the required ring is empty (backpressure). Nothing is allocated after Create.
+typedef struct CelsBufferQueues CelsBufferQueues;
+typedef struct
+{
+    CelsNum    sent, received;  // number of buffers passed through the ring
+    CelsNum    receiveWaits;    // how many times receiver had to wait on the empty ring
+    CelsNum    sendWaits;       // how many times sender had to wait on the full ring
+} CelsBufferQueueStats;
+CelsResult CelsBufferQueuesCreate (CelsNum num_inbufs, CelsNum inbuf_size, CelsNum num_outbufs, CelsNum outbuf_size, void* ud, CelsCallback* cb, CelsBufferQueues** queues);
+void       CelsBufferQueuesFree   (CelsBufferQueues* queues);
+CelsResult __cdecl CelsBufferQueuesCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
+CelsResult CelsGetEmptyInbuf   (CelsBufferQueues* queues, void** buf);                 // Returns buffer size
+CelsResult CelsPutFilledInbuf  (CelsBufferQueues* queues, void* buf, CelsNum size);
+CelsResult CelsCloseInput      (CelsBufferQueues* queues);                             // No more input: codec receives size 0
+CelsResult CelsGetFilledOutbuf (CelsBufferQueues* queues, void** buf);                 // Returns data size, or 0 once output is closed and drained
+CelsResult CelsPutEmptyOutbuf  (CelsBufferQueues* queues, void* buf);
+CelsResult CelsCloseOutput     (CelsBufferQueues* queues);                             // Called once the operation is finished
+// Statistics of the rings in the order of services: filled inbufs, empty inbufs, empty outbufs, filled outbufs
+void       CelsBufferQueuesStats (CelsBufferQueues* queues, CelsBufferQueueStats stats[4]);
+
+#ifndef _WIN32
+// File I/O callback for POSIX hosts, serving CELS_READ/CELS_WRITE and the buffer-sharing services from/to file descriptors
+// (starting at their current positions; -1 if not used). It keeps `depth` reads of `bufsize` bytes in flight ahead of
+// the codec and writes output asynchronously via io_uring on Linux, otherwise it performs pread/pwrite synchronously.
+// CELS_READV/CELS_WRITEV are served too, with CELS_WRITEV of at least bufsize bytes written directly by pwritev().
+// Pass the io as ud and CelsFileIOCallback as cb to the codec, other requests will go to the ud/cb given here.
+const int CELS_FILEIO_DIRECT            = 1;    // Bypass the page cache with O_DIRECT while reads/writes are aligned
+const int CELS_FILEIO_FIXED_BUFFERS     = 2;    // Register buffers in io_uring, saving page pinning on every request
+const int CELS_FILEIO_NO_URING          = 4;    // Always use pread/pwrite
+typedef struct CelsFileIO CelsFileIO;
+CelsResult CelsFileIOOpen  (int infd, int outfd, CelsNum bufsize, int depth, int flags, void* ud, CelsCallback* cb, CelsFileIO** io);
+CelsResult CelsFileIOClose (CelsFileIO* io);   // Finish writes, free the io and return CELS_OK or write error
+CelsResult __cdecl CelsFileIOCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
+#endif
+
+// Recording of the callback traffic, to reproduce performance of the production host offline. Pass the recorder as ud
+// and CelsRecorderCallback as cb to the codec: all requests go to the ud/cb given here, while the sequence of CELS_READ
+// and CELS_WRITE requests (vectored ones are recorded as a single request) is written to the file with their sizes,
+// results, time spent in the host and codec time between them. The method string (or NULL) is stored for the replay.
+const int CELS_RECORD_DATA              = 1;    // Also store data returned by CELS_READ, so no input is needed for the replay
+typedef struct CelsRecorder CelsRecorder;
+CelsResult CelsRecorderOpen  (const char* filename, const char* method, int service, int flags, void* ud, CelsCallback* cb, CelsRecorder** recorder);
+CelsResult CelsRecorderClose (CelsRecorder* recorder);   // Close the file, free the recorder and return CELS_OK or write error
+CelsResult __cdecl CelsRecorderCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
+
+// Replay the recording against the method (NULL - the recorded one, CELS_ERROR_INVALID_COMPRESSOR if it wasn't recorded),
+// reading input from the file (NULL - the recorded data). Reads are returned in the recorded sizes, including short reads,
+// EOF and errors (codec requests may take a recorded read by parts, but never get more than is left in it), and every
+// read/write waits for the recorded host time multiplied by the scale (0 - don't wait). Other requests go to the ud/cb.
+// Returns the result of the operation and its statistics.
+typedef struct
+{
+    CelsNum reads, writes;              // requests served
+    CelsNum input, output;              // bytes passed to/from the codec
+    CelsNum total_ns;                   // wall time of the operation
+    CelsNum host_ns;                    // part of it spent in CELS_READ/CELS_WRITE, including emulated host time
+    CelsNum max_gap_ns;                 // codec time between callbacks: maximum
+    CelsNum gaps[64];                   //   and histogram: gaps[i] counts the ones of 2^(i-1)..2^i-1 ns
+    CelsNum recorded_output;            // bytes written in the recording
+    CelsNum recorded_host_ns;           // time spent in the host and codec time between callbacks in the recording
+    CelsNum recorded_codec_ns;
+} CelsReplayStats;
+CelsResult CelsReplay (const char* filename, const void* method, const char* input, double scale, CelsReplayStats* stats, void* ud, CelsCallback* cb);
+
 
 // *** Stream processing helpers ******************************************************************************************
 
@@ -269,6 +598,10 @@ CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, v
         {CelsResult result = CelsWrite(cb,ud, (buf),(size)); \
         if (result != (size))  CELS_RETURN2(result, CELS_ERROR_WRITE);}
 
+#define CELS_WRITEV_EXACTLY(iov, count, size) \
+        {CelsResult result = CelsWritev(cb,ud, (iov),(count)); \
+        if (result != (size))  CELS_RETURN2(result, CELS_ERROR_WRITE);}
+
 // Usual way to read data going to compress. Should read less than `size` bytes only at EOF
 #define CELS_READ_OR_EOF(len, buf, size) \
         {CelsResult result = CelsRead(cb,ud, (buf),(size)); \
@@ -281,6 +614,10 @@ CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, v
         {CelsResult result = CelsRead(cb,ud, (buf),(size)); \
         if (result != (size))  CELS_RETURN2(result, CELS_ERROR_BAD_COMPRESSED_DATA);}
 
+#define CELS_READV_EXACTLY(iov, count, size) \
+        {CelsResult result = CelsReadv(cb,ud, (iov),(count)); \
+        if (result != (size))  CELS_RETURN2(result, CELS_ERROR_BAD_COMPRESSED_DATA);}
+
 // Same as above, but EOF means we have no more compressed blocks
 #define CELS_READ_EXACTLY_OR_EOF(buf, size) \
         {CelsResult result = CelsRead(cb,ud, (buf),(size)); \
@@ -305,6 +642,14 @@ CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, v
         {CelsSerializeInt((size), (buf), (W)); \
         CELS_WRITE_EXACTLY((buf), (size) + (W));}
 
+// The same without reserving space in the buffer: the size value goes as a separate part of the single CELS_WRITEV
+#define CELS_WRITEV_WITH_SIZE(size,W, buf) \
+        {char sizeBuf[16];  CelsIoVec iov[2]; \
+        CelsSerializeInt((size), sizeBuf, (W)); \
+        iov[0].buf = sizeBuf;  iov[0].size = (W); \
+        iov[1].buf = (buf);    iov[1].size = (size); \
+        CELS_WRITEV_EXACTLY(iov, 2, (size) + (W));}
+
 // Serialize the value into W bytes of the buffer, using Intel byte-order
 inline static void CelsSerializeInt(CelsResult value, char* buf, int W)
 {
@@ -0,0 +1,86 @@
+/*
+    CELS - C++ wrappers for the CELS API
+    Copyright (C) 2017-2021, Bulat Ziganshin <Bulat.Ziganshin@gmail.com>
+
+    MIT License (https://opensource.org/licenses/MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+
+    You can contact the author at:
+       - CELS repository: https://github.com/Bulat-Ziganshin/CELS
+*/
+
+#ifndef CELS_HPP
+#define CELS_HPP
+
+#include "CELS.h"
+
+// Parsed method served by the statically linked codec, whose function is known at compile time.
+// All calls go directly to the codec function, so compiler may inline it into the caller
+// when the codec is compiled in the same translation unit, f.e.:
+//
+//     #include "cels-lz4.cpp"
+//     CelsStaticMethod<Lz4Codec,CelsMain> lz4("lz4:a4");
+//     if (lz4.error())  ...
+//     lz4->acceleration = 8;
+//     CelsResult compressed_size = lz4.compress(inbuf,insize, outbuf,outsize);
+//
+template <class Instance, CelsFunction* Main>
+class CelsStaticMethod
+{
+    char method[CELS_MAX_PARSED_METHOD_SIZE];   // parsed method holding the instance data
+    Instance* instance;                         // instance data inside the parsed method, or NULL on error
+    CelsResult errcode;                         // result of parsing
+
+    CelsStaticMethod (const CelsStaticMethod&);             // parsed method can't be copied
+    CelsStaticMethod& operator= (const CelsStaticMethod&);
+
+public:
+    explicit CelsStaticMethod (const char* method_str)
+    {
+        instance = NULL;
+        errcode = CelsParse (method_str, method);
+        if (errcode < CELS_OK)  return;
+
+        CelsBoundMethod bound;
+        errcode = CelsBind (method, &bound);
+        if (errcode >= CELS_OK  &&  bound.CelsMain != Main)
+            errcode = CELS_ERROR_INVALID_COMPRESSOR;   // method is served by another codec
+        if (errcode < CELS_OK)  {CelsFree (method);  return;}
+
+        instance = (Instance*) bound.self;
+    }
+
+    ~CelsStaticMethod()  {if (instance)  CelsFree (method);}
+
+    // CELS_OK or error code returned by parsing. Other methods can be used only when it's CELS_OK
+    CelsResult error() const  {return (instance? CELS_OK : errcode);}
+
+    // Direct access to the instance parameters and the parsed method for the usual CELS API
+    Instance* operator-> ()  {return instance;}
+    void* parsed()           {return method;}
+
+    CelsResult compress   (void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud = 0, CelsCallback* cb = 0)
+        {return Main (instance, CELS_COMPRESS,0,   inbuf,insize, outbuf,outsize, ud,cb);}
+
+    CelsResult decompress (void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud = 0, CelsCallback* cb = 0)
+        {return Main (instance, CELS_DECOMPRESS,0, inbuf,insize, outbuf,outsize, ud,cb);}
+};
+
+#endif // CELS_HPP